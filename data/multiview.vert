@@ -0,0 +1,48 @@
+/* -*- Mode: C -*- */
+#version 150 compatibility
+
+// surface.vert drawn once per view: gl_InstanceID picks the view and
+// multiview.geom routes the triangle to that view's layer. Keep the
+// surface evaluation in sync with surface.vert.
+
+#define MAX_VIEWS 32
+
+uniform int surface_model; // 0: cylinder, 1: sphere
+uniform float surface_radius;
+uniform float surface_height;
+uniform mat4 surface_matrix;
+uniform int n_u;
+uniform int n_v;
+
+uniform mat4 view_proj[MAX_VIEWS];
+
+out vec2 v_texcoord;
+flat out int v_layer;
+
+const float PI = 3.14159265358979;
+
+void main(void)
+{
+  int cell = gl_VertexID / 6;
+  int corner = gl_VertexID - cell*6;
+
+  int du = (corner==1 || corner==2 || corner==4) ? 1 : 0;
+  int dv = (corner==2 || corner==4 || corner==5) ? 1 : 0;
+  int cell_v = cell / n_u;
+  int cell_u = cell - cell_v*n_u;
+  vec2 tc = vec2( float(cell_u+du)/float(n_u), float(cell_v+dv)/float(n_v) );
+
+  vec3 p;
+  if (surface_model==0) {
+    float angle = tc.x*2.0*PI + PI;
+    p = vec3( cos(angle)*surface_radius, sin(angle)*surface_radius, tc.y*surface_height );
+  } else {
+    float az = tc.x*2.0*PI;
+    float el = tc.y*PI - PI/2.0;
+    p = surface_radius*vec3( cos(az)*cos(el), sin(az)*cos(el), sin(el) );
+  }
+
+  v_texcoord = tc;
+  v_layer = gl_InstanceID;
+  gl_Position = view_proj[gl_InstanceID] * (surface_matrix * vec4(p, 1.0));
+}
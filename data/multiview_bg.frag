@@ -0,0 +1,12 @@
+/* -*- Mode: C -*- */
+#version 150 compatibility
+
+uniform sampler2DArray backgrounds;
+
+in vec2 texcoord;
+flat in int layer;
+
+void main(void)
+{
+  gl_FragColor = texture(backgrounds, vec3(texcoord, float(layer)));
+}
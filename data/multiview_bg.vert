@@ -0,0 +1,19 @@
+/* -*- Mode: C -*- */
+#version 150 compatibility
+
+// Full screen quad from a 1x1 implicit grid, one instance per view.
+
+out vec2 v_texcoord;
+flat out int v_layer;
+
+void main(void)
+{
+  int corner = gl_VertexID;
+  int du = (corner==1 || corner==2 || corner==4) ? 1 : 0;
+  int dv = (corner==2 || corner==4 || corner==5) ? 1 : 0;
+  vec2 tc = vec2(float(du), float(dv));
+
+  v_texcoord = tc;
+  v_layer = gl_InstanceID;
+  gl_Position = vec4(tc*2.0 - 1.0, 0.0, 1.0);
+}
@@ -0,0 +1,14 @@
+/* -*- Mode: C -*- */
+#version 120
+
+uniform vec4 point_color;
+
+void main(void)
+{
+  // round markers from square point sprites
+  vec2 d = gl_PointCoord*2.0 - 1.0;
+  if (dot(d, d) > 1.0) {
+    discard;
+  }
+  gl_FragColor = point_color;
+}
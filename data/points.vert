@@ -0,0 +1,10 @@
+/* -*- Mode: C -*- */
+#version 120
+
+uniform float point_size;
+
+void main(void)
+{
+  gl_Position = ftransform();
+  gl_PointSize = point_size;
+}
@@ -0,0 +1,74 @@
+/* -*- Mode: C -*- */
+#version 130
+
+// Intersect each pixel's ray with the analytic display surface and
+// write its texcoord and depth. Keep in sync with intersect_local() in
+// DisplaySurfaceGeometry.cpp.
+
+uniform int surface_model; // 0: cylinder, 1: sphere
+uniform float surface_radius;
+uniform float surface_height;
+uniform mat4 surface_matrix_inverse; // world to the frame of surface.vert
+uniform mat4 view_projection;
+uniform mat4 view_projection_inverse;
+uniform sampler2D surface_texture;
+uniform bool texcoord_colors;
+
+in vec2 ndc;
+
+const float PI = 3.14159265358979;
+
+void main(void)
+{
+  // the ray from the near (t=0) to the far plane (t=1)
+  vec4 near = view_projection_inverse * vec4(ndc, -1.0, 1.0);
+  vec4 far = view_projection_inverse * vec4(ndc, 1.0, 1.0);
+  vec3 near_world = near.xyz/near.w;
+  vec3 far_world = far.xyz/far.w;
+  vec3 o = (surface_matrix_inverse * vec4(near_world, 1.0)).xyz;
+  vec3 d = (surface_matrix_inverse * vec4(far_world, 1.0)).xyz - o;
+
+  float r = surface_radius;
+  float a, b, c;
+  if (surface_model==0) {
+    a = dot(d.xy, d.xy);
+    b = dot(o.xy, d.xy);
+    c = dot(o.xy, o.xy) - r*r;
+  } else {
+    a = dot(d, d);
+    b = dot(o, d);
+    c = dot(o, o) - r*r;
+  }
+  float disc = b*b - a*c;
+  if (a <= 0.0 || disc < 0.0) {
+    discard;
+  }
+  float s = sqrt(disc);
+
+  // nearer root first, the far side of the surface when it misses
+  float t = (-b - s)/a;
+  vec3 p = o + t*d;
+  if (t < 0.0 || t > 1.0 || (surface_model==0 && (p.z < 0.0 || p.z > surface_height))) {
+    t = (-b + s)/a;
+    p = o + t*d;
+    if (t < 0.0 || t > 1.0 || (surface_model==0 && (p.z < 0.0 || p.z > surface_height))) {
+      discard;
+    }
+  }
+
+  vec2 tc;
+  if (surface_model==0) {
+    tc = vec2( fract(atan(p.y, p.x)/(2.0*PI) - 0.5), p.z/surface_height );
+  } else {
+    tc = vec2( fract(atan(p.y, p.x)/(2.0*PI)), asin(clamp(p.z/r, -1.0, 1.0))/PI + 0.5 );
+  }
+
+  vec4 clip = view_projection * vec4(mix(near_world, far_world, t), 1.0);
+  gl_FragDepth = 0.5*clip.z/clip.w + 0.5;
+
+  if (texcoord_colors) {
+    gl_FragColor = vec4(tc, 0.0, 1.0);
+  } else {
+    gl_FragColor = texture2D(surface_texture, tc);
+  }
+}
@@ -0,0 +1,13 @@
+/* -*- Mode: C -*- */
+#version 130
+
+// Full screen quad from make_textured_quad() spanning -1..1, already in
+// normalized device coordinates.
+
+out vec2 ndc;
+
+void main(void)
+{
+  ndc = gl_Vertex.xy;
+  gl_Position = vec4(gl_Vertex.xy, 0.0, 1.0);
+}
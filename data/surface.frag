@@ -0,0 +1,15 @@
+/* -*- Mode: C -*- */
+#version 130
+
+uniform bool texcoord_colors;
+
+in vec2 texcoord;
+
+void main(void)
+{
+  if (texcoord_colors) {
+    gl_FragColor = vec4(texcoord, 0.0, 1.0);
+  } else {
+    gl_FragColor = vec4(0.0, 1.0, 0.0, 1.0); // green
+  }
+}
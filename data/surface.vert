@@ -0,0 +1,57 @@
+/* -*- Mode: C -*- */
+#version 130
+
+// Evaluate a display surface from its texture coordinates. There is no
+// vertex buffer: gl_VertexID picks a corner of a cell in an n_u x n_v
+// grid drawn as GL_TRIANGLES.
+
+uniform int surface_model; // 0: cylinder, 1: sphere
+uniform float surface_radius;
+uniform float surface_height;
+uniform mat4 surface_matrix;
+uniform int n_u;
+uniform int n_v;
+// when set, each vertex is drawn as a point on a pixel of its own in a
+// readback_width x readback_height target (see check_gpu_geom())
+uniform int readback_width;
+uniform int readback_height;
+
+out vec2 texcoord;
+flat out vec3 world_position;
+
+const float PI = 3.14159265358979;
+
+void main(void)
+{
+  int cell = gl_VertexID / 6;
+  int corner = gl_VertexID - cell*6;
+
+  // two triangles per cell: (0,0) (1,0) (1,1) and (0,0) (1,1) (0,1)
+  int du = (corner==1 || corner==2 || corner==4) ? 1 : 0;
+  int dv = (corner==2 || corner==4 || corner==5) ? 1 : 0;
+  int cell_v = cell / n_u;
+  int cell_u = cell - cell_v*n_u;
+  vec2 tc = vec2( float(cell_u+du)/float(n_u), float(cell_v+dv)/float(n_v) );
+
+  vec3 p;
+  if (surface_model==0) {
+    float angle = tc.x*2.0*PI + PI;
+    p = vec3( cos(angle)*surface_radius, sin(angle)*surface_radius, tc.y*surface_height );
+  } else {
+    float az = tc.x*2.0*PI;
+    float el = tc.y*PI - PI/2.0;
+    p = surface_radius*vec3( cos(az)*cos(el), sin(az)*cos(el), sin(el) );
+  }
+
+  vec4 world = surface_matrix * vec4(p, 1.0);
+  texcoord = tc;
+  world_position = world.xyz;
+  if (readback_width > 0) {
+    int y = gl_VertexID / readback_width;
+    int x = gl_VertexID - y*readback_width;
+    gl_Position = vec4( (2.0*float(x) + 1.0)/float(readback_width) - 1.0,
+                        (2.0*float(y) + 1.0)/float(readback_height) - 1.0, 0.0, 1.0 );
+  } else {
+    gl_Position = gl_ModelViewProjectionMatrix * world;
+  }
+}
@@ -0,0 +1,12 @@
+/* -*- Mode: C -*- */
+#version 130
+
+// Writes the position surface.vert computed for a vertex, for
+// DisplaySurfaceGeometry::check_gpu_geom().
+
+flat in vec3 world_position;
+
+void main(void)
+{
+  gl_FragColor = vec4(world_position, 1.0);
+}
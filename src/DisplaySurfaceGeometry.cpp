@@ -1,16 +1,76 @@
 /* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 #include "DisplaySurfaceGeometry.h"
+#include "profiler.h"
+#include "util.h"
+#include "array_pool.h"
+#include "surface_eval.h"
 
 #include <iostream>
 #include <fstream>
 
 #include <osg/Geometry>
+#include <osg/Program>
+#include <osg/Shader>
+#include <osg/Uniform>
+#include <osg/Texture2D>
+#include <osg/Image>
+#include <osg/Timer>
+#include <osg/Viewport>
+#include <osgViewer/Viewer>
 
 #include <stdio.h>
+#include <math.h>
 #include <jansson.h>
 
 #include <stdexcept>
 #include <sstream>
+#include <algorithm>
+#include <limits>
+
+// Nearest t in [0, t_max] where o + t*d meets the surface in its local
+// frame (see data/surface.vert), and the texcoord there. Used by the
+// CPU intersectors; keep in sync with data/raycast.frag.
+template<typename T>
+static bool intersect_local(SurfaceShaderParameters::Model model, T r, T h,
+                            const T o[3], const T d[3], T t_max, T& t, osg::Vec2& tc) {
+    const T PI = (T)osg::PI;
+    T a, b, c;
+    if (model==SurfaceShaderParameters::CYLINDER) {
+        a = d[0]*d[0] + d[1]*d[1];
+        b = o[0]*d[0] + o[1]*d[1];
+        c = o[0]*o[0] + o[1]*o[1] - r*r;
+    } else {
+        a = d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+        b = o[0]*d[0] + o[1]*d[1] + o[2]*d[2];
+        c = o[0]*o[0] + o[1]*o[1] + o[2]*o[2] - r*r;
+    }
+    T disc = b*b - a*c;
+    if (a <= 0 || disc < 0) {
+        return false;
+    }
+    T s = sqrt(disc);
+    T roots[2] = { (-b - s)/a, (-b + s)/a };
+    for (int k=0; k<2; k++) {
+        t = roots[k];
+        if (t < 0 || t > t_max) {
+            continue;
+        }
+        T p[3] = { o[0] + t*d[0], o[1] + t*d[1], o[2] + t*d[2] };
+        if (model==SurfaceShaderParameters::CYLINDER) {
+            if (p[2] < 0 || p[2] > h) {
+                continue;
+            }
+            T u = atan2(p[1], p[0])/(2*PI) - (T)0.5;
+            tc.set(u - floor(u), p[2]/h);
+        } else {
+            T u = atan2(p[1], p[0])/(2*PI);
+            T z = std::max((T)-1, std::min((T)1, p[2]/r));
+            tc.set(u - floor(u), asin(z)/PI + (T)0.5);
+        }
+        return true;
+    }
+    return false;
+}
 
 class CylinderModel : public GeomModel {
 public:
@@ -23,30 +83,43 @@ public:
         osg::Vec3 normax = _axis;
         normax.normalize();
 
-        _matrix = osg::Matrix::rotate( unit_z, normax ); // from unit_z to normax
         _height = _axis.length();
+        // a zero height cylinder is a ring, taken to lie in the xy plane
+        _matrix = _height > 0.0 ? osg::Matrix::rotate( unit_z, normax ) // from unit_z to normax
+                                : osg::Matrix::identity();
+        _to_local = osg::Matrixd::translate(-osg::Vec3d(_base)) * osg::Matrixd::inverse(_matrix);
+        _surface = CylinderSurface(_radius, _height, _matrix * osg::Matrixd::translate(_base));
     }
 
     osg::Vec3 texcoord2worldcoord( osg::Vec2 tc ) {
-        // keep in sync with simple_geom.py
-        double frac_theta = tc[0];
-        double frac_height = tc[1];
+        double xyz[3];
+        _surface.eval(tc[0], tc[1], xyz);
+        return osg::Vec3(xyz[0], xyz[1], xyz[2]);
+    }
 
-        double angle = frac_theta * 2.0*osg::PI + osg::PI;
-        float c = cosf(angle);
-        float s = sinf(angle);
-        double r = _radius;
+    osg::Vec3 texcoord2normal( osg::Vec2 tc ) {
+        double n[3];
+        _surface.normal(tc[0], tc[1], n);
+        return osg::Vec3(n[0], n[1], n[2]);
+    }
 
-        return (osg::Vec3(c*r,s*r,frac_height*_height))*_matrix + _base;
+    void texcoord2worldcoord(const double* tc, unsigned int n, double* xyz) {
+        _surface.texcoord2worldcoord(tc, n, xyz);
     }
 
-    osg::Vec3 texcoord2normal( osg::Vec2 tc ) {
-        double frac_theta = tc[0];
+    void texcoord2normal(const double* tc, unsigned int n, double* normals) {
+        _surface.texcoord2normal(tc, n, normals);
+    }
+
+    osg::Vec2 worldcoord2texcoord( osg::Vec3 xyz ) {
+        const double X[3] = {xyz[0], xyz[1], xyz[2]};
+        double tc[2];
+        _surface.inverse(X, tc);
+        return osg::Vec2(tc[0], tc[1]);
+    }
 
-        double angle = frac_theta * 2.0*osg::PI;
-        float c = cosf(angle);
-        float s = sinf(angle);
-        return osg::Vec3(c,s,0)*_matrix;
+    void worldcoord2texcoord(const float* xyz, unsigned int n, float* tc) {
+        _surface.worldcoord2texcoord(xyz, n, tc);
     }
 
     osg::ref_ptr<osg::Geometry> make_geom(bool texcoord_colors) {
@@ -55,10 +128,12 @@ public:
             double fracDelta = 1.0/(double)_n_segments;
             double frac=0.0;
 
-            osg::Vec3Array* vertices = new osg::Vec3Array;
-            osg::Vec3Array* normals = new osg::Vec3Array;
-            osg::Vec2Array* tc = new osg::Vec2Array; // cylindrical coordinates
-            osg::ref_ptr<osg::Vec4Array> colors = new osg::Vec4Array;
+            unsigned int n_verts = 2*_n_segments+2;
+            GeometryPools& pools = geometry_pools();
+            osg::ref_ptr<osg::Vec3Array> vertices = pools.vec3.get(n_verts);
+            osg::ref_ptr<osg::Vec3Array> normals = pools.vec3.get(n_verts);
+            osg::ref_ptr<osg::Vec2Array> tc = pools.vec2.get(n_verts); // cylindrical coordinates
+            osg::ref_ptr<osg::Vec4Array> colors = pools.vec4.get(texcoord_colors ? n_verts : 1);
 
             for(unsigned int bodyi=0;
                 bodyi<=_n_segments;
@@ -87,10 +162,10 @@ public:
             if (!texcoord_colors) {
                 colors->push_back(osg::Vec4(0.0f,1.0f,0.0f,1.0f));
             }
-            this_geom->setVertexArray(vertices);
-            this_geom->setNormalArray(normals);
-            this_geom->setTexCoordArray(0,tc);
-            this_geom->addPrimitiveSet(new osg::DrawArrays(osg::PrimitiveSet::LINES,0,2*_n_segments+2));
+            this_geom->setVertexArray(vertices.get());
+            this_geom->setNormalArray(normals.get());
+            this_geom->setTexCoordArray(0,tc.get());
+            this_geom->addPrimitiveSet(new osg::DrawArrays(osg::PrimitiveSet::LINES,0,n_verts));
             this_geom->setColorArray(colors.get());
             if (texcoord_colors) {
                 this_geom->setColorBinding(osg::Geometry::BIND_PER_VERTEX);
@@ -111,6 +186,40 @@ public:
         return result;
     }
 
+    SurfaceShaderParameters get_shader_parameters() {
+        SurfaceShaderParameters result;
+        result.model = SurfaceShaderParameters::CYLINDER;
+        result.radius = _radius;
+        result.height = _height;
+        result.matrix = _matrix * osg::Matrix::translate(_base);
+
+        osg::Vec3 r(_radius, _radius, _radius);
+        result.bound.expandBy( _base - r );
+        result.bound.expandBy( _base + r );
+        result.bound.expandBy( _base + _axis - r );
+        result.bound.expandBy( _base + _axis + r );
+        return result;
+    }
+
+    bool intersect(osg::Vec3d origin, osg::Vec3d dir, double& t, osg::Vec2& tc) {
+        osg::Vec3d o = origin*_to_local;
+        osg::Vec3d d = osg::Matrixd::transform3x3(dir, _to_local);
+        return intersect_local(SurfaceShaderParameters::CYLINDER, _radius, _height,
+                               o.ptr(), d.ptr(), std::numeric_limits<double>::max(), t, tc);
+    }
+
+    void get_depth_range(osg::Vec3 origin, osg::Vec3 dir, double& dmin, double& dmax) {
+        // The rim circles reach r*sin(angle between dir and axis) either
+        // side of their centers.
+        double d0 = (_base - origin) * dir;
+        double along = _axis * dir;
+        // a ring lies in the xy plane, see the constructor
+        double cos_a = _height > 0.0 ? along / _height : dir[2];
+        double rim = _radius * sqrt( std::max(0.0, 1.0 - cos_a*cos_a) );
+        dmin = d0 + std::min(0.0, along) - rim;
+        dmax = d0 + std::max(0.0, along) + rim;
+    }
+
 private:
     double _radius;
     osg::Vec3 _base;
@@ -121,46 +230,44 @@ private:
     // derived from above:
     osg::Matrix _matrix;
     double _height;
+    osg::Matrixd _to_local; // world to the frame of texcoord2worldcoord()
+    CylinderSurface _surface;
 };
 
 class SphereModel : public GeomModel {
 public:
     SphereModel(float radius, osg::Vec3 center) :
-        _radius(radius), _center(center), _n_az(20), _n_el(12) {}
+        _radius(radius), _center(center), _n_az(20), _n_el(12), _surface(radius, center) {}
 
     osg::Vec3 texcoord2worldcoord( osg::Vec2 tc ) {
-        // keep in sync with simple_geom.py
-        double frac_az = tc[0];
-        double frac_el = tc[1];
-
-        double az = frac_az * 2.0*osg::PI;
-        double el = frac_el*osg::PI - osg::PI/2.0;
-
-        double ca = cos(az);
-        double sa = sin(az);
-
-        double ce = cos(el);
-        double se = sin(el);
-
-        double r = _radius;
-
-        return osg::Vec3(r*ca*ce, r*sa*ce, r*se);
+        double xyz[3];
+        _surface.eval(tc[0], tc[1], xyz);
+        return osg::Vec3(xyz[0], xyz[1], xyz[2]);
     }
 
     osg::Vec3 texcoord2normal( osg::Vec2 tc ) {
-        double frac_az = tc[0];
-        double frac_el = tc[1];
+        double n[3];
+        _surface.normal(tc[0], tc[1], n);
+        return osg::Vec3(n[0], n[1], n[2]);
+    }
 
-        double az = frac_az * 2.0*osg::PI;
-        double el = frac_el*osg::PI - osg::PI/2.0;
+    void texcoord2worldcoord(const double* tc, unsigned int n, double* xyz) {
+        _surface.texcoord2worldcoord(tc, n, xyz);
+    }
 
-        double ca = cos(az);
-        double sa = sin(az);
+    void texcoord2normal(const double* tc, unsigned int n, double* normals) {
+        _surface.texcoord2normal(tc, n, normals);
+    }
 
-        double ce = cos(el);
-        double se = sin(el);
+    osg::Vec2 worldcoord2texcoord( osg::Vec3 xyz ) {
+        const double X[3] = {xyz[0], xyz[1], xyz[2]};
+        double tc[2];
+        _surface.inverse(X, tc);
+        return osg::Vec2(tc[0], tc[1]);
+    }
 
-        return osg::Vec3(ca*ce, sa*ce, se);
+    void worldcoord2texcoord(const float* xyz, unsigned int n, float* tc) {
+        _surface.worldcoord2texcoord(xyz, n, tc);
     }
 
     osg::ref_ptr<osg::Geometry> make_geom(bool texcoord_colors) {
@@ -171,10 +278,12 @@ public:
 
             double frac_el=0.0;
 
-            osg::Vec3Array* vertices = new osg::Vec3Array;
-            osg::Vec3Array* normals = new osg::Vec3Array;
-            osg::Vec2Array* tc = new osg::Vec2Array; // cylindrical coordinates
-            osg::ref_ptr<osg::Vec4Array> colors = new osg::Vec4Array;
+            unsigned int n_verts = 2*_n_el*(_n_az+1);
+            GeometryPools& pools = geometry_pools();
+            osg::ref_ptr<osg::Vec3Array> vertices = pools.vec3.get(n_verts);
+            osg::ref_ptr<osg::Vec3Array> normals = pools.vec3.get(n_verts);
+            osg::ref_ptr<osg::Vec2Array> tc = pools.vec2.get(n_verts); // spherical coordinates
+            osg::ref_ptr<osg::Vec4Array> colors = pools.vec4.get(texcoord_colors ? n_verts : 1);
             int idx=0;
 
             // This is quick and dirty, not elegant. Many vertices
@@ -190,6 +299,7 @@ public:
 
                 osg::DrawElementsUInt* sphere_strip =
                     new osg::DrawElementsUInt(osg::PrimitiveSet::QUAD_STRIP, 0);
+                sphere_strip->reserve(2*(_n_az+1));
 
                 for(unsigned int bodyj=0;
                     bodyj<=_n_az;
@@ -218,15 +328,15 @@ public:
                         sphere_strip->push_back(idx);
                         idx++;
                     }
-                    this_geom->addPrimitiveSet(sphere_strip);
                 }
+                this_geom->addPrimitiveSet(sphere_strip);
             }
             if (!texcoord_colors) {
                 colors->push_back(osg::Vec4(1.0f,1.0f,1.0f,1.0f));
             }
-            this_geom->setVertexArray(vertices);
-            this_geom->setNormalArray(normals);
-            this_geom->setTexCoordArray(0,tc);
+            this_geom->setVertexArray(vertices.get());
+            this_geom->setNormalArray(normals.get());
+            this_geom->setTexCoordArray(0,tc.get());
             this_geom->setColorArray(colors.get());
             if (texcoord_colors) {
                 this_geom->setColorBinding(osg::Geometry::BIND_PER_VERTEX);
@@ -247,14 +357,78 @@ public:
         return result;
     }
 
+    SurfaceShaderParameters get_shader_parameters() {
+        SurfaceShaderParameters result;
+        result.model = SurfaceShaderParameters::SPHERE;
+        result.radius = _radius;
+        result.height = 0.0;
+        result.matrix = osg::Matrix::translate(_center);
+
+        osg::Vec3 r(_radius, _radius, _radius);
+        result.bound.expandBy( _center - r );
+        result.bound.expandBy( _center + r );
+        return result;
+    }
+
+    bool intersect(osg::Vec3d origin, osg::Vec3d dir, double& t, osg::Vec2& tc) {
+        osg::Vec3d o = origin - osg::Vec3d(_center);
+        return intersect_local(SurfaceShaderParameters::SPHERE, _radius, 0.0,
+                               o.ptr(), dir.ptr(), std::numeric_limits<double>::max(), t, tc);
+    }
+
+    void get_depth_range(osg::Vec3 origin, osg::Vec3 dir, double& dmin, double& dmax) {
+        double d0 = (_center - origin) * dir;
+        dmin = d0 - _radius;
+        dmax = d0 + _radius;
+    }
+
 private:
     double _radius;
     osg::Vec3 _center;
 
     unsigned int _n_az;
     unsigned int _n_el;
+    SphereSurface _surface;
+};
+
+// Draws an n_u x n_v grid of cells as GL_TRIANGLES without any vertex
+// arrays, for shaders that derive the vertex from gl_VertexID.
+class ImplicitGridDrawable : public osg::Drawable {
+public:
+    ImplicitGridDrawable() : _n_vertices(0), _n_instances(1), _mode(GL_TRIANGLES) {}
+    ImplicitGridDrawable(unsigned int n_u, unsigned int n_v, unsigned int n_instances,
+                         GLenum mode=GL_TRIANGLES) :
+        _n_vertices(6*n_u*n_v), _n_instances(n_instances), _mode(mode) {
+        setUseDisplayList(false);
+    }
+    ImplicitGridDrawable(const ImplicitGridDrawable& other,
+                         const osg::CopyOp& copyop=osg::CopyOp::SHALLOW_COPY) :
+        osg::Drawable(other, copyop), _n_vertices(other._n_vertices),
+        _n_instances(other._n_instances), _mode(other._mode) {}
+
+    META_Object(flyvr, ImplicitGridDrawable);
+
+    virtual void drawImplementation(osg::RenderInfo& renderInfo) const {
+        osg::State* state = renderInfo.getState();
+        state->disableAllVertexArrays();
+        if (_n_instances==1) {
+            glDrawArrays(_mode, 0, _n_vertices);
+        } else {
+            state->glDrawArraysInstanced(_mode, 0, _n_vertices, _n_instances);
+        }
+    }
+
+private:
+    GLsizei _n_vertices;
+    GLsizei _n_instances;
+    GLenum _mode; // GL_POINTS to read vertices back
 };
 
+osg::ref_ptr<osg::Drawable> make_implicit_grid(unsigned int n_u, unsigned int n_v,
+                                               unsigned int n_instances) {
+    return new ImplicitGridDrawable(n_u, n_v, n_instances);
+}
+
 osg::Vec3 parse_vec3( json_t *root) {
     float x,y,z;
 
@@ -280,6 +454,7 @@ osg::Vec3 parse_vec3( json_t *root) {
 }
 
 DisplaySurfaceGeometry::DisplaySurfaceGeometry(const char *fname) {
+    PROFILE_ZONE("json load");
     json_t *root;
     json_error_t error;
 
@@ -290,7 +465,13 @@ DisplaySurfaceGeometry::DisplaySurfaceGeometry(const char *fname) {
         throw std::runtime_error(os.str());
     }
 
-    parse_json(root);
+    try {
+        parse_json(root);
+    } catch (...) {
+        json_decref(root);
+        throw;
+    }
+    json_decref(root);
 }
 
 void DisplaySurfaceGeometry::parse_json(json_t *root) {
@@ -340,14 +521,692 @@ void DisplaySurfaceGeometry::parse_json(json_t *root) {
         os << "unknown model " << model;
         throw std::runtime_error(os.str());
     }
-
-    json_decref(root);
 }
 
 osg::ref_ptr<osg::Geometry> DisplaySurfaceGeometry::make_geom(bool texcoord_colors) {
+    PROFILE_ZONE("make_geom");
     return _geom->make_geom(texcoord_colors);
 };
 
 KeyPointMap DisplaySurfaceGeometry::get_key_points() {
     return _geom->get_key_points();
 }
+
+osg::Vec3 DisplaySurfaceGeometry::texcoord2worldcoord(osg::Vec2 tc) {
+    return _geom->texcoord2worldcoord(tc);
+}
+
+void DisplaySurfaceGeometry::texcoord2worldcoord(const double* tc, unsigned int n, double* xyz) {
+    _geom->texcoord2worldcoord(tc, n, xyz);
+}
+
+void DisplaySurfaceGeometry::texcoord2normal(const double* tc, unsigned int n, double* normals) {
+    _geom->texcoord2normal(tc, n, normals);
+}
+
+osg::Vec2 DisplaySurfaceGeometry::worldcoord2texcoord(osg::Vec3 xyz) {
+    return _geom->worldcoord2texcoord(xyz);
+}
+
+void DisplaySurfaceGeometry::worldcoord2texcoord(const float* xyz, unsigned int n, float* tc) {
+    _geom->worldcoord2texcoord(xyz, n, tc);
+}
+
+void DisplaySurfaceGeometry::get_depth_range(osg::Vec3 origin, osg::Vec3 dir, double& dmin, double& dmax) {
+    _geom->get_depth_range(origin, dir, dmin, dmax);
+}
+
+SurfaceShaderParameters DisplaySurfaceGeometry::get_shader_parameters() {
+    return _geom->get_shader_parameters();
+}
+
+osg::ref_ptr<osg::Geode> DisplaySurfaceGeometry::make_gpu_geom(unsigned int n_u, unsigned int n_v,
+                                                               bool texcoord_colors,
+                                                               unsigned int n_instances) {
+    PROFILE_ZONE("make_gpu_geom");
+    SurfaceShaderParameters params = _geom->get_shader_parameters();
+
+    osg::ref_ptr<ImplicitGridDrawable> drawable = new ImplicitGridDrawable(n_u, n_v, n_instances);
+    drawable->setInitialBound(params.bound);
+
+    osg::ref_ptr<osg::Geode> geode = new osg::Geode;
+    geode->addDescription("GPU surface geode");
+    geode->addDrawable(drawable.get());
+
+    osg::Program* program = new osg::Program;
+    osg::Shader* vert = new osg::Shader(osg::Shader::VERTEX);
+    osg::Shader* frag = new osg::Shader(osg::Shader::FRAGMENT);
+    LoadShaderSource(vert, "surface.vert");
+    LoadShaderSource(frag, "surface.frag");
+    program->addShader(vert);
+    program->addShader(frag);
+
+    // Changing the surface later is only a matter of setting these
+    // uniforms (and the initial bound if it grows).
+    osg::StateSet* ss = geode->getOrCreateStateSet();
+    ss->setAttributeAndModes(program, osg::StateAttribute::ON);
+    ss->addUniform(new osg::Uniform("surface_model", (int)params.model));
+    ss->addUniform(new osg::Uniform("surface_radius", params.radius));
+    ss->addUniform(new osg::Uniform("surface_height", params.height));
+    ss->addUniform(new osg::Uniform("surface_matrix", params.matrix));
+    ss->addUniform(new osg::Uniform("n_u", (int)n_u));
+    ss->addUniform(new osg::Uniform("n_v", (int)n_v));
+    ss->addUniform(new osg::Uniform("texcoord_colors", texcoord_colors));
+    ss->setMode(GL_LIGHTING, osg::StateAttribute::OFF);
+    return geode;
+}
+
+// Draws scene once into a float RGBA image in an offscreen context and
+// reads it back, so that shader output can be compared with the CPU.
+// The shaders place their own geometry, the camera matrices are
+// identity. Pixels nothing was drawn to are left at alpha 0.
+static osg::ref_ptr<osg::Image> render_float_image(osg::Node* scene, unsigned int width, unsigned int height) {
+    osg::ref_ptr<osg::GraphicsContext::Traits> traits = new osg::GraphicsContext::Traits;
+    traits->x = 0;
+    traits->y = 0;
+    traits->width = width;
+    traits->height = height;
+    traits->windowDecoration = false;
+    traits->doubleBuffer = false;
+    traits->pbuffer = true;
+    osg::ref_ptr<osg::GraphicsContext> gc = osg::GraphicsContext::createGraphicsContext(traits.get());
+    if (!gc.valid()) {
+        throw std::runtime_error("could not create offscreen context for the shader check");
+    }
+
+    osg::ref_ptr<osg::Image> image = new osg::Image;
+    image->allocateImage(width, height, 1, GL_RGBA, GL_FLOAT);
+    image->setInternalTextureFormat(GL_RGBA32F_ARB);
+
+    osgViewer::Viewer viewer;
+    viewer.setThreadingModel(osgViewer::Viewer::SingleThreaded);
+    viewer.setSceneData(scene);
+    osg::Camera* camera = viewer.getCamera();
+    camera->setGraphicsContext(gc.get());
+    camera->setViewport(new osg::Viewport(0, 0, width, height));
+    camera->setComputeNearFarMode(osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR);
+    camera->setCullingMode(osg::CullSettings::NO_CULLING);
+    camera->setViewMatrix(osg::Matrixd::identity());
+    camera->setProjectionMatrix(osg::Matrixd::identity());
+    camera->setClearColor(osg::Vec4(0.0f, 0.0f, 0.0f, 0.0f));
+    camera->setRenderTargetImplementation(osg::Camera::FRAME_BUFFER_OBJECT);
+    camera->attach(osg::Camera::COLOR_BUFFER, image.get());
+    viewer.realize();
+    viewer.frame();
+    return image;
+}
+
+double DisplaySurfaceGeometry::check_gpu_geom(unsigned int n_u, unsigned int n_v) {
+    SurfaceShaderParameters params = _geom->get_shader_parameters();
+
+    // surface.vert puts every vertex of the grid on a pixel of its own
+    // and surface_readback.frag writes the position it computed there
+    const unsigned int n_vertices = 6*n_u*n_v;
+    const unsigned int width = std::min(n_vertices, 1024u);
+    const unsigned int height = (n_vertices + width - 1)/width;
+
+    osg::ref_ptr<osg::Geode> geode = new osg::Geode;
+    osg::ref_ptr<ImplicitGridDrawable> drawable = new ImplicitGridDrawable(n_u, n_v, 1, GL_POINTS);
+    drawable->setInitialBound(params.bound);
+    geode->addDrawable(drawable.get());
+
+    osg::Program* program = new osg::Program;
+    osg::Shader* vert = new osg::Shader(osg::Shader::VERTEX);
+    osg::Shader* frag = new osg::Shader(osg::Shader::FRAGMENT);
+    LoadShaderSource(vert, "surface.vert");
+    LoadShaderSource(frag, "surface_readback.frag");
+    program->addShader(vert);
+    program->addShader(frag);
+
+    osg::StateSet* ss = geode->getOrCreateStateSet();
+    ss->setAttributeAndModes(program, osg::StateAttribute::ON);
+    ss->addUniform(new osg::Uniform("surface_model", (int)params.model));
+    ss->addUniform(new osg::Uniform("surface_radius", params.radius));
+    ss->addUniform(new osg::Uniform("surface_height", params.height));
+    ss->addUniform(new osg::Uniform("surface_matrix", params.matrix));
+    ss->addUniform(new osg::Uniform("n_u", (int)n_u));
+    ss->addUniform(new osg::Uniform("n_v", (int)n_v));
+    ss->addUniform(new osg::Uniform("readback_width", (int)width));
+    ss->addUniform(new osg::Uniform("readback_height", (int)height));
+    ss->setMode(GL_LIGHTING, osg::StateAttribute::OFF);
+    ss->setMode(GL_DEPTH_TEST, osg::StateAttribute::OFF);
+
+    osg::ref_ptr<osg::Image> image = render_float_image(geode.get(), width, height);
+
+    double max_err = 0.0;
+    for (unsigned int id=0; id<n_vertices; id++) {
+        const float* pixel = (const float*)image->data(id % width, id / width);
+        if (pixel[3] < 0.5f) {
+            throw std::runtime_error("surface shader check: vertex missing from the readback");
+        }
+        // the corner surface.vert derives from gl_VertexID
+        unsigned int cell = id/6, corner = id%6;
+        unsigned int du = (corner==1 || corner==2 || corner==4) ? 1 : 0;
+        unsigned int dv = (corner==2 || corner==4 || corner==5) ? 1 : 0;
+        osg::Vec2 tc( (float)(cell%n_u + du)/(float)n_u, (float)(cell/n_u + dv)/(float)n_v );
+        osg::Vec3 p(pixel[0], pixel[1], pixel[2]);
+        max_err = std::max(max_err, (double)(p - _geom->texcoord2worldcoord(tc)).length());
+    }
+    return max_err;
+}
+
+bool DisplaySurfaceGeometry::intersect(osg::Vec3d origin, osg::Vec3d dir, double& t, osg::Vec2& tc) {
+    return _geom->intersect(origin, dir, t, tc);
+}
+
+osg::ref_ptr<osg::Group> DisplaySurfaceGeometry::make_raycast_geom(const CameraModel& cam, float znear, float zfar,
+                                                                   osg::Texture* texture,
+                                                                   bool texcoord_colors) {
+    PROFILE_ZONE("make_raycast_geom");
+    SurfaceShaderParameters params = _geom->get_shader_parameters();
+
+    osg::ref_ptr<osg::Texture> tex = texture;
+    if (!tex.valid()) {
+        osg::ref_ptr<osg::Image> green = new osg::Image;
+        green->allocateImage(1, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE);
+        unsigned char* data = green->data();
+        data[0] = 0; data[1] = 255; data[2] = 0; data[3] = 255;
+        tex = new osg::Texture2D(green.get());
+    }
+
+    // the quad spans normalized device coordinates and is never culled
+    osg::ref_ptr<osg::Group> group = make_textured_quad(tex.get(), 0.0f, 1.0f, 1.0f,
+                                                        -1.0f, -1.0f, 2.0f, 2.0f);
+    group->addDescription("raycast surface");
+    group->setCullingActive(false);
+    for (unsigned int i=0; i<group->getNumChildren(); i++) {
+        group->getChild(i)->setCullingActive(false);
+    }
+
+    osg::Program* program = new osg::Program;
+    osg::Shader* vert = new osg::Shader(osg::Shader::VERTEX);
+    osg::Shader* frag = new osg::Shader(osg::Shader::FRAGMENT);
+    LoadShaderSource(vert, "raycast.vert");
+    LoadShaderSource(frag, "raycast.frag");
+    program->addShader(vert);
+    program->addShader(frag);
+
+    osg::StateSet* ss = group->getOrCreateStateSet();
+    ss->setAttributeAndModes(program, osg::StateAttribute::ON);
+    ss->addUniform(new osg::Uniform("surface_model", (int)params.model));
+    ss->addUniform(new osg::Uniform("surface_radius", params.radius));
+    ss->addUniform(new osg::Uniform("surface_height", params.height));
+    ss->addUniform(new osg::Uniform("surface_matrix_inverse", osg::Matrixf::inverse(params.matrix)));
+    ss->addUniform(new osg::Uniform("surface_texture", 0));
+    ss->addUniform(new osg::Uniform("texcoord_colors", texcoord_colors));
+    set_raycast_camera(group.get(), cam, znear, zfar);
+    return group;
+}
+
+void DisplaySurfaceGeometry::set_raycast_camera(osg::Node* node, const CameraModel& cam, float znear, float zfar) {
+    // built once, a temporary std::string per call would allocate every frame
+    static const std::string view_projection_name("view_projection");
+    static const std::string view_projection_inverse_name("view_projection_inverse");
+    osg::Matrixd view_projection = cam.view()*cam.projection(znear, zfar);
+    osg::StateSet* ss = node->getOrCreateStateSet();
+    ss->getOrCreateUniform(view_projection_name, osg::Uniform::FLOAT_MAT4)->set(osg::Matrixf(view_projection));
+    ss->getOrCreateUniform(view_projection_inverse_name, osg::Uniform::FLOAT_MAT4)->set(
+        osg::Matrixf(osg::Matrixd::inverse(view_projection)));
+}
+
+double DisplaySurfaceGeometry::check_raycast_geom(const CameraModel& cam, float znear, float zfar,
+                                                  unsigned int n, unsigned int* n_disagree) {
+    // the shader's texcoords, alpha 1 where it hit the surface; the
+    // quad spans the viewport, so n x n pixels sample the whole camera
+    osg::ref_ptr<osg::Group> node = make_raycast_geom(cam, znear, zfar, NULL, true);
+    osg::ref_ptr<osg::Image> image = render_float_image(node.get(), n, n);
+
+    // reference rays straight from K, R and t
+    double R[9], t[3], K00, K01, K02, K11, K12;
+    cam.get_Rt(R, t);
+    cam.get_intrinsic(K00, K01, K02, K11, K12);
+    osg::Vec3d origin( -(R[0]*t[0] + R[3]*t[1] + R[6]*t[2]),
+                       -(R[1]*t[0] + R[4]*t[1] + R[7]*t[2]),
+                       -(R[2]*t[0] + R[5]*t[1] + R[8]*t[2]) );
+
+    const double w = cam.width(), h = cam.height();
+    double max_err = 0.0;
+    unsigned int disagree = 0;
+    for (unsigned int j=0; j<n; j++) {
+        for (unsigned int i=0; i<n; i++) {
+            // window coordinates of the pixel center; the projection puts
+            // pixel u at window x = u and row v at y = v (y up) or
+            // y = height - v. Rows are read back bottom up.
+            double x = (i + 0.5)*w/n;
+            double y = (j + 0.5)*h/n;
+            const float* pixel = (const float*)image->data(i, j);
+            bool hit_shader = pixel[3] > 0.5f;
+            osg::Vec2 tc_shader(pixel[0], pixel[1]);
+
+            double v = cam.y_up() ? y : h - y;
+            double yc = (v - K12)/K11;
+            double xc = (x - K02 - K01*yc)/K00;
+            osg::Vec3d dir( R[0]*xc + R[3]*yc + R[6],
+                            R[1]*xc + R[4]*yc + R[7],
+                            R[2]*xc + R[5]*yc + R[8] );
+            double t_hit;
+            osg::Vec2 tc_cpu;
+            bool hit_cpu = _geom->intersect(origin, dir, t_hit, tc_cpu);
+
+            if (hit_shader != hit_cpu) {
+                disagree++;
+                continue;
+            }
+            if (hit_cpu) {
+                double du = fabs(tc_shader[0] - tc_cpu[0]);
+                du = std::min(du, 1.0 - du); // across the seam
+                double dv = tc_shader[1] - tc_cpu[1];
+                max_err = std::max(max_err, sqrt(du*du + dv*dv));
+            }
+        }
+    }
+    if (n_disagree) {
+        *n_disagree = disagree;
+    }
+    return max_err;
+}
+
+std::vector<SurfaceChunk> DisplaySurfaceGeometry::make_chunks(unsigned int n_u, unsigned int n_v) {
+    // Bounds come from sampling the patch. The padding covers the
+    // bulge of the curved surface between samples.
+    const unsigned int n_samples = 8;
+    const float padding = 1.02f;
+
+    std::vector<SurfaceChunk> result;
+    result.reserve(n_u*n_v);
+    for (unsigned int j=0; j<n_v; j++) {
+        for (unsigned int i=0; i<n_u; i++) {
+            SurfaceChunk chunk;
+            chunk.tc_min = osg::Vec2( (float)i/n_u, (float)j/n_v );
+            chunk.tc_max = osg::Vec2( (float)(i+1)/n_u, (float)(j+1)/n_v );
+
+            osg::BoundingBox bbox;
+            for (unsigned int si=0; si<=n_samples; si++) {
+                for (unsigned int sj=0; sj<=n_samples; sj++) {
+                    osg::Vec2 tc( chunk.tc_min[0] + (chunk.tc_max[0]-chunk.tc_min[0])*si/n_samples,
+                                  chunk.tc_min[1] + (chunk.tc_max[1]-chunk.tc_min[1])*sj/n_samples );
+                    bbox.expandBy( _geom->texcoord2worldcoord(tc) );
+                }
+            }
+            chunk.bound = osg::BoundingSphere( bbox.center(), bbox.radius()*padding );
+            result.push_back(chunk);
+        }
+    }
+    return result;
+}
+
+osg::ref_ptr<osg::Geometry> DisplaySurfaceGeometry::make_chunk_geom(const SurfaceChunk& chunk, unsigned int n,
+                                                                    bool texcoord_colors) {
+    unsigned int n_verts = (n+1)*(n+1);
+    GeometryPools& pools = geometry_pools();
+    osg::ref_ptr<osg::Vec3Array> vertices = pools.vec3.get(n_verts);
+    osg::ref_ptr<osg::Vec3Array> normals = pools.vec3.get(n_verts);
+    osg::ref_ptr<osg::Vec2Array> tc = pools.vec2.get(n_verts);
+    osg::ref_ptr<osg::Vec4Array> colors = pools.vec4.get(texcoord_colors ? n_verts : 1);
+
+    for (unsigned int j=0; j<=n; j++) {
+        for (unsigned int i=0; i<=n; i++) {
+            osg::Vec2 tci( chunk.tc_min[0] + (chunk.tc_max[0]-chunk.tc_min[0])*i/n,
+                           chunk.tc_min[1] + (chunk.tc_max[1]-chunk.tc_min[1])*j/n );
+            vertices->push_back( _geom->texcoord2worldcoord(tci) );
+            normals->push_back( _geom->texcoord2normal(tci) );
+            tc->push_back( tci );
+            if (texcoord_colors) {
+                colors->push_back( osg::Vec4( tci[0], tci[1], 0.0, 1.0 ) );
+            }
+        }
+    }
+    if (!texcoord_colors) {
+        colors->push_back(osg::Vec4(0.0f,1.0f,0.0f,1.0f));
+    }
+
+    osg::ref_ptr<osg::DrawElementsUInt> tris = new osg::DrawElementsUInt(osg::PrimitiveSet::TRIANGLES, 0);
+    tris->reserve(6*n*n);
+    for (unsigned int j=0; j<n; j++) {
+        for (unsigned int i=0; i<n; i++) {
+            unsigned int a = j*(n+1)+i;
+            unsigned int b = a+1;
+            unsigned int c = a+(n+1);
+            unsigned int d = c+1;
+            tris->push_back(a); tris->push_back(b); tris->push_back(d);
+            tris->push_back(a); tris->push_back(d); tris->push_back(c);
+        }
+    }
+
+    osg::ref_ptr<osg::Geometry> this_geom = new osg::Geometry;
+    this_geom->setVertexArray(vertices.get());
+    this_geom->setNormalArray(normals.get());
+    this_geom->setNormalBinding(osg::Geometry::BIND_PER_VERTEX);
+    this_geom->setTexCoordArray(0,tc.get());
+    this_geom->addPrimitiveSet(tris.get());
+    this_geom->setColorArray(colors.get());
+    if (texcoord_colors) {
+        this_geom->setColorBinding(osg::Geometry::BIND_PER_VERTEX);
+    } else {
+        this_geom->setColorBinding(osg::Geometry::BIND_OVERALL);
+    }
+    return this_geom;
+}
+
+// Surface points seen by a camera as OpenGL renders them: pixel,
+// without lens distortion, and depth along the optical axis.
+class SurfaceProjector {
+public:
+    SurfaceProjector(GeomModel* geom, const CameraModel& cam) : _geom(geom), _cam(cam) {
+        _cam.get_Rt(_R, _t);
+    }
+
+    void project(const std::vector<osg::Vec2>& tc, std::vector<double>& uv, std::vector<double>& depth) {
+        const unsigned int n = tc.size();
+        if (n == 0) {
+            return;
+        }
+        _tc.resize(2*n);
+        _xyz.resize(3*n);
+        uv.resize(2*n);
+        depth.resize(n);
+        for (unsigned int i=0; i<n; i++) {
+            _tc[2*i] = tc[i][0];
+            _tc[2*i+1] = tc[i][1];
+        }
+        _geom->texcoord2worldcoord(&_tc[0], n, &_xyz[0]);
+        for (unsigned int i=0; i<n; i++) {
+            const double* p = &_xyz[3*i];
+            depth[i] = _R[6]*p[0] + _R[7]*p[1] + _R[8]*p[2] + _t[2];
+        }
+        _cam.project_3d_to_pixel(&_xyz[0], n, &uv[0], false);
+    }
+
+private:
+    GeomModel* _geom;
+    const CameraModel& _cam;
+    double _R[9], _t[3];
+    std::vector<double> _tc;
+    std::vector<double> _xyz;
+};
+
+// Pixel distance between the surface point at the texcoord midpoint of
+// edge a-b and where the rasterized edge puts that midpoint: attributes
+// interpolate perspective correctly, so it is not the screen midpoint.
+// Edges behind the camera or entirely outside the image count as exact.
+static double edge_error(const std::vector<double>& uv, const std::vector<double>& depth,
+                         unsigned int a, unsigned int b, unsigned int mid,
+                         double width, double height) {
+    const double za = depth[a], zb = depth[b];
+    if (za <= 0.0 || zb <= 0.0 || depth[mid] <= 0.0) {
+        return 0.0;
+    }
+    const unsigned int idx[3] = {a, b, mid};
+    double umin = uv[2*a], umax = umin, vmin = uv[2*a+1], vmax = vmin;
+    for (unsigned int k=1; k<3; k++) {
+        umin = std::min(umin, uv[2*idx[k]]); umax = std::max(umax, uv[2*idx[k]]);
+        vmin = std::min(vmin, uv[2*idx[k]+1]); vmax = std::max(vmax, uv[2*idx[k]+1]);
+    }
+    if (umax < 0.0 || vmax < 0.0 || umin > width || vmin > height) {
+        return 0.0;
+    }
+    const double s = zb/(za + zb);
+    const double du = uv[2*a] + s*(uv[2*b] - uv[2*a]) - uv[2*mid];
+    const double dv = uv[2*a+1] + s*(uv[2*b+1] - uv[2*a+1]) - uv[2*mid+1];
+    return sqrt(du*du + dv*dv);
+}
+
+// midpoints of the intervals flagged in split, if they are still wide
+// enough; true if any was inserted
+static bool split_intervals(std::vector<double>& breaks, const std::vector<bool>& split) {
+    std::vector<double> result;
+    result.reserve(2*breaks.size());
+    bool any = false;
+    for (unsigned int i=0; i+1<breaks.size(); i++) {
+        result.push_back(breaks[i]);
+        if (split[i] && breaks[i+1]-breaks[i] > 1.0/65536.0) {
+            result.push_back(0.5*(breaks[i] + breaks[i+1]));
+            any = true;
+        }
+    }
+    result.push_back(breaks.back());
+    breaks.swap(result);
+    return any;
+}
+
+// 16 columns halved this often are 65536
+#define MAX_ADAPTIVE_PASSES 12
+
+// cells of a uniform grid as fine as the finest interval
+static unsigned int uniform_cells(const std::vector<double>& breaks) {
+    double finest = 1.0;
+    for (unsigned int i=0; i+1<breaks.size(); i++) {
+        finest = std::min(finest, breaks[i+1]-breaks[i]);
+    }
+    return (unsigned int)ceil(1.0/finest - 1e-6);
+}
+
+osg::ref_ptr<osg::Geometry> DisplaySurfaceGeometry::make_adaptive_geom(const CameraModel& cam, double max_error,
+                                                                       bool texcoord_colors,
+                                                                       AdaptiveMeshStats* stats) {
+    PROFILE_ZONE("adaptive surface mesh");
+    // start fine enough around the surface that no bulge hides between
+    // two midpoints
+    std::vector<double> us, vs;
+    for (unsigned int i=0; i<=16; i++) {
+        us.push_back(i/16.0);
+    }
+    vs.push_back(0.0);
+    vs.push_back(1.0);
+
+    SurfaceProjector projector(_geom.get(), cam);
+    std::vector<osg::Vec2> tc;
+    std::vector<double> uv, depth;
+    double worst = 0.0;
+    for (unsigned int pass=0; ; pass++) {
+        // grid vertices, then midpoints of the u edges, the v edges and
+        // the cell diagonals
+        const unsigned int nu = us.size()-1, nv = vs.size()-1;
+        const unsigned int umid0 = (nu+1)*(nv+1);
+        const unsigned int vmid0 = umid0 + nu*(nv+1);
+        const unsigned int cmid0 = vmid0 + (nu+1)*nv;
+        tc.clear();
+        for (unsigned int j=0; j<=nv; j++) {
+            for (unsigned int i=0; i<=nu; i++) {
+                tc.push_back(osg::Vec2(us[i], vs[j]));
+            }
+        }
+        for (unsigned int j=0; j<=nv; j++) {
+            for (unsigned int i=0; i<nu; i++) {
+                tc.push_back(osg::Vec2(0.5*(us[i]+us[i+1]), vs[j]));
+            }
+        }
+        for (unsigned int j=0; j<nv; j++) {
+            for (unsigned int i=0; i<=nu; i++) {
+                tc.push_back(osg::Vec2(us[i], 0.5*(vs[j]+vs[j+1])));
+            }
+        }
+        for (unsigned int j=0; j<nv; j++) {
+            for (unsigned int i=0; i<nu; i++) {
+                tc.push_back(osg::Vec2(0.5*(us[i]+us[i+1]), 0.5*(vs[j]+vs[j+1])));
+            }
+        }
+        projector.project(tc, uv, depth);
+
+        const double w = cam.width(), h = cam.height();
+        std::vector<bool> split_u(nu, false), split_v(nv, false);
+        std::vector<double> error_u((nv+1)*nu), error_v(nv*(nu+1));
+        worst = 0.0;
+        for (unsigned int j=0; j<=nv; j++) {
+            for (unsigned int i=0; i<nu; i++) {
+                unsigned int a = j*(nu+1) + i;
+                double e = error_u[j*nu+i] = edge_error(uv, depth, a, a+1, umid0 + j*nu + i, w, h);
+                worst = std::max(worst, e);
+                if (e > max_error) {
+                    split_u[i] = true;
+                }
+            }
+        }
+        for (unsigned int j=0; j<nv; j++) {
+            for (unsigned int i=0; i<=nu; i++) {
+                unsigned int a = j*(nu+1) + i;
+                double e = error_v[j*(nu+1)+i] = edge_error(uv, depth, a, a+nu+1,
+                                                             vmid0 + j*(nu+1) + i, w, h);
+                worst = std::max(worst, e);
+                if (e > max_error) {
+                    split_v[j] = true;
+                }
+            }
+        }
+        for (unsigned int j=0; j<nv; j++) {
+            for (unsigned int i=0; i<nu; i++) {
+                unsigned int a = j*(nu+1) + i;
+                double e = edge_error(uv, depth, a, a+nu+2, cmid0 + j*nu + i, w, h);
+                worst = std::max(worst, e);
+                if (e > max_error) {
+                    // split across the worse pair of edges: a planar
+                    // cell of a cylinder only bends around the axis
+                    double eu = std::max(error_u[j*nu+i], error_u[(j+1)*nu+i]);
+                    double ev = std::max(error_v[j*(nu+1)+i], error_v[j*(nu+1)+i+1]);
+                    if (eu >= ev) {
+                        split_u[i] = true;
+                    } else {
+                        split_v[j] = true;
+                    }
+                }
+            }
+        }
+
+        if (pass == MAX_ADAPTIVE_PASSES) {
+            break;
+        }
+        bool more_u = split_intervals(us, split_u);
+        bool more_v = split_intervals(vs, split_v);
+        if (!more_u && !more_v) {
+            break;
+        }
+    }
+
+    const unsigned int nu = us.size()-1, nv = vs.size()-1;
+    const unsigned int n_verts = (nu+1)*(nv+1);
+    GeometryPools& pools = geometry_pools();
+    osg::ref_ptr<osg::Vec3Array> vertices = pools.vec3.get(n_verts);
+    osg::ref_ptr<osg::Vec3Array> normals = pools.vec3.get(n_verts);
+    osg::ref_ptr<osg::Vec2Array> tcs = pools.vec2.get(n_verts);
+    osg::ref_ptr<osg::Vec4Array> colors = pools.vec4.get(texcoord_colors ? n_verts : 1);
+
+    for (unsigned int j=0; j<=nv; j++) {
+        for (unsigned int i=0; i<=nu; i++) {
+            osg::Vec2 tci(us[i], vs[j]);
+            vertices->push_back( _geom->texcoord2worldcoord(tci) );
+            normals->push_back( _geom->texcoord2normal(tci) );
+            tcs->push_back( tci );
+            if (texcoord_colors) {
+                colors->push_back( osg::Vec4( tci[0], tci[1], 0.0, 1.0 ) );
+            }
+        }
+    }
+    if (!texcoord_colors) {
+        colors->push_back(osg::Vec4(0.0f,1.0f,0.0f,1.0f));
+    }
+
+    // diagonals as evaluated above
+    osg::ref_ptr<osg::DrawElementsUInt> tris = new osg::DrawElementsUInt(osg::PrimitiveSet::TRIANGLES, 0);
+    tris->reserve(6*nu*nv);
+    for (unsigned int j=0; j<nv; j++) {
+        for (unsigned int i=0; i<nu; i++) {
+            unsigned int a = j*(nu+1)+i;
+            unsigned int b = a+1;
+            unsigned int c = a+(nu+1);
+            unsigned int d = c+1;
+            tris->push_back(a); tris->push_back(b); tris->push_back(d);
+            tris->push_back(a); tris->push_back(d); tris->push_back(c);
+        }
+    }
+
+    if (stats) {
+        stats->n_u = nu;
+        stats->n_v = nv;
+        stats->n_triangles = 2*nu*nv;
+        stats->max_error = worst;
+        stats->n_uniform_triangles = 2*uniform_cells(us)*uniform_cells(vs);
+    }
+
+    osg::ref_ptr<osg::Geometry> this_geom = new osg::Geometry;
+    this_geom->setVertexArray(vertices.get());
+    this_geom->setNormalArray(normals.get());
+    this_geom->setNormalBinding(osg::Geometry::BIND_PER_VERTEX);
+    this_geom->setTexCoordArray(0,tcs.get());
+    this_geom->addPrimitiveSet(tris.get());
+    this_geom->setColorArray(colors.get());
+    if (texcoord_colors) {
+        this_geom->setColorBinding(osg::Geometry::BIND_PER_VERTEX);
+    } else {
+        this_geom->setColorBinding(osg::Geometry::BIND_OVERALL);
+    }
+    return this_geom;
+}
+
+void benchmark_surface_eval(DisplaySurfaceGeometry& geom, unsigned int n, std::ostream& os) {
+    std::vector<double> tc(2*n);
+    for (unsigned int i=0; i<n; i++) {
+        tc[2*i] = ((i % 1021) + 0.5)/1021.0;
+        tc[2*i+1] = ((i/1021 % 509) + 0.5)/509.0;
+    }
+    std::vector<double> xyz_virtual(3*n), xyz_batch(3*n);
+    osg::Timer timer;
+    osg::Timer_t start;
+
+    os << "evaluating " << n << " surface points" << std::endl;
+
+    start = timer.tick();
+    for (unsigned int i=0; i<n; i++) {
+        osg::Vec3 p = geom.texcoord2worldcoord(osg::Vec2(tc[2*i], tc[2*i+1]));
+        xyz_virtual[3*i] = p[0];
+        xyz_virtual[3*i+1] = p[1];
+        xyz_virtual[3*i+2] = p[2];
+    }
+    double dt_virtual = timer.delta_s(start, timer.tick());
+
+    start = timer.tick();
+    geom.texcoord2worldcoord(&tc[0], n, &xyz_batch[0]);
+    double dt_batch = timer.delta_s(start, timer.tick());
+
+    // the per sample interface rounds to float
+    double max_diff = 0.0;
+    for (unsigned int i=0; i<3*n; i++) {
+        max_diff = std::max(max_diff, fabs(xyz_virtual[i] - xyz_batch[i]));
+    }
+    os << "  virtual per sample: " << n/dt_virtual << " samples/sec" << std::endl;
+    os << "  batch evaluator:    " << n/dt_batch << " samples/sec, "
+       << dt_virtual/dt_batch << "x, max difference " << max_diff << std::endl;
+
+    // back to texcoords; the round trip error is measured on the
+    // surface, where u is well defined also near the sphere's poles
+    std::vector<float> xyz_f(xyz_batch.begin(), xyz_batch.end());
+    std::vector<float> tc_f(2*n);
+    std::vector<double> tc_back(2*n), xyz_back(3*n);
+
+    start = timer.tick();
+    for (unsigned int i=0; i<n; i++) {
+        osg::Vec2 t = geom.worldcoord2texcoord(osg::Vec3(xyz_f[3*i], xyz_f[3*i+1], xyz_f[3*i+2]));
+        tc_back[2*i] = t[0];
+        tc_back[2*i+1] = t[1];
+    }
+    dt_virtual = timer.delta_s(start, timer.tick());
+    geom.texcoord2worldcoord(&tc_back[0], n, &xyz_back[0]);
+    double err_virtual = 0.0;
+    for (unsigned int i=0; i<3*n; i++) {
+        err_virtual = std::max(err_virtual, fabs(xyz_back[i] - xyz_batch[i]));
+    }
+
+    start = timer.tick();
+    geom.worldcoord2texcoord(&xyz_f[0], n, &tc_f[0]);
+    dt_batch = timer.delta_s(start, timer.tick());
+    std::copy(tc_f.begin(), tc_f.end(), tc_back.begin());
+    geom.texcoord2worldcoord(&tc_back[0], n, &xyz_back[0]);
+    double err_batch = 0.0;
+    for (unsigned int i=0; i<3*n; i++) {
+        err_batch = std::max(err_batch, fabs(xyz_back[i] - xyz_batch[i]));
+    }
+
+    os << "  inverse per sample: " << n/dt_virtual << " samples/sec, round trip error "
+       << err_virtual << std::endl;
+    os << "  inverse batch:      " << n/dt_batch << " samples/sec, round trip error "
+       << err_batch << std::endl;
+}
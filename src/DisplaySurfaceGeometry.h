@@ -4,15 +4,70 @@
 #include <iostream>
 
 #include <osg/Geometry>
+#include <osg/Geode>
+#include <osg/BoundingSphere>
+#include <osg/Texture>
+
+#include <vector>
 
 #include <jansson.h>
 
+#include "camera_model.h"
+
 typedef std::map<std::string, osg::Vec3> KeyPointMap;
 
-class GeomModel {
+// Uniforms for evaluating a surface on the GPU with data/surface.vert.
+struct SurfaceShaderParameters {
+    enum Model { CYLINDER=0, SPHERE=1 };
+    Model model;
+    float radius;
+    float height;
+    osg::Matrixf matrix; // local surface frame to world
+    osg::BoundingBox bound;
+};
+
+class GeomModel : public osg::Referenced {
 public:
     virtual osg::ref_ptr<osg::Geometry> make_geom(bool texcoord_colors=false) = 0;
     virtual KeyPointMap get_key_points() = 0;
+    virtual osg::Vec3 texcoord2worldcoord( osg::Vec2 tc ) = 0;
+    virtual osg::Vec3 texcoord2normal( osg::Vec2 tc ) = 0;
+    // n texcoords (u,v pairs) at once into x,y,z triples, one virtual
+    // call per batch; models loop over an inline SurfaceEvaluator
+    virtual void texcoord2worldcoord(const double* tc, unsigned int n, double* xyz) = 0;
+    virtual void texcoord2normal(const double* tc, unsigned int n, double* normals) = 0;
+    // texcoord of the nearest surface point: radially for the cylinder
+    // (height clamped to its ends), from the center for the sphere
+    virtual osg::Vec2 worldcoord2texcoord( osg::Vec3 xyz ) = 0;
+    // n x,y,z triples into u,v pairs, with SSE2 four at a time
+    virtual void worldcoord2texcoord(const float* xyz, unsigned int n, float* tc) = 0;
+    virtual SurfaceShaderParameters get_shader_parameters() = 0;
+    // nearest point origin + t*dir with t >= 0 on the surface, and its texcoord
+    virtual bool intersect(osg::Vec3d origin, osg::Vec3d dir, double& t, osg::Vec2& tc) = 0;
+    // exact extent of the surface along the unit vector dir, measured from origin
+    virtual void get_depth_range(osg::Vec3 origin, osg::Vec3 dir, double& dmin, double& dmax) = 0;
+};
+
+// Draws an n_u x n_v grid as GL_TRIANGLES without vertex arrays, for
+// shaders that compute positions from gl_VertexID (and gl_InstanceID
+// when drawn n_instances times).
+osg::ref_ptr<osg::Drawable> make_implicit_grid(unsigned int n_u, unsigned int n_v,
+                                               unsigned int n_instances=1);
+
+// A rectangle of the texcoord domain and the bound of its surface patch.
+struct SurfaceChunk {
+    osg::Vec2 tc_min;
+    osg::Vec2 tc_max;
+    osg::BoundingSphere bound;
+};
+
+// Result of DisplaySurfaceGeometry::make_adaptive_geom().
+struct AdaptiveMeshStats {
+    unsigned int n_u;               // cells along each texcoord axis
+    unsigned int n_v;
+    unsigned int n_triangles;
+    double max_error;               // largest remaining error, pixels
+    unsigned int n_uniform_triangles; // uniform grid as fine as the finest cell
 };
 
 class DisplaySurfaceGeometry {
@@ -20,8 +75,69 @@ public:
     DisplaySurfaceGeometry(const char *fname);
     osg::ref_ptr<osg::Geometry> make_geom(bool texcoord_colors=false);
     KeyPointMap get_key_points();
+    osg::Vec3 texcoord2worldcoord(osg::Vec2 tc);
+    // tc holds n u,v pairs, xyz receives n x,y,z triples
+    void texcoord2worldcoord(const double* tc, unsigned int n, double* xyz);
+    void texcoord2normal(const double* tc, unsigned int n, double* normals);
+    // inverse of texcoord2worldcoord() for points on the surface, see GeomModel
+    osg::Vec2 worldcoord2texcoord(osg::Vec3 xyz);
+    void worldcoord2texcoord(const float* xyz, unsigned int n, float* tc);
+    void get_depth_range(osg::Vec3 origin, osg::Vec3 dir, double& dmin, double& dmax);
+
+    // Surface evaluated in the vertex shader from an implicit n_u x n_v
+    // grid, no vertex buffer is uploaded. With n_instances > 1 the grid
+    // is drawn that many times, for shaders that override surface.vert.
+    osg::ref_ptr<osg::Geode> make_gpu_geom(unsigned int n_u, unsigned int n_v,
+                                           bool texcoord_colors=false,
+                                           unsigned int n_instances=1);
+    SurfaceShaderParameters get_shader_parameters();
+    // maximum distance between the vertices surface.vert computes for
+    // that grid, rendered offscreen and read back, and the CPU surface
+    double check_gpu_geom(unsigned int n_u, unsigned int n_v);
+
+    bool intersect(osg::Vec3d origin, osg::Vec3d dir, double& t, osg::Vec2& tc);
+    // The surface intersected exactly per pixel by data/raycast.frag: a
+    // full screen quad whose fragments rebuild their ray from cam's
+    // inverse view and projection and write texcoord and depth. Cost
+    // does not depend on any tessellation. Without texture the surface
+    // is green as in make_geom(); texcoord_colors draws the
+    // pixel->texcoord map. The shader must be rendered with cam's own
+    // view and projection for znear, zfar.
+    osg::ref_ptr<osg::Group> make_raycast_geom(const CameraModel& cam, float znear, float zfar,
+                                               osg::Texture* texture=NULL,
+                                               bool texcoord_colors=false);
+    // follow a moved camera or new clip planes
+    static void set_raycast_camera(osg::Node* node, const CameraModel& cam, float znear, float zfar);
+    // maximum texcoord difference between the shader, rendered offscreen
+    // and read back, and intersect() on an n x n grid of cam's pixels;
+    // pixels that only one of them hits, at grazing silhouettes, are
+    // counted in n_disagree
+    double check_raycast_geom(const CameraModel& cam, float znear, float zfar,
+                              unsigned int n, unsigned int* n_disagree=NULL);
+
+    // split the texcoord domain into n_u x n_v chunks
+    std::vector<SurfaceChunk> make_chunks(unsigned int n_u, unsigned int n_v);
+    // triangle mesh of one chunk with n x n cells
+    osg::ref_ptr<osg::Geometry> make_chunk_geom(const SurfaceChunk& chunk, unsigned int n,
+                                                 bool texcoord_colors=false);
+
+    // Triangle mesh refined until, seen by cam as OpenGL renders it
+    // (without lens distortion), every edge and cell diagonal puts its
+    // texcoord midpoint within max_error pixels of the true surface
+    // point. Columns and rows are
+    // split across the whole surface so the mesh has no T-junctions;
+    // only parts of the surface in front of cam and inside its image
+    // drive refinement.
+    osg::ref_ptr<osg::Geometry> make_adaptive_geom(const CameraModel& cam, double max_error,
+                                                    bool texcoord_colors=false,
+                                                    AdaptiveMeshStats* stats=NULL);
 private:
     void parse_json(json_t *json);
-    GeomModel* _geom;
+    osg::ref_ptr<GeomModel> _geom;
 };
+// Evaluates n texcoords through the per sample virtual interface and
+// through the batch evaluator, maps the points back to texcoords both
+// ways and prints samples/sec of each and the round trip error.
+void benchmark_surface_eval(DisplaySurfaceGeometry& geom, unsigned int n, std::ostream& os);
+
 #endif
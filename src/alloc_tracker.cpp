@@ -0,0 +1,100 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include "alloc_tracker.h"
+
+#include <stdlib.h>
+#include <new>
+
+#if __cplusplus >= 201103L
+#define ALLOC_THROW
+#define ALLOC_NOTHROW noexcept
+#else
+#define ALLOC_THROW throw(std::bad_alloc)
+#define ALLOC_NOTHROW throw()
+#endif
+
+// Plain thread locals, nothing here may allocate.
+static __thread bool armed = false;
+static __thread unsigned long long n_allocs = 0;
+static __thread unsigned long long n_bytes = 0;
+static bool abort_on_alloc = false;
+
+void alloc_tracking_arm() {
+    n_allocs = 0;
+    n_bytes = 0;
+    armed = true;
+}
+
+void alloc_tracking_disarm() {
+    armed = false;
+}
+
+unsigned long long alloc_tracking_count() {
+    return n_allocs;
+}
+
+unsigned long long alloc_tracking_bytes() {
+    return n_bytes;
+}
+
+void alloc_tracking_abort_on_alloc(bool enable) {
+    abort_on_alloc = enable;
+}
+
+static void* tracked_alloc(size_t size) {
+    if (armed) {
+        n_allocs++;
+        n_bytes += size;
+        if (abort_on_alloc) {
+            abort();
+        }
+    }
+    return malloc(size ? size : 1);
+}
+
+void* operator new(size_t size) ALLOC_THROW {
+    void* p = tracked_alloc(size);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t size) ALLOC_THROW {
+    void* p = tracked_alloc(size);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) ALLOC_NOTHROW {
+    return tracked_alloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) ALLOC_NOTHROW {
+    return tracked_alloc(size);
+}
+
+void operator delete(void* p) ALLOC_NOTHROW {
+    free(p);
+}
+
+void operator delete[](void* p) ALLOC_NOTHROW {
+    free(p);
+}
+
+void operator delete(void* p, size_t) ALLOC_NOTHROW {
+    free(p);
+}
+
+void operator delete[](void* p, size_t) ALLOC_NOTHROW {
+    free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) ALLOC_NOTHROW {
+    free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) ALLOC_NOTHROW {
+    free(p);
+}
@@ -0,0 +1,27 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef ALLOC_TRACKER_H
+#define ALLOC_TRACKER_H
+
+// Counts heap allocations made through operator new, for checking that
+// a steady state frame loop allocates nothing. Linking alloc_tracker.cpp
+// replaces the global operator new and delete; they only count on
+// threads that armed tracking, so worker threads are not affected.
+// malloc() called directly (C libraries, the GL driver) is not seen.
+//
+//   for (...) { frame(); }         // warm up
+//   alloc_tracking_arm();
+//   for (...) { frame(); }
+//   if (alloc_tracking_count()) { fail }
+
+// start counting on the calling thread from zero
+void alloc_tracking_arm();
+void alloc_tracking_disarm();
+
+// allocations and bytes requested on the calling thread since it armed
+unsigned long long alloc_tracking_count();
+unsigned long long alloc_tracking_bytes();
+
+// abort() at the first counted allocation, so a debugger shows who made it
+void alloc_tracking_abort_on_alloc(bool enable);
+
+#endif
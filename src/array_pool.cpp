@@ -0,0 +1,17 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include "array_pool.h"
+
+GeometryPools& geometry_pools() {
+    static GeometryPools pools;
+    return pools;
+}
+
+std::ostream& operator<<(std::ostream& os, const GeometryPools& pools) {
+    os << "arrays allocated "
+       << pools.vec2.n_allocated() + pools.vec3.n_allocated() + pools.vec4.n_allocated()
+       << ", reused "
+       << pools.vec2.n_reused() + pools.vec3.n_reused() + pools.vec4.n_reused()
+       << ", pooled "
+       << pools.vec2.n_pooled() + pools.vec3.n_pooled() + pools.vec4.n_pooled();
+    return os;
+}
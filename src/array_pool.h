@@ -0,0 +1,85 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef ARRAY_POOL_H
+#define ARRAY_POOL_H
+
+#include <vector>
+#include <ostream>
+
+#include <osg/Array>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+
+// Recycles OSG arrays between scene graph rebuilds. An array is handed
+// out again once the pool holds the only reference to it, i.e. once
+// the geometry that used it has been released.
+template<class ArrayT>
+class ArrayPool {
+public:
+    ArrayPool() : _n_allocated(0), _n_reused(0) {}
+
+    // empty array with room for capacity elements
+    osg::ref_ptr<ArrayT> get(unsigned int capacity) {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+        for (unsigned int i=0; i<_arrays.size(); i++) {
+            ArrayT* array = _arrays[i].get();
+            if (array->referenceCount()==1) {
+                array->clear();
+                array->reserve(capacity);
+                array->dirty();
+                _n_reused++;
+                return array;
+            }
+        }
+        osg::ref_ptr<ArrayT> array = new ArrayT;
+        array->reserve(capacity);
+        _arrays.push_back(array);
+        _n_allocated++;
+        return array;
+    }
+
+    unsigned int n_allocated() const { return _n_allocated; }
+    unsigned int n_reused() const { return _n_reused; }
+    // arrays held, in use or not
+    unsigned int n_pooled() const {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+        return _arrays.size();
+    }
+
+    // Drop unused arrays. The pool otherwise keeps every array of its
+    // busiest rebuild for good.
+    void trim() {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+        std::vector<osg::ref_ptr<ArrayT> > in_use;
+        for (unsigned int i=0; i<_arrays.size(); i++) {
+            if (_arrays[i]->referenceCount() > 1) {
+                in_use.push_back(_arrays[i]);
+            }
+        }
+        _arrays.swap(in_use);
+    }
+
+private:
+    mutable OpenThreads::Mutex _mutex;
+    std::vector<osg::ref_ptr<ArrayT> > _arrays;
+    unsigned int _n_allocated;
+    unsigned int _n_reused;
+};
+
+struct GeometryPools {
+    ArrayPool<osg::Vec2Array> vec2;
+    ArrayPool<osg::Vec3Array> vec3;
+    ArrayPool<osg::Vec4Array> vec4;
+
+    void trim() {
+        vec2.trim();
+        vec3.trim();
+        vec4.trim();
+    }
+};
+
+// pools shared by make_geom(), make_rendering() and make_textured_quad()
+GeometryPools& geometry_pools();
+
+std::ostream& operator<<(std::ostream& os, const GeometryPools& pools);
+
+#endif
@@ -0,0 +1,314 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include "background_stream.h"
+
+#include <OpenThreads/ScopedLock>
+#include <osg/BufferObject>
+#include <osg/Timer>
+
+#include <string.h>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// ---- conversion kernels ------------------------------------------
+
+void convert_mono16_to_mono8(const unsigned short* src, unsigned char* dst, size_t n, unsigned int shift) {
+    size_t i=0;
+#ifdef __SSE2__
+    __m128i count = _mm_cvtsi32_si128(shift);
+    for (; i+16<=n; i+=16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src+i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src+i+8));
+        a = _mm_srl_epi16(a, count);
+        b = _mm_srl_epi16(b, count);
+        _mm_storeu_si128((__m128i*)(dst+i), _mm_packus_epi16(a, b));
+    }
+#endif
+    for (; i<n; i++) {
+        unsigned int v = src[i] >> shift;
+        dst[i] = v > 255 ? 255 : v;
+    }
+}
+
+// Position of each color in the 2x2 Bayer cell: 0 and 1 are the even
+// and odd pixel of the first row, 2 and 3 of the second row.
+static void bayer_cell(CameraPixelFormat format, int& r, int& g0, int& g1, int& b) {
+    switch (format) {
+    case BAYER_RGGB8: r=0; g0=1; g1=2; b=3; break;
+    case BAYER_BGGR8: b=0; g0=1; g1=2; r=3; break;
+    case BAYER_GRBG8: g0=0; r=1; b=2; g1=3; break;
+    case BAYER_GBRG8: g0=0; b=1; r=2; g1=3; break;
+    default:
+        throw std::runtime_error("not a Bayer format");
+    }
+}
+
+void convert_bayer8_to_rgba(const unsigned char* src, unsigned char* dst,
+                            unsigned int width, unsigned int height, CameraPixelFormat format) {
+    int r, g0, g1, b;
+    bayer_cell(format, r, g0, g1, b);
+
+    for (unsigned int y=0; y+1<height; y+=2) {
+        const unsigned char* s0 = src + y*width;
+        const unsigned char* s1 = s0 + width;
+        unsigned char* d0 = dst + y*width*4;
+        unsigned char* d1 = d0 + width*4;
+        unsigned int x=0;
+#ifdef __SSE2__
+        const __m128i lo_mask = _mm_set1_epi16(0x00FF);
+        const __m128i alpha = _mm_set1_epi16((short)0xFF00);
+        for (; x+16<=width; x+=16) {
+            __m128i v0 = _mm_loadu_si128((const __m128i*)(s0+x));
+            __m128i v1 = _mm_loadu_si128((const __m128i*)(s1+x));
+            // 8 cells, one 16 bit lane each
+            __m128i cell[4];
+            cell[0] = _mm_and_si128(v0, lo_mask);
+            cell[1] = _mm_srli_epi16(v0, 8);
+            cell[2] = _mm_and_si128(v1, lo_mask);
+            cell[3] = _mm_srli_epi16(v1, 8);
+
+            __m128i G = _mm_avg_epu16(cell[g0], cell[g1]);
+            __m128i RG = _mm_or_si128(cell[r], _mm_slli_epi16(G, 8));
+            __m128i BA = _mm_or_si128(cell[b], alpha);
+
+            // RGBA pixels of cells 0-3 and 4-7, each repeated twice
+            __m128i p_lo = _mm_unpacklo_epi16(RG, BA);
+            __m128i p_hi = _mm_unpackhi_epi16(RG, BA);
+            __m128i out[4];
+            out[0] = _mm_unpacklo_epi32(p_lo, p_lo);
+            out[1] = _mm_unpackhi_epi32(p_lo, p_lo);
+            out[2] = _mm_unpacklo_epi32(p_hi, p_hi);
+            out[3] = _mm_unpackhi_epi32(p_hi, p_hi);
+            for (int k=0; k<4; k++) {
+                _mm_storeu_si128((__m128i*)(d0+x*4+k*16), out[k]);
+                _mm_storeu_si128((__m128i*)(d1+x*4+k*16), out[k]);
+            }
+        }
+#endif
+        for (; x+1<width; x+=2) {
+            unsigned char cell[4] = { s0[x], s0[x+1], s1[x], s1[x+1] };
+            unsigned char rgba[4] = { cell[r], (unsigned char)((cell[g0]+cell[g1]+1)>>1), cell[b], 255 };
+            memcpy(d0+x*4, rgba, 4);
+            memcpy(d0+x*4+4, rgba, 4);
+            memcpy(d1+x*4, rgba, 4);
+            memcpy(d1+x*4+4, rgba, 4);
+        }
+    }
+}
+
+// ---- texture upload ----------------------------------------------
+
+static bool is_mono(CameraPixelFormat format) {
+    return format==MONO8 || format==MONO16;
+}
+
+// Uploads the newest converted frame each time the texture is applied.
+// Only one graphics context is supported.
+class BackgroundSubloadCallback : public osg::Texture2D::SubloadCallback {
+public:
+    BackgroundSubloadCallback(BackgroundStream* stream) :
+        _stream(stream), _pbo(0), _buf(stream->texture_size()) {}
+
+    virtual void load(const osg::Texture2D& texture, osg::State& state) const {
+        glTexImage2D(GL_TEXTURE_2D, 0, internal_format(), _stream->width(), _stream->height(), 0,
+                     pixel_format(), GL_UNSIGNED_BYTE, NULL);
+    }
+
+    virtual void subload(const osg::Texture2D& texture, osg::State& state) const {
+        if (!_stream->take_converted(_buf)) {
+            return;
+        }
+        osg::GLBufferObject::Extensions* ext =
+            osg::GLBufferObject::getExtensions(state.getContextID(), true);
+        if (!_pbo) {
+            ext->glGenBuffers(1, &_pbo);
+        }
+        ext->glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, _pbo);
+        // Orphan the old storage so the driver need not wait for the
+        // previous upload to finish before handing out memory.
+        ext->glBufferData(GL_PIXEL_UNPACK_BUFFER_ARB, _buf.size(), NULL, GL_STREAM_DRAW_ARB);
+        void* dst = ext->glMapBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, GL_WRITE_ONLY_ARB);
+        if (dst) {
+            memcpy(dst, &_buf[0], _buf.size());
+            ext->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER_ARB);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, _stream->width(), _stream->height(),
+                            pixel_format(), GL_UNSIGNED_BYTE, 0);
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_stream->_mutex);
+            _stream->_n_uploaded++;
+        }
+        ext->glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+    }
+
+private:
+    GLint internal_format() const { return is_mono(_stream->_format) ? GL_LUMINANCE8 : GL_RGBA8; }
+    GLenum pixel_format() const { return is_mono(_stream->_format) ? GL_LUMINANCE : GL_RGBA; }
+
+    BackgroundStream* _stream;
+    mutable GLuint _pbo;
+    mutable std::vector<unsigned char> _buf;
+};
+
+// ---- BackgroundStream --------------------------------------------
+
+BackgroundStream::BackgroundStream(unsigned int width, unsigned int height, CameraPixelFormat format,
+                                   unsigned int bits) :
+    _width(width), _height(height), _format(format), _bits(bits), _done(false),
+    _raw_ready(false), _converted_ready(false), _n_pushed(0), _n_converted(0), _n_uploaded(0)
+{
+    if (!is_mono(format) && ((width%2) || (height%2))) {
+        throw std::runtime_error("Bayer images need even width and height");
+    }
+    if (format==MONO16 && (bits<8 || bits>16)) {
+        throw std::runtime_error("MONO16 needs between 8 and 16 significant bits");
+    }
+    _raw_spare.resize(raw_size());
+    _raw_pending.resize(raw_size());
+    _converted.resize(texture_size());
+
+    _texture = new osg::Texture2D;
+    _texture->setDataVariance(osg::Object::DYNAMIC);
+    _texture->setTextureSize(_width, _height);
+    _texture->setResizeNonPowerOfTwoHint(false);
+    _texture->setFilter(osg::Texture::MIN_FILTER, osg::Texture::LINEAR);
+    _texture->setFilter(osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
+    _texture->setSubloadCallback(new BackgroundSubloadCallback(this));
+}
+
+BackgroundStream::~BackgroundStream() {
+    if (isRunning()) {
+        cancel();
+    }
+}
+
+size_t BackgroundStream::raw_size() const {
+    return (size_t)_width*_height*(_format==MONO16 ? 2 : 1);
+}
+
+size_t BackgroundStream::texture_size() const {
+    return (size_t)_width*_height*(is_mono(_format) ? 1 : 4);
+}
+
+void BackgroundStream::push_frame(const unsigned char* data) {
+    memcpy(&_raw_spare[0], data, _raw_spare.size());
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    _raw_spare.swap(_raw_pending);
+    _raw_ready = true;
+    _n_pushed++;
+    _cond.signal();
+}
+
+void BackgroundStream::convert(const std::vector<unsigned char>& raw,
+                               std::vector<unsigned char>& result) const {
+    switch (_format) {
+    case MONO8:
+        memcpy(&result[0], &raw[0], raw.size());
+        break;
+    case MONO16:
+        convert_mono16_to_mono8((const unsigned short*)&raw[0], &result[0],
+                                (size_t)_width*_height, _bits-8);
+        break;
+    default:
+        convert_bayer8_to_rgba(&raw[0], &result[0], _width, _height, _format);
+        break;
+    }
+}
+
+unsigned long long BackgroundStream::frames_pushed() const {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    return _n_pushed;
+}
+
+unsigned long long BackgroundStream::frames_converted() const {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    return _n_converted;
+}
+
+unsigned long long BackgroundStream::frames_uploaded() const {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    return _n_uploaded;
+}
+
+bool BackgroundStream::take_converted(std::vector<unsigned char>& buf) {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    if (!_converted_ready) {
+        return false;
+    }
+    buf.resize(_converted.size());
+    buf.swap(_converted);
+    _converted_ready = false;
+    return true;
+}
+
+void BackgroundStream::run() {
+    std::vector<unsigned char> raw(raw_size());
+    std::vector<unsigned char> result(texture_size());
+    while (true) {
+        {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+            while (!_raw_ready && !_done) {
+                _cond.wait(&_mutex);
+            }
+            if (_done) {
+                break;
+            }
+            raw.swap(_raw_pending);
+            _raw_ready = false;
+        }
+
+        convert(raw, result);
+
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+        _converted.swap(result);
+        _converted_ready = true;
+        _n_converted++;
+    }
+}
+
+int BackgroundStream::cancel() {
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+        _done = true;
+        _cond.signal();
+    }
+    return join();
+}
+
+// ---- TestPatternSource -------------------------------------------
+
+TestPatternSource::TestPatternSource(BackgroundStream* stream, double fps) :
+    _stream(stream), _fps(fps), _done(0)
+{
+}
+
+void TestPatternSource::run() {
+    unsigned int w = _stream->width();
+    unsigned int h = _stream->height();
+    bool mono16 = _stream->format()==MONO16;
+    std::vector<unsigned short> frame16(w*h);
+    std::vector<unsigned char> frame8(w*h);
+    osg::Timer timer;
+    osg::Timer_t start = timer.tick();
+    for (unsigned long long i=0; _done == 0; i++) {
+        for (unsigned int y=0; y<h; y++) {
+            for (unsigned int x=0; x<w; x++) {
+                unsigned char v = (x + y + i*4) & 0xFF;
+                frame8[y*w+x] = v;
+                frame16[y*w+x] = v << (_stream->bits()-8);
+            }
+        }
+        _stream->push_frame(mono16 ? (const unsigned char*)&frame16[0] : &frame8[0]);
+
+        double wait = (i+1)/_fps - timer.delta_s(start, timer.tick());
+        if (wait > 0.0) {
+            OpenThreads::Thread::microSleep((unsigned int)(wait*1e6));
+        }
+    }
+}
+
+int TestPatternSource::cancel() {
+    _done.exchange(1);
+    return join();
+}
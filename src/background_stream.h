@@ -0,0 +1,105 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef BACKGROUND_STREAM_H
+#define BACKGROUND_STREAM_H
+
+#include <vector>
+#include <stddef.h>
+
+#include <osg/Texture2D>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/Condition>
+#include <OpenThreads/Thread>
+#include <OpenThreads/Atomic>
+
+enum CameraPixelFormat {
+    MONO8,
+    MONO16,
+    BAYER_RGGB8,
+    BAYER_BGGR8,
+    BAYER_GRBG8,
+    BAYER_GBRG8
+};
+
+// pixel conversion kernels, SSE2 when available
+void convert_mono16_to_mono8(const unsigned short* src, unsigned char* dst, size_t n, unsigned int shift);
+// Each 2x2 Bayer cell becomes four identical RGBA pixels with the two
+// greens averaged. width and height must be even.
+void convert_bayer8_to_rgba(const unsigned char* src, unsigned char* dst,
+                            unsigned int width, unsigned int height, CameraPixelFormat format);
+
+// Live camera background. A producer thread pushes raw frames, a
+// converter thread turns them into texture data, and the render thread
+// uploads the newest converted frame through an orphaned pixel buffer
+// object when the texture is applied. Frames arriving faster than they
+// can be converted or drawn replace older pending ones.
+class BackgroundStream : public OpenThreads::Thread {
+public:
+    // bits: significant bits of MONO16 data
+    BackgroundStream(unsigned int width, unsigned int height, CameraPixelFormat format,
+                     unsigned int bits=16);
+    ~BackgroundStream();
+
+    // copy in a raw frame (single producer thread), returns immediately
+    void push_frame(const unsigned char* data);
+
+    osg::Texture2D* get_texture() { return _texture.get(); }
+
+    unsigned int width() const { return _width; }
+    unsigned int height() const { return _height; }
+    CameraPixelFormat format() const { return _format; }
+    unsigned int bits() const { return _bits; }
+
+    // counted on the producer, converter and render threads
+    unsigned long long frames_pushed() const;
+    unsigned long long frames_converted() const;
+    unsigned long long frames_uploaded() const;
+
+    virtual void run();
+    virtual int cancel();
+
+private:
+    friend class BackgroundSubloadCallback;
+
+    size_t raw_size() const;
+    size_t texture_size() const;
+    void convert(const std::vector<unsigned char>& raw, std::vector<unsigned char>& result) const;
+    // swap the newest converted frame into buf, false if nothing new
+    bool take_converted(std::vector<unsigned char>& buf);
+
+    unsigned int _width;
+    unsigned int _height;
+    CameraPixelFormat _format;
+    unsigned int _bits;
+
+    osg::ref_ptr<osg::Texture2D> _texture;
+
+    mutable OpenThreads::Mutex _mutex;
+    OpenThreads::Condition _cond;
+    bool _done;
+
+    // Buffers are handed between threads by swapping under _mutex.
+    std::vector<unsigned char> _raw_spare;   // producer
+    std::vector<unsigned char> _raw_pending; // producer -> converter
+    bool _raw_ready;
+    std::vector<unsigned char> _converted;   // converter -> render
+    bool _converted_ready;
+
+    // under _mutex
+    unsigned long long _n_pushed;
+    unsigned long long _n_converted;
+    unsigned long long _n_uploaded;
+};
+
+// Synthetic producer pushing a moving test pattern at a fixed rate.
+class TestPatternSource : public OpenThreads::Thread {
+public:
+    TestPatternSource(BackgroundStream* stream, double fps);
+    virtual void run();
+    virtual int cancel();
+private:
+    BackgroundStream* _stream;
+    double _fps;
+    OpenThreads::Atomic _done;
+};
+
+#endif
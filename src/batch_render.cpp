@@ -0,0 +1,495 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include "batch_render.h"
+#include "util.h"
+#include "profiler.h"
+
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Thread>
+
+#include <osg/Image>
+#include <osgDB/FileUtils>
+#include <osgDB/ReadFile>
+
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <stdexcept>
+#include <sstream>
+
+// ---- manifest ----------------------------------------------------
+
+static std::string manifest_path(const std::string& dir, const std::string& fname) {
+    if (fname.empty() || fname[0]=='/') {
+        return fname;
+    }
+    return join_path(dir, fname);
+}
+
+static json_t* get_member(json_t* obj, const char* key, const char* what) {
+    json_t* value = json_object_get(obj, key);
+    if (!value) {
+        std::ostringstream os;
+        os << "batch manifest " << what << ": missing " << key;
+        throw std::runtime_error(os.str());
+    }
+    return value;
+}
+
+static std::string get_string(json_t* obj, const char* key, const char* what) {
+    json_t* value = get_member(obj, key, what);
+    if (!json_is_string(value)) {
+        std::ostringstream os;
+        os << "batch manifest " << what << " parsing " << key << ": expected string";
+        throw std::runtime_error(os.str());
+    }
+    return json_string_value(value);
+}
+
+static double get_number(json_t* obj, const char* key, const char* what) {
+    json_t* value = get_member(obj, key, what);
+    if (!json_is_number(value)) {
+        std::ostringstream os;
+        os << "batch manifest " << what << " parsing " << key << ": expected number";
+        throw std::runtime_error(os.str());
+    }
+    return json_number_value(value);
+}
+
+static void get_numbers(json_t* obj, const char* key, const char* what, double* result, size_t n) {
+    json_t* value = get_member(obj, key, what);
+    if (!json_is_array(value) || json_array_size(value)!=n) {
+        std::ostringstream os;
+        os << "batch manifest " << what << " parsing " << key << ": expected " << n << " numbers";
+        throw std::runtime_error(os.str());
+    }
+    for (size_t i=0; i<n; i++) {
+        json_t* element = json_array_get(value, i);
+        if (!json_is_number(element)) {
+            std::ostringstream os;
+            os << "batch manifest " << what << " parsing " << key << ": expected " << n << " numbers";
+            throw std::runtime_error(os.str());
+        }
+        result[i] = json_number_value(element);
+    }
+}
+
+static BatchCamera parse_camera(json_t* root, const std::string& dir) {
+    if (!json_is_object(root)) {
+        throw std::runtime_error("batch manifest cameras: expected objects");
+    }
+    BatchCamera result;
+    result.name = get_string(root, "name", "camera");
+    unsigned int width = get_number(root, "width", "camera");
+    unsigned int height = get_number(root, "height", "camera");
+    json_t* y_up_json = json_object_get(root, "y_up");
+    bool y_up = y_up_json ? json_is_true(y_up_json) : false;
+
+    if (json_object_get(root, "P")) {
+        double P[12];
+        get_numbers(root, "P", "camera", P, 12);
+        result.cam = CameraModel(width, height, y_up);
+        result.cam.set_P(P);
+    } else if (json_object_get(root, "K")) {
+        double K[5], eye[3], center[3], up[3];
+        get_numbers(root, "K", "camera", K, 5);
+        get_numbers(root, "eye", "camera", eye, 3);
+        get_numbers(root, "center", "camera", center, 3);
+        get_numbers(root, "up", "camera", up, 3);
+        result.cam = CameraModel(width, height, y_up);
+        result.cam.set_intrinsic(K[0], K[1], K[2], K[3], K[4]);
+        result.cam.set_extrinsic(osg::Vec3d(eye[0], eye[1], eye[2]), osg::Vec3d(center[0], center[1], center[2]),
+                                 osg::Vec3d(up[0], up[1], up[2]));
+    } else {
+        std::string fname = manifest_path(dir, get_string(root, "matrix", "camera"));
+        CameraModel* cam = load_camera_matrix(fname.c_str(), width, height, y_up);
+        result.cam = *cam;
+        delete cam;
+    }
+    if (json_object_get(root, "distortion")) {
+        double d[5];
+        get_numbers(root, "distortion", "camera", d, 5);
+        result.cam.set_distortion(d[0], d[1], d[2], d[3], d[4]);
+    }
+    if (json_object_get(root, "background")) {
+        result.background = manifest_path(dir, get_string(root, "background", "camera"));
+    }
+    return result;
+}
+
+static BatchSurface parse_surface(json_t* root, const std::string& dir) {
+    if (!json_is_object(root)) {
+        throw std::runtime_error("batch manifest surfaces: expected objects");
+    }
+    BatchSurface result;
+    result.name = get_string(root, "name", "surface");
+    result.fname = manifest_path(dir, get_string(root, "file", "surface"));
+    return result;
+}
+
+void parse_batch_manifest(json_t* root, const std::string& dir, BatchManifest& result) {
+    result.output_dir = ".";
+    if (json_object_get(root, "output")) {
+        result.output_dir = manifest_path(dir, get_string(root, "output", "root"));
+    }
+    if (json_object_get(root, "grid")) {
+        result.grid_n = get_number(root, "grid", "root");
+    }
+    if (json_object_get(root, "lut")) {
+        result.write_lut = json_is_true(json_object_get(root, "lut"));
+    }
+    if (json_object_get(root, "image")) {
+        result.write_image = json_is_true(json_object_get(root, "image"));
+    }
+
+    json_t* cameras = get_member(root, "cameras", "root");
+    if (!json_is_array(cameras)) {
+        throw std::runtime_error("batch manifest parsing cameras: expected array");
+    }
+    for (size_t i=0; i<json_array_size(cameras); i++) {
+        result.cameras.push_back(parse_camera(json_array_get(cameras, i), dir));
+    }
+    json_t* surfaces = get_member(root, "surfaces", "root");
+    if (!json_is_array(surfaces)) {
+        throw std::runtime_error("batch manifest parsing surfaces: expected array");
+    }
+    for (size_t i=0; i<json_array_size(surfaces); i++) {
+        result.surfaces.push_back(parse_surface(json_array_get(surfaces, i), dir));
+    }
+}
+
+BatchManifest load_batch_manifest(const char* fname) {
+    json_error_t error;
+    json_t* root = json_load_file(fname, 0, &error);
+    if (!root) {
+        std::ostringstream os;
+        os << "Could not load batch manifest " << fname << " line " << error.line << ": " << error.text;
+        throw std::runtime_error(os.str());
+    }
+
+    std::string dir(fname);
+    size_t slash = dir.rfind('/');
+    dir = slash==std::string::npos ? std::string(".") : dir.substr(0, slash+1);
+
+    BatchManifest result;
+    try {
+        parse_batch_manifest(root, dir, result);
+    } catch (...) {
+        json_decref(root);
+        throw;
+    }
+    json_decref(root);
+    return result;
+}
+
+// ---- rasterization -----------------------------------------------
+
+SurfaceGrid make_surface_grid(DisplaySurfaceGeometry& geom, unsigned int n) {
+    if (n==0) {
+        throw std::runtime_error("surface grid needs at least one cell");
+    }
+    SurfaceGrid result;
+    result.n = n;
+    result.tc.reserve((n+1)*(n+1));
+    std::vector<double> tc;
+    tc.reserve(2*(n+1)*(n+1));
+    for (unsigned int j=0; j<=n; j++) {
+        for (unsigned int i=0; i<=n; i++) {
+            result.tc.push_back(osg::Vec2( (float)i/n, (float)j/n ));
+            tc.push_back(result.tc.back()[0]);
+            tc.push_back(result.tc.back()[1]);
+        }
+    }
+    result.xyz.resize(3*result.tc.size());
+    geom.texcoord2worldcoord(&tc[0], result.tc.size(), &result.xyz[0]);
+    return result;
+}
+
+// twice the signed area of the triangle a, b, (x, y)
+static double edge(const double* a, const double* b, double x, double y) {
+    return (b[0] - a[0])*(y - a[1]) - (b[1] - a[1])*(x - a[0]);
+}
+
+static void raster_triangle(unsigned int i0, unsigned int i1, unsigned int i2,
+                            const std::vector<double>& uv, const std::vector<double>& depth,
+                            const std::vector<osg::Vec2>& tc, SurfaceLUT& lut) {
+    const unsigned int idx[3] = {i0, i1, i2};
+    for (int k=0; k<3; k++) {
+        // triangles reaching behind the camera are dropped
+        if (depth[idx[k]] <= 0.0) {
+            return;
+        }
+    }
+    const double* p0 = &uv[2*i0];
+    const double* p1 = &uv[2*i1];
+    const double* p2 = &uv[2*i2];
+    double area = edge(p0, p1, p2[0], p2[1]);
+    if (fabs(area) < 1e-12) {
+        return;
+    }
+
+    // pixel centers are at integer coordinates
+    double x_min = ceil(std::min(p0[0], std::min(p1[0], p2[0])));
+    double x_max = floor(std::max(p0[0], std::max(p1[0], p2[0])));
+    double y_min = ceil(std::min(p0[1], std::min(p1[1], p2[1])));
+    double y_max = floor(std::max(p0[1], std::max(p1[1], p2[1])));
+    x_min = std::max(x_min, 0.0);
+    y_min = std::max(y_min, 0.0);
+    x_max = std::min(x_max, lut.width - 1.0);
+    y_max = std::min(y_max, lut.height - 1.0);
+    if (x_min > x_max || y_min > y_max) {
+        return;
+    }
+
+    // attributes over depth interpolate linearly in screen space
+    const double iz[3] = {1.0/depth[i0], 1.0/depth[i1], 1.0/depth[i2]};
+    for (int y=(int)y_min; y<=(int)y_max; y++) {
+        for (int x=(int)x_min; x<=(int)x_max; x++) {
+            double w0 = edge(p1, p2, x, y)/area;
+            double w1 = edge(p2, p0, x, y)/area;
+            double w2 = 1.0 - w0 - w1;
+            if (w0 < 0.0 || w1 < 0.0 || w2 < 0.0) {
+                continue;
+            }
+            double z = 1.0/(w0*iz[0] + w1*iz[1] + w2*iz[2]);
+            float* px = &lut.data[3*((size_t)y*lut.width + x)];
+            if (px[2]!=0.0f && px[2] <= z) {
+                continue;
+            }
+            w0 *= iz[0]*z;
+            w1 *= iz[1]*z;
+            w2 *= iz[2]*z;
+            px[0] = w0*tc[i0][0] + w1*tc[i1][0] + w2*tc[i2][0];
+            px[1] = w0*tc[i0][1] + w1*tc[i1][1] + w2*tc[i2][1];
+            px[2] = z;
+        }
+    }
+}
+
+void rasterize_surface(const CameraModel& cam, const SurfaceGrid& grid, SurfaceLUT& lut) {
+    PROFILE_ZONE("rasterize surface");
+    const unsigned int w = cam.width();
+    const unsigned int h = cam.height();
+    lut.width = w;
+    lut.height = h;
+    lut.data.assign((size_t)w*h*3, 0.0f);
+
+    const unsigned int n_vertices = grid.tc.size();
+    std::vector<double> uv(2*n_vertices);
+    cam.project_3d_to_pixel(&grid.xyz[0], n_vertices, &uv[0]);
+
+    double R[9], t[3];
+    cam.get_Rt(R, t);
+    std::vector<double> depth(n_vertices);
+    for (unsigned int i=0; i<n_vertices; i++) {
+        const double* p = &grid.xyz[3*i];
+        depth[i] = R[6]*p[0] + R[7]*p[1] + R[8]*p[2] + t[2];
+        if (cam.y_up()) {
+            uv[2*i+1] = (h - 1.0) - uv[2*i+1];
+        }
+    }
+
+    const unsigned int n1 = grid.n + 1;
+    for (unsigned int j=0; j<grid.n; j++) {
+        for (unsigned int i=0; i<grid.n; i++) {
+            unsigned int a = j*n1 + i;
+            raster_triangle(a, a+1, a+n1+1, uv, depth, grid.tc, lut);
+            raster_triangle(a, a+n1+1, a+n1, uv, depth, grid.tc, lut);
+        }
+    }
+}
+
+static FILE* open_output(const std::string& fname) {
+    FILE* f = fopen(fname.c_str(), "wb");
+    if (!f) {
+        std::ostringstream os;
+        os << "Could not open " << fname;
+        throw std::ios_base::failure(os.str());
+    }
+    return f;
+}
+
+void write_lut_pfm(const SurfaceLUT& lut, const std::string& fname) {
+    FILE* f = open_output(fname);
+    // a negative scale marks little endian data
+    const unsigned short one = 1;
+    bool little_endian = *(const unsigned char*)&one==1;
+    fprintf(f, "PF\n%u %u\n%s\n", lut.width, lut.height, little_endian ? "-1.0" : "1.0");
+    for (unsigned int y=lut.height; y-- > 0; ) {
+        fwrite(&lut.data[3*(size_t)y*lut.width], sizeof(float), 3*lut.width, f);
+    }
+    fclose(f);
+}
+
+void write_lut_image(const SurfaceLUT& lut, const std::string& background, const std::string& fname) {
+    osg::ref_ptr<osg::Image> bg;
+    if (!background.empty()) {
+        bg = osgDB::readImageFile(background);
+        if (!bg.valid()) {
+            std::ostringstream os;
+            os << "Could not open background image " << background;
+            throw std::ios_base::failure(os.str());
+        }
+        if (bg->s()!=(int)lut.width || bg->t()!=(int)lut.height) {
+            throw std::runtime_error("background size differs from camera resolution");
+        }
+    }
+
+    std::vector<unsigned char> rgb((size_t)lut.width*lut.height*3, 0);
+    for (unsigned int y=0; y<lut.height; y++) {
+        for (unsigned int x=0; x<lut.width; x++) {
+            unsigned char* dst = &rgb[3*((size_t)y*lut.width + x)];
+            osg::Vec4 c(0.0f, 0.0f, 0.0f, 1.0f);
+            if (bg.valid()) {
+                // osg::Image rows start at the bottom
+                c = bg->getColor(x, lut.height - 1 - y);
+            }
+            const float* px = &lut.data[3*((size_t)y*lut.width + x)];
+            if (px[2]!=0.0f) {
+                c = c*0.5f + osg::Vec4(px[0], px[1], 0.0f, 1.0f)*0.5f;
+            }
+            for (int k=0; k<3; k++) {
+                dst[k] = (unsigned char)(std::min(std::max(c[k], 0.0f), 1.0f)*255.0f + 0.5f);
+            }
+        }
+    }
+
+    FILE* f = open_output(fname);
+    fprintf(f, "P6\n%u %u\n255\n", lut.width, lut.height);
+    fwrite(&rgb[0], 1, rgb.size(), f);
+    fclose(f);
+}
+
+// ---- BatchRunner -------------------------------------------------
+
+std::ostream& operator<<(std::ostream& os, const BatchStats& stats) {
+    os << stats.n_jobs << " jobs (" << stats.n_failed << " failed) in " << stats.seconds << " sec, "
+       << stats.n_jobs/stats.seconds << " jobs/sec, "
+       << stats.megapixels/stats.seconds << " Mpixel/sec";
+    return os;
+}
+
+class BatchWorker : public OpenThreads::Thread {
+public:
+    BatchWorker(BatchRunner* runner) : _runner(runner) {}
+
+    virtual void run() {
+        unsigned int index;
+        while (_runner->next_job(index)) {
+            _runner->run_job(index);
+        }
+    }
+
+private:
+    BatchRunner* _runner;
+};
+
+BatchRunner::BatchRunner(const BatchManifest& manifest, unsigned int n_threads) :
+    _manifest(manifest), _n_threads(n_threads), _publisher(NULL), _progress(NULL),
+    _next_job(0), _n_done(0), _n_failed(0), _megapixels(0.0), _start(0), _last_report(0.0)
+{
+    if (_n_threads==0) {
+        _n_threads = OpenThreads::GetNumberOfProcessors();
+    }
+    if (_n_threads==0) {
+        _n_threads = 1;
+    }
+    // every job of a surface shares its grid
+    for (unsigned int i=0; i<_manifest.surfaces.size(); i++) {
+        DisplaySurfaceGeometry geom(_manifest.surfaces[i].fname.c_str());
+        _surfaces.push_back(make_surface_grid(geom, _manifest.grid_n));
+    }
+}
+
+BatchStats BatchRunner::run(std::ostream& progress) {
+    if (!osgDB::makeDirectory(_manifest.output_dir)) {
+        std::ostringstream os;
+        os << "Could not create output directory " << _manifest.output_dir;
+        throw std::ios_base::failure(os.str());
+    }
+    _progress = &progress;
+    _next_job = 0;
+    _n_done = 0;
+    _n_failed = 0;
+    _megapixels = 0.0;
+    _start = osg::Timer::instance()->tick();
+    _last_report = 0.0;
+
+    std::vector<BatchWorker*> workers;
+    for (unsigned int i=0; i<std::min(_n_threads, n_jobs()); i++) {
+        workers.push_back(new BatchWorker(this));
+        workers.back()->start();
+    }
+    for (unsigned int i=0; i<workers.size(); i++) {
+        workers[i]->join();
+        delete workers[i];
+    }
+
+    BatchStats stats;
+    stats.n_jobs = n_jobs();
+    stats.n_failed = _n_failed;
+    stats.seconds = osg::Timer::instance()->delta_s(_start, osg::Timer::instance()->tick());
+    stats.megapixels = _megapixels;
+    return stats;
+}
+
+bool BatchRunner::next_job(unsigned int& index) {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    if (_next_job >= n_jobs()) {
+        return false;
+    }
+    index = _next_job++;
+    return true;
+}
+
+void BatchRunner::run_job(unsigned int index) {
+    const BatchCamera& camera = _manifest.cameras[index / _surfaces.size()];
+    const unsigned int surface = index % _surfaces.size();
+    std::string error;
+    double megapixels = 0.0;
+    try {
+        SurfaceLUT lut;
+        rasterize_surface(camera.cam, _surfaces[surface], lut);
+        std::string base = join_path(_manifest.output_dir,
+                                     camera.name + "_" + _manifest.surfaces[surface].name);
+        if (_manifest.write_lut) {
+            write_lut_pfm(lut, base + ".pfm");
+        }
+        if (_manifest.write_image) {
+            write_lut_image(lut, camera.background, base + ".ppm");
+        }
+        if (_publisher) {
+            FrameInfo info;
+            info.kind = FRAME_LUT_FLOAT3;
+            info.width = lut.width;
+            info.height = lut.height;
+            info.bytes = lut.data.size()*sizeof(float);
+            info.timestamp = osg::Timer::instance()->time_s();
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_publish_mutex);
+            _publisher->publish(info, &lut.data[0]);
+        }
+        megapixels = lut.width*(double)lut.height*1e-6;
+    } catch (std::exception& e) {
+        error = e.what();
+    } catch (const char* e) {
+        error = e;
+    }
+    finish_job(index, megapixels, error);
+}
+
+void BatchRunner::finish_job(unsigned int index, double megapixels, const std::string& error) {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    _n_done++;
+    _megapixels += megapixels;
+    if (!error.empty()) {
+        _n_failed++;
+        *_progress << "job " << _manifest.cameras[index / _surfaces.size()].name << " x "
+                   << _manifest.surfaces[index % _surfaces.size()].name << " failed: "
+                   << error << std::endl;
+    }
+    double now = osg::Timer::instance()->delta_s(_start, osg::Timer::instance()->tick());
+    if (now - _last_report >= 1.0 || _n_done==n_jobs()) {
+        _last_report = now;
+        *_progress << "[" << _n_done << "/" << n_jobs() << "] "
+                   << _n_done/now << " jobs/sec, " << _megapixels/now << " Mpixel/sec" << std::endl;
+    }
+}
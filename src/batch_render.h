@@ -0,0 +1,130 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef BATCH_RENDER_H
+#define BATCH_RENDER_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+#include <OpenThreads/Mutex>
+#include <osg/Timer>
+
+#include "DisplaySurfaceGeometry.h"
+#include "camera_model.h"
+#include "frame_ring.h"
+
+// A calibration in a batch manifest.
+struct BatchCamera {
+    BatchCamera() : cam(0, 0) {}
+    std::string name;
+    CameraModel cam;
+    std::string background; // image file, empty for none
+};
+
+// A surface in a batch manifest.
+struct BatchSurface {
+    std::string name;
+    std::string fname;      // surface JSON as read by DisplaySurfaceGeometry
+};
+
+// Every camera is combined with every surface. Manifests are JSON:
+//
+//   { "output": "qa", "grid": 256, "lut": true, "image": true,
+//     "cameras": [ { "name": "cam0", "width": 752, "height": 480, "y_up": false,
+//                    "matrix": "cameramatrix.txt",
+//                    "distortion": [k1, k2, p1, p2, k3],
+//                    "background": "luminance.png" } ],
+//     "surfaces": [ { "name": "arena", "file": "geom.json" } ] }
+//
+// Instead of "matrix" a camera may give its 3x4 camera matrix inline as
+// "P": [12 numbers, row major], or "K": [K00, K01, K02, K11, K12] with
+// "eye", "center" and "up" as for CameraModel::set_extrinsic().
+// "distortion" and "background" are optional. Relative file names are
+// relative to the manifest.
+struct BatchManifest {
+    BatchManifest() : grid_n(256), write_lut(true), write_image(true) {}
+    std::string output_dir;
+    unsigned int grid_n;    // surface grid cells per texcoord axis
+    bool write_lut;
+    bool write_image;
+    std::vector<BatchCamera> cameras;
+    std::vector<BatchSurface> surfaces;
+};
+
+BatchManifest load_batch_manifest(const char* fname);
+// the same from parsed JSON, relative file names are relative to dir
+void parse_batch_manifest(json_t* root, const std::string& dir, BatchManifest& result);
+
+// The surface sampled on a regular texcoord grid, shared by all jobs.
+struct SurfaceGrid {
+    unsigned int n;                 // cells per axis, (n+1)^2 vertices
+    std::vector<double> xyz;        // world coordinates
+    std::vector<osg::Vec2> tc;
+};
+
+SurfaceGrid make_surface_grid(DisplaySurfaceGeometry& geom, unsigned int n);
+
+// Per pixel texcoord and depth of the nearest surface point, rows from
+// the top of the image. Pixels without surface have depth 0.
+struct SurfaceLUT {
+    unsigned int width;
+    unsigned int height;
+    std::vector<float> data;        // u, v, depth per pixel
+};
+
+// CPU rasterization of the grid's triangles, vertices projected with
+// lens distortion and attributes interpolated perspective correctly.
+// Needs no graphics context.
+void rasterize_surface(const CameraModel& cam, const SurfaceGrid& grid, SurfaceLUT& lut);
+
+// the LUT as a 3 channel PFM image (bottom row first, as PFM wants)
+void write_lut_pfm(const SurfaceLUT& lut, const std::string& fname);
+// the background, or black, with the surface tinted by its texcoords
+void write_lut_image(const SurfaceLUT& lut, const std::string& background, const std::string& fname);
+
+struct BatchStats {
+    unsigned int n_jobs;
+    unsigned int n_failed;
+    double seconds;
+    double megapixels;
+};
+
+std::ostream& operator<<(std::ostream& os, const BatchStats& stats);
+
+// Runs every camera x surface job of a manifest on a pool of threads,
+// printing progress about once a second. Failed jobs are reported and
+// counted, the others still run.
+class BatchRunner {
+public:
+    // n_threads 0: one per processor
+    BatchRunner(const BatchManifest& manifest, unsigned int n_threads=0);
+    BatchStats run(std::ostream& progress);
+    // also publish every LUT (FRAME_LUT_FLOAT3) to this ring, whose
+    // slots must hold the largest camera's LUT
+    void set_publisher(FramePublisher* publisher) { _publisher = publisher; }
+
+private:
+    friend class BatchWorker;
+
+    unsigned int n_jobs() const { return _manifest.cameras.size()*_surfaces.size(); }
+    bool next_job(unsigned int& index);
+    void run_job(unsigned int index);
+    void finish_job(unsigned int index, double megapixels, const std::string& error);
+
+    const BatchManifest& _manifest;
+    unsigned int _n_threads;
+    std::vector<SurfaceGrid> _surfaces;
+    FramePublisher* _publisher;
+
+    OpenThreads::Mutex _mutex;
+    OpenThreads::Mutex _publish_mutex;
+    std::ostream* _progress;
+    unsigned int _next_job;
+    unsigned int _n_done;
+    unsigned int _n_failed;
+    double _megapixels;
+    osg::Timer_t _start;
+    double _last_report;    // seconds after _start
+};
+
+#endif
@@ -0,0 +1,70 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+// Projects every surface of a manifest into every calibration without a
+// display, see batch_render.h for the manifest format.
+
+#include <osg/ArgumentParser>
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include "batch_render.h"
+
+int main(int argc, char**argv) {
+    osg::ArgumentParser arguments(&argc, argv);
+
+    // job threads, default one per processor
+    unsigned int n_threads = 0;
+    arguments.read("--threads", n_threads);
+
+    // override the manifest's output directory and surface grid
+    std::string output_dir;
+    bool set_output = arguments.read("--output", output_dir);
+    unsigned int grid_n = 0;
+    arguments.read("--grid", grid_n);
+
+    // publish every LUT to a shared memory ring of this name
+    std::string publish_name;
+    bool publish = arguments.read("--publish", publish_name);
+
+    if (arguments.argc()!=2) {
+        std::cerr << "usage: " << arguments.getApplicationName()
+                  << " MANIFEST.json [--threads N] [--output DIR] [--grid N] [--publish NAME]" << std::endl;
+        return 1;
+    }
+
+    // outlives the runner, which holds on to it
+    FramePublisher* publisher = NULL;
+    int result = 1;
+    try {
+        BatchManifest manifest = load_batch_manifest(arguments[1]);
+        if (set_output) {
+            manifest.output_dir = output_dir;
+        }
+        if (grid_n > 0) {
+            manifest.grid_n = grid_n;
+        }
+        std::cout << manifest.cameras.size() << " cameras x " << manifest.surfaces.size()
+                  << " surfaces" << std::endl;
+
+        BatchRunner runner(manifest, n_threads);
+        if (publish) {
+            size_t slot_size = 0;
+            for (unsigned int i=0; i<manifest.cameras.size(); i++) {
+                const CameraModel& cam = manifest.cameras[i].cam;
+                slot_size = std::max(slot_size, (size_t)cam.width()*cam.height()*3*sizeof(float));
+            }
+            publisher = new FramePublisher(publish_name, 8, slot_size);
+            runner.set_publisher(publisher);
+        }
+        BatchStats stats = runner.run(std::cout);
+        std::cout << stats << std::endl;
+        result = stats.n_failed > 0 ? 1 : 0;
+    } catch (std::exception& e) {
+        std::cerr << e.what() << std::endl;
+    } catch (const char* e) {
+        std::cerr << e << std::endl;
+    }
+    delete publisher;
+    return result;
+}
@@ -8,6 +8,8 @@
 #include <assert.h>
 #include <GL/glut.h>
 
+#include "hz_projection.h"
+
 #define PI 3.14159
 
 // globals
@@ -169,6 +171,9 @@ void on_draw() {
 void on_resize(int width, int height) {
     int x0, y0;
     int i,j;
+    hz_intrinsics K = {604.39963621, -7.33740535, 356.25995387,
+                       578.11306274, 257.36283644};
+    hz_mat4 m;
 
     x0 = 0;
     y0 = 0;
@@ -177,11 +182,10 @@ void on_resize(int width, int height) {
 
 
     //  gluPerspective( 80.0, 1.0, 0.1, 10.0 );
-    set_matrix( proj,
-                1.60744584,  0.01951438,  0.05250012,  0.,
-                0.,          2.40880443,  0.07234515,  0.   ,
-                0.,          0.,         -1.00020002, -0.20002,
-                0.,          0.,         -1.,          0.);
+    m = hz_gl_projection(K, 752, 480, x0, y0, HZ_Y_DOWN, 0.1, 10.0);
+    for (i=0; i<16; i++) {
+        proj[i] = m.m[i];
+    }
 
     glUniformMatrix4fv(projection_matrix_location, 1, GL_FALSE, proj);
 
@@ -4,37 +4,13 @@
 #include <stdio.h>
 #include <GL/glut.h>
 
+#include "hz_projection.h"
+
 #define PI 3.14159
 
 // global
 unsigned int CYL;
 
-void set_matrix(float* m,
-                float M00, float M01, float M02, float M03,
-                float M10, float M11, float M12, float M13,
-                float M20, float M21, float M22, float M23,
-                float M30, float M31, float M32, float M33) {
-    m[0] = M00;
-    m[1] = M10;
-    m[2] = M20;
-    m[3] = M30;
-
-    m[4] = M01;
-    m[5] = M11;
-    m[6] = M21;
-    m[7] = M31;
-
-    m[8] = M02;
-    m[9] = M12;
-    m[10]= M22;
-    m[11]= M32;
-
-    m[12]= M03;
-    m[13]= M13;
-    m[14]= M23;
-    m[15]= M33;
-}
-
 void on_draw() {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -46,7 +22,9 @@ void on_draw() {
 
 void on_resize(int width, int height) {
     int x0, y0;
-    float* m;
+    hz_intrinsics K = {604.39963621, -7.33740535, 356.25995387,
+                       578.11306274, 257.36283644};
+    hz_mat4 m;
 
     x0 = 0;
     y0 = 0;
@@ -56,14 +34,8 @@ void on_resize(int width, int height) {
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
     //  gluPerspective( 80.0, 1.0, 0.1, 10.0 );
-    m = malloc(16*sizeof(float));
-    set_matrix( m,
-                1.60744584,  0.01951438,  0.05250012,  0.,
-                0.,          2.40880443,  0.07234515,  0.   ,
-                0.,          0.,         -1.00020002, -0.20002,
-                0.,          0.,         -1.,          0.);
-    glLoadMatrixf(m);
-    free(m);
+    m = hz_gl_projection(K, 752, 480, x0, y0, HZ_Y_DOWN, 0.1, 10.0);
+    glLoadMatrixd(m.m);
 }
 
 void assign_vert3f( float* base_ptr, int idx, int len, float a, float b, float c ) {
@@ -36,6 +36,9 @@
 #include <osgViewer/ViewerEventHandlers>
 
 #include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
 #include <stdexcept>
 #include <sstream>
 #include <iostream>
@@ -43,6 +46,23 @@
 #include "util.h"
 #include "DisplaySurfaceGeometry.h"
 #include "camera_model.h"
+#include "pose_predictor.h"
+#include "profiler.h"
+#include "background_stream.h"
+#include "array_pool.h"
+#include "tiled_renderer.h"
+#include "surface_culling.h"
+#include "clip_planes.h"
+#include "multiview_renderer.h"
+#include "camera_refinement.h"
+#include "camera_path.h"
+#include "point_overlay.h"
+#include "frame_ring.h"
+#include "photometric.h"
+#include "coverage.h"
+#include "alloc_tracker.h"
+#include "frame_pacer.h"
+#include "scene.h"
 
 osg::Camera* createBG(int width, int height)
 {
@@ -70,26 +90,225 @@ osg::Camera* createBG(int width, int height)
     return camera;
 }
 
+// Reads each rendered frame (bottom row first) straight into the next
+// slot of a shared memory ring.
+class PublishFrameCallback : public osg::Camera::DrawCallback {
+public:
+    PublishFrameCallback(FramePublisher* publisher) : _publisher(publisher) {}
+
+    virtual void operator () (osg::RenderInfo& renderInfo) const {
+        PROFILE_ZONE("publish frame");
+        const osg::Viewport* vp = renderInfo.getCurrentCamera()->getViewport();
+        FrameInfo info;
+        info.kind = FRAME_RGB8;
+        info.width = vp->width();
+        info.height = vp->height();
+        info.bytes = (size_t)info.width*info.height*3;
+        if (info.bytes > _publisher->slot_size()) {
+            return;
+        }
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(vp->x(), vp->y(), info.width, info.height, GL_RGB, GL_UNSIGNED_BYTE,
+                     _publisher->begin_frame());
+        info.timestamp = PosePredictor::now();
+        _publisher->commit_frame(info);
+    }
+
+private:
+    FramePublisher* _publisher;
+};
+
 int main(int argc, char**argv) {
+    osg::ArgumentParser arguments(&argc, argv);
+
+    // head tracking: replay a recorded eye track and render the
+    // predicted pose at the expected scan-out time
+    std::string track_fname;
+    bool use_track = arguments.read("--track", track_fname);
+    double latency = 1.0/60.0;
+    arguments.read("--latency", latency);
+
+    // frame time instrumentation, see profiler.h
+    std::string trace_fname;
+    bool write_trace = arguments.read("--trace", trace_fname);
+    bool profile_hud = arguments.read("--profile-hud");
+
+    // evaluate the surface in the vertex shader on an N x N grid
+    unsigned int gpu_surface_n = 0;
+    arguments.read("--gpu-surface", gpu_surface_n);
+
+    // split the surface into N x N chunks and draw only those the camera sees
+    unsigned int n_chunks = 0;
+    arguments.read("--chunks", n_chunks);
+    // time drawing the surface from N cameras with and without culling
+    // the chunks (8 x 8 without --chunks)
+    unsigned int n_cull_cameras = 0;
+    arguments.read("--cull-benchmark", n_cull_cameras);
+
+    // stream a synthetic live camera background at this frame rate
+    double stream_fps = 0.0;
+    arguments.read("--stream-background", stream_fps);
+
+    // rebuild the geometry N times, as recalibration does, and report pool usage
+    unsigned int n_rebuilds = 0;
+    arguments.read("--rebuild", n_rebuilds);
+
+    // render the surface offscreen in tiles at scale x the camera resolution
+    std::string tiled_fname;
+    bool render_tiled = arguments.read("--tiled", tiled_fname);
+    double tiled_scale = 1.0;
+    arguments.read("--tiled-scale", tiled_scale);
+    unsigned int n_contexts = 2;
+    arguments.read("--tiled-contexts", n_contexts);
+
+    // render 1, 2, 4, ... N cameras around the real one offscreen and
+    // report views/sec for each; with --scene, any N sweeps up to the
+    // scene's cameras
+    unsigned int n_multiview = 0;
+    arguments.read("--multiview", n_multiview);
+
+    // refine the camera pose against observed key points ("0 name u v" lines)
+    std::string observations_fname;
+    bool refine = arguments.read("--refine", observations_fname);
+    // refine a synthetic rig of N cameras on one and on all processors
+    unsigned int n_refine_cameras = 0;
+    arguments.read("--refine-benchmark", n_refine_cameras);
+
+    // fly the camera once around the surface in this many seconds
+    double fly_duration = 0.0;
+    arguments.read("--fly", fly_duration);
+
+    // project N points with double and float camera models, also in
+    // georeferenced coordinates
+    unsigned int n_precision = 0;
+    arguments.read("--precision", n_precision);
+
+    // benchmark overlays of up to N track points, then show N of them
+    unsigned int n_points = 0;
+    arguments.read("--points", n_points);
+
+    // publish rendered frames to other processes through shared memory
+    std::string publish_name;
+    bool publish = arguments.read("--publish", publish_name);
+    // push N camera sized frames through a shared memory ring to two
+    // reader processes and report throughput
+    unsigned int n_ring_frames = 0;
+    arguments.read("--ring-benchmark", n_ring_frames);
+
+    // solid surface mesh refined to this many pixels of error in the
+    // camera, instead of the fixed tessellation
+    double adaptive_error = 0.0;
+    arguments.read("--adaptive", adaptive_error);
+
+    // intersect the analytic surface per pixel instead of drawing a mesh
+    bool raycast = arguments.read("--raycast");
+
+    // evaluate N surface points per sample and in batches
+    unsigned int n_eval = 0;
+    arguments.read("--eval-benchmark", n_eval);
+
+    // correct brightness for incidence and distance and the measured
+    // luminance.png, writing the gain to correction.pgm
+    bool photometric = arguments.read("--photometric");
+
+    // which parts of the surface a rig of N cameras (with --scene, the
+    // scene's cameras) sees, writing the maps to coverage_*
+    unsigned int n_coverage = 0;
+    arguments.read("--coverage", n_coverage);
+
+    // after WARMUP frames, render FRAMES more in one thread and fail if
+    // any of them allocates; --alloc-abort stops at the first allocation
+    unsigned int steady_warmup = 0, steady_frames = 0;
+    bool steady_state = arguments.read("--steady-state", steady_warmup, steady_frames);
+    if (arguments.read("--alloc-abort")) {
+        alloc_tracking_abort_on_alloc(true);
+    }
+
+    // start each frame as late as possible before the vblank of a HZ
+    // display and render the pose at its predicted present time,
+    // logging the predicted and achieved times to --pace-log
+    double pace_hz = 0.0;
+    arguments.read("--pace", pace_hz);
+    std::string pace_log_fname;
+    arguments.read("--pace-log", pace_log_fname);
+
+    // pace N frames against a simulated 59.94 Hz display and exit
+    unsigned int n_pacing_sim = 0;
+    arguments.read("--pacing-sim", n_pacing_sim);
+
+    // cameras, surfaces, backgrounds and clip planes from a scene
+    // manifest (see scene.h) instead of the built in camera,
+    // luminance.png and geom.json
+    std::string scene_fname;
+    Scene* scene = NULL;
+    if (arguments.read("--scene", scene_fname)) {
+        scene = new Scene(scene_fname.c_str());
+    }
+
     osg::ref_ptr<osg::Group> root = new osg::Group; root->addDescription("root node");
 
+    CameraModel* cam1_params;
+    std::string geom_fname = "geom.json";
+    if (scene) {
+        const SceneSettings& settings = scene->settings();
+        cam1_params = new CameraModel(scene->camera(settings.view));
+        geom_fname = scene->manifest().surfaces[settings.surface].fname;
+        // the background is not needed when streaming
+        std::vector<unsigned int> cameras;
+        if (stream_fps <= 0.0) {
+            cameras.push_back(settings.view);
+        }
+        std::cout << scene->preload(cameras, std::vector<unsigned int>(1, settings.surface)) << std::endl;
+    } else {
+        cam1_params = make_real_camera_parameters();
+    }
+
     // set up the texture state.
-    std::string filename = "luminance.png";
-    osg::Image* image = osgDB::readImageFile(filename);
-    if (!image) {
-        throw std::ios_base::failure("Could not open image file");
+    osg::Texture2D* texture;
+    int bg_width, bg_height;
+    BackgroundStream* stream = NULL;
+    if (stream_fps > 0.0) {
+        stream = new BackgroundStream( cam1_params->width(), cam1_params->height(), MONO8 );
+        texture = stream->get_texture();
+        bg_width = stream->width();
+        bg_height = stream->height();
+    } else if (scene) {
+        texture = scene->background_texture(scene->settings().view);
+        if (!texture) {
+            // black, the size of the camera image
+            osg::ref_ptr<osg::Image> black = new osg::Image;
+            black->allocateImage(cam1_params->width(), cam1_params->height(), 1, GL_LUMINANCE, GL_UNSIGNED_BYTE);
+            memset(black->data(), 0, black->getTotalSizeInBytes());
+            texture = new osg::Texture2D(black.get());
+        }
+        bg_width = texture->getImage()->s();
+        bg_height = texture->getImage()->t();
+    } else {
+        std::string filename = "luminance.png";
+        osg::Image* image = osgDB::readImageFile(filename);
+        if (!image) {
+            throw std::ios_base::failure("Could not open image file");
+        }
+        texture = new osg::Texture2D(image);
+        bg_width = image->s();
+        bg_height = image->t();
     }
-    osg::Camera* bgcam = createBG( image->s(), image->t() );
+    osg::Camera* bgcam = createBG( bg_width, bg_height );
     root->addChild( bgcam );
     {
-        osg::Texture2D* texture = new osg::Texture2D(image);
         osg::Geode* geode = new osg::Geode;
         geode->addDescription("background texture geode");
         {
             osg::Vec3 pos = osg::Vec3(0.0f,0.0f,0.0f);
-            osg::Vec3 width(image->s(),0.0f,0.0);
-            osg::Vec3 height(0.0,image->t(),0.0);
-            osg::Geometry* geometry = osg::createTexturedQuadGeometry(pos,width,height);
+            osg::Vec3 width(bg_width,0.0f,0.0);
+            osg::Vec3 height(0.0,bg_height,0.0);
+            osg::Geometry* geometry;
+            if (stream) {
+                // camera frames start with the top row
+                geometry = osg::createTexturedQuadGeometry(pos,width,height,0.0f,1.0f,1.0f,0.0f);
+            } else {
+                geometry = osg::createTexturedQuadGeometry(pos,width,height);
+            }
             geode->addDrawable(geometry);
 
             osg::StateSet* stateset = geode->getOrCreateStateSet();
@@ -102,26 +321,258 @@ int main(int argc, char**argv) {
 
     }
 
-    DisplaySurfaceGeometry* geometry_parameters = new DisplaySurfaceGeometry( "geom.json" );
+    DisplaySurfaceGeometry* geometry_parameters = scene ? scene->surface(scene->settings().surface)
+                                                        : new DisplaySurfaceGeometry( geom_fname.c_str() );
+
+    if (refine) {
+        // a few key points only pin down the pose, keep K and distortion
+        std::vector<CameraModel> cameras(1, *cam1_params);
+        KeyPointMap key_points = geometry_parameters->get_key_points();
+        RefinementOptions options;
+        options.refine_intrinsics = false;
+        options.refine_distortion = false;
+        std::cout << refine_cameras(cameras, key_points,
+                                    load_observations(observations_fname.c_str()),
+                                    options) << std::endl;
+        *cam1_params = cameras[0];
+    }
+
+    if (n_rebuilds > 0) {
+        osg::Timer timer;
+        osg::Timer_t start = timer.tick();
+        for (unsigned int i=0; i<n_rebuilds; i++) {
+            DisplaySurfaceGeometry rebuilt( geom_fname.c_str() );
+            osg::ref_ptr<osg::Geometry> geom = rebuilt.make_geom();
+            osg::ref_ptr<osg::Group> frustum = cam1_params->make_rendering(1.0);
+        }
+        std::cout << n_rebuilds << " rebuilds in " << timer.delta_m(start, timer.tick()) << " msec, "
+                  << geometry_pools() << std::endl;
+        // the rebuilt geometry is gone, only the scene's arrays stay
+        geometry_pools().trim();
+        std::cout << "after trimming the pools: " << geometry_pools() << std::endl;
+    }
 
-    CameraModel* cam1_params = make_real_camera_parameters();
+    if (n_ring_frames > 0) {
+        bool ok = benchmark_frame_ring(cam1_params->width(), cam1_params->height(),
+                                       n_ring_frames, 2, 8, std::cout);
+        std::cout << "frame ring readers " << (ok ? "ok" : "FAILED") << std::endl;
+    }
 
-    {
+    if (n_eval > 0) {
+        benchmark_surface_eval(*geometry_parameters, n_eval, std::cout);
+    }
+
+    if (n_refine_cameras > 0) {
+        benchmark_refinement(n_refine_cameras, 0, std::cout);
+    }
+
+    if (n_precision > 0) {
+        benchmark_precision(*cam1_params, n_precision, osg::Vec3d(0.0, 0.0, 0.0), std::cout);
+        // UTM-like easting and northing
+        benchmark_precision(*cam1_params, n_precision, osg::Vec3d(500000.0, 4000000.0, 100.0), std::cout);
+    }
+
+    // near and far hug the surface and follow the camera pose, unless
+    // the scene fixes them
+    ClipPlaneCache clip_planes(geometry_parameters);
+    bool fit_clip = !(scene && scene->settings().fixed_clip);
+    float znear, zfar;
+    if (fit_clip) {
+        clip_planes.update(*cam1_params);
+        znear = clip_planes.znear();
+        zfar = clip_planes.zfar();
+    } else {
+        znear = scene->settings().znear;
+        zfar = scene->settings().zfar;
+    }
+    std::cout << "clip planes: near " << znear << ", far " << zfar << std::endl;
+
+    if (n_cull_cameras > 0) {
+        benchmark_culled_surface(*geometry_parameters, *cam1_params, znear, zfar,
+                                 n_chunks > 0 ? n_chunks : 8, n_cull_cameras, 100, std::cout);
+    }
+
+    osg::ref_ptr<osg::Group> surface = new osg::Group; surface->addDescription("surface");
+    root->addChild(surface.get());
+    CulledSurface* culled = NULL;
+    osg::ref_ptr<osg::Node> raycast_node;
+    if (raycast) {
+        unsigned int n_disagree;
+        double err = geometry_parameters->check_raycast_geom(*cam1_params, znear, zfar, 256, &n_disagree);
+        std::cout << "raycast shader max texcoord error vs. CPU intersector: " << err
+                  << " (" << n_disagree << " of " << 256*256 << " pixels disagree on hits)" << std::endl;
+        raycast_node = geometry_parameters->make_raycast_geom(*cam1_params, znear, zfar);
+        surface->addChild(raycast_node.get());
+    } else if (gpu_surface_n > 0) {
+        std::cout << "GPU surface max error vs. CPU model: "
+                  << geometry_parameters->check_gpu_geom(gpu_surface_n, gpu_surface_n) << std::endl;
+        surface->addChild( geometry_parameters->make_gpu_geom(gpu_surface_n, gpu_surface_n).get() );
+    } else if (n_chunks > 0) {
+        culled = new CulledSurface(*geometry_parameters, n_chunks, n_chunks);
+        surface->addChild(culled->node());
+        unsigned int n_visible = culled->count_visible(*cam1_params, znear, zfar);
+        std::cout << n_visible << " of " << culled->n_chunks() << " surface chunks visible" << std::endl;
+    } else if (adaptive_error > 0.0) {
+        AdaptiveMeshStats stats;
+        osg::ref_ptr<osg::Geometry> mesh = geometry_parameters->make_adaptive_geom(*cam1_params, adaptive_error,
+                                                                                   false, &stats);
+        std::cout << "adaptive mesh: " << stats.n_u << "x" << stats.n_v << " cells, "
+                  << stats.n_triangles << " triangles, max error " << stats.max_error << " px ("
+                  << stats.n_uniform_triangles << " triangles uniform)" << std::endl;
+        osg::Geode* geode = new osg::Geode;
+        geode->addDrawable(mesh.get());
+        surface->addChild(geode);
+    } else {
         osg::ref_ptr<osg::Geometry> cyl = geometry_parameters->make_geom();
         osg::Geode* geode = new osg::Geode;
         geode->addDrawable(cyl);
-        root->addChild(geode);
+        surface->addChild(geode);
+    }
+
+    if (render_tiled) {
+        // The background camera is not tile aware, so only the surface is drawn.
+        CameraModel big = cam1_params->scaled(tiled_scale);
+        TiledRenderer renderer(big, surface.get(), 2048, 2048, n_contexts);
+        renderer.set_clip_planes(znear, zfar);
+        double sec = renderer.render(tiled_fname);
+        std::cout << "rendered " << big.width() << "x" << big.height() << " to " << tiled_fname
+                  << " in " << sec << " sec" << std::endl;
+        return 0;
+    }
+
+    if (n_multiview > 0 && scene) {
+        // the scene's rig, all backgrounds decoded at once
+        std::vector<unsigned int> cameras;
+        for (unsigned int i=0; i<scene->n_cameras(); i++) {
+            cameras.push_back(i);
+        }
+        std::cout << scene->preload(cameras, std::vector<unsigned int>()) << std::endl;
+        std::vector<CameraModel> cams;
+        std::vector<osg::Image*> backgrounds;
+        for (unsigned int i=0; i<scene->n_cameras(); i++) {
+            osg::Image* bg = scene->background(i);
+            const CameraModel& cam = scene->camera(i);
+            if (bg && (bg->s()!=(int)cam.width() || bg->t()!=(int)cam.height())) {
+                bg = NULL;
+            }
+            cams.push_back(cam);
+            backgrounds.push_back(bg);
+        }
+        benchmark_multiview(geometry_parameters, cams, backgrounds, 100, std::cout);
+        return 0;
+    }
+
+    if (n_multiview > 0) {
+        // fake rig: the real camera turned about the surface's vertical axis
+        osg::ref_ptr<osg::Image> bg = osgDB::readImageFile("luminance.png");
+        if (bg.valid() && (bg->s()!=(int)cam1_params->width() || bg->t()!=(int)cam1_params->height())) {
+            bg = NULL;
+        }
+        std::vector<CameraModel> cams;
+        for (unsigned int i=0; i<n_multiview; i++) {
+            osg::Matrixd rot = osg::Matrixd::rotate(2.0*osg::PI*i/n_multiview, osg::Vec3(0,0,1));
+            CameraModel cam = *cam1_params;
+            cam.set_extrinsic(cam1_params->eye()*rot, cam1_params->center()*rot, cam1_params->up()*rot);
+            cams.push_back(cam);
+        }
+        benchmark_multiview(geometry_parameters, cams, std::vector<osg::Image*>(n_multiview, bg.get()), 100,
+                            std::cout);
+        return 0;
+    }
+
+    if (n_pacing_sim > 0) {
+        // render times of 4 to 9 ms with a 25 ms hitch every 500 frames
+        std::vector<double> render_times(n_pacing_sim);
+        unsigned int seed = 1;
+        for (unsigned int i=0; i<n_pacing_sim; i++) {
+            seed = seed*1664525u + 1013904223u;
+            render_times[i] = i%500==250 ? 0.025 : 0.004 + 0.005*(seed >> 8)/(double)(1u << 24);
+        }
+        SimulatedVblankClock clock(1.0/59.94, 0.003, 50e-6);
+        FramePacer pacer(&clock, 1.0/60.0);
+        std::cout << simulate_frame_pacing(clock, pacer, render_times) << std::endl;
+        if (!pace_log_fname.empty()) {
+            pacer.write_log(pace_log_fname);
+        }
+        return 0;
+    }
+
+    if (n_coverage > 0) {
+        // the scene's rig, or the same fake rig, tilted a little each so
+        // the views differ in v
+        std::vector<CameraModel> rig;
+        for (unsigned int i=0; scene && i<scene->n_cameras(); i++) {
+            rig.push_back(scene->camera(i));
+        }
+        for (unsigned int i=0; !scene && i<n_coverage; i++) {
+            osg::Matrixd rot = osg::Matrixd::rotate(2.0*osg::PI*i/n_coverage, osg::Vec3(0,0,1));
+            osg::Vec3 center = cam1_params->center() + cam1_params->up()*(0.1f*(i%5) - 0.2f);
+            CameraModel cam = *cam1_params;
+            cam.set_extrinsic(cam1_params->eye()*rot, center*rot, cam1_params->up()*rot);
+            rig.push_back(cam);
+        }
+        CoverageOptions options;
+        options.n_u = 4096;
+        options.n_v = 2048;
+        CoverageMaps maps;
+        std::cout << analyze_coverage(*geometry_parameters, rig, options, maps) << std::endl;
+        write_coverage_maps(maps, "coverage");
+        return 0;
+    }
+
+    PointOverlay* overlay = NULL;
+    std::vector<osg::Vec3> tracks;
+    osg::BoundingSphere track_bound;
+    if (n_points > 0) {
+        // animals move inside the surface
+        track_bound = geometry_parameters->make_chunks(1, 1)[0].bound;
+        for (unsigned int n=1000; ; n*=10) {
+            n = std::min(n, n_points);
+            double fps = benchmark_point_overlay(*cam1_params, n, track_bound.center(),
+                                                 track_bound.radius()*0.5f);
+            std::cout << n << " overlay points: " << fps << " frames/sec" << std::endl;
+            if (n==n_points) {
+                break;
+            }
+        }
+        overlay = new PointOverlay(n_points);
+        root->addChild(overlay->node());
+        // the ring keeps the trail of each track
+        tracks.resize(std::min(n_points, 256u));
+    }
+
+    if (photometric) {
+        std::vector<PhotometricProjector> projectors(1);
+        projectors[0].cam = *cam1_params;
+        rasterize_surface(*cam1_params, make_surface_grid(*geometry_parameters, 256), projectors[0].lut);
+        projectors[0].luminance = scene ? scene->background(scene->settings().view)
+                                        : osgDB::readImageFile("luminance.png");
+        std::vector<CorrectionMap> maps = compute_correction_maps(*geometry_parameters, projectors);
+        const std::vector<unsigned short>& gain = maps[0].gain;
+        std::cout << "photometric gain " << *std::min_element(gain.begin(), gain.end())/65535.0
+                  << " to " << *std::max_element(gain.begin(), gain.end())/65535.0 << std::endl;
+        write_correction_pgm(maps[0], "correction.pgm");
+        root->addChild(make_correction_pass(maps[0]));
+    }
+
+    if (profile_hud) {
+        root->addChild( make_profiler_hud() );
     }
 
     osgViewer::Viewer* _viewer = new osgViewer::Viewer;
     _viewer->setSceneData(root.get());
+    if (steady_state || pace_hz > 0.0) {
+        // Cull and draw on this thread: the tracker only counts on the
+        // thread that armed it, so the draw thread of the default
+        // threading model would go unchecked, and the pacer needs the
+        // swap to have happened when the frame returns.
+        _viewer->setThreadingModel(osgViewer::Viewer::SingleThreaded);
+    }
 
     // construct the viewer.
-    _viewer->setUpViewInWindow( 32, 32, image->s(), image->t());
+    _viewer->setUpViewInWindow( 32, 32, bg_width, bg_height);
     _viewer->realize();
 
-    float znear=0.1f;
-    float zfar=10.0f;
     _viewer->getCamera()->setProjectionMatrix(cam1_params->projection(znear,zfar));
     _viewer->getCamera()->setReferenceFrame(osg::Transform::ABSOLUTE_RF);
     osg::Matrixd viewin = cam1_params->view();
@@ -133,8 +584,191 @@ int main(int argc, char**argv) {
 
     _viewer->getCamera()->setComputeNearFarMode(osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR);
 
+    FramePublisher* publisher = NULL;
+    if (publish) {
+        publisher = new FramePublisher(publish_name, 4, (size_t)bg_width*bg_height*3);
+        _viewer->getCamera()->setFinalDrawCallback(new PublishFrameCallback(publisher));
+    }
+
+    PosePredictor predictor;
+    TrackPlayer* player = NULL;
+    if (use_track) {
+        std::vector<PoseSample> track = load_track(track_fname.c_str());
+        std::cout << replay_track(track, predictor, latency) << std::endl;
+        predictor.reset();
+        player = new TrackPlayer(track, &predictor);
+        player->start();
+    }
+    // the ray cast surface takes the pose predicted when drawing starts
+    osg::ref_ptr<LateLatchViewCallback> late_latch;
+    if (player && raycast_node.valid()) {
+        late_latch = new LateLatchViewCallback(&predictor, raycast_node.get(), latency);
+        late_latch->set_camera(*cam1_params, znear, zfar);
+        _viewer->getCamera()->setPreDrawCallback(late_latch.get());
+    }
+
+    TestPatternSource* source = NULL;
+    if (stream) {
+        stream->start();
+        source = new TestPatternSource(stream, stream_fps);
+        source->start();
+    }
+
+    CameraPath path;
+    if (fly_duration > 0.0) {
+        const unsigned int n_keys = 8;
+        for (unsigned int i=0; i<=n_keys; i++) {
+            osg::Quat rot(2.0*osg::PI*i/n_keys, osg::Vec3d(0,0,1));
+            // OSG quaternions compose left to right: the camera's own
+            // orientation first, then the turn about the axis
+            path.add_key(fly_duration*i/n_keys,
+                         CameraPose(cam1_params->orientation()*rot, rot*cam1_params->position()));
+        }
+        std::vector<double> t(100000);
+        for (unsigned int i=0; i<t.size(); i++) {
+            t[i] = fly_duration*i/t.size();
+        }
+        std::vector<CameraPose> poses(t.size());
+        osg::Timer timer;
+        osg::Timer_t start = timer.tick();
+        path.sample(&t[0], t.size(), &poses[0]);
+        std::cout << "camera path: " << t.size()/timer.delta_m(start, timer.tick())
+                  << " poses/msec" << std::endl;
+    }
+    double fly_start = PosePredictor::now();
+
+    bool profiling = write_trace || profile_hud;
+    if (profiling && steady_state) {
+        // the statistics are kept in maps filled every frame
+        std::cerr << "--steady-state cannot be combined with --trace or --profile-hud" << std::endl;
+        return 1;
+    }
+    if (profiling) {
+        profile_enable_viewer_stats(_viewer);
+    }
+
+    SystemFrameClock frame_clock;
+    FramePacer* pacer = NULL;
+    osg::ref_ptr<PacerSwapCallback> swap_callback;
+    if (pace_hz > 0.0) {
+        pacer = new FramePacer(&frame_clock, 1.0/pace_hz);
+        if (steady_state) {
+            // every checked frame, else the default ring of recent ones
+            pacer->set_log_size(std::max(1u, steady_warmup + steady_frames));
+        }
+        swap_callback = new PacerSwapCallback(&frame_clock);
+        std::vector<osg::GraphicsContext*> contexts;
+        _viewer->getContexts(contexts);
+        for (unsigned int i=0; i<contexts.size(); i++) {
+            contexts[i]->setSwapCallback(swap_callback.get());
+        }
+    }
+
+    unsigned int n_frames = 0;
     while (!_viewer->done()) {
-        _viewer->frame();
+        if (steady_state && n_frames == steady_warmup) {
+            alloc_tracking_arm();
+        }
+        if (steady_state && n_frames == steady_warmup + steady_frames) {
+            break;
+        }
+        PROFILE_ZONE("frame");
+        // when the frame will be seen
+        double t_present = pacer ? pacer->begin_frame() : PosePredictor::now() + latency;
+        bool moved = false;
+        if (fly_duration > 0.0) {
+            double t = pacer ? t_present : PosePredictor::now();
+            CameraPose pose = path.sample(fmod(t - fly_start, fly_duration));
+            cam1_params->set_extrinsic(pose.orientation, pose.position);
+            moved = true;
+        } else if (player && predictor.is_valid()) {
+            apply_predicted_pose(cam1_params, predictor, t_present);
+            moved = true;
+        }
+        if (moved) {
+            _viewer->getCamera()->setViewMatrix(cam1_params->view());
+            if (fit_clip && clip_planes.update(*cam1_params)) {
+                znear = clip_planes.znear();
+                zfar = clip_planes.zfar();
+                _viewer->getCamera()->setProjectionMatrix(cam1_params->projection(znear,zfar));
+            }
+            if (late_latch.valid()) {
+                late_latch->set_camera(*cam1_params, znear, zfar);
+            } else if (raycast_node.valid()) {
+                DisplaySurfaceGeometry::set_raycast_camera(raycast_node.get(), *cam1_params, znear, zfar);
+            }
+        }
+        if (overlay) {
+            double t = PosePredictor::now() - fly_start;
+            float r = track_bound.radius()*0.5f;
+            for (unsigned int i=0; i<tracks.size(); i++) {
+                float a = t*(0.2 + 0.8*i/tracks.size()) + i;
+                float ri = r*(i+1)/tracks.size();
+                tracks[i] = track_bound.center() + osg::Vec3(cosf(a)*ri, sinf(a)*ri, r*0.3f*sinf(i));
+            }
+            overlay->push(&tracks[0], tracks.size());
+        }
+        if (steady_state && n_frames >= steady_warmup) {
+            // frame() without its event traversal, whose queue allocates
+            // a frame event every frame: the frame stamp is advanced in
+            // place and input is ignored until the check ends.
+            osg::FrameStamp* stamp = _viewer->getFrameStamp();
+            double t = osg::Timer::instance()->delta_s(_viewer->getStartTick(), osg::Timer::instance()->tick());
+            stamp->setFrameNumber(stamp->getFrameNumber() + 1);
+            stamp->setReferenceTime(t);
+            stamp->setSimulationTime(t);
+            _viewer->updateTraversal();
+            _viewer->renderingTraversals();
+        } else {
+            _viewer->frame();
+        }
+        n_frames++;
+        if (pacer) {
+            pacer->end_frame(swap_callback->rendered(), swap_callback->achieved());
+        }
+        if (profiling) {
+            profile_collect_viewer_stats(_viewer);
+        }
+    }
+    if (pacer) {
+        std::cout << pacer->stats() << std::endl;
+        if (!pace_log_fname.empty()) {
+            pacer->write_log(pace_log_fname);
+        }
+        delete pacer;
+    }
+    int result = 0;
+    if (steady_state) {
+        alloc_tracking_disarm();
+        unsigned long long n_allocs = alloc_tracking_count();
+        std::cout << n_allocs << " heap allocations (" << alloc_tracking_bytes() << " bytes) in "
+                  << n_frames - std::min(n_frames, steady_warmup) << " steady state frames" << std::endl;
+        if (n_allocs > 0) {
+            result = 1;
+        }
+    }
+    if (write_trace) {
+        profile_write_chrome_trace(trace_fname);
+    }
+    if (stream) {
+        source->cancel();
+        stream->cancel();
+        std::cout << "background frames pushed " << stream->frames_pushed()
+                  << ", converted " << stream->frames_converted()
+                  << ", uploaded " << stream->frames_uploaded() << std::endl;
+        delete source;
+    }
+    if (player) {
+        player->cancel();
+        delete player;
+    }
+    delete culled;
+    delete overlay;
+    if (publisher) {
+        _viewer->getCamera()->setFinalDrawCallback(NULL);
+        std::cout << publisher->frames_published() << " frames published to "
+                  << publisher->name() << std::endl;
+        delete publisher;
     }
-    return 0;
+    return result;
 }
@@ -1,67 +1,120 @@
 /* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 #include "camera_model.h"
+#include "profiler.h"
+#include "array_pool.h"
+#include "hz_projection.h"
 #include <osg/Geode>
 #include <osg/Geometry>
 #include <osg/MatrixTransform>
+#include <osg/Timer>
 
+#include <math.h>
+#include <algorithm>
+#include <vector>
 #include <stdexcept>
+#include <fstream>
+#include <sstream>
 #include <assert.h>
 
-CameraModel::CameraModel(unsigned int width, unsigned int height, bool y_up)  :
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+template<typename T>
+CameraModelT<T>::CameraModelT(unsigned int width, unsigned int height, bool y_up)  :
 	_width(width), _height(height), _y_up(y_up), intrinsic_valid(false), extrinsic_valid(false)
 {
+    for (int i=0; i<5; i++) {
+        _distortion[i] = 0.0;
+    }
 }
 
 // get extrinsic parameter information
-osg::Vec3 CameraModel::eye() const { if (!extrinsic_valid) {throw "invalid extrinsic";} return _eye;}
-osg::Vec3 CameraModel::center() const {if (!extrinsic_valid) {throw "invalid extrinsic";} return _center;}
-osg::Vec3 CameraModel::up() const {if (!extrinsic_valid) {throw "invalid extrinsic";} return _up;}
-
-osg::Matrixd CameraModel::view() const {
+template<typename T>
+typename CameraModelT<T>::Vec3 CameraModelT<T>::eye() const { if (!extrinsic_valid) {throw "invalid extrinsic";} return _position;}
+template<typename T>
+typename CameraModelT<T>::Vec3 CameraModelT<T>::center() const {if (!extrinsic_valid) {throw "invalid extrinsic";} return Vec3(osg::Vec3d(_position) + _orientation*osg::Vec3d(0,0,-1));}
+template<typename T>
+typename CameraModelT<T>::Vec3 CameraModelT<T>::up() const {if (!extrinsic_valid) {throw "invalid extrinsic";} return Vec3(_orientation*osg::Vec3d(0,1,0));}
+template<typename T>
+osg::Quat CameraModelT<T>::orientation() const {if (!extrinsic_valid) {throw "invalid extrinsic";} return _orientation;}
+template<typename T>
+typename CameraModelT<T>::Vec3 CameraModelT<T>::position() const {if (!extrinsic_valid) {throw "invalid extrinsic";} return _position;}
+
+template<typename T>
+osg::Matrixd CameraModelT<T>::view() const {
+    PROFILE_ZONE("view matrix");
     if (!extrinsic_valid) {throw "invalid extrinsic";}
-	osg::Matrixd result = osg::Matrixd::lookAt(eye(),
-                                               center(),
-                                               up());
-	return result;
+    return osg::Matrixd::translate(-osg::Vec3d(_position))*osg::Matrixd::rotate(_orientation.inverse());
 }
 
-osg::Matrixd CameraModel::projection(float znear, float zfar) const {
+template<typename T>
+osg::Matrixd CameraModelT<T>::projection(float znear, float zfar) const {
+    PROFILE_ZONE("projection matrix");
 	// See http://strawlab.org/2011/11/05/augmented-reality-with-OpenGL/
     if (!intrinsic_valid) {throw "invalid intrinsic";}
 
-	float depth = zfar - znear;
-	float q = -(zfar + znear) / depth;
-	float qn = -2 * (zfar * znear) / depth;
-
-	float x0=0;
-	float y0=0;
-
-	osg::Matrixd p;
-	float width=_width;
-	float height=_height;
-
-	if (_y_up) {
-		p=osg::Matrixf( 2*_K00/ width, -2*_K01/ width, (-2*_K02+ width+2*x0)/ width, 0,
-						0,             -2*_K11/height, (-2*_K12+height+2*y0)/height, 0,
-						0,              0,             q,                            qn,
-						0,              0,             -1,                           0);
-	}
-	else {
-		p=osg::Matrixf( 2*_K00/ width, -2*_K01/ width, (-2*_K02+ width+2*x0)/ width, 0,
-						0,              2*_K11/height, ( 2*_K12-height+2*y0)/height, 0,
-						0,              0,             q,                            qn,
-						0,              0,             -1,                           0);
- 	}
-	osg::Matrixd pT;
-	for (int i=0; i<4; i++) {
-		for (int j=0; j<4; j++) {
-			pT(i,j) = p(j,i);
-		}
-	}
-	return pT;
-}
-
-osg::ref_ptr<osg::Group> CameraModel::make_rendering(float size) const {
+    hz_intrinsics K = {_K00, _K01, _K02, _K11, _K12};
+    hz_mat4 p = hz_gl_projection(K, _width, _height, 0.0, 0.0, _y_up, znear, zfar);
+    return osg::Matrixd(p.m);
+}
+
+template<typename T>
+osg::Matrixd CameraModelT<T>::projection_tile(double u0, double v0, double w, double h,
+                                            float znear, float zfar) const {
+    if (!intrinsic_valid) {throw "invalid intrinsic";}
+
+    hz_intrinsics K = {_K00, _K01, _K02, _K11, _K12};
+    hz_mat4 p = hz_gl_projection_tile(K, u0, v0, w, h, _y_up, znear, zfar);
+    return osg::Matrixd(p.m);
+}
+
+template<typename T>
+osg::Polytope CameraModelT<T>::frustum(float znear, float zfar) const {
+    osg::Polytope result;
+    frustum(znear, zfar, result);
+    return result;
+}
+
+template<typename T>
+void CameraModelT<T>::frustum(float znear, float zfar, osg::Polytope& result) const {
+    // Gribb & Hartmann: with row vectors clip = world*M, so each plane
+    // is a sum or difference of columns of M.
+    osg::Matrixd M = view()*projection(znear, zfar);
+    osg::Polytope::PlaneList& planes = result.getPlaneList();
+    if (planes.size() != 6) {
+        planes.resize(6);
+        result.setupMask();
+    }
+    unsigned int i = 0;
+    for (int axis=0; axis<3; axis++) {
+        for (int sign=-1; sign<=1; sign+=2) {
+            osg::Plane& plane = planes[i++];
+            plane.set( M(0,3) + sign*M(0,axis),
+                       M(1,3) + sign*M(1,axis),
+                       M(2,3) + sign*M(2,axis),
+                       M(3,3) + sign*M(3,axis) );
+            plane.makeUnitLength();
+        }
+    }
+}
+
+template<typename T>
+CameraModelT<T> CameraModelT<T>::scaled(double factor) const {
+    CameraModelT result( (unsigned int)(_width*factor + 0.5), (unsigned int)(_height*factor + 0.5), _y_up );
+    if (intrinsic_valid) {
+        result.set_intrinsic( _K00*factor, _K01*factor, _K02*factor, _K11*factor, _K12*factor );
+    }
+    result.set_distortion( _distortion[0], _distortion[1], _distortion[2],
+                           _distortion[3], _distortion[4] );
+    if (extrinsic_valid) {
+        result.set_extrinsic( _orientation, osg::Vec3d(_position) );
+    }
+    return result;
+}
+
+template<typename T>
+osg::ref_ptr<osg::Group> CameraModelT<T>::make_rendering(float size) const {
     if (!intrinsic_valid) {
         throw std::runtime_error("need valid intrinsics to make rendering");
     }
@@ -74,7 +127,7 @@ osg::ref_ptr<osg::Group> CameraModel::make_rendering(float size) const {
     osg::Matrixd mv;
 
 	proj = projection(size*0.1,size);
-	mv.makeLookAt( _eye, _center, _up );
+	mv = view();
 
     // Get near and far from the Projection matrix.
     const double near = proj(3,2) / (proj(2,2)-1.0);
@@ -94,7 +147,8 @@ osg::ref_ptr<osg::Group> CameraModel::make_rendering(float size) const {
 
     // Our vertex array needs only 9 vertices: The origin, and the
     // eight corners of the near and far planes.
-    osg::Vec3Array* v = new osg::Vec3Array;
+    GeometryPools& pools = geometry_pools();
+    osg::ref_ptr<osg::Vec3Array> v = pools.vec3.get(9);
     v->resize( 9 );
     (*v)[0].set( 0., 0., 0. );
     (*v)[1].set( nLeft, nBottom, -near );
@@ -108,11 +162,11 @@ osg::ref_ptr<osg::Group> CameraModel::make_rendering(float size) const {
 
     osg::Geometry* geom = new osg::Geometry;
     geom->setUseDisplayList( false );
-    geom->setVertexArray( v );
+    geom->setVertexArray( v.get() );
 
-    osg::Vec4Array* c = new osg::Vec4Array;
+    osg::ref_ptr<osg::Vec4Array> c = pools.vec4.get(1);
     c->push_back( osg::Vec4( 1., 1., 1., 1. ) );
-    geom->setColorArray( c );
+    geom->setColorArray( c.get() );
     geom->setColorBinding( osg::Geometry::BIND_OVERALL );
 
     GLushort idxLines[8] = {
@@ -143,7 +197,8 @@ osg::ref_ptr<osg::Group> CameraModel::make_rendering(float size) const {
 	return group;
 }
 
-osg::Vec3 CameraModel::project_pixel_to_camera_frame(osg::Vec2 uv, bool distorted, double distance ) {
+template<typename T>
+typename CameraModelT<T>::Vec3 CameraModelT<T>::project_pixel_to_camera_frame(Vec2 uv, bool distorted, double distance ) {
     if (!intrinsic_valid) {
         throw std::runtime_error("need valid intrinsics to project pixel to camera frame");
     }
@@ -160,52 +215,173 @@ osg::Vec3 CameraModel::project_pixel_to_camera_frame(osg::Vec2 uv, bool distorte
     y = (uv[1] - cy - Ty) / fy;
     z = -1.0f; // -1 because osg and ROS/OpenCV coords are flipped
 
-    osg::Vec3 result(x,y,z);
+    osg::Vec3d result(x,y,z);
     result.normalize();
     result *= distance;
+    return Vec3(result);
+}
+
+template<typename T>
+osg::Matrix CameraModelT<T>::get_rot() const {
+    return osg::Matrixd::rotate(_orientation.inverse());
+}
+
+template<typename T>
+osg::Matrix CameraModelT<T>::get_rot_inv() const {
+    return osg::Matrixd::rotate(_orientation);
+}
+
+template<typename T>
+typename CameraModelT<T>::Vec3 CameraModelT<T>::get_translation() const {
+    osg::Vec4d eye( _position[0], _position[1], _position[2], 1.0);
+    osg::Vec4d t = -(eye*get_rot());
+    assert(t[3]==1.0);
+    Vec3 result(t[0], t[1], t[2]);
     return result;
 }
 
-osg::Matrix CameraModel::get_rot() const {
-    osg::Vec3d lv( _center - _eye );
+template<typename T>
+typename CameraModelT<T>::Vec3 CameraModelT<T>::project_camera_frame_to_3d(Vec3 xyz_c ) {
+    osg::Vec3d diff = osg::Vec3d(xyz_c)-osg::Vec3d(get_translation());
+    osg::Vec3d world_coords = diff*get_rot_inv();
+    return Vec3(world_coords);
+}
 
-    osg::Vec3d f( lv );
-    f.normalize();
-    osg::Vec3d s( f^_up );
-    s.normalize();
-    osg::Vec3d u( s^f );
-    u.normalize();
+// Forward projection with R, t and K in the precision of the camera.
+// d is NULL without distortion.
+template<typename T>
+static void project_points(const T R[9], const T t[3], const T K[5], const T* d,
+                           const T* xyz, unsigned int n, T* uv) {
+    for (unsigned int i=0; i<n; i++) {
+        const T* X = xyz + 3*i;
+        T px = R[0]*X[0] + R[1]*X[1] + R[2]*X[2] + t[0];
+        T py = R[3]*X[0] + R[4]*X[1] + R[5]*X[2] + t[1];
+        T pz = R[6]*X[0] + R[7]*X[1] + R[8]*X[2] + t[2];
+        T x = px/pz;
+        T y = py/pz;
+        if (d) {
+            T r2 = x*x + y*y;
+            T radial = 1 + r2*(d[0] + r2*(d[1] + r2*d[4]));
+            T xd = x*radial + 2*d[2]*x*y + d[3]*(r2 + 2*x*x);
+            T yd = y*radial + d[2]*(r2 + 2*y*y) + 2*d[3]*x*y;
+            x = xd;
+            y = yd;
+        }
+        uv[2*i] = K[0]*x + K[1]*y + K[2];
+        uv[2*i+1] = K[3]*y + K[4];
+    }
+}
 
-    osg::Matrixd rotation_matrix( s[0], u[0], -f[0], 0.0f,
-                            s[1], u[1], -f[1], 0.0f,
-                            s[2], u[2], -f[2], 0.0f,
-                            0.0f, 0.0f,  0.0f, 1.0f );
-    return rotation_matrix;
+// R, t of get_Rt(), built in double and rounded to the camera's precision
+template<typename T>
+static void world_to_camera_frame(const CameraModelT<T>& cam, T R[9], T t[3]) {
+    double Rd[9], td[3];
+    cam.get_Rt(Rd, td);
+    for (int i=0; i<9; i++) {
+        R[i] = Rd[i];
+    }
+    for (int i=0; i<3; i++) {
+        t[i] = td[i];
+    }
 }
 
-osg::Matrix CameraModel::get_rot_inv() const {
-    osg::Matrix result;
-    // OSG doesn't have a transpose matrix function?
-    result.invert( get_rot() );
-    return result;
+#ifdef __SSE2__
+// project_points() on four points at a time, the remainder is scalar
+static void project_points_sse(const float R[9], const float t[3], const float K[5], const float* d,
+                               const float* xyz, unsigned int n, float* uv) {
+    __m128 r[9];
+    for (int i=0; i<9; i++) {
+        r[i] = _mm_set1_ps(R[i]);
+    }
+    const __m128 t0 = _mm_set1_ps(t[0]), t1 = _mm_set1_ps(t[1]), t2 = _mm_set1_ps(t[2]);
+    const __m128 k00 = _mm_set1_ps(K[0]), k01 = _mm_set1_ps(K[1]), k02 = _mm_set1_ps(K[2]);
+    const __m128 k11 = _mm_set1_ps(K[3]), k12 = _mm_set1_ps(K[4]);
+    const __m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f);
+    __m128 dk1 = _mm_setzero_ps(), dk2 = dk1, dp1 = dk1, dp2 = dk1, dk3 = dk1;
+    if (d) {
+        dk1 = _mm_set1_ps(d[0]);
+        dk2 = _mm_set1_ps(d[1]);
+        dp1 = _mm_set1_ps(d[2]);
+        dp2 = _mm_set1_ps(d[3]);
+        dk3 = _mm_set1_ps(d[4]);
+    }
+
+    const unsigned int n4 = n & ~3u;
+    for (unsigned int i=0; i<n4; i+=4) {
+        const float* X = xyz + 3*i;
+        __m128 wx = _mm_set_ps(X[9], X[6], X[3], X[0]);
+        __m128 wy = _mm_set_ps(X[10], X[7], X[4], X[1]);
+        __m128 wz = _mm_set_ps(X[11], X[8], X[5], X[2]);
+        __m128 px = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r[0], wx), _mm_mul_ps(r[1], wy)),
+                               _mm_add_ps(_mm_mul_ps(r[2], wz), t0));
+        __m128 py = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r[3], wx), _mm_mul_ps(r[4], wy)),
+                               _mm_add_ps(_mm_mul_ps(r[5], wz), t1));
+        __m128 pz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r[6], wx), _mm_mul_ps(r[7], wy)),
+                               _mm_add_ps(_mm_mul_ps(r[8], wz), t2));
+        __m128 x = _mm_div_ps(px, pz);
+        __m128 y = _mm_div_ps(py, pz);
+        if (d) {
+            __m128 xy = _mm_mul_ps(x, y);
+            __m128 xx = _mm_mul_ps(x, x);
+            __m128 yy = _mm_mul_ps(y, y);
+            __m128 r2 = _mm_add_ps(xx, yy);
+            __m128 radial = _mm_add_ps(one, _mm_mul_ps(r2, _mm_add_ps(dk1,
+                                _mm_mul_ps(r2, _mm_add_ps(dk2, _mm_mul_ps(r2, dk3))))));
+            __m128 xd = _mm_add_ps(_mm_mul_ps(x, radial),
+                        _mm_add_ps(_mm_mul_ps(_mm_mul_ps(two, dp1), xy),
+                                   _mm_mul_ps(dp2, _mm_add_ps(r2, _mm_mul_ps(two, xx)))));
+            __m128 yd = _mm_add_ps(_mm_mul_ps(y, radial),
+                        _mm_add_ps(_mm_mul_ps(dp1, _mm_add_ps(r2, _mm_mul_ps(two, yy))),
+                                   _mm_mul_ps(_mm_mul_ps(two, dp2), xy)));
+            x = xd;
+            y = yd;
+        }
+        __m128 u = _mm_add_ps(_mm_add_ps(_mm_mul_ps(k00, x), _mm_mul_ps(k01, y)), k02);
+        __m128 v = _mm_add_ps(_mm_mul_ps(k11, y), k12);
+        _mm_storeu_ps(uv + 2*i, _mm_unpacklo_ps(u, v));
+        _mm_storeu_ps(uv + 2*i + 4, _mm_unpackhi_ps(u, v));
+    }
+    project_points(R, t, K, d, xyz + 3*n4, n - n4, uv + 2*n4);
 }
+#endif
 
-osg::Vec3 CameraModel::get_translation() const {
-    osg::Vec4 eye( _eye[0], _eye[1], _eye[2], 1.0);
-    osg::Vec4 t = -(eye*get_rot());
-    assert(t[3]==1.0);
-    osg::Vec3 result(t[0], t[1], t[2]);
-    return result;
+template<typename T>
+void CameraModelT<T>::project_3d_to_pixel(const T* xyz, unsigned int n, T* uv, bool distorted) const {
+    if (!intrinsic_valid) {
+        throw std::runtime_error("need valid intrinsics to project 3d to pixel");
+    }
+    T R[9], t[3];
+    world_to_camera_frame(*this, R, t);
+    const T K[5] = {_K00, _K01, _K02, _K11, _K12};
+    project_points(R, t, K, distorted ? _distortion : (const T*)NULL, xyz, n, uv);
 }
 
-osg::Vec3 CameraModel::project_camera_frame_to_3d(osg::Vec3 xyz_c ) {
-    osg::Vec3 diff = xyz_c-get_translation();
-    osg::Vec3 world_coords = diff*get_rot_inv();
-    return world_coords;
+#ifdef __SSE2__
+template<>
+void CameraModelT<float>::project_3d_to_pixel(const float* xyz, unsigned int n, float* uv, bool distorted) const {
+    if (!intrinsic_valid) {
+        throw std::runtime_error("need valid intrinsics to project 3d to pixel");
+    }
+    float R[9], t[3];
+    world_to_camera_frame(*this, R, t);
+    const float K[5] = {_K00, _K01, _K02, _K11, _K12};
+    project_points_sse(R, t, K, distorted ? _distortion : (const float*)NULL, xyz, n, uv);
+}
+#endif
+
+template<typename T>
+typename CameraModelT<T>::Vec2 CameraModelT<T>::project_3d_to_pixel(Vec3 xyz, bool distorted) const {
+    // the pose is converted to R, t in the camera frame of K (y down,
+    // looking down +z) for every call, batches amortize that
+    const T X[3] = {xyz[0], xyz[1], xyz[2]};
+    T uv[2];
+    project_3d_to_pixel(X, 1, uv, distorted);
+    return Vec2(uv[0], uv[1]);
 }
 
-void CameraModel::set_intrinsic( double K00, double K01, double K02,
-                                 double K11, double K12 ) {
+template<typename T>
+void CameraModelT<T>::set_intrinsic( double K00, double K01, double K02,
+                                    double K11, double K12 ) {
     _K00 = K00;
     _K01 = K01;
     _K02 = K02;
@@ -214,13 +390,154 @@ void CameraModel::set_intrinsic( double K00, double K01, double K02,
     intrinsic_valid = true;
 }
 
-void CameraModel::set_extrinsic( osg::Vec3 eye, osg::Vec3 center, osg::Vec3 up ) {
-    _eye = eye;
-    _center = center;
-    _up = up;
+template<typename T>
+void CameraModelT<T>::get_intrinsic( double& K00, double& K01, double& K02,
+                                    double& K11, double& K12 ) const {
+    if (!intrinsic_valid) {throw "invalid intrinsic";}
+    K00 = _K00;
+    K01 = _K01;
+    K02 = _K02;
+    K11 = _K11;
+    K12 = _K12;
+}
+
+template<typename T>
+void CameraModelT<T>::set_distortion( double k1, double k2, double p1, double p2, double k3 ) {
+    _distortion[0] = k1;
+    _distortion[1] = k2;
+    _distortion[2] = p1;
+    _distortion[3] = p2;
+    _distortion[4] = k3;
+}
+
+template<typename T>
+void CameraModelT<T>::get_distortion( double& k1, double& k2, double& p1, double& p2, double& k3 ) const {
+    k1 = _distortion[0];
+    k2 = _distortion[1];
+    p1 = _distortion[2];
+    p2 = _distortion[3];
+    k3 = _distortion[4];
+}
+
+template<typename T>
+void CameraModelT<T>::set_extrinsic( const osg::Vec3d& eye, const osg::Vec3d& center, const osg::Vec3d& up ) {
+    // the view matrix rotates world into eye coordinates, the
+    // orientation is its inverse
+    _orientation = osg::Matrixd::lookAt(eye, center, up).getRotate().inverse();
+    _position = Vec3(eye);
+    extrinsic_valid = true;
+}
+
+template<typename T>
+void CameraModelT<T>::set_extrinsic( const osg::Quat& orientation, const osg::Vec3d& position ) {
+    _orientation = orientation;
+    _position = Vec3(position);
     extrinsic_valid = true;
 }
 
+// OpenGL eye coordinates have y up and look down -z, the camera frame
+// of K has y down and looks down +z
+static const double cv_flip[3] = {1.0, -1.0, -1.0};
+
+template<typename T>
+void CameraModelT<T>::get_Rt( double R[9], double t[3] ) const {
+    osg::Matrixd V = view();
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<3; j++) {
+            R[i*3+j] = cv_flip[i]*V(j,i);
+        }
+        t[i] = cv_flip[i]*V(3,i);
+    }
+}
+
+template<typename T>
+void CameraModelT<T>::set_Rt( const double R[9], const double t[3] ) {
+    osg::Matrixd rot;
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<3; j++) {
+            rot(j,i) = cv_flip[i]*R[i*3+j];
+        }
+    }
+    osg::Vec3d eye( -(R[0]*t[0] + R[3]*t[1] + R[6]*t[2]),
+                    -(R[1]*t[0] + R[4]*t[1] + R[7]*t[2]),
+                    -(R[2]*t[0] + R[5]*t[1] + R[8]*t[2]) );
+    set_extrinsic( rot.getRotate().inverse(), eye );
+}
+
+template<typename T>
+void CameraModelT<T>::get_P( double P[12] ) const {
+    if (!intrinsic_valid) {throw "invalid intrinsic";}
+    double R[9], t[3];
+    get_Rt(R, t);
+    const double K[3][3] = { {_K00, _K01, _K02},
+                             {  0.0, _K11, _K12},
+                             {  0.0,  0.0,  1.0} };
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<3; j++) {
+            P[i*4+j] = K[i][0]*R[j] + K[i][1]*R[3+j] + K[i][2]*R[6+j];
+        }
+        P[i*4+3] = K[i][0]*t[0] + K[i][1]*t[1] + K[i][2]*t[2];
+    }
+}
+
+template<typename T>
+void CameraModelT<T>::set_P( const double P_in[12] ) {
+    // RQ decomposition of the left 3x3 block by Gram-Schmidt from the
+    // bottom row, as decompose() in calib_test_utils.py. P is only
+    // defined up to scale, pick the sign that gives a proper rotation.
+    double P[12];
+    const double* m = P_in;
+    double det = m[0]*(m[5]*m[10] - m[6]*m[9])
+               - m[1]*(m[4]*m[10] - m[6]*m[8])
+               + m[2]*(m[4]*m[9] - m[5]*m[8]);
+    for (int i=0; i<12; i++) {
+        P[i] = det < 0.0 ? -P_in[i] : P_in[i];
+    }
+    osg::Vec3d m0(P[0], P[1], P[2]), m1(P[4], P[5], P[6]), m2(P[8], P[9], P[10]);
+
+    double K22 = m2.length();
+    osg::Vec3d r2 = m2/K22;
+    double K12 = m1*r2;
+    osg::Vec3d v = m1 - r2*K12;
+    double K11 = v.length();
+    osg::Vec3d r1 = v/K11;
+    double K02 = m0*r2;
+    double K01 = m0*r1;
+    v = m0 - r1*K01 - r2*K02;
+    double K00 = v.length();
+    osg::Vec3d r0 = v/K00;
+
+    // t = K^-1 p4, K upper triangular
+    double t[3];
+    t[2] = P[11]/K22;
+    t[1] = (P[7] - K12*t[2])/K11;
+    t[0] = (P[3] - K01*t[1] - K02*t[2])/K00;
+
+    double R[9] = { r0[0], r0[1], r0[2],
+                    r1[0], r1[1], r1[2],
+                    r2[0], r2[1], r2[2] };
+    set_Rt(R, t);
+    set_intrinsic(K00/K22, K01/K22, K02/K22, K11/K22, K12/K22);
+}
+
+CameraModel* load_camera_matrix(const char* fname, unsigned int width, unsigned int height, bool y_up) {
+    std::ifstream in(fname);
+    if (!in) {
+        std::ostringstream os;
+        os << "Could not open camera matrix file " << fname;
+        throw std::ios_base::failure(os.str());
+    }
+    double P[12];
+    for (int i=0; i<12; i++) {
+        if (!(in >> P[i])) {
+            throw std::runtime_error("Error parsing camera matrix: expected 3x4 numbers");
+        }
+    }
+    CameraModel* result = new CameraModel(width, height, y_up);
+    result->set_P(P);
+    return result;
+}
+
 CameraModel* make_real_camera_parameters() {
 	// this is just a stub until we get real parameter loading code in here.
 	osg::Vec3 eye = osg::Vec3(-0.708471152493,-1.4184181224,1.30394218099);
@@ -239,3 +556,98 @@ CameraModel* make_real_camera_parameters() {
 
 	return result;
 }
+
+template class CameraModelT<float>;
+template class CameraModelT<double>;
+
+template<typename T>
+static double max_pixel_error(const std::vector<T>& uv, const std::vector<double>& ref) {
+    double result = 0.0;
+    for (unsigned int i=0; i<ref.size(); i+=2) {
+        double du = uv[i] - ref[i];
+        double dv = uv[i+1] - ref[i+1];
+        result = std::max(result, sqrt(du*du + dv*dv));
+    }
+    return result;
+}
+
+void benchmark_precision(const CameraModel& cam, unsigned int n_points,
+                         const osg::Vec3d& offset, std::ostream& os) {
+    double K00, K01, K02, K11, K12;
+    cam.get_intrinsic(K00, K01, K02, K11, K12);
+    double R[9], t[3];
+    cam.get_Rt(R, t);
+
+    // points on a grid of pixels and depths, reference pixels from the
+    // double model before the offset
+    std::vector<double> xyz(3*n_points);
+    for (unsigned int i=0; i<n_points; i++) {
+        double u = ((i % 97) + 0.5)/97.0*cam.width();
+        double v = ((i/97 % 89) + 0.5)/89.0*cam.height();
+        double z = 1.0 + 3.0*(i % 13)/12.0;
+        double y = (v - K12)/K11;
+        double x = (u - K02 - K01*y)/K00;
+        double c[3] = {x*z - t[0], y*z - t[1], z - t[2]};
+        for (int j=0; j<3; j++) {
+            xyz[3*i+j] = R[j]*c[0] + R[3+j]*c[1] + R[6+j]*c[2];
+        }
+    }
+    std::vector<double> ref(2*n_points);
+    cam.project_3d_to_pixel(&xyz[0], n_points, &ref[0]);
+
+    CameraModel cam_d(cam);
+    cam_d.set_extrinsic(cam.orientation(), cam.position() + offset);
+    CameraModelf cam_f(cam_d);
+    std::vector<float> xyz_f(3*n_points);
+    for (unsigned int i=0; i<n_points; i++) {
+        for (int j=0; j<3; j++) {
+            xyz[3*i+j] += offset[j];
+            xyz_f[3*i+j] = xyz[3*i+j];
+        }
+    }
+
+    std::vector<double> uv_d(2*n_points);
+    std::vector<float> uv_f(2*n_points);
+    osg::Timer timer;
+    osg::Timer_t start;
+    double dt;
+
+    os << "projecting " << n_points << " points at offset " << offset[0] << " "
+       << offset[1] << " " << offset[2] << std::endl;
+
+    start = timer.tick();
+    for (unsigned int i=0; i<n_points; i++) {
+        osg::Vec2d p = cam_d.project_3d_to_pixel(osg::Vec3d(xyz[3*i], xyz[3*i+1], xyz[3*i+2]));
+        uv_d[2*i] = p[0];
+        uv_d[2*i+1] = p[1];
+    }
+    dt = timer.delta_s(start, timer.tick());
+    os << "  double scalar: max error " << max_pixel_error(uv_d, ref) << " px, "
+       << n_points/dt << " points/sec" << std::endl;
+
+    start = timer.tick();
+    cam_d.project_3d_to_pixel(&xyz[0], n_points, &uv_d[0]);
+    dt = timer.delta_s(start, timer.tick());
+    os << "  double batch:  max error " << max_pixel_error(uv_d, ref) << " px, "
+       << n_points/dt << " points/sec" << std::endl;
+
+    start = timer.tick();
+    for (unsigned int i=0; i<n_points; i++) {
+        osg::Vec2f p = cam_f.project_3d_to_pixel(osg::Vec3f(xyz_f[3*i], xyz_f[3*i+1], xyz_f[3*i+2]));
+        uv_f[2*i] = p[0];
+        uv_f[2*i+1] = p[1];
+    }
+    dt = timer.delta_s(start, timer.tick());
+    os << "  float scalar:  max error " << max_pixel_error(uv_f, ref) << " px, "
+       << n_points/dt << " points/sec" << std::endl;
+
+    start = timer.tick();
+    cam_f.project_3d_to_pixel(&xyz_f[0], n_points, &uv_f[0]);
+    dt = timer.delta_s(start, timer.tick());
+#ifdef __SSE2__
+    os << "  float SSE2:    max error ";
+#else
+    os << "  float batch:   max error ";
+#endif
+    os << max_pixel_error(uv_f, ref) << " px, " << n_points/dt << " points/sec" << std::endl;
+}
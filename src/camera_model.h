@@ -3,63 +3,161 @@
 #define CAMERA_MODEL_H
 
 #include <osg/Camera>
+#include <osg/Polytope>
+#include <osg/Quat>
+#include <osg/Vec2d>
+#include <osg/Vec3d>
 
-class CameraModel {
+#include <ostream>
+
+// vector types of a CameraModelT in its scalar precision
+template<typename T> struct CameraScalar;
+template<> struct CameraScalar<float> {
+    typedef osg::Vec2f Vec2;
+    typedef osg::Vec3f Vec3;
+};
+template<> struct CameraScalar<double> {
+    typedef osg::Vec2d Vec2;
+    typedef osg::Vec3d Vec3;
+};
+
+// A pinhole camera with plumb bob lens distortion, templated on the
+// scalar type T of its parameters and of forward projection. Matrices
+// for OpenGL, the frustum and back projection are always built in
+// double, the orientation is always a (double) osg::Quat. float models
+// are half the size and project batches of points with SSE2, at the
+// cost of precision far from the world origin; CameraModel (double) is
+// the default.
+template<typename T>
+class CameraModelT {
 public:
-    CameraModel(unsigned int width, unsigned int height, bool y_up=true);
+    typedef typename CameraScalar<T>::Vec2 Vec2;
+    typedef typename CameraScalar<T>::Vec3 Vec3;
+
+    CameraModelT(unsigned int width, unsigned int height, bool y_up=true);
+
+    // the same camera in another precision
+    template<typename U>
+    explicit CameraModelT(const CameraModelT<U>& other) :
+        _width(other.width()), _height(other.height()), _y_up(other.y_up()),
+        intrinsic_valid(false), extrinsic_valid(false)
+    {
+        double d[5];
+        other.get_distortion(d[0], d[1], d[2], d[3], d[4]);
+        set_distortion(d[0], d[1], d[2], d[3], d[4]);
+        if (other.is_intrinsic_valid()) {
+            double K00, K01, K02, K11, K12;
+            other.get_intrinsic(K00, K01, K02, K11, K12);
+            set_intrinsic(K00, K01, K02, K11, K12);
+        }
+        if (other.is_extrinsic_valid()) {
+            set_extrinsic(other.orientation(), osg::Vec3d(other.position()));
+        }
+    }
 
     // get basic 2D image information
     unsigned int width() const { return _width; }
     unsigned int height() const {return _height; }
+    bool y_up() const {return _y_up; }
 
     // get extrinsic parameter information
-    osg::Vec3 eye() const;// const {return _eye;}
-    osg::Vec3 center() const;// const {return _center;}
-    osg::Vec3 up() const;// const {return _up;}
+    Vec3 eye() const;// const {return _eye;}
+    Vec3 center() const;// const {return _center;}
+    Vec3 up() const;// const {return _up;}
+    // canonical pose: camera to world rotation and eye position
+    osg::Quat orientation() const;
+    Vec3 position() const;
 
     // get matrices
     osg::Matrixd projection(float znear, float zfar) const;
     osg::Matrixd view() const;
 
+    // Off-axis projection for the w x h pixel tile with smallest pixel
+    // coordinates (u0,v0), drawn into a w x h viewport. Tiles stitch
+    // seamlessly.
+    osg::Matrixd projection_tile(double u0, double v0, double w, double h,
+                                 float znear, float zfar) const;
+
+    // same camera with its image scaled by factor (e.g. for supersampling)
+    CameraModelT scaled(double factor) const;
+
+    // the six frustum planes in world coordinates, normals point inside
+    osg::Polytope frustum(float znear, float zfar) const;
+    // the same, overwriting the planes of result in place so a polytope
+    // kept across frames is not reallocated
+    void frustum(float znear, float zfar, osg::Polytope& result) const;
+
     // get viewer geometry
     osg::ref_ptr<osg::Group> make_rendering(float size) const;
 
     // project pixels
-    osg::Vec3 project_pixel_to_camera_frame(osg::Vec2 uv, bool distorted=true, double distance=1.0 );
-    osg::Vec3 project_camera_frame_to_3d(osg::Vec3 xyz_c );
+    Vec3 project_pixel_to_camera_frame(Vec2 uv, bool distorted=true, double distance=1.0 );
+    Vec3 project_camera_frame_to_3d(Vec3 xyz_c );
+    // pixel (in the camera's own row convention) seen at a world point
+    Vec2 project_3d_to_pixel(Vec3 xyz, bool distorted=true) const;
+    // the same for n points, xyz holds n x,y,z triples and uv receives
+    // n u,v pairs. float cameras do four points at a time with SSE2.
+    void project_3d_to_pixel(const T* xyz, unsigned int n, T* uv, bool distorted=true) const;
 
     // setters
     //  - extrinsics
-    void set_extrinsic( osg::Vec3 eye, osg::Vec3 center, osg::Vec3 up );
+    void set_extrinsic( const osg::Vec3d& eye, const osg::Vec3d& center, const osg::Vec3d& up );
+    void set_extrinsic( const osg::Quat& orientation, const osg::Vec3d& position );
+    //  - world to camera frame of K (x right, y down, z forward), R row major
+    void get_Rt( double R[9], double t[3] ) const;
+    void set_Rt( const double R[9], const double t[3] );
+    //  - 3x4 camera matrix P = K [R|t], row major; set_P() also sets K
+    void get_P( double P[12] ) const;
+    void set_P( const double P[12] );
 
     //  - intrinsics (3x3 matrix upper triangular K normalized so K22 is 1.)
     void set_intrinsic( double K00, double K01, double K02,
                         double K11, double K12 );
+    void get_intrinsic( double& K00, double& K01, double& K02,
+                        double& K11, double& K12 ) const;
+
+    //  - lens distortion, plumb bob model as in OpenCV and ROS. It
+    //    applies to project_3d_to_pixel() only; OpenGL renderings are
+    //    undistorted.
+    void set_distortion( double k1, double k2, double p1, double p2, double k3=0.0 );
+    void get_distortion( double& k1, double& k2, double& p1, double& p2, double& k3 ) const;
 
     bool is_intrinsic_valid() const {return intrinsic_valid;}
     bool is_extrinsic_valid() const {return extrinsic_valid;}
 
     osg::Matrix get_rot() const;
     osg::Matrix get_rot_inv() const;
-    osg::Vec3 get_translation() const;
+    Vec3 get_translation() const;
 
 private:
     unsigned int _width;
     unsigned int _height;
-    float _K00;
-    float _K01;
-    float _K02;
-    float _K11;
-    float _K12;
+    T _K00;
+    T _K01;
+    T _K02;
+    T _K11;
+    T _K12;
     bool _y_up;
-    osg::Vec3 _eye;
-    osg::Vec3 _center;
-    osg::Vec3 _up;
+    osg::Quat _orientation;
+    Vec3 _position;
+    T _distortion[5];
 
     bool intrinsic_valid;
     bool extrinsic_valid;
 
 };
 
+typedef CameraModelT<double> CameraModel;
+typedef CameraModelT<float> CameraModelf;
+
 CameraModel* make_real_camera_parameters();
+// decomposes a 3x4 camera matrix such as data/cameramatrix.txt
+CameraModel* load_camera_matrix(const char* fname, unsigned int width, unsigned int height, bool y_up=false);
+
+// Projects n_points pixels of cam seen from 1 to 4 units away, with
+// the scene moved by offset (e.g. georeferenced coordinates), through
+// the double and float models, scalar and batched, and prints the
+// worst pixel error and points per second of each.
+void benchmark_precision(const CameraModel& cam, unsigned int n_points,
+                         const osg::Vec3d& offset, std::ostream& os);
 #endif
@@ -0,0 +1,176 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include "camera_path.h"
+
+#include <math.h>
+#include <stdexcept>
+
+// Quaternions here use the Hamilton product on osg::Quat's (x,y,z,w)
+// components, independent of osg::Quat's own operator order.
+
+static osg::Quat qmul(const osg::Quat& a, const osg::Quat& b) {
+    return osg::Quat( a[3]*b[0] + a[0]*b[3] + a[1]*b[2] - a[2]*b[1],
+                      a[3]*b[1] - a[0]*b[2] + a[1]*b[3] + a[2]*b[0],
+                      a[3]*b[2] + a[0]*b[1] - a[1]*b[0] + a[2]*b[3],
+                      a[3]*b[3] - a[0]*b[0] - a[1]*b[1] - a[2]*b[2] );
+}
+
+static double qdot(const osg::Quat& a, const osg::Quat& b) {
+    return a[0]*b[0] + a[1]*b[1] + a[2]*b[2] + a[3]*b[3];
+}
+
+static osg::Quat qconj(const osg::Quat& q) {
+    return osg::Quat(-q[0], -q[1], -q[2], q[3]);
+}
+
+// log of a unit quaternion, a pure quaternion stored in x,y,z
+static osg::Quat qlog(const osg::Quat& q) {
+    double v = sqrt(q[0]*q[0] + q[1]*q[1] + q[2]*q[2]);
+    double s = v > 1e-12 ? atan2(v, q[3])/v : 1.0;
+    return osg::Quat(q[0]*s, q[1]*s, q[2]*s, 0.0);
+}
+
+static osg::Quat qexp(const osg::Quat& q) {
+    double v = sqrt(q[0]*q[0] + q[1]*q[1] + q[2]*q[2]);
+    double s = v > 1e-12 ? sin(v)/v : 1.0;
+    return osg::Quat(q[0]*s, q[1]*s, q[2]*s, cos(v));
+}
+
+static void arc(const osg::Quat& a, const osg::Quat& b, double& theta, double& inv_sin) {
+    double c = qdot(a, b);
+    c = c > 1.0 ? 1.0 : (c < -1.0 ? -1.0 : c);
+    theta = acos(c);
+    inv_sin = theta > 1e-6 ? 1.0/sin(theta) : 0.0;
+}
+
+// slerp with the arc between a and b already known
+static osg::Quat slerp_arc(const osg::Quat& a, const osg::Quat& b,
+                           double theta, double inv_sin, double u) {
+    double wa, wb;
+    if (inv_sin==0.0) {
+        wa = 1.0 - u;
+        wb = u;
+    } else {
+        wa = sin((1.0 - u)*theta)*inv_sin;
+        wb = sin(u*theta)*inv_sin;
+    }
+    return osg::Quat( wa*a[0] + wb*b[0], wa*a[1] + wb*b[1],
+                      wa*a[2] + wb*b[2], wa*a[3] + wb*b[3] );
+}
+
+static osg::Quat slerp(const osg::Quat& a, const osg::Quat& b, double u) {
+    double theta, inv_sin;
+    arc(a, b, theta, inv_sin);
+    return slerp_arc(a, b, theta, inv_sin, u);
+}
+
+void CameraPath::add_key(double t, const CameraPose& pose) {
+    if (!_keys.empty() && t <= _keys.back().t) {
+        throw std::runtime_error("camera path keys must have increasing times");
+    }
+    Key key;
+    key.t = t;
+    key.pose = pose;
+    // stay on the hemisphere of the previous key so arcs are the short way
+    if (!_keys.empty() && qdot(_keys.back().pose.orientation, pose.orientation) < 0.0) {
+        key.pose.orientation = pose.orientation*-1.0;
+    }
+    key.control = key.pose.orientation;
+    _keys.push_back(key);
+
+    // the new key changes the controls of its predecessor and the last two segments
+    unsigned int n = _keys.size();
+    if (n >= 2) {
+        _segments.resize(n-1);
+        if (n >= 3) {
+            update_controls(n-2);
+            update_segment(n-3);
+        }
+        update_segment(n-2);
+    }
+}
+
+void CameraPath::update_controls(unsigned int i) {
+    // Shoemake's inner quadrangle point
+    const osg::Quat& q = _keys[i].pose.orientation;
+    osg::Quat qi = qconj(q);
+    osg::Quat a = qlog(qmul(qi, _keys[i+1].pose.orientation));
+    osg::Quat b = qlog(qmul(qi, _keys[i-1].pose.orientation));
+    osg::Quat sum( -(a[0]+b[0])*0.25, -(a[1]+b[1])*0.25, -(a[2]+b[2])*0.25, 0.0 );
+    _keys[i].control = qmul(q, qexp(sum));
+}
+
+void CameraPath::update_segment(unsigned int i) {
+    Segment& s = _segments[i];
+    arc(_keys[i].pose.orientation, _keys[i+1].pose.orientation, s.theta, s.inv_sin);
+    arc(_keys[i].control, _keys[i+1].control, s.control_theta, s.control_inv_sin);
+}
+
+CameraPose CameraPath::eval(unsigned int i, double u) const {
+    const Key& k0 = _keys[i];
+    const Key& k1 = _keys[i+1];
+    const Segment& s = _segments[i];
+    CameraPose result;
+
+    osg::Quat q = slerp_arc(k0.pose.orientation, k1.pose.orientation, s.theta, s.inv_sin, u);
+    if (_method==SLERP) {
+        result.orientation = q;
+        result.position = k0.pose.position*(1.0 - u) + k1.pose.position*u;
+        return result;
+    }
+
+    osg::Quat c = slerp_arc(k0.control, k1.control, s.control_theta, s.control_inv_sin, u);
+    result.orientation = slerp(q, c, 2.0*u*(1.0 - u));
+
+    // cubic Hermite with Catmull-Rom tangents scaled to this segment
+    double dt = k1.t - k0.t;
+    const osg::Vec3d& p0 = k0.pose.position;
+    const osg::Vec3d& p1 = k1.pose.position;
+    osg::Vec3d m0 = p1 - p0;
+    osg::Vec3d m1 = m0;
+    if (i > 0) {
+        const Key& kp = _keys[i-1];
+        m0 = (p1 - kp.pose.position)*(dt/(k1.t - kp.t));
+    }
+    if (i+2 < _keys.size()) {
+        const Key& kn = _keys[i+2];
+        m1 = (kn.pose.position - p0)*(dt/(kn.t - k0.t));
+    }
+    double u2 = u*u;
+    double u3 = u2*u;
+    result.position = p0*(2.0*u3 - 3.0*u2 + 1.0) + m0*(u3 - 2.0*u2 + u)
+                    + p1*(-2.0*u3 + 3.0*u2) + m1*(u3 - u2);
+    return result;
+}
+
+CameraPose CameraPath::sample(double t) const {
+    CameraPose result;
+    sample(&t, 1, &result);
+    return result;
+}
+
+void CameraPath::sample(const double* t, unsigned int n, CameraPose* result) const {
+    if (_keys.empty()) {
+        throw std::runtime_error("cannot sample a camera path without keys");
+    }
+    const unsigned int last = _keys.size()-1;
+    unsigned int i = 0;
+    for (unsigned int j=0; j<n; j++) {
+        double tj = t[j];
+        if (last==0 || tj <= _keys[0].t) {
+            result[j] = _keys[0].pose;
+            continue;
+        }
+        if (tj >= _keys[last].t) {
+            result[j] = _keys[last].pose;
+            continue;
+        }
+        // the segment of the previous sample is a good guess
+        if (tj < _keys[i].t) {
+            i = 0;
+        }
+        while (_keys[i+1].t <= tj) {
+            i++;
+        }
+        result[j] = eval(i, (tj - _keys[i].t)/(_keys[i+1].t - _keys[i].t));
+    }
+}
@@ -0,0 +1,64 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef CAMERA_PATH_H
+#define CAMERA_PATH_H
+
+#include <vector>
+
+#include <osg/Quat>
+#include <osg/Vec3d>
+
+#include "camera_model.h"
+
+// the canonical extrinsics of a CameraModel
+struct CameraPose {
+    CameraPose() {}
+    CameraPose(const osg::Quat& o, const osg::Vec3d& p) : orientation(o), position(p) {}
+    explicit CameraPose(const CameraModel& cam) :
+        orientation(cam.orientation()), position(cam.position()) {}
+    osg::Quat orientation;  // camera to world
+    osg::Vec3d position;    // eye
+};
+
+// Camera fly-through or blend between calibrations through keyframe
+// poses. SLERP interpolates orientations along great arcs and positions
+// linearly; SQUAD makes both smooth across keyframes (Catmull-Rom for
+// positions). Per segment constants are computed when keys are added,
+// so sampling a path costs a few sines per pose.
+class CameraPath {
+public:
+    enum Interpolation { SLERP, SQUAD };
+
+    CameraPath(Interpolation method=SQUAD) : _method(method) {}
+
+    // keys must be added in increasing time order
+    void add_key(double t, const CameraPose& pose);
+    unsigned int n_keys() const { return _keys.size(); }
+
+    // pose at time t, clamped to the first and last keys
+    CameraPose sample(double t) const;
+    // n poses at times t; fastest when t is sorted
+    void sample(const double* t, unsigned int n, CameraPose* result) const;
+
+private:
+    struct Key {
+        double t;
+        CameraPose pose;
+        osg::Quat control;  // SQUAD inner control point
+    };
+    struct Segment {
+        double theta;       // angle between the key orientations
+        double inv_sin;
+        double control_theta;
+        double control_inv_sin;
+    };
+
+    void update_controls(unsigned int i);
+    void update_segment(unsigned int i);
+    CameraPose eval(unsigned int i, double u) const;
+
+    Interpolation _method;
+    std::vector<Key> _keys;
+    std::vector<Segment> _segments;
+};
+
+#endif
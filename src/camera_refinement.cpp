@@ -0,0 +1,804 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include "camera_refinement.h"
+#include "profiler.h"
+
+#include <OpenThreads/Barrier>
+#include <OpenThreads/Thread>
+#include <osg/Timer>
+
+#include <math.h>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+// parameters of one camera: K00 K01 K02 K11 K12, k1 k2 p1 p2 k3,
+// rotation update, translation
+#define N_CAM_PARAMS 16
+#define P_INTRINSIC 0
+#define P_DISTORTION 5
+#define P_ROTATION 10
+#define P_TRANSLATION 13
+
+// below this many observations per thread evaluation stays serial
+#define MIN_OBSERVATIONS_PER_THREAD 256
+
+namespace {
+
+struct CameraParams {
+    double K[5];
+    double dist[5];
+    double R[9];  // world to the camera frame of K (x right, y down, z forward), row major
+    double t[3];
+};
+
+struct Observation {
+    unsigned int camera;
+    unsigned int point;
+    unsigned int pair;   // index of the (camera, point) block
+    double uv[2];
+};
+
+struct Evaluation {
+    bool valid;          // point in front of the camera
+    double r[2];
+    double Jc[2][N_CAM_PARAMS];
+    double Jx[2][3];
+};
+
+struct Problem {
+    std::vector<Observation> obs;
+    std::vector<osg::Vec3d> points0;  // surveyed key points
+    bool mask[N_CAM_PARAMS];          // parameter is refined
+    bool refine_points;
+    double point_weight;              // 1/sigma^2 of the key point prior
+};
+
+struct State {
+    std::vector<CameraParams> cams;
+    std::vector<osg::Vec3d> points;
+    std::vector<Evaluation> eval;
+    double cost;
+    unsigned int n_valid;
+};
+
+}
+
+static CameraParams to_params(const CameraModel& cam) {
+    CameraParams c;
+    cam.get_intrinsic(c.K[0], c.K[1], c.K[2], c.K[3], c.K[4]);
+    cam.get_distortion(c.dist[0], c.dist[1], c.dist[2], c.dist[3], c.dist[4]);
+    cam.get_Rt(c.R, c.t);
+    return c;
+}
+
+static void from_params(const CameraParams& c, CameraModel& cam) {
+    cam.set_intrinsic(c.K[0], c.K[1], c.K[2], c.K[3], c.K[4]);
+    cam.set_distortion(c.dist[0], c.dist[1], c.dist[2], c.dist[3], c.dist[4]);
+    cam.set_Rt(c.R, c.t);
+}
+
+// Pixel of world point X and, if Jc is given, its derivatives with
+// respect to the camera parameters and to X. Returns false if X is
+// not in front of the camera.
+static bool project(const CameraParams& c, const osg::Vec3d& X, double uv[2],
+                    double Jc[2][N_CAM_PARAMS], double Jx[2][3]) {
+    const double* R = c.R;
+    double q[3], p[3];
+    for (int i=0; i<3; i++) {
+        q[i] = R[i*3]*X[0] + R[i*3+1]*X[1] + R[i*3+2]*X[2];
+        p[i] = q[i] + c.t[i];
+    }
+    if (p[2] <= 1e-9) {
+        return false;
+    }
+    double iz = 1.0/p[2];
+    double x = p[0]*iz;
+    double y = p[1]*iz;
+
+    const double* d = c.dist;
+    double r2 = x*x + y*y;
+    double radial = 1.0 + r2*(d[0] + r2*(d[1] + r2*d[4]));
+    double xd = x*radial + 2.0*d[2]*x*y + d[3]*(r2 + 2.0*x*x);
+    double yd = y*radial + d[2]*(r2 + 2.0*y*y) + 2.0*d[3]*x*y;
+
+    const double* K = c.K;
+    uv[0] = K[0]*xd + K[1]*yd + K[2];
+    uv[1] = K[3]*yd + K[4];
+    if (!Jc) {
+        return true;
+    }
+
+    // distorted by undistorted normalized coordinates
+    double g = d[0] + r2*(2.0*d[1] + 3.0*d[4]*r2);
+    double dxd_dx = radial + 2.0*g*x*x + 2.0*d[2]*y + 6.0*d[3]*x;
+    double dxd_dy = 2.0*g*x*y + 2.0*d[2]*x + 2.0*d[3]*y;
+    double dyd_dx = dxd_dy;
+    double dyd_dy = radial + 2.0*g*y*y + 6.0*d[2]*y + 2.0*d[3]*x;
+
+    // pixel by normalized coordinates, then by camera frame point
+    double A[2][2] = { { K[0]*dxd_dx + K[1]*dyd_dx, K[0]*dxd_dy + K[1]*dyd_dy },
+                       { K[3]*dyd_dx,               K[3]*dyd_dy } };
+    double B[2][3];
+    for (int r=0; r<2; r++) {
+        B[r][0] = A[r][0]*iz;
+        B[r][1] = A[r][1]*iz;
+        B[r][2] = -(A[r][0]*x + A[r][1]*y)*iz;
+    }
+
+    Jc[0][0] = xd;  Jc[0][1] = yd;  Jc[0][2] = 1.0; Jc[0][3] = 0.0; Jc[0][4] = 0.0;
+    Jc[1][0] = 0.0; Jc[1][1] = 0.0; Jc[1][2] = 0.0; Jc[1][3] = yd;  Jc[1][4] = 1.0;
+
+    double r4 = r2*r2;
+    double dxd_dk[5] = { x*r2, x*r4, 2.0*x*y, r2 + 2.0*x*x, x*r4*r2 };
+    double dyd_dk[5] = { y*r2, y*r4, r2 + 2.0*y*y, 2.0*x*y, y*r4*r2 };
+    for (int k=0; k<5; k++) {
+        Jc[0][P_DISTORTION+k] = K[0]*dxd_dk[k] + K[1]*dyd_dk[k];
+        Jc[1][P_DISTORTION+k] = K[3]*dyd_dk[k];
+    }
+
+    // R is updated as exp([w]x) R, so dp/dw = -[q]x
+    double dp_dw[3][3] = { {   0.0,  q[2], -q[1] },
+                           { -q[2],   0.0,  q[0] },
+                           {  q[1], -q[0],   0.0 } };
+    for (int r=0; r<2; r++) {
+        for (int k=0; k<3; k++) {
+            Jc[r][P_ROTATION+k] = B[r][0]*dp_dw[0][k] + B[r][1]*dp_dw[1][k] + B[r][2]*dp_dw[2][k];
+            Jc[r][P_TRANSLATION+k] = B[r][k];
+            Jx[r][k] = B[r][0]*R[k] + B[r][1]*R[3+k] + B[r][2]*R[6+k];
+        }
+    }
+    return true;
+}
+
+static void apply_update(const double* delta, CameraParams& c) {
+    for (int k=0; k<5; k++) {
+        c.K[k] += delta[P_INTRINSIC+k];
+        c.dist[k] += delta[P_DISTORTION+k];
+    }
+    for (int k=0; k<3; k++) {
+        c.t[k] += delta[P_TRANSLATION+k];
+    }
+
+    // Rodrigues' formula for exp([w]x)
+    const double* w = delta + P_ROTATION;
+    double theta = sqrt(w[0]*w[0] + w[1]*w[1] + w[2]*w[2]);
+    double a = 1.0, b = 0.5;
+    if (theta > 1e-12) {
+        a = sin(theta)/theta;
+        b = (1.0 - cos(theta))/(theta*theta);
+    }
+    double W[9] = {  0.0, -w[2],  w[1],
+                    w[2],   0.0, -w[0],
+                   -w[1],  w[0],   0.0 };
+    double E[9];
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<3; j++) {
+            double W2 = W[i*3]*W[j] + W[i*3+1]*W[3+j] + W[i*3+2]*W[6+j];
+            E[i*3+j] = (i==j ? 1.0 : 0.0) + a*W[i*3+j] + b*W2;
+        }
+    }
+    double R[9];
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<3; j++) {
+            R[i*3+j] = E[i*3]*c.R[j] + E[i*3+1]*c.R[3+j] + E[i*3+2]*c.R[6+j];
+        }
+    }
+    std::copy(R, R+9, c.R);
+}
+
+static void evaluate_range(const Problem& pb, const State& s, unsigned int begin, unsigned int end,
+                           std::vector<Evaluation>& eval) {
+    for (unsigned int i=begin; i<end; i++) {
+        const Observation& o = pb.obs[i];
+        Evaluation& e = eval[i];
+        double uv[2];
+        e.valid = project(s.cams[o.camera], s.points[o.point], uv, e.Jc, e.Jx);
+        if (!e.valid) {
+            continue;
+        }
+        e.r[0] = uv[0] - o.uv[0];
+        e.r[1] = uv[1] - o.uv[1];
+        for (int k=0; k<N_CAM_PARAMS; k++) {
+            if (!pb.mask[k]) {
+                e.Jc[0][k] = 0.0;
+                e.Jc[1][k] = 0.0;
+            }
+        }
+    }
+}
+
+// Evaluates the observations on threads kept for the whole refinement.
+// evaluate() releases the workers through one barrier, takes the first
+// range itself and waits for the others at a second barrier.
+class EvaluationPool {
+public:
+    EvaluationPool(const Problem& pb, unsigned int n_threads);
+    ~EvaluationPool();
+    void evaluate(State& s);
+
+private:
+    class Worker : public OpenThreads::Thread {
+    public:
+        Worker(EvaluationPool* pool, unsigned int begin, unsigned int end) :
+            _pool(pool), _begin(begin), _end(end) {}
+        virtual void run() {
+            while (true) {
+                _pool->_start.block();
+                if (_pool->_quit) {
+                    return;
+                }
+                evaluate_range(_pool->_pb, *_pool->_state, _begin, _end, _pool->_state->eval);
+                _pool->_done.block();
+            }
+        }
+    private:
+        EvaluationPool* _pool;
+        unsigned int _begin;
+        unsigned int _end;
+    };
+
+    const Problem& _pb;
+    unsigned int _first_end;    // the calling thread's range is [0, _first_end)
+    std::vector<Worker*> _workers;
+    OpenThreads::Barrier _start;
+    OpenThreads::Barrier _done;
+    State* _state;
+    bool _quit;                 // read by the workers after _start
+};
+
+EvaluationPool::EvaluationPool(const Problem& pb, unsigned int n_threads) :
+    _pb(pb), _start(n_threads), _done(n_threads), _state(NULL), _quit(false)
+{
+    const unsigned int n = pb.obs.size();
+    _first_end = n/n_threads;
+    for (unsigned int i=1; i<n_threads; i++) {
+        _workers.push_back(new Worker(this, n*i/n_threads, n*(i+1)/n_threads));
+        _workers.back()->start();
+    }
+}
+
+EvaluationPool::~EvaluationPool() {
+    _quit = true;
+    _start.block();
+    for (unsigned int i=0; i<_workers.size(); i++) {
+        _workers[i]->join();
+        delete _workers[i];
+    }
+}
+
+void EvaluationPool::evaluate(State& s) {
+    _state = &s;
+    _start.block();
+    evaluate_range(_pb, s, 0, _first_end, s.eval);
+    _done.block();
+}
+
+// residuals and Jacobians of all observations, and the total cost; on
+// the pool's threads if there is one
+static void evaluate(const Problem& pb, State& s, EvaluationPool* pool) {
+    const unsigned int n = pb.obs.size();
+    s.eval.resize(n);
+    if (pool) {
+        pool->evaluate(s);
+    } else {
+        evaluate_range(pb, s, 0, n, s.eval);
+    }
+
+    s.cost = 0.0;
+    s.n_valid = 0;
+    for (unsigned int i=0; i<n; i++) {
+        if (s.eval[i].valid) {
+            s.cost += s.eval[i].r[0]*s.eval[i].r[0] + s.eval[i].r[1]*s.eval[i].r[1];
+            s.n_valid++;
+        }
+    }
+    if (pb.refine_points) {
+        for (unsigned int p=0; p<s.points.size(); p++) {
+            s.cost += pb.point_weight*(s.points[p] - pb.points0[p]).length2();
+        }
+    }
+}
+
+// solves A x = b for symmetric positive definite A (n x n, overwritten), b becomes x
+static bool cholesky_solve(std::vector<double>& A, std::vector<double>& b, unsigned int n) {
+    for (unsigned int j=0; j<n; j++) {
+        double sum = A[j*n+j];
+        for (unsigned int k=0; k<j; k++) {
+            sum -= A[j*n+k]*A[j*n+k];
+        }
+        if (sum <= 0.0) {
+            return false;
+        }
+        double ljj = sqrt(sum);
+        A[j*n+j] = ljj;
+        for (unsigned int i=j+1; i<n; i++) {
+            double s = A[i*n+j];
+            for (unsigned int k=0; k<j; k++) {
+                s -= A[i*n+k]*A[j*n+k];
+            }
+            A[i*n+j] = s/ljj;
+        }
+    }
+    for (unsigned int i=0; i<n; i++) {
+        double s = b[i];
+        for (unsigned int k=0; k<i; k++) {
+            s -= A[i*n+k]*b[k];
+        }
+        b[i] = s/A[i*n+i];
+    }
+    for (unsigned int i=n; i-- > 0; ) {
+        double s = b[i];
+        for (unsigned int k=i+1; k<n; k++) {
+            s -= A[k*n+i]*b[k];
+        }
+        b[i] = s/A[i*n+i];
+    }
+    return true;
+}
+
+static bool invert3(const double* M, double* inv) {
+    inv[0] = M[4]*M[8] - M[5]*M[7];
+    inv[1] = M[2]*M[7] - M[1]*M[8];
+    inv[2] = M[1]*M[5] - M[2]*M[4];
+    inv[3] = M[5]*M[6] - M[3]*M[8];
+    inv[4] = M[0]*M[8] - M[2]*M[6];
+    inv[5] = M[2]*M[3] - M[0]*M[5];
+    inv[6] = M[3]*M[7] - M[4]*M[6];
+    inv[7] = M[1]*M[6] - M[0]*M[7];
+    inv[8] = M[0]*M[4] - M[1]*M[3];
+    double det = M[0]*inv[0] + M[1]*inv[3] + M[2]*inv[6];
+    if (fabs(det) < 1e-300) {
+        return false;
+    }
+    for (int i=0; i<9; i++) {
+        inv[i] /= det;
+    }
+    return true;
+}
+
+// Gauss-Newton normal equations J^T J and J^T r, split into camera
+// blocks U, point blocks V and the coupling blocks W.
+struct NormalEquations {
+    std::vector<double> U;   // n_cams x 16 x 16
+    std::vector<double> gc;  // n_cams x 16
+    std::vector<double> V;   // n_points x 3 x 3
+    std::vector<double> gp;  // n_points x 3
+    std::vector<double> W;   // n_pairs x 16 x 3
+};
+
+static void build_normal_equations(const Problem& pb, const State& s, unsigned int n_pairs,
+                                   NormalEquations& ne) {
+    const unsigned int NC = N_CAM_PARAMS;
+    ne.U.assign(s.cams.size()*NC*NC, 0.0);
+    ne.gc.assign(s.cams.size()*NC, 0.0);
+    unsigned int n_points = pb.refine_points ? s.points.size() : 0;
+    ne.V.assign(n_points*9, 0.0);
+    ne.gp.assign(n_points*3, 0.0);
+    ne.W.assign(pb.refine_points ? n_pairs*NC*3 : 0, 0.0);
+
+    for (unsigned int i=0; i<pb.obs.size(); i++) {
+        const Evaluation& e = s.eval[i];
+        if (!e.valid) {
+            continue;
+        }
+        const Observation& o = pb.obs[i];
+        double* U = &ne.U[o.camera*NC*NC];
+        double* gc = &ne.gc[o.camera*NC];
+        for (unsigned int a=0; a<NC; a++) {
+            for (unsigned int b=a; b<NC; b++) {
+                U[a*NC+b] += e.Jc[0][a]*e.Jc[0][b] + e.Jc[1][a]*e.Jc[1][b];
+            }
+            gc[a] += e.Jc[0][a]*e.r[0] + e.Jc[1][a]*e.r[1];
+        }
+        if (!pb.refine_points) {
+            continue;
+        }
+        double* V = &ne.V[o.point*9];
+        double* gp = &ne.gp[o.point*3];
+        double* W = &ne.W[o.pair*NC*3];
+        for (unsigned int a=0; a<3; a++) {
+            for (unsigned int b=0; b<3; b++) {
+                V[a*3+b] += e.Jx[0][a]*e.Jx[0][b] + e.Jx[1][a]*e.Jx[1][b];
+            }
+            gp[a] += e.Jx[0][a]*e.r[0] + e.Jx[1][a]*e.r[1];
+        }
+        for (unsigned int a=0; a<NC; a++) {
+            for (unsigned int b=0; b<3; b++) {
+                W[a*3+b] += e.Jc[0][a]*e.Jx[0][b] + e.Jc[1][a]*e.Jx[1][b];
+            }
+        }
+    }
+    // mirror the upper triangles
+    for (unsigned int c=0; c<s.cams.size(); c++) {
+        double* U = &ne.U[c*NC*NC];
+        for (unsigned int a=0; a<NC; a++) {
+            for (unsigned int b=0; b<a; b++) {
+                U[a*NC+b] = U[b*NC+a];
+            }
+        }
+    }
+    for (unsigned int p=0; p<n_points; p++) {
+        for (unsigned int a=0; a<3; a++) {
+            ne.V[p*9+a*4] += pb.point_weight;
+            ne.gp[p*3+a] += pb.point_weight*(s.points[p][a] - pb.points0[p][a]);
+        }
+    }
+}
+
+// Marquardt damping; parameters without information stay put
+static void damp(double* A, unsigned int n, double lambda) {
+    for (unsigned int i=0; i<n; i++) {
+        double& d = A[i*n+i];
+        if (d <= 0.0) {
+            d = 1.0;
+        } else {
+            d *= 1.0 + lambda;
+        }
+    }
+}
+
+// Damped step for all cameras (dc) and points (dp). The points are
+// eliminated first: S = U - W V^-1 W^T couples only cameras that share
+// a point.
+static bool solve_step(const Problem& pb, const NormalEquations& ne, unsigned int n_cams,
+                       const std::vector<std::pair<unsigned int, unsigned int> >& pairs,
+                       const std::vector<std::vector<unsigned int> >& point_pairs,
+                       double lambda, std::vector<double>& dc, std::vector<double>& dp) {
+    const unsigned int NC = N_CAM_PARAMS;
+    dc.assign(n_cams*NC, 0.0);
+
+    if (!pb.refine_points) {
+        // block diagonal: every camera on its own
+        std::vector<double> A(NC*NC), b(NC);
+        for (unsigned int c=0; c<n_cams; c++) {
+            std::copy(&ne.U[c*NC*NC], &ne.U[(c+1)*NC*NC], A.begin());
+            damp(&A[0], NC, lambda);
+            for (unsigned int a=0; a<NC; a++) {
+                b[a] = -ne.gc[c*NC+a];
+            }
+            if (!cholesky_solve(A, b, NC)) {
+                return false;
+            }
+            std::copy(b.begin(), b.end(), &dc[c*NC]);
+        }
+        dp.clear();
+        return true;
+    }
+
+    const unsigned int n = n_cams*NC;
+    const unsigned int n_points = point_pairs.size();
+    std::vector<double> S(n*n, 0.0);
+    std::vector<double> rhs(n);
+    for (unsigned int c=0; c<n_cams; c++) {
+        std::vector<double> A(&ne.U[c*NC*NC], &ne.U[(c+1)*NC*NC]);
+        damp(&A[0], NC, lambda);
+        for (unsigned int a=0; a<NC; a++) {
+            for (unsigned int b=0; b<NC; b++) {
+                S[(c*NC+a)*n + c*NC+b] = A[a*NC+b];
+            }
+            rhs[c*NC+a] = -ne.gc[c*NC+a];
+        }
+    }
+
+    std::vector<double> Vinv(n_points*9);
+    std::vector<double> WVinv(pairs.size()*NC*3);
+    for (unsigned int p=0; p<n_points; p++) {
+        double V[9];
+        std::copy(&ne.V[p*9], &ne.V[p*9+9], V);
+        damp(V, 3, lambda);
+        if (!invert3(V, &Vinv[p*9])) {
+            return false;
+        }
+        const std::vector<unsigned int>& pp = point_pairs[p];
+        for (unsigned int k=0; k<pp.size(); k++) {
+            const double* W = &ne.W[pp[k]*NC*3];
+            double* WV = &WVinv[pp[k]*NC*3];
+            for (unsigned int a=0; a<NC; a++) {
+                for (unsigned int b=0; b<3; b++) {
+                    WV[a*3+b] = W[a*3]*Vinv[p*9+b] + W[a*3+1]*Vinv[p*9+3+b] + W[a*3+2]*Vinv[p*9+6+b];
+                }
+            }
+        }
+        for (unsigned int k=0; k<pp.size(); k++) {
+            unsigned int ci = pairs[pp[k]].first;
+            const double* WV = &WVinv[pp[k]*NC*3];
+            for (unsigned int a=0; a<NC; a++) {
+                rhs[ci*NC+a] += WV[a*3]*ne.gp[p*3] + WV[a*3+1]*ne.gp[p*3+1] + WV[a*3+2]*ne.gp[p*3+2];
+            }
+            for (unsigned int l=0; l<pp.size(); l++) {
+                unsigned int cj = pairs[pp[l]].first;
+                const double* Wj = &ne.W[pp[l]*NC*3];
+                for (unsigned int a=0; a<NC; a++) {
+                    double* row = &S[(ci*NC+a)*n + cj*NC];
+                    for (unsigned int b=0; b<NC; b++) {
+                        row[b] -= WV[a*3]*Wj[b*3] + WV[a*3+1]*Wj[b*3+1] + WV[a*3+2]*Wj[b*3+2];
+                    }
+                }
+            }
+        }
+    }
+
+    if (!cholesky_solve(S, rhs, n)) {
+        return false;
+    }
+    dc = rhs;
+
+    // back substitute: dp = V^-1 (-gp - W^T dc)
+    dp.assign(n_points*3, 0.0);
+    for (unsigned int p=0; p<n_points; p++) {
+        double b[3] = { -ne.gp[p*3], -ne.gp[p*3+1], -ne.gp[p*3+2] };
+        const std::vector<unsigned int>& pp = point_pairs[p];
+        for (unsigned int k=0; k<pp.size(); k++) {
+            const double* W = &ne.W[pp[k]*NC*3];
+            const double* d = &dc[pairs[pp[k]].first*NC];
+            for (unsigned int a=0; a<NC; a++) {
+                b[0] -= W[a*3]*d[a];
+                b[1] -= W[a*3+1]*d[a];
+                b[2] -= W[a*3+2]*d[a];
+            }
+        }
+        for (unsigned int a=0; a<3; a++) {
+            dp[p*3+a] = Vinv[p*9+a*3]*b[0] + Vinv[p*9+a*3+1]*b[1] + Vinv[p*9+a*3+2]*b[2];
+        }
+    }
+    return true;
+}
+
+RefinementResult refine_cameras(std::vector<CameraModel>& cameras, KeyPointMap& key_points,
+                                const std::vector<KeyPointObservation>& observations,
+                                const RefinementOptions& options) {
+    PROFILE_ZONE("refine cameras");
+    osg::Timer timer;
+    osg::Timer_t start = timer.tick();
+
+    Problem pb;
+    State s;
+    std::map<std::string, unsigned int> point_index;
+    std::vector<std::string> point_names;
+    for (KeyPointMap::const_iterator it=key_points.begin(); it!=key_points.end(); ++it) {
+        point_index[it->first] = point_names.size();
+        point_names.push_back(it->first);
+        pb.points0.push_back(it->second);
+    }
+    s.points = pb.points0;
+    for (unsigned int c=0; c<cameras.size(); c++) {
+        s.cams.push_back(to_params(cameras[c]));
+    }
+
+    std::map<std::pair<unsigned int, unsigned int>, unsigned int> pair_index;
+    std::vector<std::pair<unsigned int, unsigned int> > pairs;
+    std::vector<std::vector<unsigned int> > point_pairs(point_names.size());
+    for (unsigned int i=0; i<observations.size(); i++) {
+        const KeyPointObservation& ko = observations[i];
+        if (ko.camera >= cameras.size()) {
+            std::ostringstream os;
+            os << "observation of unknown camera " << ko.camera;
+            throw std::runtime_error(os.str());
+        }
+        std::map<std::string, unsigned int>::const_iterator pt = point_index.find(ko.key_point);
+        if (pt==point_index.end()) {
+            throw std::runtime_error("observation of unknown key point \"" + ko.key_point + "\"");
+        }
+        Observation o;
+        o.camera = ko.camera;
+        o.point = pt->second;
+        o.uv[0] = ko.uv[0];
+        o.uv[1] = ko.uv[1];
+        std::pair<unsigned int, unsigned int> key(o.camera, o.point);
+        std::map<std::pair<unsigned int, unsigned int>, unsigned int>::iterator pi = pair_index.find(key);
+        if (pi==pair_index.end()) {
+            pi = pair_index.insert(std::make_pair(key, (unsigned int)pairs.size())).first;
+            point_pairs[o.point].push_back(pairs.size());
+            pairs.push_back(key);
+        }
+        o.pair = pi->second;
+        pb.obs.push_back(o);
+    }
+
+    for (int k=0; k<N_CAM_PARAMS; k++) {
+        if (k < P_DISTORTION) {
+            pb.mask[k] = options.refine_intrinsics;
+        } else if (k < P_ROTATION) {
+            pb.mask[k] = options.refine_distortion;
+        } else {
+            pb.mask[k] = options.refine_extrinsics;
+        }
+    }
+    pb.refine_points = options.refine_key_points;
+    pb.point_weight = 1.0/(options.key_point_sigma*options.key_point_sigma);
+
+    unsigned int n_threads = options.n_threads;
+    if (n_threads==0) {
+        n_threads = std::max(1, OpenThreads::GetNumberOfProcessors());
+    }
+    n_threads = std::min(n_threads, (unsigned int)pb.obs.size()/MIN_OBSERVATIONS_PER_THREAD);
+    // started once, every iteration evaluates at least once
+    EvaluationPool* pool = n_threads > 1 ? new EvaluationPool(pb, n_threads) : NULL;
+
+    RefinementResult result;
+    result.iterations = 0;
+    result.n_observations = pb.obs.size();
+    result.converged = false;
+
+    // squared reprojection error of each observation, -1 behind the camera
+    std::vector<double> initial_error(pb.obs.size());
+    try {
+        evaluate(pb, s, pool);
+        for (unsigned int i=0; i<s.eval.size(); i++) {
+            const Evaluation& e = s.eval[i];
+            initial_error[i] = e.valid ? e.r[0]*e.r[0] + e.r[1]*e.r[1] : -1.0;
+        }
+
+        NormalEquations ne;
+        std::vector<double> dc, dp;
+        State trial;
+        double lambda = 1e-3;
+        bool stalled = false;
+        while (result.iterations < options.max_iterations && !result.converged && !stalled) {
+            result.iterations++;
+            build_normal_equations(pb, s, pairs.size(), ne);
+
+            bool accepted = false;
+            while (!accepted) {
+                if (lambda > 1e12) {
+                    // no downhill step left, which is not convergence
+                    stalled = true;
+                    break;
+                }
+                if (!solve_step(pb, ne, s.cams.size(), pairs, point_pairs, lambda, dc, dp)) {
+                    lambda *= 10.0;
+                    continue;
+                }
+                trial.cams = s.cams;
+                trial.points = s.points;
+                for (unsigned int c=0; c<trial.cams.size(); c++) {
+                    apply_update(&dc[c*N_CAM_PARAMS], trial.cams[c]);
+                }
+                for (unsigned int p=0; p<dp.size()/3; p++) {
+                    trial.points[p] += osg::Vec3d(dp[p*3], dp[p*3+1], dp[p*3+2]);
+                }
+                evaluate(pb, trial, pool);
+                // the cost leaves out observations behind their camera, so a
+                // step losing one is no improvement however low its cost
+                if (trial.n_valid >= s.n_valid && trial.cost < s.cost) {
+                    double improvement = (s.cost - trial.cost)/s.cost;
+                    std::swap(s, trial);
+                    accepted = true;
+                    lambda = std::max(lambda*0.1, 1e-12);
+                    if (improvement < options.tolerance) {
+                        result.converged = true;
+                    }
+                } else {
+                    lambda *= 10.0;
+                }
+            }
+        }
+    } catch (...) {
+        delete pool;
+        throw;
+    }
+    delete pool;
+
+    for (unsigned int c=0; c<cameras.size(); c++) {
+        from_params(s.cams[c], cameras[c]);
+    }
+    if (pb.refine_points) {
+        for (unsigned int p=0; p<point_names.size(); p++) {
+            key_points[point_names[p]] = s.points[p];
+        }
+    }
+
+    // report the reprojection error alone, without the key point prior,
+    // and over the same observations before and after
+    double initial_sum = 0.0, final_sum = 0.0;
+    result.n_measured = 0;
+    for (unsigned int i=0; i<s.eval.size(); i++) {
+        const Evaluation& e = s.eval[i];
+        if (e.valid && initial_error[i] >= 0.0) {
+            initial_sum += initial_error[i];
+            final_sum += e.r[0]*e.r[0] + e.r[1]*e.r[1];
+            result.n_measured++;
+        }
+    }
+    result.initial_rms = result.n_measured ? sqrt(initial_sum/result.n_measured) : 0.0;
+    result.final_rms = result.n_measured ? sqrt(final_sum/result.n_measured) : 0.0;
+    result.seconds = timer.delta_s(start, timer.tick());
+    return result;
+}
+
+std::vector<KeyPointObservation> load_observations(const char* fname) {
+    std::ifstream in(fname);
+    if (!in) {
+        std::ostringstream os;
+        os << "Could not open observation file " << fname;
+        throw std::ios_base::failure(os.str());
+    }
+    std::vector<KeyPointObservation> result;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0]=='#') {
+            continue;
+        }
+        std::istringstream ls(line);
+        KeyPointObservation o;
+        double u, v;
+        if (!(ls >> o.camera >> o.key_point >> u >> v)) {
+            throw std::runtime_error("Error parsing observations: expected \"camera key_point u v\"");
+        }
+        o.uv.set(u, v);
+        result.push_back(o);
+    }
+    return result;
+}
+
+std::ostream& operator<<(std::ostream& os, const RefinementResult& result) {
+    os << result.n_observations << " observations";
+    if (result.n_measured != result.n_observations) {
+        os << " (" << result.n_observations - result.n_measured << " behind their camera)";
+    }
+    os << ", rms error " << result.initial_rms
+       << " -> " << result.final_rms << " pixels in " << result.iterations << " iterations ("
+       << (result.converged ? "converged" : "not converged") << "), "
+       << result.seconds << " sec";
+    return os;
+}
+
+// ---- benchmark ---------------------------------------------------
+
+void benchmark_refinement(unsigned int n_cameras, unsigned int n_threads, std::ostream& os) {
+    const unsigned int n_points = 400;
+    const unsigned int width = 800, height = 600;
+
+    // key points in a cube, LCG for the same rig on every platform
+    unsigned int seed = 1;
+    KeyPointMap key_points;
+    for (unsigned int i=0; i<n_points; i++) {
+        double xyz[3];
+        for (int k=0; k<3; k++) {
+            seed = seed*1664525u + 1013904223u;
+            xyz[k] = 2.0*(seed >> 8)/(double)(1u << 24) - 1.0;
+        }
+        std::ostringstream name;
+        name << "p" << i;
+        key_points[name.str()] = osg::Vec3(xyz[0], xyz[1], xyz[2]);
+    }
+
+    // a ring of cameras looking at the cube, and a guess of each that
+    // is off by a few centimeters, a few mrad and 1% in focal length
+    std::vector<CameraModel> truth, cameras;
+    std::vector<KeyPointObservation> observations;
+    for (unsigned int c=0; c<n_cameras; c++) {
+        double a = 2.0*osg::PI*c/n_cameras;
+        osg::Vec3d eye(4.0*cos(a), 4.0*sin(a), 0.5 + 0.5*sin(3.0*a));
+        CameraModel cam(width, height);
+        cam.set_intrinsic(600.0, 0.0, width/2.0, 600.0, height/2.0);
+        cam.set_extrinsic(eye, osg::Vec3d(0.0, 0.0, 0.0), osg::Vec3d(0.0, 0.0, 1.0));
+        truth.push_back(cam);
+
+        for (KeyPointMap::const_iterator it=key_points.begin(); it!=key_points.end(); ++it) {
+            osg::Vec2d uv = cam.project_3d_to_pixel(osg::Vec3d(it->second));
+            if (uv[0] >= 0.0 && uv[0] < width && uv[1] >= 0.0 && uv[1] < height) {
+                observations.push_back(KeyPointObservation(c, it->first, osg::Vec2(uv[0], uv[1])));
+            }
+        }
+
+        double s = (c%3) - 1.0;
+        cam.set_intrinsic(606.0, 0.0, width/2.0, 606.0, height/2.0);
+        cam.set_extrinsic(eye + osg::Vec3d(0.03*s, -0.02, 0.01*s), osg::Vec3d(0.01, 0.01*s, 0.0),
+                          osg::Vec3d(0.0, 0.0, 1.0));
+        cameras.push_back(cam);
+    }
+
+    RefinementOptions options;
+    options.refine_distortion = false;
+    os << "camera refinement, " << n_cameras << " cameras:" << std::endl;
+    std::vector<CameraModel> refined = cameras;
+    options.n_threads = 1;
+    os << "  1 thread:  " << refine_cameras(refined, key_points, observations, options) << std::endl;
+    refined = cameras;
+    options.n_threads = n_threads;
+    os << "  " << (n_threads ? n_threads : OpenThreads::GetNumberOfProcessors()) << " threads: "
+       << refine_cameras(refined, key_points, observations, options) << std::endl;
+}
@@ -0,0 +1,81 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef CAMERA_REFINEMENT_H
+#define CAMERA_REFINEMENT_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+#include <osg/Vec2>
+
+#include "DisplaySurfaceGeometry.h"
+#include "camera_model.h"
+
+// A key point (see DisplaySurfaceGeometry::get_key_points()) seen by
+// one camera, e.g. clicked or detected in its image.
+struct KeyPointObservation {
+    KeyPointObservation() : camera(0) {}
+    KeyPointObservation(unsigned int c, const std::string& name, osg::Vec2 p) :
+        camera(c), key_point(name), uv(p) {}
+    unsigned int camera;    // index into the cameras being refined
+    std::string key_point;  // name in the KeyPointMap
+    osg::Vec2 uv;           // distorted pixel, in the camera's row convention
+};
+
+struct RefinementOptions {
+    RefinementOptions() :
+        refine_intrinsics(true), refine_distortion(true), refine_extrinsics(true),
+        refine_key_points(false), key_point_sigma(0.01),
+        max_iterations(100), tolerance(1e-10), n_threads(0) {}
+    bool refine_intrinsics;
+    bool refine_distortion;
+    bool refine_extrinsics;
+    // Also move the key points. They are held near their surveyed
+    // positions with this standard deviation (world units, against a
+    // one pixel observation error), which also fixes the gauge.
+    bool refine_key_points;
+    double key_point_sigma;
+    unsigned int max_iterations;
+    double tolerance;       // stop when the cost improves by less than this fraction
+    unsigned int n_threads; // 0: one per processor
+};
+
+struct RefinementResult {
+    unsigned int iterations;
+    unsigned int n_observations;
+    // both errors are over the observations in front of their camera
+    // before and after the refinement
+    unsigned int n_measured;
+    double initial_rms;     // pixels
+    double final_rms;
+    bool converged;         // false also when no step lowered the cost
+    double seconds;
+};
+
+// Levenberg-Marquardt refinement of K, distortion, rotation and
+// translation of every camera against 2D observations of the key
+// points. Jacobians are analytic. When key points are refined too, they
+// are eliminated with the Schur complement so that only the reduced
+// camera system is factored; otherwise each camera's block is solved
+// on its own. Residuals and Jacobians are evaluated on n_threads
+// threads. A step that moves a key point behind a camera that saw it
+// is rejected, it would only lower the cost by dropping a residual.
+//
+// cameras (and key_points, if refined) are updated in place. Throws
+// std::runtime_error for observations of unknown cameras or key points.
+RefinementResult refine_cameras(std::vector<CameraModel>& cameras, KeyPointMap& key_points,
+                                const std::vector<KeyPointObservation>& observations,
+                                const RefinementOptions& options=RefinementOptions());
+
+// one observation per line: "camera key_point u v", key point names
+// may not contain spaces
+std::vector<KeyPointObservation> load_observations(const char* fname);
+
+std::ostream& operator<<(std::ostream& os, const RefinementResult& result);
+
+// Refines a synthetic ring of n_cameras cameras around 400 key points,
+// from perturbed intrinsics and poses, on one thread and on n_threads
+// (0: one per processor), and prints both results with their wall time.
+void benchmark_refinement(unsigned int n_cameras, unsigned int n_threads, std::ostream& os);
+
+#endif
@@ -0,0 +1,53 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include "clip_planes.h"
+
+#include <algorithm>
+
+// slack so the surface is not clipped by rounding
+#define DEPTH_MARGIN 0.01
+
+bool surface_near_far(DisplaySurfaceGeometry& geom, const CameraModel& cam,
+                      float& znear, float& zfar, float min_near_ratio) {
+    osg::Vec3 eye = cam.eye();
+    osg::Vec3 dir = cam.center() - eye;
+    dir.normalize();
+
+    double dmin, dmax;
+    geom.get_depth_range(eye, dir, dmin, dmax);
+    if (dmax <= 0.0) {
+        return false;
+    }
+    double margin = DEPTH_MARGIN*(dmax - dmin) + 1e-6;
+    double zf = dmax + margin;
+    double zn = std::max(dmin - margin, zf*min_near_ratio);
+    znear = zn;
+    zfar = zf;
+    return true;
+}
+
+ClipPlaneCache::ClipPlaneCache(DisplaySurfaceGeometry* geom, float znear, float zfar) :
+    _geom(geom), _znear(znear), _zfar(zfar), _valid(false), _n_updates(0)
+{
+}
+
+bool ClipPlaneCache::update(const CameraModel& cam) {
+    osg::Quat orientation = cam.orientation();
+    osg::Vec3d position = cam.position();
+    if (_valid && orientation==_orientation && position==_position) {
+        return false;
+    }
+    _orientation = orientation;
+    _position = position;
+    _valid = true;
+
+    float znear = _znear;
+    float zfar = _zfar;
+    if (!surface_near_far(*_geom, cam, znear, zfar)) {
+        return false;
+    }
+    _n_updates++;
+    bool changed = znear!=_znear || zfar!=_zfar;
+    _znear = znear;
+    _zfar = zfar;
+    return changed;
+}
@@ -0,0 +1,43 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef CLIP_PLANES_H
+#define CLIP_PLANES_H
+
+#include "DisplaySurfaceGeometry.h"
+#include "camera_model.h"
+
+// Tightest near and far planes containing the whole display surface,
+// from its analytic bounds in the camera's eye space. znear is kept at
+// least zfar*min_near_ratio when the camera is inside the surface.
+// Returns false, leaving znear and zfar alone, if the surface is
+// entirely behind the camera.
+bool surface_near_far(DisplaySurfaceGeometry& geom, const CameraModel& cam,
+                      float& znear, float& zfar, float min_near_ratio=1e-3f);
+
+// Caches surface_near_far() for one camera, so the planes are only
+// recomputed when its extrinsics or the surface change. This replaces
+// OSG's per frame near/far computation, which walks the scene graph.
+class ClipPlaneCache {
+public:
+    ClipPlaneCache(DisplaySurfaceGeometry* geom, float znear=0.1f, float zfar=10.0f);
+
+    // the surface was replaced or recalibrated
+    void set_surface(DisplaySurfaceGeometry* geom) { _geom = geom; _valid = false; }
+
+    // returns true if the planes changed since the last call
+    bool update(const CameraModel& cam);
+
+    float znear() const { return _znear; }
+    float zfar() const { return _zfar; }
+    unsigned int n_updates() const { return _n_updates; }
+
+private:
+    DisplaySurfaceGeometry* _geom;
+    float _znear;
+    float _zfar;
+    bool _valid;
+    osg::Quat _orientation;
+    osg::Vec3d _position;
+    unsigned int _n_updates;
+};
+
+#endif
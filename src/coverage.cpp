@@ -0,0 +1,332 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include "coverage.h"
+#include "clip_planes.h"
+#include "surface_culling.h"
+#include "profiler.h"
+
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Thread>
+
+#include <osg/Timer>
+
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <stdexcept>
+#include <sstream>
+
+std::ostream& operator<<(std::ostream& os, const CoverageStats& stats) {
+    os << stats.n_samples << " samples x " << stats.n_cameras << " cameras in " << stats.seconds << " sec ("
+       << stats.tests_per_sample << " tests/sample): "
+       << 100.0*stats.covered << "% covered, " << 100.0*stats.overlapped << "% overlapped, up to "
+       << stats.max_count << " cameras, " << stats.n_holes << " holes, resolution "
+       << stats.min_resolution << " px/mm min, " << stats.mean_resolution << " mean";
+    return os;
+}
+
+// A camera as the inner loop needs it.
+struct CoverageCamera {
+    const CameraModel* cam;
+    double R[9], t[3];
+    double center[3];
+    double focal;       // sqrt(fx*fy)
+};
+
+class CoverageAnalysis {
+public:
+    CoverageAnalysis(DisplaySurfaceGeometry& geom, const std::vector<CameraModel>& cameras,
+                     const CoverageOptions& options, CoverageMaps& maps);
+    unsigned long long run();
+
+private:
+    friend class CoverageWorker;
+
+    bool next_chunk(unsigned int& index);
+    // returns the number of camera tests
+    unsigned long long run_chunk(unsigned int index, std::vector<unsigned int>& camera_samples,
+                                 std::vector<double>& tc, std::vector<double>& xyz,
+                                 std::vector<double>& normals, std::vector<double>& uv);
+    void finish(const std::vector<unsigned int>& camera_samples, unsigned long long n_tests);
+
+    DisplaySurfaceGeometry& _geom;
+    const CoverageOptions& _options;
+    CoverageMaps& _maps;
+    std::vector<CoverageCamera> _cameras;
+    std::vector<SurfaceChunk> _chunks;
+    std::vector<std::vector<unsigned int> > _chunk_cameras;
+
+    OpenThreads::Mutex _mutex;
+    unsigned int _next_chunk;
+    unsigned long long _n_tests;
+};
+
+class CoverageWorker : public OpenThreads::Thread {
+public:
+    CoverageWorker(CoverageAnalysis* analysis) : _analysis(analysis) {}
+
+    virtual void run() {
+        std::vector<unsigned int> camera_samples(_analysis->_cameras.size(), 0);
+        std::vector<double> tc, xyz, normals, uv;
+        unsigned long long n_tests = 0;
+        unsigned int index;
+        while (_analysis->next_chunk(index)) {
+            n_tests += _analysis->run_chunk(index, camera_samples, tc, xyz, normals, uv);
+        }
+        _analysis->finish(camera_samples, n_tests);
+    }
+
+private:
+    CoverageAnalysis* _analysis;
+};
+
+CoverageAnalysis::CoverageAnalysis(DisplaySurfaceGeometry& geom, const std::vector<CameraModel>& cameras,
+                                   const CoverageOptions& options, CoverageMaps& maps) :
+    _geom(geom), _options(options), _maps(maps), _next_chunk(0), _n_tests(0)
+{
+    PROFILE_ZONE("coverage index");
+    _chunks = geom.make_chunks(options.chunks_u, options.chunks_v);
+    _chunk_cameras.resize(_chunks.size());
+    for (unsigned int k=0; k<cameras.size(); k++) {
+        CoverageCamera c;
+        c.cam = &cameras[k];
+        cameras[k].get_Rt(c.R, c.t);
+        for (int i=0; i<3; i++) {
+            c.center[i] = -(c.R[i]*c.t[0] + c.R[3+i]*c.t[1] + c.R[6+i]*c.t[2]);
+        }
+        double K00, K01, K02, K11, K12;
+        cameras[k].get_intrinsic(K00, K01, K02, K11, K12);
+        c.focal = sqrt(fabs(K00*K11));
+        _cameras.push_back(c);
+
+        // a camera the surface is entirely behind sees nothing
+        float znear = 0.1f, zfar = 10.0f;
+        if (!surface_near_far(geom, cameras[k], znear, zfar)) {
+            continue;
+        }
+        std::vector<unsigned int> visible = cull_chunks(_chunks, cameras[k].frustum(znear, zfar));
+        for (unsigned int i=0; i<visible.size(); i++) {
+            _chunk_cameras[visible[i]].push_back(k);
+        }
+    }
+}
+
+bool CoverageAnalysis::next_chunk(unsigned int& index) {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    if (_next_chunk >= _chunks.size()) {
+        return false;
+    }
+    index = _next_chunk++;
+    return true;
+}
+
+unsigned long long CoverageAnalysis::run_chunk(unsigned int index, std::vector<unsigned int>& camera_samples,
+                                               std::vector<double>& tc, std::vector<double>& xyz,
+                                               std::vector<double>& normals, std::vector<double>& uv) {
+    const std::vector<unsigned int>& candidates = _chunk_cameras[index];
+    if (candidates.empty()) {
+        return 0;
+    }
+    // the samples whose centers fall in the chunk, chunks are row major
+    const unsigned int cu = index % _options.chunks_u, cv = index / _options.chunks_u;
+    const unsigned int i0 = (cu*_maps.n_u + _options.chunks_u/2)/_options.chunks_u;
+    const unsigned int i1 = ((cu+1)*_maps.n_u + _options.chunks_u/2)/_options.chunks_u;
+    const unsigned int j0 = (cv*_maps.n_v + _options.chunks_v/2)/_options.chunks_v;
+    const unsigned int j1 = ((cv+1)*_maps.n_v + _options.chunks_v/2)/_options.chunks_v;
+    const unsigned int n = (i1-i0)*(j1-j0);
+    if (n == 0) {
+        return 0;
+    }
+    tc.resize(2*n);
+    xyz.resize(3*n);
+    normals.resize(3*n);
+    uv.resize(2*n);
+    for (unsigned int j=j0, s=0; j<j1; j++) {
+        for (unsigned int i=i0; i<i1; i++, s++) {
+            tc[2*s] = (i + 0.5)/_maps.n_u;
+            tc[2*s+1] = (j + 0.5)/_maps.n_v;
+        }
+    }
+    _geom.texcoord2worldcoord(&tc[0], n, &xyz[0]);
+    _geom.texcoord2normal(&tc[0], n, &normals[0]);
+
+    // pixels per world unit, squared, to pixels per mm
+    const double mm2 = _options.units_per_mm*_options.units_per_mm;
+    unsigned long long n_tests = 0;
+    for (unsigned int c=0; c<candidates.size(); c++) {
+        const CoverageCamera& cam = _cameras[candidates[c]];
+        const double w = cam.cam->width(), h = cam.cam->height();
+        cam.cam->project_3d_to_pixel(&xyz[0], n, &uv[0]);
+        n_tests += n;
+        for (unsigned int s=0; s<n; s++) {
+            const double* p = &xyz[3*s];
+            double depth = cam.R[6]*p[0] + cam.R[7]*p[1] + cam.R[8]*p[2] + cam.t[2];
+            if (depth <= 0.0 || uv[2*s] < -0.5 || uv[2*s] >= w - 0.5 ||
+                uv[2*s+1] < -0.5 || uv[2*s+1] >= h - 0.5) {
+                continue;
+            }
+            osg::Vec3d dir(p[0] - cam.center[0], p[1] - cam.center[1], p[2] - cam.center[2]);
+            double t_hit;
+            osg::Vec2 tc_hit;
+            if (!_geom.intersect(osg::Vec3d(cam.center[0], cam.center[1], cam.center[2]), dir, t_hit, tc_hit) ||
+                t_hit < 1.0 - 1e-6) {
+                continue; // occluded by the surface itself
+            }
+
+            const unsigned int i = i0 + s % (i1-i0), j = j0 + s / (i1-i0);
+            const size_t idx = (size_t)j*_maps.n_u + i;
+            _maps.count[idx]++;
+            camera_samples[candidates[c]]++;
+            // image area per surface area is f^2 (n.(c-p))/depth^3
+            const double* nrm = &normals[3*s];
+            double facing = fabs(nrm[0]*dir[0] + nrm[1]*dir[1] + nrm[2]*dir[2]);
+            float res = cam.focal*sqrt(facing*mm2/depth)/depth;
+            _maps.resolution[idx] = std::max(_maps.resolution[idx], res);
+        }
+    }
+    return n_tests;
+}
+
+void CoverageAnalysis::finish(const std::vector<unsigned int>& camera_samples, unsigned long long n_tests) {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    for (unsigned int k=0; k<camera_samples.size(); k++) {
+        _maps.camera_samples[k] += camera_samples[k];
+    }
+    _n_tests += n_tests;
+}
+
+unsigned long long CoverageAnalysis::run() {
+    unsigned int n_threads = _options.n_threads;
+    if (n_threads==0) {
+        n_threads = std::max(1, OpenThreads::GetNumberOfProcessors());
+    }
+    n_threads = std::max(1u, std::min(n_threads, (unsigned int)_chunks.size()));
+    std::vector<CoverageWorker*> workers;
+    for (unsigned int i=0; i<n_threads; i++) {
+        workers.push_back(new CoverageWorker(this));
+        workers.back()->start();
+    }
+    for (unsigned int i=0; i<workers.size(); i++) {
+        workers[i]->join();
+        delete workers[i];
+    }
+    return _n_tests;
+}
+
+// Connected regions of unseen samples, 4-neighbours, wrapping around
+// in u where the surface closes.
+static unsigned int count_holes(const CoverageMaps& maps) {
+    const unsigned int n_u = maps.n_u, n_v = maps.n_v;
+    std::vector<unsigned char> seen(maps.count.size(), 0);
+    std::vector<size_t> stack;
+    unsigned int n_holes = 0;
+    for (size_t start=0; start<maps.count.size(); start++) {
+        if (maps.count[start]!=0 || seen[start]) {
+            continue;
+        }
+        n_holes++;
+        seen[start] = 1;
+        stack.push_back(start);
+        while (!stack.empty()) {
+            size_t idx = stack.back();
+            stack.pop_back();
+            unsigned int i = idx % n_u, j = idx / n_u;
+            size_t neighbours[4] = { (size_t)j*n_u + (i+1)%n_u, (size_t)j*n_u + (i+n_u-1)%n_u,
+                                     j+1<n_v ? idx + n_u : idx, j>0 ? idx - n_u : idx };
+            for (int k=0; k<4; k++) {
+                size_t nb = neighbours[k];
+                if (maps.count[nb]==0 && !seen[nb]) {
+                    seen[nb] = 1;
+                    stack.push_back(nb);
+                }
+            }
+        }
+    }
+    return n_holes;
+}
+
+CoverageStats analyze_coverage(DisplaySurfaceGeometry& geom, const std::vector<CameraModel>& cameras,
+                               const CoverageOptions& options, CoverageMaps& maps) {
+    PROFILE_ZONE("coverage");
+    if (options.n_u==0 || options.n_v==0 || options.chunks_u==0 || options.chunks_v==0) {
+        throw std::runtime_error("coverage needs at least one sample and chunk");
+    }
+    osg::Timer_t start = osg::Timer::instance()->tick();
+    maps.n_u = options.n_u;
+    maps.n_v = options.n_v;
+    maps.count.assign((size_t)maps.n_u*maps.n_v, 0);
+    maps.resolution.assign((size_t)maps.n_u*maps.n_v, 0.0f);
+    maps.camera_samples.assign(cameras.size(), 0);
+
+    CoverageAnalysis analysis(geom, cameras, options, maps);
+    unsigned long long n_tests = analysis.run();
+
+    CoverageStats stats;
+    stats.n_samples = maps.count.size();
+    stats.n_cameras = cameras.size();
+    stats.max_count = 0;
+    stats.min_resolution = 0.0;
+    stats.mean_resolution = 0.0;
+    unsigned int n_covered = 0, n_overlapped = 0;
+    for (size_t i=0; i<maps.count.size(); i++) {
+        unsigned int c = maps.count[i];
+        stats.max_count = std::max(stats.max_count, c);
+        if (c==0) {
+            continue;
+        }
+        double res = maps.resolution[i];
+        stats.min_resolution = n_covered==0 ? res : std::min(stats.min_resolution, res);
+        stats.mean_resolution += res;
+        n_covered++;
+        if (c > 1) {
+            n_overlapped++;
+        }
+    }
+    stats.covered = n_covered/(double)stats.n_samples;
+    stats.overlapped = n_overlapped/(double)stats.n_samples;
+    stats.mean_resolution = n_covered > 0 ? stats.mean_resolution/n_covered : 0.0;
+    stats.n_holes = count_holes(maps);
+    stats.tests_per_sample = n_tests/(double)stats.n_samples;
+    stats.seconds = osg::Timer::instance()->delta_s(start, osg::Timer::instance()->tick());
+    return stats;
+}
+
+static FILE* open_output(const std::string& fname) {
+    FILE* f = fopen(fname.c_str(), "wb");
+    if (!f) {
+        std::ostringstream os;
+        os << "Could not open " << fname;
+        throw std::ios_base::failure(os.str());
+    }
+    return f;
+}
+
+void write_coverage_maps(const CoverageMaps& maps, const std::string& basename) {
+    std::vector<unsigned char> count(maps.count.size()), holes(maps.count.size());
+    // image rows start at the top, texcoord rows at v=0
+    for (unsigned int j=0; j<maps.n_v; j++) {
+        for (unsigned int i=0; i<maps.n_u; i++) {
+            size_t src = (size_t)j*maps.n_u + i;
+            size_t dst = (size_t)(maps.n_v - 1 - j)*maps.n_u + i;
+            count[dst] = std::min(maps.count[src], (unsigned short)255);
+            holes[dst] = maps.count[src]==0 ? 255 : 0;
+        }
+    }
+    FILE* f = open_output(basename + "_count.pgm");
+    fprintf(f, "P5\n%u %u\n255\n", maps.n_u, maps.n_v);
+    fwrite(&count[0], 1, count.size(), f);
+    fclose(f);
+
+    f = open_output(basename + "_holes.pgm");
+    fprintf(f, "P5\n%u %u\n255\n", maps.n_u, maps.n_v);
+    fwrite(&holes[0], 1, holes.size(), f);
+    fclose(f);
+
+    // PFM rows start at the bottom, like the texcoords
+    f = open_output(basename + "_resolution.pfm");
+    const unsigned short one = 1;
+    bool little_endian = *(const unsigned char*)&one==1;
+    fprintf(f, "Pf\n%u %u\n%s\n", maps.n_u, maps.n_v, little_endian ? "-1.0" : "1.0");
+    fwrite(&maps.resolution[0], sizeof(float), maps.resolution.size(), f);
+    fclose(f);
+}
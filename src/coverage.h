@@ -0,0 +1,62 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef COVERAGE_H
+#define COVERAGE_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+#include "DisplaySurfaceGeometry.h"
+#include "camera_model.h"
+
+struct CoverageOptions {
+    CoverageOptions() : n_u(1024), n_v(512), chunks_u(64), chunks_v(32),
+                        n_threads(0), units_per_mm(0.001) {}
+    unsigned int n_u;           // samples along each texcoord axis
+    unsigned int n_v;
+    unsigned int chunks_u;      // cells of the index of surface chunks
+    unsigned int chunks_v;      //   against camera frustums
+    unsigned int n_threads;     // 0: one per processor
+    double units_per_mm;        // world units in a millimetre
+};
+
+// Per sample maps on the n_u x n_v texcoord grid, sample (i, j) at
+// texcoord ((i+0.5)/n_u, (j+0.5)/n_v), row j at index j*n_u.
+struct CoverageMaps {
+    unsigned int n_u;
+    unsigned int n_v;
+    std::vector<unsigned short> count;          // cameras that see the sample
+    std::vector<float> resolution;              // best pixels per mm among them, 0 in holes
+    std::vector<unsigned int> camera_samples;   // samples seen by each camera
+};
+
+struct CoverageStats {
+    unsigned int n_samples;
+    unsigned int n_cameras;
+    double covered;             // fraction of samples seen at all
+    double overlapped;          // fraction seen by two or more cameras
+    unsigned int max_count;
+    double min_resolution;      // pixels per mm, over covered samples
+    double mean_resolution;
+    unsigned int n_holes;       // connected regions of unseen samples
+    double tests_per_sample;    // camera tests left by the index
+    double seconds;
+};
+
+std::ostream& operator<<(std::ostream& os, const CoverageStats& stats);
+
+// Which cameras see which part of the surface. A sample is seen by a
+// camera if it is in front of it, projects (with distortion) into its
+// image and the ray to it hits no surface first. The index culls
+// chunk bounds against every camera's frustum, so each sample is only
+// tested against cameras whose frustum reaches its chunk; chunks are
+// processed in parallel. Resolution is the pinhole estimate
+// sqrt(fx*fy*cos(incidence)*distance)/depth^1.5 per world unit.
+CoverageStats analyze_coverage(DisplaySurfaceGeometry& geom, const std::vector<CameraModel>& cameras,
+                               const CoverageOptions& options, CoverageMaps& maps);
+
+// basename_count.pgm (8 bit, saturating), basename_holes.pgm (255 in
+// holes) and basename_resolution.pfm, row j=0 at the bottom
+void write_coverage_maps(const CoverageMaps& maps, const std::string& basename);
+
+#endif
@@ -0,0 +1,232 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include "frame_pacer.h"
+#include "pose_predictor.h"
+#include "profiler.h"
+
+#include <osg/GL>
+#include <OpenThreads/Thread>
+
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <stdexcept>
+#include <sstream>
+
+double SystemFrameClock::now() {
+    return PosePredictor::now();
+}
+
+void SystemFrameClock::sleep_until(double t) {
+    double wait = t - now();
+    if (wait > 0.002) {
+        OpenThreads::Thread::microSleep((unsigned int)((wait - 0.001)*1e6));
+    }
+    while (now() < t) {
+    }
+}
+
+SimulatedVblankClock::SimulatedVblankClock(double period, double phase, double jitter, unsigned int seed) :
+    _period(period), _phase(phase), _jitter(jitter), _seed(seed), _now(phase)
+{
+}
+
+void SimulatedVblankClock::sleep_until(double t) {
+    _now = std::max(_now, t);
+}
+
+double SimulatedVblankClock::swap() {
+    _now = _phase + ceil((_now - _phase)/_period)*_period;
+    // LCG, deterministic across platforms unlike rand()
+    _seed = _seed*1664525u + 1013904223u;
+    double noise = (2.0*(_seed >> 8)/(double)(1u << 24) - 1.0)*_jitter;
+    return _now + noise;
+}
+
+unsigned int SimulatedVblankClock::n_vblanks() const {
+    return (unsigned int)floor((_now - _phase)/_period + 1e-9);
+}
+
+std::ostream& operator<<(std::ostream& os, const PacingStats& stats) {
+    os << stats.n_frames << " frames, " << stats.n_dropped << " dropped, period "
+       << stats.period*1e3 << " ms, present error " << stats.mean_error*1e6 << " us mean "
+       << stats.max_error*1e6 << " us max, slack " << stats.mean_slack*1e3 << " ms";
+    return os;
+}
+
+FramePacer::FramePacer(FrameClock* clock, double nominal_period, double margin) :
+    _clock(clock), _margin(margin), _period(nominal_period), _phase(0.0),
+    _n_presents(0), _last_index(0.0), _start(0.0), _predicted(0.0), _n_frames(0),
+    _log(DEFAULT_LOG_FRAMES)
+{
+}
+
+void FramePacer::set_log_size(unsigned int n_frames) {
+    if (n_frames == 0) {
+        throw std::invalid_argument("the frame log needs room for a frame");
+    }
+    std::vector<FrameTiming>(n_frames).swap(_log);
+    _n_frames = 0;
+}
+
+const FrameTiming& FramePacer::logged(unsigned int i) const {
+    return _log[(_n_frames - n_logged() + i) % _log.size()];
+}
+
+double FramePacer::next_vblank(double t) const {
+    return _phase + ceil((t - _phase)/_period - 1e-6)*_period;
+}
+
+double FramePacer::begin_frame() {
+    PROFILE_ZONE("pace frame");
+    double now = _clock->now();
+    if (_n_presents == 0) {
+        // nothing known of the display yet, start right away
+        _phase = now;
+        _predicted = now;
+        _start = now;
+        return now;
+    }
+    // Frames that took longer than a refresh were dropped anyway and
+    // would only start the next ones early. Starting more than a period
+    // ahead could present a frame a vblank early.
+    double render = 0.0;
+    for (unsigned int i=0; i<std::min(_n_presents, (unsigned int)WINDOW); i++) {
+        if (_render[i] < _period) {
+            render = std::max(render, _render[i]);
+        }
+    }
+    double budget = std::min(render + _margin, _period);
+    if (_n_presents < MIN_HISTORY) {
+        // too few render times to trust, take the whole refresh
+        budget = _period;
+    }
+    _predicted = next_vblank(now + budget);
+    _clock->sleep_until(_predicted - budget);
+    _start = _clock->now();
+    return _predicted;
+}
+
+void FramePacer::end_frame(double rendered, double achieved) {
+    FrameTiming& timing = _log[_n_frames % _log.size()];
+    timing.frame = _n_frames;
+    timing.start = _start;
+    timing.predicted = _predicted;
+    timing.rendered = rendered;
+    timing.achieved = achieved;
+    timing.dropped = 0;
+    // the first frame only finds the phase
+    double late = achieved - _predicted;
+    if (_n_presents > 0 && late > 0.5*_period) {
+        timing.dropped = (unsigned int)floor(late/_period + 0.5);
+    }
+    _n_frames++;
+
+    unsigned int slot = _n_presents % WINDOW;
+    double index = 0.0;
+    if (_n_presents > 0) {
+        double previous = _present[(_n_presents - 1) % WINDOW];
+        index = _last_index + std::max(1.0, floor((achieved - previous)/_period + 0.5));
+    }
+    _render[slot] = rendered - _start;
+    _index[slot] = index;
+    _present[slot] = achieved;
+    _last_index = index;
+    _n_presents++;
+    fit();
+}
+
+void FramePacer::fit() {
+    const unsigned int n = std::min(_n_presents, (unsigned int)WINDOW);
+    double mean_index = 0.0, mean_present = 0.0;
+    for (unsigned int i=0; i<n; i++) {
+        mean_index += _index[i];
+        mean_present += _present[i];
+    }
+    mean_index /= n;
+    mean_present /= n;
+    // a few presents only give the phase; the period needs a longer baseline
+    if (n >= MIN_HISTORY) {
+        double sxx = 0.0, sxy = 0.0;
+        for (unsigned int i=0; i<n; i++) {
+            double dx = _index[i] - mean_index;
+            sxx += dx*dx;
+            sxy += dx*(_present[i] - mean_present);
+        }
+        if (sxx > 0.0) {
+            _period = sxy/sxx;
+        }
+    }
+    _phase = mean_present - mean_index*_period;
+}
+
+void FramePacer::write_log(const std::string& fname) const {
+    FILE* f = fopen(fname.c_str(), "w");
+    if (!f) {
+        std::ostringstream os;
+        os << "Could not open " << fname;
+        throw std::ios_base::failure(os.str());
+    }
+    fprintf(f, "frame,start,predicted,rendered,achieved,dropped\n");
+    for (unsigned int i=0; i<n_logged(); i++) {
+        const FrameTiming& t = logged(i);
+        fprintf(f, "%u,%.6f,%.6f,%.6f,%.6f,%u\n", t.frame, t.start, t.predicted,
+                t.rendered, t.achieved, t.dropped);
+    }
+    fclose(f);
+}
+
+PacingStats FramePacer::stats() const {
+    PacingStats stats;
+    stats.n_frames = n_logged();
+    stats.n_dropped = 0;
+    stats.period = _period;
+    stats.mean_error = 0.0;
+    stats.max_error = 0.0;
+    stats.mean_slack = 0.0;
+    unsigned int n_on_time = 0, n_timed = 0;
+    for (unsigned int i=0; i<n_logged(); i++) {
+        const FrameTiming& t = logged(i);
+        // the first frame only finds the phase
+        if (t.frame == 0) {
+            continue;
+        }
+        n_timed++;
+        stats.mean_slack += t.predicted - t.rendered;
+        if (t.dropped > 0) {
+            stats.n_dropped++;
+            continue;
+        }
+        double error = fabs(t.achieved - t.predicted);
+        stats.mean_error += error;
+        stats.max_error = std::max(stats.max_error, error);
+        n_on_time++;
+    }
+    if (n_on_time > 0) {
+        stats.mean_error /= n_on_time;
+    }
+    if (n_timed > 0) {
+        stats.mean_slack /= n_timed;
+    }
+    return stats;
+}
+
+void PacerSwapCallback::swapBuffersImplementation(osg::GraphicsContext* gc) {
+    glFinish();
+    _rendered = _clock->now();
+    gc->swapBuffersImplementation();
+    glFinish();
+    _achieved = _clock->now();
+}
+
+PacingStats simulate_frame_pacing(SimulatedVblankClock& clock, FramePacer& pacer,
+                                  const std::vector<double>& render_times) {
+    pacer.set_log_size(std::max(1u, (unsigned int)render_times.size()));
+    for (unsigned int i=0; i<render_times.size(); i++) {
+        pacer.begin_frame();
+        clock.advance(render_times[i]);
+        double rendered = clock.now();
+        double achieved = clock.swap();
+        pacer.end_frame(rendered, achieved);
+    }
+    return pacer.stats();
+}
@@ -0,0 +1,149 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef FRAME_PACER_H
+#define FRAME_PACER_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <algorithm>
+
+#include <osg/GraphicsContext>
+
+// Time source of the frame pacer, seconds on the PosePredictor::now()
+// clock.
+class FrameClock {
+public:
+    virtual ~FrameClock() {}
+    virtual double now() = 0;
+    virtual void sleep_until(double t) = 0;
+};
+
+// The system clock. Sleeps coarsely and spins the last millisecond,
+// the scheduler's sleep is too imprecise for late starts.
+class SystemFrameClock : public FrameClock {
+public:
+    virtual double now();
+    virtual void sleep_until(double t);
+};
+
+// A display with vertical blanks at phase + n*period, for testing the
+// pacing headless and deterministically. Rendering takes time by
+// advance(); swap() blocks to the first vblank after the frame is
+// submitted, like a swap with vsync, and returns the present time with
+// jitter as a real timestamp would have.
+class SimulatedVblankClock : public FrameClock {
+public:
+    SimulatedVblankClock(double period, double phase=0.0, double jitter=0.0, unsigned int seed=1);
+    virtual double now() { return _now; }
+    virtual void sleep_until(double t);
+    void advance(double dt) { _now += dt; }
+    double swap();
+    unsigned int n_vblanks() const;
+
+private:
+    double _period;
+    double _phase;
+    double _jitter;
+    unsigned int _seed;
+    double _now;
+};
+
+// One frame as the pacer saw it.
+struct FrameTiming {
+    unsigned int frame;
+    double start;       // rendering started
+    double predicted;   // vblank it was scheduled for
+    double rendered;    // rendering finished, before the swap
+    double achieved;    // present time measured after the swap
+    unsigned int dropped; // vblanks missed, 0 if on time
+};
+
+struct PacingStats {
+    unsigned int n_frames;
+    unsigned int n_dropped;     // frames presented later than predicted
+    double period;              // estimated refresh period
+    double mean_error;          // |achieved - predicted| of frames on time
+    double max_error;
+    double mean_slack;          // predicted - rendered: margin left by the late start
+};
+
+std::ostream& operator<<(std::ostream& os, const PacingStats& stats);
+
+// Schedules frames against the display refresh. The refresh period
+// and phase are fitted by least squares to recent present times, and
+// each frame starts as late as the longest recent render time plus a
+// margin allows before the next vblank. Use the predicted present time
+// from begin_frame() for everything that depends on when the frame is
+// seen, e.g. the pose prediction.
+//
+//   double t_present = pacer.begin_frame();
+//   ... render and swap ...
+//   pacer.end_frame(t_rendered, t_achieved);
+class FramePacer {
+public:
+    FramePacer(FrameClock* clock, double nominal_period, double margin=0.5e-3);
+
+    // sleeps until the latest safe start and returns the predicted present time
+    double begin_frame();
+    // rendering finished at rendered and the frame reached the screen at achieved
+    void end_frame(double rendered, double achieved);
+
+    double period() const { return _period; }
+    // predicted time of the first vblank at or after t
+    double next_vblank(double t) const;
+
+    // The log is a ring of the last n_frames frames (DEFAULT_LOG_FRAMES
+    // until set), allocated here so the frame loop does not allocate.
+    // Setting it clears the log.
+    void set_log_size(unsigned int n_frames);
+    unsigned int n_logged() const { return std::min(_n_frames, (unsigned int)_log.size()); }
+    // i-th kept frame, oldest first
+    const FrameTiming& logged(unsigned int i) const;
+    // CSV, one kept frame per line
+    void write_log(const std::string& fname) const;
+    // over the kept frames
+    PacingStats stats() const;
+
+    enum { DEFAULT_LOG_FRAMES = 1 << 16 };
+
+private:
+    void fit();
+
+    enum { WINDOW = 64, MIN_HISTORY = 8 };
+    FrameClock* _clock;
+    double _margin;
+    double _period;
+    double _phase;              // a vblank time, the origin of vblank indices
+    // recent presents as (vblank index, time) and render times, rings
+    double _index[WINDOW];
+    double _present[WINDOW];
+    double _render[WINDOW];
+    unsigned int _n_presents;
+    double _last_index;
+    double _start;
+    double _predicted;
+    unsigned int _n_frames;     // frames ended, the log keeps the last ones
+    std::vector<FrameTiming> _log;
+};
+
+// Records the render and present time of each frame of a context for a
+// FramePacer: glFinish() before the swap for the render time and after
+// it for the present time, which with vsync on is when the swap took.
+class PacerSwapCallback : public osg::GraphicsContext::SwapCallback {
+public:
+    PacerSwapCallback(FrameClock* clock) : _clock(clock), _rendered(0.0), _achieved(0.0) {}
+    virtual void swapBuffersImplementation(osg::GraphicsContext* gc);
+    double rendered() const { return _rendered; }
+    double achieved() const { return _achieved; }
+private:
+    FrameClock* _clock;
+    double _rendered;
+    double _achieved;
+};
+
+// Runs render_times.size() frames against a simulated display, each
+// taking its render time, and returns the pacing statistics.
+PacingStats simulate_frame_pacing(SimulatedVblankClock& clock, FramePacer& pacer,
+                                  const std::vector<double>& render_times);
+
+#endif
@@ -0,0 +1,396 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include "frame_ring.h"
+
+#include <osg/Timer>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include <stdexcept>
+#include <sstream>
+#include <vector>
+
+#define FRAME_RING_MAGIC 0x464c5931 // "FLY1", also marks the header complete
+#define FRAME_RING_ALIGN 64
+
+// Shared layout: this header, then n_slots slots of a FrameSlotHeader
+// and slot_size payload bytes, each rounded up to FRAME_RING_ALIGN.
+struct FrameRingHeader {
+    volatile uint32_t magic;
+    uint32_t n_slots;
+    uint64_t slot_size;
+    volatile uint64_t head;     // seq of the newest complete frame, 0 for none
+    volatile int32_t futex;     // bumped with every frame
+    volatile int32_t waiters;   // readers asleep on futex
+    unsigned char pad[FRAME_RING_ALIGN - 32];
+};
+
+struct FrameSlotHeader {
+    volatile uint64_t seq;      // 0 while being written
+    uint32_t kind;
+    uint32_t width;
+    uint32_t height;
+    uint32_t reserved;
+    uint64_t bytes;
+    double timestamp;
+    unsigned char pad[FRAME_RING_ALIGN - 40];
+};
+
+static size_t round_up(size_t n) {
+    return (n + FRAME_RING_ALIGN - 1)/FRAME_RING_ALIGN*FRAME_RING_ALIGN;
+}
+
+static void throw_errno(const char* what, const std::string& name) {
+    std::ostringstream os;
+    os << what << " " << name << ": " << strerror(errno);
+    throw std::runtime_error(os.str());
+}
+
+static void futex_wake(volatile int32_t* addr) {
+#ifdef __linux__
+    syscall(SYS_futex, (int32_t*)addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+// sleeps while *addr==value, at most timeout seconds
+static void futex_wait(volatile int32_t* addr, int32_t value, double timeout) {
+#ifdef __linux__
+    struct timespec ts;
+    ts.tv_sec = (time_t)timeout;
+    ts.tv_nsec = (long)((timeout - ts.tv_sec)*1e9);
+    syscall(SYS_futex, (int32_t*)addr, FUTEX_WAIT, value, &ts, NULL, 0);
+#else
+    usleep(timeout < 0.001 ? (useconds_t)(timeout*1e6) : 1000);
+#endif
+}
+
+// ---- FramePublisher ----------------------------------------------
+
+FramePublisher::FramePublisher(const std::string& name, unsigned int n_slots, size_t slot_size) :
+    _name(name), _n_slots(n_slots), _slot_size(slot_size), _published(0), _writing(false)
+{
+    if (n_slots < 2) {
+        throw std::runtime_error("a frame ring needs at least two slots");
+    }
+    _stride = round_up(sizeof(FrameSlotHeader) + slot_size);
+    _size = sizeof(FrameRingHeader) + _n_slots*_stride;
+
+    shm_unlink(_name.c_str());
+    int fd = shm_open(_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0660);
+    if (fd < 0) {
+        throw_errno("could not create shared memory", _name);
+    }
+    if (ftruncate(fd, _size) < 0) {
+        close(fd);
+        shm_unlink(_name.c_str());
+        throw_errno("could not size shared memory", _name);
+    }
+    void* base = mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base==MAP_FAILED) {
+        shm_unlink(_name.c_str());
+        throw_errno("could not map shared memory", _name);
+    }
+    _base = (unsigned char*)base;
+    _header = (FrameRingHeader*)_base;
+
+    // ftruncate zero fills, so every slot starts out empty
+    _header->n_slots = _n_slots;
+    _header->slot_size = _slot_size;
+    _header->head = 0;
+    _header->futex = 0;
+    _header->waiters = 0;
+    __sync_synchronize();
+    _header->magic = FRAME_RING_MAGIC;
+}
+
+FramePublisher::~FramePublisher() {
+    // readers keep their mappings
+    munmap(_base, _size);
+    shm_unlink(_name.c_str());
+}
+
+FrameSlotHeader* FramePublisher::slot(unsigned long long seq) {
+    return (FrameSlotHeader*)(_base + sizeof(FrameRingHeader) + ((seq - 1) % _n_slots)*_stride);
+}
+
+void* FramePublisher::begin_frame() {
+    FrameSlotHeader* s = slot(_published + 1);
+    // readers of the frame this slot held see it go
+    s->seq = 0;
+    __sync_synchronize();
+    _writing = true;
+    return s + 1;
+}
+
+void FramePublisher::commit_frame(const FrameInfo& info) {
+    if (!_writing) {
+        throw std::runtime_error("commit_frame() without begin_frame()");
+    }
+    if (info.bytes > _slot_size) {
+        throw std::runtime_error("frame larger than the ring's slots");
+    }
+    const unsigned long long seq = _published + 1;
+    FrameSlotHeader* s = slot(seq);
+    s->kind = info.kind;
+    s->width = info.width;
+    s->height = info.height;
+    s->bytes = info.bytes;
+    s->timestamp = info.timestamp;
+    __sync_synchronize();
+    s->seq = seq;
+    _header->head = seq;
+    __sync_synchronize();
+    __sync_fetch_and_add(&_header->futex, 1);
+    if (_header->waiters > 0) {
+        futex_wake(&_header->futex);
+    }
+    _published = seq;
+    _writing = false;
+}
+
+void FramePublisher::publish(const FrameInfo& info, const void* data) {
+    if (info.bytes > _slot_size) {
+        throw std::runtime_error("frame larger than the ring's slots");
+    }
+    memcpy(begin_frame(), data, info.bytes);
+    commit_frame(info);
+}
+
+// ---- FrameReader -------------------------------------------------
+
+FrameReader::FrameReader(const std::string& name) :
+    _last(0), _n_read(0), _n_skipped(0)
+{
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        throw_errno("could not open shared memory", name);
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(FrameRingHeader)) {
+        close(fd);
+        throw std::runtime_error("shared memory " + name + " is not a frame ring");
+    }
+    _size = st.st_size;
+    // read and write: readers register on the futex
+    void* base = mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base==MAP_FAILED) {
+        throw_errno("could not map shared memory", name);
+    }
+    _base = (unsigned char*)base;
+    _header = (FrameRingHeader*)_base;
+    if (_header->magic!=FRAME_RING_MAGIC) {
+        munmap(_base, _size);
+        throw std::runtime_error("shared memory " + name + " is not a frame ring");
+    }
+    __sync_synchronize();
+    _n_slots = _header->n_slots;
+    _slot_size = _header->slot_size;
+    _stride = round_up(sizeof(FrameSlotHeader) + _slot_size);
+    // start with the frames published from now on
+    _last = _header->head;
+}
+
+FrameReader::~FrameReader() {
+    munmap(_base, _size);
+}
+
+const FrameSlotHeader* FrameReader::slot(unsigned long long seq) const {
+    return (const FrameSlotHeader*)(_base + sizeof(FrameRingHeader) + ((seq - 1) % _n_slots)*_stride);
+}
+
+const void* FrameReader::wait_frame(FrameInfo& info, double timeout) {
+    osg::Timer timer;
+    osg::Timer_t start = timer.tick();
+    while (true) {
+        int32_t futex = _header->futex;
+        __sync_synchronize();
+        unsigned long long head = _header->head;
+        if (head > _last) {
+            const FrameSlotHeader* s = slot(head);
+            __sync_synchronize();
+            info.kind = (FrameKind)s->kind;
+            info.width = s->width;
+            info.height = s->height;
+            info.bytes = s->bytes;
+            info.timestamp = s->timestamp;
+            __sync_synchronize();
+            // lapped by the writer while reading the header: try again
+            if (s->seq!=head) {
+                continue;
+            }
+            info.seq = head;
+            _n_skipped += head - _last - 1;
+            _n_read++;
+            _last = head;
+            return s + 1;
+        }
+
+        double remaining = timeout - timer.delta_s(start, timer.tick());
+        if (remaining <= 0.0) {
+            return NULL;
+        }
+        __sync_fetch_and_add(&_header->waiters, 1);
+        __sync_synchronize();
+        futex_wait(&_header->futex, futex, remaining);
+        __sync_fetch_and_sub(&_header->waiters, 1);
+    }
+}
+
+bool FrameReader::still_valid() const {
+    if (_last==0) {
+        return false;
+    }
+    __sync_synchronize();
+    return slot(_last)->seq==_last;
+}
+
+// ---- benchmark ---------------------------------------------------
+
+struct ReaderCounts {
+    unsigned long long read;
+    unsigned long long skipped;
+    unsigned long long torn;
+    unsigned long long corrupt;
+};
+
+// child process: read until the last frame, checking the stamps at
+// both ends and the fill in the middle of each payload. Writes one
+// status byte to ready_fd whether or not the ring could be opened,
+// then the counts to result_fd if it was.
+static void run_benchmark_reader(const std::string& name, unsigned int n_frames,
+                                 int ready_fd, int result_fd) {
+    FrameReader* reader = NULL;
+    try {
+        reader = new FrameReader(name);
+    } catch (std::exception& e) {
+        // reported as a zero status byte
+    }
+    char ready = reader ? 1 : 0;
+    if (write(ready_fd, &ready, 1)!=1 || !ready) {
+        delete reader;
+        _exit(1);
+    }
+
+    ReaderCounts counts = {0, 0, 0, 0};
+    try {
+        FrameInfo info;
+        while (info.seq < n_frames) {
+            const unsigned char* data = (const unsigned char*)reader->wait_frame(info, 1.0);
+            if (!data) {
+                break;
+            }
+            unsigned long long first, last;
+            memcpy(&first, data, sizeof(first));
+            memcpy(&last, data + info.bytes - sizeof(last), sizeof(last));
+            unsigned char fill = data[info.bytes/2];
+            if (!reader->still_valid()) {
+                counts.torn++;
+            } else if (first!=info.seq || last!=info.seq || fill!=(info.seq & 0xFF)) {
+                counts.corrupt++;
+            }
+        }
+        counts.read = reader->frames_read();
+        counts.skipped = reader->frames_skipped();
+    } catch (std::exception& e) {
+        counts.corrupt = 1;
+    }
+    delete reader;
+    ssize_t n = write(result_fd, &counts, sizeof(counts));
+    _exit(n==(ssize_t)sizeof(counts) ? 0 : 1);
+}
+
+bool benchmark_frame_ring(unsigned int width, unsigned int height, unsigned int n_frames,
+                          unsigned int n_readers, unsigned int n_slots, std::ostream& os) {
+    std::ostringstream name;
+    name << "/flyvr_ring_benchmark_" << getpid();
+    const size_t bytes = (size_t)width*height*3;
+    if (bytes < 2*sizeof(unsigned long long)) {
+        throw std::runtime_error("benchmark frames are too small");
+    }
+    FramePublisher publisher(name.str(), n_slots, bytes);
+
+    int ready_pipe[2], result_pipe[2];
+    if (pipe(ready_pipe) < 0 || pipe(result_pipe) < 0) {
+        throw std::runtime_error("could not create pipes for the ring benchmark");
+    }
+    std::vector<pid_t> children;
+    for (unsigned int i=0; i<n_readers; i++) {
+        pid_t pid = fork();
+        if (pid==0) {
+            run_benchmark_reader(name.str(), n_frames, ready_pipe[1], result_pipe[1]);
+        }
+        if (pid < 0) {
+            throw std::runtime_error("could not start ring benchmark reader");
+        }
+        children.push_back(pid);
+    }
+    // only the children write, so a reader that dies early ends the reads
+    close(ready_pipe[1]);
+    close(result_pipe[1]);
+    unsigned int n_started = 0;
+    for (unsigned int i=0; i<n_readers; i++) {
+        char ready;
+        if (read(ready_pipe[0], &ready, 1)==1 && ready) {
+            n_started++;
+        }
+    }
+
+    // the publisher fills each frame in place, as a renderer would
+    osg::Timer timer;
+    osg::Timer_t start = timer.tick();
+    FrameInfo info;
+    info.kind = FRAME_RGB8;
+    info.width = width;
+    info.height = height;
+    info.bytes = bytes;
+    for (unsigned long long seq=1; seq<=n_frames; seq++) {
+        unsigned char* data = (unsigned char*)publisher.begin_frame();
+        memset(data, seq & 0xFF, bytes);
+        memcpy(data, &seq, sizeof(seq));
+        memcpy(data + bytes - sizeof(seq), &seq, sizeof(seq));
+        info.timestamp = timer.time_s();
+        publisher.commit_frame(info);
+    }
+    double sec = timer.delta_s(start, timer.tick());
+
+    bool ok = n_started==n_readers;
+    if (!ok) {
+        os << "  " << n_readers - n_started << " of " << n_readers << " readers failed to start" << std::endl;
+    }
+    os << n_frames << " frames of " << width << "x" << height << " RGB through " << n_slots
+       << " slots: " << n_frames/sec << " frames/sec, " << n_frames*(double)bytes/sec*1e-9
+       << " GB/sec" << std::endl;
+    for (unsigned int i=0; i<n_started; i++) {
+        ReaderCounts counts;
+        if (read(result_pipe[0], &counts, sizeof(counts))!=(ssize_t)sizeof(counts)) {
+            ok = false;
+            continue;
+        }
+        os << "  reader: " << counts.read << " read, " << counts.skipped << " skipped, "
+           << counts.torn << " torn, " << counts.corrupt << " corrupt" << std::endl;
+        ok = ok && counts.corrupt==0;
+    }
+    for (unsigned int i=0; i<children.size(); i++) {
+        int status;
+        waitpid(children[i], &status, 0);
+        ok = ok && WIFEXITED(status) && WEXITSTATUS(status)==0;
+    }
+    close(ready_pipe[0]);
+    close(result_pipe[0]);
+    return ok;
+}
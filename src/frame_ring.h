@@ -0,0 +1,106 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <string>
+#include <ostream>
+#include <stddef.h>
+
+enum FrameKind {
+    FRAME_RGB8 = 1,
+    FRAME_RGBA8 = 2,
+    FRAME_MONO8 = 3,
+    FRAME_LUT_FLOAT3 = 4    // u, v, depth per pixel, see SurfaceLUT
+};
+
+struct FrameInfo {
+    FrameInfo() : seq(0), kind(FRAME_RGB8), width(0), height(0), bytes(0), timestamp(0.0) {}
+    unsigned long long seq; // 1 for the first frame published, set by the ring
+    FrameKind kind;
+    unsigned int width;
+    unsigned int height;
+    size_t bytes;
+    double timestamp;
+};
+
+struct FrameRingHeader;
+struct FrameSlotHeader;
+
+// Publishes frames to other processes through a POSIX shared memory
+// ring of n_slots fixed size slots. Each slot carries the sequence
+// number of its frame. The writer never waits for readers: a reader
+// that falls n_slots frames behind skips frames, and one still using a
+// slot that gets reused finds out from FrameReader::still_valid().
+// Readers sleep on a futex in the shared header (Linux; elsewhere they
+// poll), which is only woken when someone waits.
+//
+// One publisher per ring. name is a shared memory object name such as
+// "/flyvr_frames"; a stale ring of that name is replaced.
+class FramePublisher {
+public:
+    FramePublisher(const std::string& name, unsigned int n_slots, size_t slot_size);
+    ~FramePublisher();
+
+    // Zero copy: the payload of the next slot, valid until
+    // commit_frame(). Readers cannot see the slot until then.
+    void* begin_frame();
+    void commit_frame(const FrameInfo& info);
+    // begin, copy in and commit
+    void publish(const FrameInfo& info, const void* data);
+
+    size_t slot_size() const { return _slot_size; }
+    unsigned long long frames_published() const { return _published; }
+    const std::string& name() const { return _name; }
+
+private:
+    FrameSlotHeader* slot(unsigned long long seq);
+
+    std::string _name;
+    unsigned int _n_slots;
+    size_t _slot_size;
+    size_t _stride;
+    size_t _size;
+    unsigned char* _base;
+    FrameRingHeader* _header;
+    unsigned long long _published;
+    bool _writing;
+};
+
+class FrameReader {
+public:
+    // throws std::runtime_error if there is no ring of that name
+    FrameReader(const std::string& name);
+    ~FrameReader();
+
+    // Newest frame after the last one returned, in place in shared
+    // memory. Waits up to timeout seconds, NULL if none arrived.
+    const void* wait_frame(FrameInfo& info, double timeout);
+    // whether the last frame returned is still intact, check after use
+    bool still_valid() const;
+
+    unsigned long long frames_read() const { return _n_read; }
+    unsigned long long frames_skipped() const { return _n_skipped; }
+    size_t slot_size() const { return _slot_size; }
+
+private:
+    const FrameSlotHeader* slot(unsigned long long seq) const;
+
+    unsigned int _n_slots;
+    size_t _slot_size;
+    size_t _stride;
+    size_t _size;
+    unsigned char* _base;
+    FrameRingHeader* _header;
+    unsigned long long _last;
+    unsigned long long _n_read;
+    unsigned long long _n_skipped;
+};
+
+// Publishes n_frames frames of width x height RGB through a ring of
+// n_slots to n_readers reader processes, which check every frame's
+// sequence stamps. Prints frames/sec and per reader frames read,
+// skipped and torn; returns false if a reader saw a corrupt frame.
+bool benchmark_frame_ring(unsigned int width, unsigned int height, unsigned int n_frames,
+                          unsigned int n_readers, unsigned int n_slots, std::ostream& os);
+
+#endif
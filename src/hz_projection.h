@@ -0,0 +1,83 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef HZ_PROJECTION_H
+#define HZ_PROJECTION_H
+
+/* OpenGL projection matrices from Hartley & Zisserman style intrinsic
+ * parameters. This is the closed form of what projection_math.py
+ * derives with sympy, plus pixel sub-rectangles for tiled rendering.
+ * See http://strawlab.org/2011/11/05/augmented-reality-with-OpenGL/
+ *
+ * Usable from C and C++. With C++14 the functions are constexpr, so a
+ * fixed rig can have its matrices computed at compile time:
+ *
+ *   constexpr hz_intrinsics K = {604.4, -7.337, 356.26, 578.11, 257.36};
+ *   constexpr hz_mat4 P = hz_gl_projection(K, 752, 480, 0, 0, HZ_Y_DOWN, 0.1, 10.0);
+ *
+ * Matrices are stored column major, as glLoadMatrixd() and
+ * osg::Matrixd(const double*) expect.
+ */
+
+#if defined(__cplusplus) && __cplusplus >= 201402L
+#define HZ_CONSTEXPR static constexpr
+#else
+#define HZ_CONSTEXPR static inline
+#endif
+
+#define HZ_Y_DOWN 0 /* pixel rows counted from the top (OpenCV, ROS) */
+#define HZ_Y_UP   1 /* pixel rows counted from the bottom (OpenGL window) */
+
+/* upper triangular K normalized so K22 is 1 */
+typedef struct {
+    double K00, K01, K02;
+    double K11, K12;
+} hz_intrinsics;
+
+typedef struct {
+    double m[16];
+} hz_mat4;
+
+/* element at row, col */
+HZ_CONSTEXPR double hz_mat4_get(hz_mat4 M, int row, int col) {
+    return M.m[col*4+row];
+}
+
+/* Projection for a width x height camera drawn into a viewport of the
+ * same size whose lower left corner is at (x0, y0) in window
+ * coordinates. */
+HZ_CONSTEXPR hz_mat4 hz_gl_projection(hz_intrinsics K, double width, double height,
+                                      double x0, double y0, int y_up,
+                                      double znear, double zfar) {
+    hz_mat4 P = {{0}};
+    double depth = zfar - znear;
+
+    P.m[0]  = 2*K.K00/width;                    /* row 0 */
+    P.m[4]  = -2*K.K01/width;
+    P.m[8]  = (-2*K.K02 + width + 2*x0)/width;
+
+    if (y_up) {                                 /* row 1 */
+        P.m[5] = -2*K.K11/height;
+        P.m[9] = (-2*K.K12 + height + 2*y0)/height;
+    } else {
+        P.m[5] = 2*K.K11/height;
+        P.m[9] = (2*K.K12 - height + 2*y0)/height;
+    }
+
+    P.m[10] = -(zfar + znear)/depth;            /* row 2, as glFrustum */
+    P.m[14] = -2*(zfar*znear)/depth;
+
+    P.m[11] = -1;                               /* row 3 */
+    return P;
+}
+
+/* Projection for the tile_width x tile_height sub-rectangle of the
+ * camera image whose smallest pixel coordinates are (u0, v0), in the
+ * camera's own row convention. The tile is drawn into a viewport of
+ * the tile's size at the window origin. Tiles that partition the image
+ * stitch without gaps or overlap. */
+HZ_CONSTEXPR hz_mat4 hz_gl_projection_tile(hz_intrinsics K, double u0, double v0,
+                                           double tile_width, double tile_height, int y_up,
+                                           double znear, double zfar) {
+    return hz_gl_projection(K, tile_width, tile_height, u0, y_up ? v0 : -v0, y_up, znear, zfar);
+}
+
+#endif
@@ -0,0 +1,229 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include "multiview_renderer.h"
+#include "util.h"
+#include "profiler.h"
+
+#include <osg/Depth>
+#include <osg/Geode>
+#include <osg/GraphicsContext>
+#include <osg/Program>
+#include <osg/Shader>
+#include <osg/Timer>
+
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+
+// waits for the GPU so that timings cover the whole frame
+class FinishCallback : public osg::Camera::DrawCallback {
+public:
+    virtual void operator () (osg::RenderInfo& renderInfo) const {
+        glFinish();
+    }
+};
+
+static osg::Program* make_program(const char* vert_fname, const char* frag_fname) {
+    osg::Program* program = new osg::Program;
+    osg::Shader* vert = new osg::Shader(osg::Shader::VERTEX);
+    osg::Shader* geom = new osg::Shader(osg::Shader::GEOMETRY);
+    osg::Shader* frag = new osg::Shader(osg::Shader::FRAGMENT);
+    LoadShaderSource(vert, vert_fname);
+    LoadShaderSource(geom, "multiview.geom");
+    LoadShaderSource(frag, frag_fname);
+    program->addShader(vert);
+    program->addShader(geom);
+    program->addShader(frag);
+    return program;
+}
+
+MultiViewRenderer::MultiViewRenderer(DisplaySurfaceGeometry* geom, unsigned int grid_n) :
+    _geom(geom), _grid_n(grid_n)
+{
+}
+
+void MultiViewRenderer::add_view(const CameraModel& cam, osg::Image* background) {
+    if (_viewer.valid()) {
+        throw std::runtime_error("cannot add views after realize()");
+    }
+    if (_cams.size() >= MULTIVIEW_MAX_VIEWS) {
+        throw std::runtime_error("too many views");
+    }
+    if (!cam.is_intrinsic_valid() || !cam.is_extrinsic_valid()) {
+        throw std::runtime_error("need a fully calibrated camera for each view");
+    }
+    if (!_cams.empty() && (cam.width()!=_cams[0].width() || cam.height()!=_cams[0].height())) {
+        throw std::runtime_error("all views must share one resolution");
+    }
+
+    osg::ref_ptr<osg::Image> bg = background;
+    if (!bg.valid()) {
+        bg = new osg::Image;
+        bg->allocateImage(cam.width(), cam.height(), 1, GL_RGBA, GL_UNSIGNED_BYTE);
+        memset(bg->data(), 0, bg->getTotalSizeInBytes());
+    } else if (bg->s()!=(int)cam.width() || bg->t()!=(int)cam.height()) {
+        throw std::runtime_error("background size differs from camera resolution");
+    }
+
+    _cams.push_back(cam);
+    _clip_planes.push_back(ClipPlaneCache(_geom));
+    _backgrounds.push_back(bg);
+}
+
+void MultiViewRenderer::update_view(unsigned int i, const CameraModel& cam) {
+    if (cam.width()!=_cams.at(i).width() || cam.height()!=_cams.at(i).height()) {
+        throw std::runtime_error("all views must share one resolution");
+    }
+    _cams[i] = cam;
+    if (_view_proj.valid()) {
+        update_uniform(i);
+    }
+}
+
+void MultiViewRenderer::update_uniform(unsigned int i) {
+    // near and far are recomputed only if this camera moved
+    _clip_planes[i].update(_cams[i]);
+    osg::Matrixd m = _cams[i].view()*_cams[i].projection(_clip_planes[i].znear(),
+                                                          _clip_planes[i].zfar());
+    _view_proj->setElement(i, osg::Matrixf(m));
+}
+
+void MultiViewRenderer::realize() {
+    if (_cams.empty()) {
+        throw std::runtime_error("no views to render");
+    }
+    const unsigned int n = _cams.size();
+    const unsigned int w = _cams[0].width();
+    const unsigned int h = _cams[0].height();
+
+    _color = new osg::Texture2DArray;
+    _color->setTextureSize(w, h, n);
+    _color->setInternalFormat(GL_RGBA);
+    _color->setFilter(osg::Texture::MIN_FILTER, osg::Texture::LINEAR);
+    _color->setFilter(osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
+
+    osg::ref_ptr<osg::Texture2DArray> depth = new osg::Texture2DArray;
+    depth->setTextureSize(w, h, n);
+    depth->setInternalFormat(GL_DEPTH_COMPONENT24);
+    depth->setSourceFormat(GL_DEPTH_COMPONENT);
+    depth->setSourceType(GL_FLOAT);
+
+    osg::ref_ptr<osg::Texture2DArray> backgrounds = new osg::Texture2DArray;
+    backgrounds->setTextureSize(w, h, n);
+    for (unsigned int i=0; i<n; i++) {
+        backgrounds->setImage(i, _backgrounds[i].get());
+    }
+
+    // One camera renders into every layer; the geometry shader chooses.
+    // The matrices live in view_proj, so OSG's own are left as identity
+    // and OSG culling is off.
+    _rtt = new osg::Camera;
+    _rtt->setRenderTargetImplementation(osg::Camera::FRAME_BUFFER_OBJECT);
+    _rtt->setRenderOrder(osg::Camera::PRE_RENDER);
+    _rtt->setReferenceFrame(osg::Transform::ABSOLUTE_RF);
+    _rtt->setViewport(0, 0, w, h);
+    _rtt->setClearMask(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    _rtt->setComputeNearFarMode(osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR);
+    _rtt->setCullingMode(osg::CullSettings::NO_CULLING);
+    _rtt->attach(osg::Camera::COLOR_BUFFER, _color.get(), 0,
+                 osg::Camera::FACE_CONTROLLED_BY_GEOMETRY_SHADER);
+    _rtt->attach(osg::Camera::DEPTH_BUFFER, depth.get(), 0,
+                 osg::Camera::FACE_CONTROLLED_BY_GEOMETRY_SHADER);
+
+    {
+        osg::Geode* geode = new osg::Geode;
+        geode->addDescription("multiview backgrounds");
+        geode->addDrawable(make_implicit_grid(1, 1, n).get());
+        osg::StateSet* ss = geode->getOrCreateStateSet();
+        ss->setAttributeAndModes(make_program("multiview_bg.vert", "multiview_bg.frag"),
+                                 osg::StateAttribute::ON);
+        ss->setTextureAttribute(0, backgrounds.get(), osg::StateAttribute::ON);
+        ss->addUniform(new osg::Uniform("backgrounds", 0));
+        ss->setAttributeAndModes(new osg::Depth(osg::Depth::ALWAYS, 0.0, 1.0, false),
+                                 osg::StateAttribute::ON);
+        ss->setRenderBinDetails(-1, "RenderBin");
+        _rtt->addChild(geode);
+    }
+    {
+        // surface.vert and surface.frag are overridden by the per view versions
+        osg::ref_ptr<osg::Geode> geode = _geom->make_gpu_geom(_grid_n, _grid_n, false, n);
+        osg::StateSet* ss = geode->getOrCreateStateSet();
+        osg::Group* group = new osg::Group;
+        group->getOrCreateStateSet()->setAttributeAndModes(
+            make_program("multiview.vert", "multiview.frag"),
+            osg::StateAttribute::ON | osg::StateAttribute::OVERRIDE);
+        _view_proj = new osg::Uniform(osg::Uniform::FLOAT_MAT4, "view_proj", MULTIVIEW_MAX_VIEWS);
+        ss->addUniform(_view_proj.get());
+        group->addChild(geode.get());
+        _rtt->addChild(group);
+    }
+    for (unsigned int i=0; i<n; i++) {
+        update_uniform(i);
+    }
+
+    osg::ref_ptr<osg::GraphicsContext::Traits> traits = new osg::GraphicsContext::Traits;
+    traits->x = 0;
+    traits->y = 0;
+    traits->width = 1;
+    traits->height = 1;
+    traits->windowDecoration = false;
+    traits->doubleBuffer = false;
+    traits->pbuffer = true;
+    osg::ref_ptr<osg::GraphicsContext> gc = osg::GraphicsContext::createGraphicsContext(traits.get());
+    if (!gc.valid()) {
+        throw std::runtime_error("could not create offscreen context for multiview rendering");
+    }
+
+    _viewer = new osgViewer::Viewer;
+    _viewer->setThreadingModel(osgViewer::Viewer::SingleThreaded);
+    _viewer->setSceneData(_rtt.get());
+    _viewer->getCamera()->setGraphicsContext(gc.get());
+    _viewer->getCamera()->setViewport(new osg::Viewport(0, 0, 1, 1));
+    _viewer->realize();
+}
+
+void MultiViewRenderer::render_frame() {
+    PROFILE_ZONE("multiview frame");
+    if (!_viewer.valid()) {
+        throw std::runtime_error("call realize() before rendering");
+    }
+    _viewer->frame();
+}
+
+double MultiViewRenderer::benchmark(unsigned int n_frames) {
+    // the first frame compiles shaders and uploads textures
+    render_frame();
+
+    osg::ref_ptr<FinishCallback> finish = new FinishCallback;
+    _rtt->setFinalDrawCallback(finish.get());
+    render_frame();
+
+    osg::Timer timer;
+    osg::Timer_t start = timer.tick();
+    for (unsigned int i=0; i<n_frames; i++) {
+        render_frame();
+    }
+    double sec = timer.delta_s(start, timer.tick());
+    _rtt->setFinalDrawCallback(NULL);
+    return n_frames*n_views()/sec;
+}
+
+void benchmark_multiview(DisplaySurfaceGeometry* geom, const std::vector<CameraModel>& cams,
+                         const std::vector<osg::Image*>& backgrounds, unsigned int n_frames,
+                         std::ostream& os) {
+    const unsigned int n_max = std::min((unsigned int)cams.size(), (unsigned int)MULTIVIEW_MAX_VIEWS);
+    os << "multiview, " << n_frames << " frames per rig:" << std::endl;
+    for (unsigned int n=1; n_max > 0; n*=2) {
+        n = std::min(n, n_max);
+        MultiViewRenderer renderer(geom);
+        for (unsigned int i=0; i<n; i++) {
+            renderer.add_view(cams[i], i < backgrounds.size() ? backgrounds[i] : NULL);
+        }
+        renderer.realize();
+        double views_per_sec = renderer.benchmark(n_frames);
+        os << "  " << n << " views: " << views_per_sec << " views/sec, "
+           << n/views_per_sec*1e3 << " ms per frame" << std::endl;
+        if (n==n_max) {
+            break;
+        }
+    }
+}
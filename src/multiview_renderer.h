@@ -0,0 +1,74 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef MULTIVIEW_RENDERER_H
+#define MULTIVIEW_RENDERER_H
+
+#include <vector>
+#include <ostream>
+
+#include <osg/Camera>
+#include <osg/Image>
+#include <osg/Texture2DArray>
+#include <osg/Uniform>
+#include <osgViewer/Viewer>
+
+#include "DisplaySurfaceGeometry.h"
+#include "camera_model.h"
+#include "clip_planes.h"
+
+// must match MAX_VIEWS in multiview.vert
+#define MULTIVIEW_MAX_VIEWS 32
+
+// Renders the display surface as seen by many cameras of a rig in one
+// offscreen pass. Each view goes to its own layer of a texture array:
+// the surface grid (see make_gpu_geom()) is drawn once per view with
+// instancing, and a geometry shader picks the layer. The surface is
+// described by a handful of uniforms shared by all views, so nothing is
+// uploaded per camera except its matrix and background.
+//
+// All views must have the same resolution, since the layers of a
+// texture array share one size.
+class MultiViewRenderer {
+public:
+    MultiViewRenderer(DisplaySurfaceGeometry* geom, unsigned int grid_n=128);
+
+    // background is drawn behind the surface, it may be NULL
+    void add_view(const CameraModel& cam, osg::Image* background=NULL);
+    // new pose for view i
+    void update_view(unsigned int i, const CameraModel& cam);
+    unsigned int n_views() const { return _cams.size(); }
+
+    // create the offscreen context, after the last add_view()
+    void realize();
+    // render all views
+    void render_frame();
+    // views rendered per second over n_frames frames
+    double benchmark(unsigned int n_frames);
+
+    // one layer per view
+    osg::Texture2DArray* get_texture() { return _color.get(); }
+
+private:
+    void update_uniform(unsigned int i);
+
+    DisplaySurfaceGeometry* _geom;
+    unsigned int _grid_n;
+    std::vector<CameraModel> _cams;
+    std::vector<ClipPlaneCache> _clip_planes;
+    std::vector<osg::ref_ptr<osg::Image> > _backgrounds;
+
+    osg::ref_ptr<osg::Uniform> _view_proj;
+    osg::ref_ptr<osg::Texture2DArray> _color;
+    osg::ref_ptr<osg::Camera> _rtt;
+    osg::ref_ptr<osgViewer::Viewer> _viewer;
+};
+
+// Renders the first 1, 2, 4, ... of the cameras, and all of them, each
+// rig for n_frames frames, and prints views/sec and ms per frame for
+// each rig size, to show how the single pass scales with the number of
+// views. Rigs are capped at MULTIVIEW_MAX_VIEWS; backgrounds may be
+// NULL or empty.
+void benchmark_multiview(DisplaySurfaceGeometry* geom, const std::vector<CameraModel>& cams,
+                         const std::vector<osg::Image*>& backgrounds, unsigned int n_frames,
+                         std::ostream& os);
+
+#endif
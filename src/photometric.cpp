@@ -0,0 +1,243 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include "photometric.h"
+#include "profiler.h"
+#include "util.h"
+
+#include <osg/BlendFunc>
+#include <osg/Texture2D>
+
+#include <stdio.h>
+#include <math.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <sstream>
+
+#ifndef GL_LUMINANCE16
+#define GL_LUMINANCE16 0x8042
+#endif
+
+// distance of pixel (x, y) to the image border, 0.5 at edge pixels
+static double border_distance(double x, double y, unsigned int w, unsigned int h) {
+    return std::min(std::min(x + 0.5, w - 0.5 - x), std::min(y + 0.5, h - 0.5 - y));
+}
+
+// Rec. 709 luminance of the measured image at LUT pixel (x, y), rows
+// from the top, nearest neighbour
+static float measured_luminance(const osg::Image* image, unsigned int x, unsigned int y,
+                                unsigned int w, unsigned int h) {
+    unsigned int s = (unsigned int)((x + 0.5)*image->s()/w);
+    unsigned int t = (unsigned int)((y + 0.5)*image->t()/h);
+    // osg::Image rows start at the bottom
+    osg::Vec4 c = image->getColor(s, image->t() - 1 - t);
+    return 0.2126f*c[0] + 0.7152f*c[1] + 0.0722f*c[2];
+}
+
+// The surface seen by one projector: its covered pixels and their
+// surface points.
+struct CoveredPixels {
+    std::vector<unsigned int> index;    // y*width + x
+    std::vector<double> xyz;
+    std::vector<double> brightness;     // attenuation times luminance
+};
+
+std::vector<CorrectionMap> compute_correction_maps(DisplaySurfaceGeometry& geom,
+                                                   const std::vector<PhotometricProjector>& projectors,
+                                                   double min_level) {
+    PROFILE_ZONE("correction maps");
+    const unsigned int n_proj = projectors.size();
+    std::vector<CorrectionMap> maps(n_proj);
+    std::vector<CoveredPixels> covered(n_proj);
+
+    double max_attenuation = 0.0;
+    for (unsigned int k=0; k<n_proj; k++) {
+        const PhotometricProjector& proj = projectors[k];
+        const SurfaceLUT& lut = proj.lut;
+        CorrectionMap& map = maps[k];
+        map.width = lut.width;
+        map.height = lut.height;
+        map.attenuation.assign((size_t)lut.width*lut.height, 0.0f);
+
+        CoveredPixels& px = covered[k];
+        std::vector<double> tc;
+        for (unsigned int i=0; i<lut.width*lut.height; i++) {
+            if (lut.data[3*i+2] > 0.0f) {
+                px.index.push_back(i);
+                tc.push_back(lut.data[3*i]);
+                tc.push_back(lut.data[3*i+1]);
+            }
+        }
+        const unsigned int n = px.index.size();
+        if (n == 0) {
+            continue;
+        }
+        px.xyz.resize(3*n);
+        std::vector<double> normals(3*n);
+        geom.texcoord2worldcoord(&tc[0], n, &px.xyz[0]);
+        geom.texcoord2normal(&tc[0], n, &normals[0]);
+
+        double R[9], t[3];
+        proj.cam.get_Rt(R, t);
+        const double center[3] = { -(R[0]*t[0] + R[3]*t[1] + R[6]*t[2]),
+                                   -(R[1]*t[0] + R[4]*t[1] + R[7]*t[2]),
+                                   -(R[2]*t[0] + R[5]*t[1] + R[8]*t[2]) };
+        for (unsigned int i=0; i<n; i++) {
+            const double* p = &px.xyz[3*i];
+            const double* nrm = &normals[3*i];
+            double d[3] = { center[0] - p[0], center[1] - p[1], center[2] - p[2] };
+            double dist2 = d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+            // the normal's sign depends on the model, light may come from either side
+            double cos_incidence = fabs(nrm[0]*d[0] + nrm[1]*d[1] + nrm[2]*d[2])/sqrt(dist2);
+            float a = cos_incidence/dist2;
+            map.attenuation[px.index[i]] = a;
+            max_attenuation = std::max(max_attenuation, (double)a);
+        }
+    }
+
+    // relative brightness of every covered pixel
+    double max_brightness = 0.0;
+    for (unsigned int k=0; k<n_proj; k++) {
+        const PhotometricProjector& proj = projectors[k];
+        CorrectionMap& map = maps[k];
+        CoveredPixels& px = covered[k];
+        float max_luminance = 0.0f;
+        if (proj.luminance.valid()) {
+            for (int t=0; t<proj.luminance->t(); t++) {
+                for (int s=0; s<proj.luminance->s(); s++) {
+                    osg::Vec4 c = proj.luminance->getColor(s, t);
+                    max_luminance = std::max(max_luminance, 0.2126f*c[0] + 0.7152f*c[1] + 0.0722f*c[2]);
+                }
+            }
+        }
+        for (unsigned int i=0; i<map.attenuation.size() && max_attenuation>0.0; i++) {
+            map.attenuation[i] /= max_attenuation;
+        }
+        px.brightness.resize(px.index.size());
+        for (unsigned int i=0; i<px.index.size(); i++) {
+            unsigned int idx = px.index[i];
+            double b = map.attenuation[idx];
+            if (max_luminance > 0.0f) {
+                b *= measured_luminance(proj.luminance.get(), idx % map.width, idx / map.width,
+                                        map.width, map.height)/max_luminance;
+            }
+            px.brightness[i] = b;
+            max_brightness = std::max(max_brightness, b);
+        }
+    }
+
+    // The dimmest point sets the level, unless it is below min_level.
+    double target = max_brightness;
+    for (unsigned int k=0; k<n_proj; k++) {
+        for (unsigned int i=0; i<covered[k].brightness.size(); i++) {
+            double b = covered[k].brightness[i];
+            if (b >= min_level*max_brightness) {
+                target = std::min(target, b);
+            }
+        }
+    }
+
+    for (unsigned int k=0; k<n_proj; k++) {
+        CorrectionMap& map = maps[k];
+        CoveredPixels& px = covered[k];
+        const unsigned int n = px.index.size();
+        map.blend.assign((size_t)map.width*map.height, 0.0f);
+        // pixels without surface keep full gain
+        map.gain.assign((size_t)map.width*map.height, 65535);
+
+        // border distance of this pixel and of the pixels of other
+        // projectors that see the same surface point
+        std::vector<double> weight(n), weight_sum(n);
+        for (unsigned int i=0; i<n; i++) {
+            weight[i] = weight_sum[i] = border_distance(px.index[i] % map.width, px.index[i] / map.width,
+                                                        map.width, map.height);
+        }
+        for (unsigned int j=0; j<n_proj && n>0; j++) {
+            if (j == k) {
+                continue;
+            }
+            const PhotometricProjector& other = projectors[j];
+            const SurfaceLUT& lut = other.lut;
+            std::vector<double> uv(2*n);
+            other.cam.project_3d_to_pixel(&px.xyz[0], n, &uv[0]);
+            double R[9], t[3];
+            other.cam.get_Rt(R, t);
+            for (unsigned int i=0; i<n; i++) {
+                const double* p = &px.xyz[3*i];
+                double depth = R[6]*p[0] + R[7]*p[1] + R[8]*p[2] + t[2];
+                double x = uv[2*i];
+                double y = other.cam.y_up() ? (lut.height - 1.0) - uv[2*i+1] : uv[2*i+1];
+                double w = border_distance(x, y, lut.width, lut.height);
+                if (depth <= 0.0 || w <= 0.0) {
+                    continue;
+                }
+                unsigned int idx = (unsigned int)(y + 0.5)*lut.width + (unsigned int)(x + 0.5);
+                float seen = lut.data[3*idx+2];
+                // occluded from there if its nearest surface is closer
+                if (seen > 0.0f && fabs(seen - depth) < 0.01*depth) {
+                    weight_sum[i] += w;
+                }
+            }
+        }
+
+        for (unsigned int i=0; i<n; i++) {
+            unsigned int idx = px.index[i];
+            double blend = weight[i]/weight_sum[i];
+            map.blend[idx] = blend;
+            double b = px.brightness[i];
+            double gain = b > 0.0 ? std::min(1.0, blend*target/b) : 0.0;
+            map.gain[idx] = (unsigned short)(gain*65535.0 + 0.5);
+        }
+    }
+    return maps;
+}
+
+void write_correction_pgm(const CorrectionMap& map, const std::string& fname) {
+    FILE* f = fopen(fname.c_str(), "wb");
+    if (!f) {
+        std::ostringstream os;
+        os << "Could not open " << fname;
+        throw std::ios_base::failure(os.str());
+    }
+    fprintf(f, "P5\n%u %u\n65535\n", map.width, map.height);
+    // PGM wants big endian samples
+    std::vector<unsigned char> row(2*map.width);
+    for (unsigned int y=0; y<map.height; y++) {
+        for (unsigned int x=0; x<map.width; x++) {
+            unsigned short g = map.gain[(size_t)y*map.width + x];
+            row[2*x] = g >> 8;
+            row[2*x+1] = g & 0xff;
+        }
+        fwrite(&row[0], 1, row.size(), f);
+    }
+    fclose(f);
+}
+
+osg::ref_ptr<osg::Image> make_correction_image(const CorrectionMap& map) {
+    osg::ref_ptr<osg::Image> image = new osg::Image;
+    image->allocateImage(map.width, map.height, 1, GL_LUMINANCE, GL_UNSIGNED_SHORT);
+    for (unsigned int y=0; y<map.height; y++) {
+        std::copy(&map.gain[(size_t)y*map.width], &map.gain[(size_t)y*map.width] + map.width,
+                  (unsigned short*)image->data(0, map.height - 1 - y));
+    }
+    return image;
+}
+
+osg::Camera* make_correction_pass(const CorrectionMap& map) {
+    osg::Texture2D* texture = new osg::Texture2D(make_correction_image(map).get());
+    texture->setInternalFormat(GL_LUMINANCE16);
+    texture->setResizeNonPowerOfTwoHint(false);
+    texture->setFilter(osg::Texture::MIN_FILTER, osg::Texture::NEAREST);
+    texture->setFilter(osg::Texture::MAG_FILTER, osg::Texture::NEAREST);
+    texture->setWrap(osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE);
+    texture->setWrap(osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE);
+
+    osg::Camera* camera = createHUD();
+    camera->addDescription("photometric correction");
+    camera->addChild(make_textured_quad(texture));
+
+    // framebuffer = framebuffer * gain
+    osg::StateSet* ss = camera->getOrCreateStateSet();
+    ss->setAttributeAndModes(new osg::BlendFunc(GL_ZERO, GL_SRC_COLOR), osg::StateAttribute::ON);
+    ss->setMode(GL_DEPTH_TEST, osg::StateAttribute::OFF);
+    return camera;
+}
@@ -0,0 +1,53 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef PHOTOMETRIC_H
+#define PHOTOMETRIC_H
+
+#include <string>
+#include <vector>
+
+#include <osg/Camera>
+#include <osg/Image>
+
+#include "DisplaySurfaceGeometry.h"
+#include "camera_model.h"
+#include "batch_render.h"
+
+// A projector to correct: its calibration, its surface LUT (see
+// rasterize_surface()) and optionally a measured luminance image of it
+// projecting full white, rows as read by osgDB, resampled to the LUT.
+struct PhotometricProjector {
+    PhotometricProjector() : cam(0, 0) {}
+    CameraModel cam;
+    SurfaceLUT lut;
+    osg::ref_ptr<osg::Image> luminance;
+};
+
+// Per pixel maps of one projector, rows from the top of the image.
+struct CorrectionMap {
+    unsigned int width;
+    unsigned int height;
+    std::vector<float> attenuation;     // cosine falloff / distance^2, 1 at the brightest pixel of all projectors
+    std::vector<float> blend;           // share of this projector where projectors overlap
+    std::vector<unsigned short> gain;   // final correction, 65535 is 1
+};
+
+// Correction maps that make every covered surface point as bright as
+// the dimmest one, with overlapping projectors cross-faded by their
+// pixels' distance to the image border. Relative brightness is the
+// geometric attenuation times the measured luminance; pixels dimmer
+// than min_level of the brightest are left at full gain rather than
+// dragging everything down to them.
+std::vector<CorrectionMap> compute_correction_maps(DisplaySurfaceGeometry& geom,
+                                                   const std::vector<PhotometricProjector>& projectors,
+                                                   double min_level=0.2);
+
+// 16 bit binary PGM
+void write_correction_pgm(const CorrectionMap& map, const std::string& fname);
+// GL_LUMINANCE16 image of the gain, bottom row first as osg::Image wants
+osg::ref_ptr<osg::Image> make_correction_image(const CorrectionMap& map);
+// Post render camera drawing the gain over the whole viewport with
+// blending set to multiply, so the frame is corrected on the GPU with
+// no per frame work. The viewport must be the projector's image.
+osg::Camera* make_correction_pass(const CorrectionMap& map);
+
+#endif
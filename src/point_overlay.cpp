@@ -0,0 +1,331 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include "point_overlay.h"
+#include "util.h"
+#include "profiler.h"
+
+#include <OpenThreads/ScopedLock>
+
+#include <osg/BufferObject>
+#include <osg/GLExtensions>
+#include <osg/GraphicsContext>
+#include <osg/PointSprite>
+#include <osg/Program>
+#include <osg/Shader>
+#include <osg/Timer>
+#include <osgViewer/Viewer>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdexcept>
+
+// regions of the persistently mapped buffer, drawn in turn
+#define POINT_BUFFER_REGIONS 3
+
+#ifndef GL_MAP_WRITE_BIT
+#define GL_MAP_WRITE_BIT 0x0002
+#endif
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+#ifndef GL_SYNC_GPU_COMMANDS_COMPLETE
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#endif
+#ifndef GL_SYNC_FLUSH_COMMANDS_BIT
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x00000001
+#endif
+#ifndef GL_TIMEOUT_EXPIRED
+#define GL_TIMEOUT_EXPIRED 0x911B
+#endif
+#ifndef GL_VERTEX_PROGRAM_POINT_SIZE
+#define GL_VERTEX_PROGRAM_POINT_SIZE 0x8642
+#endif
+
+// GL 4.4 buffer storage and GL 3.2 sync objects, which not every OSG
+// version wraps. A GLsync is an opaque pointer.
+typedef void* PointSync;
+typedef void (GL_APIENTRY * BufferStorageProc)(GLenum target, GLsizeiptrARB size,
+                                               const GLvoid* data, GLbitfield flags);
+typedef GLvoid* (GL_APIENTRY * MapBufferRangeProc)(GLenum target, GLintptrARB offset,
+                                                   GLsizeiptrARB length, GLbitfield access);
+typedef PointSync (GL_APIENTRY * FenceSyncProc)(GLenum condition, GLbitfield flags);
+typedef GLenum (GL_APIENTRY * ClientWaitSyncProc)(PointSync sync, GLbitfield flags,
+                                                  unsigned long long timeout);
+typedef void (GL_APIENTRY * DeleteSyncProc)(PointSync sync);
+
+class PointCloudDrawable : public osg::Drawable {
+public:
+    PointCloudDrawable() : _overlay(NULL) { init(); }
+    PointCloudDrawable(PointOverlay* overlay) : _overlay(overlay) {
+        init();
+        setUseDisplayList(false);
+        setDataVariance(osg::Object::DYNAMIC);
+    }
+    PointCloudDrawable(const PointCloudDrawable& other,
+                       const osg::CopyOp& copyop=osg::CopyOp::SHALLOW_COPY) :
+        osg::Drawable(other, copyop), _overlay(other._overlay) { init(); }
+
+    META_Object(flyvr, PointCloudDrawable);
+
+    virtual void drawImplementation(osg::RenderInfo& renderInfo) const {
+        PROFILE_ZONE("point overlay");
+        osg::State* state = renderInfo.getState();
+        osg::GLBufferObject::Extensions* ext =
+            osg::GLBufferObject::getExtensions(state->getContextID(), true);
+        if (!_vbo) {
+            create_buffer(*state, ext);
+        }
+
+        state->disableAllVertexArrays();
+        state->unbindVertexBufferObject();
+        ext->glBindBuffer(GL_ARRAY_BUFFER_ARB, _vbo);
+        if (_overlay->version()!=_version) {
+            upload(ext);
+        }
+
+        const unsigned int capacity = _overlay->capacity();
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glVertexPointer(3, GL_FLOAT, 0, 0);
+        glDrawArrays(GL_POINTS, _mapped ? _region*capacity : 0, _n_points);
+        glDisableClientState(GL_VERTEX_ARRAY);
+        ext->glBindBuffer(GL_ARRAY_BUFFER_ARB, 0);
+
+        if (_mapped) {
+            // the region may be rewritten once this draw is done with it
+            if (_fences[_region]) {
+                _delete_sync(_fences[_region]);
+            }
+            _fences[_region] = _fence_sync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        }
+    }
+
+private:
+    void init() {
+        _vbo = 0;
+        _mapped = NULL;
+        _region = 0;
+        _n_points = 0;
+        _version = 0;
+        for (int i=0; i<POINT_BUFFER_REGIONS; i++) {
+            _fences[i] = NULL;
+        }
+    }
+
+    void create_buffer(osg::State& state, osg::GLBufferObject::Extensions* ext) const {
+        const GLsizeiptrARB bytes = _overlay->capacity()*sizeof(osg::Vec3);
+        ext->glGenBuffers(1, &_vbo);
+        ext->glBindBuffer(GL_ARRAY_BUFFER_ARB, _vbo);
+
+        unsigned int id = state.getContextID();
+        if (osg::isGLExtensionOrVersionSupported(id, "GL_ARB_buffer_storage", 4.4f) &&
+            osg::isGLExtensionOrVersionSupported(id, "GL_ARB_sync", 3.2f)) {
+            BufferStorageProc buffer_storage = NULL;
+            MapBufferRangeProc map_buffer_range = NULL;
+            osg::setGLExtensionFuncPtr(buffer_storage, "glBufferStorage");
+            osg::setGLExtensionFuncPtr(map_buffer_range, "glMapBufferRange");
+            osg::setGLExtensionFuncPtr(_fence_sync, "glFenceSync");
+            osg::setGLExtensionFuncPtr(_client_wait_sync, "glClientWaitSync");
+            osg::setGLExtensionFuncPtr(_delete_sync, "glDeleteSync");
+            if (buffer_storage && map_buffer_range && _fence_sync && _client_wait_sync && _delete_sync) {
+                const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+                buffer_storage(GL_ARRAY_BUFFER_ARB, POINT_BUFFER_REGIONS*bytes, NULL, flags);
+                _mapped = (osg::Vec3*)map_buffer_range(GL_ARRAY_BUFFER_ARB, 0,
+                                                       POINT_BUFFER_REGIONS*bytes, flags);
+            }
+        }
+        if (!_mapped) {
+            ext->glBufferData(GL_ARRAY_BUFFER_ARB, bytes, NULL, GL_STREAM_DRAW_ARB);
+        }
+        ext->glBindBuffer(GL_ARRAY_BUFFER_ARB, 0);
+    }
+
+    // with _vbo bound
+    void upload(osg::GLBufferObject::Extensions* ext) const {
+        if (_mapped) {
+            unsigned int next = (_region + 1) % POINT_BUFFER_REGIONS;
+            if (_fences[next]) {
+                // normally long signalled, a region is reused two frames later
+                while (_client_wait_sync(_fences[next], GL_SYNC_FLUSH_COMMANDS_BIT,
+                                         1000000000ULL)==GL_TIMEOUT_EXPIRED) {
+                }
+                _delete_sync(_fences[next]);
+                _fences[next] = NULL;
+            }
+            _n_points = _overlay->copy_to(_mapped + next*_overlay->capacity(), _version);
+            _region = next;
+            return;
+        }
+        // Orphan the old storage so the driver need not wait for the
+        // previous draw to finish before handing out memory.
+        ext->glBufferData(GL_ARRAY_BUFFER_ARB, _overlay->capacity()*sizeof(osg::Vec3),
+                          NULL, GL_STREAM_DRAW_ARB);
+        osg::Vec3* dst = (osg::Vec3*)ext->glMapBuffer(GL_ARRAY_BUFFER_ARB, GL_WRITE_ONLY_ARB);
+        if (dst) {
+            _n_points = _overlay->copy_to(dst, _version);
+            ext->glUnmapBuffer(GL_ARRAY_BUFFER_ARB);
+        }
+    }
+
+    PointOverlay* _overlay;
+    mutable GLuint _vbo;
+    mutable osg::Vec3* _mapped;
+    mutable unsigned int _region;
+    mutable unsigned int _n_points;
+    mutable unsigned long long _version;
+    mutable PointSync _fences[POINT_BUFFER_REGIONS];
+    mutable FenceSyncProc _fence_sync;
+    mutable ClientWaitSyncProc _client_wait_sync;
+    mutable DeleteSyncProc _delete_sync;
+};
+
+// ---- PointOverlay ------------------------------------------------
+
+PointOverlay::PointOverlay(unsigned int capacity, float point_size, osg::Vec4 color) :
+    _ring(capacity), _head(0), _count(0), _version(0)
+{
+    if (capacity==0) {
+        throw std::runtime_error("point overlay needs a capacity of at least one point");
+    }
+    _geode = new osg::Geode;
+    _geode->addDescription("point overlay");
+    _geode->addDrawable(new PointCloudDrawable(this));
+    // points may be anywhere, and their bound changes every frame
+    _geode->setCullingActive(false);
+
+    osg::StateSet* ss = _geode->getOrCreateStateSet();
+    osg::Program* program = new osg::Program;
+    osg::Shader* vert = new osg::Shader(osg::Shader::VERTEX);
+    osg::Shader* frag = new osg::Shader(osg::Shader::FRAGMENT);
+    LoadShaderSource(vert, "points.vert");
+    LoadShaderSource(frag, "points.frag");
+    program->addShader(vert);
+    program->addShader(frag);
+    ss->setAttributeAndModes(program, osg::StateAttribute::ON);
+    ss->addUniform(new osg::Uniform("point_size", point_size));
+    ss->addUniform(new osg::Uniform("point_color", color));
+    ss->setTextureAttributeAndModes(0, new osg::PointSprite, osg::StateAttribute::ON);
+    ss->setMode(GL_VERTEX_PROGRAM_POINT_SIZE, osg::StateAttribute::ON);
+    // an overlay: on top of the background and the surface
+    ss->setMode(GL_DEPTH_TEST, osg::StateAttribute::OFF);
+    ss->setMode(GL_LIGHTING, osg::StateAttribute::OFF);
+    ss->setRenderBinDetails(10, "RenderBin");
+}
+
+void PointOverlay::push(const osg::Vec3* positions, unsigned int n) {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    const unsigned int capacity = _ring.size();
+    // only the newest capacity positions survive
+    if (n > capacity) {
+        positions += n - capacity;
+        n = capacity;
+    }
+    unsigned int first = capacity - _head;
+    if (first > n) {
+        first = n;
+    }
+    memcpy(&_ring[_head], positions, first*sizeof(osg::Vec3));
+    if (n > first) {
+        memcpy(&_ring[0], positions + first, (n - first)*sizeof(osg::Vec3));
+    }
+    _head = (_head + n) % capacity;
+    _count = _count + n > capacity ? capacity : _count + n;
+    _version++;
+}
+
+void PointOverlay::clear() {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    _head = 0;
+    _count = 0;
+    _version++;
+}
+
+unsigned int PointOverlay::size() const {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    return _count;
+}
+
+unsigned long long PointOverlay::version() const {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    return _version;
+}
+
+unsigned int PointOverlay::copy_to(osg::Vec3* dst, unsigned long long& version) const {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    // Points are drawn in any order. Until the ring wraps the valid
+    // ones are at the start, afterwards all of them are valid.
+    memcpy(dst, &_ring[0], _count*sizeof(osg::Vec3));
+    version = _version;
+    return _count;
+}
+
+// ---- benchmark ---------------------------------------------------
+
+// waits for the GPU so that timings cover the whole frame
+class OverlayFinishCallback : public osg::Camera::DrawCallback {
+public:
+    virtual void operator () (osg::RenderInfo& renderInfo) const {
+        glFinish();
+    }
+};
+
+static float random_unit() {
+    return rand()/(float)RAND_MAX*2.0f - 1.0f;
+}
+
+double benchmark_point_overlay(const CameraModel& cam, unsigned int n_points,
+                               const osg::Vec3& center, float radius,
+                               unsigned int n_frames) {
+    // two sets of points, alternated so that every frame uploads
+    std::vector<osg::Vec3> points[2];
+    for (int k=0; k<2; k++) {
+        points[k].reserve(n_points);
+        while (points[k].size() < n_points) {
+            osg::Vec3 p(random_unit(), random_unit(), random_unit());
+            if (p.length2() <= 1.0f) {
+                points[k].push_back(center + p*radius);
+            }
+        }
+    }
+    PointOverlay overlay(n_points);
+
+    osg::ref_ptr<osg::GraphicsContext::Traits> traits = new osg::GraphicsContext::Traits;
+    traits->x = 0;
+    traits->y = 0;
+    traits->width = cam.width();
+    traits->height = cam.height();
+    traits->windowDecoration = false;
+    traits->doubleBuffer = false;
+    traits->pbuffer = true;
+    osg::ref_ptr<osg::GraphicsContext> gc = osg::GraphicsContext::createGraphicsContext(traits.get());
+    if (!gc.valid()) {
+        throw std::runtime_error("could not create offscreen context for the point overlay benchmark");
+    }
+
+    osgViewer::Viewer viewer;
+    viewer.setThreadingModel(osgViewer::Viewer::SingleThreaded);
+    viewer.setSceneData(overlay.node());
+    osg::Camera* camera = viewer.getCamera();
+    camera->setGraphicsContext(gc.get());
+    camera->setViewport(new osg::Viewport(0, 0, cam.width(), cam.height()));
+    camera->setComputeNearFarMode(osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR);
+    camera->setViewMatrix(cam.view());
+    camera->setProjectionMatrix(cam.projection(0.01f, 100.0f));
+    viewer.realize();
+
+    // the first frames compile shaders and create the buffer
+    for (int i=0; i<2; i++) {
+        overlay.push(&points[i][0], n_points);
+        viewer.frame();
+    }
+    camera->setFinalDrawCallback(new OverlayFinishCallback);
+
+    osg::Timer timer;
+    osg::Timer_t start = timer.tick();
+    for (unsigned int i=0; i<n_frames; i++) {
+        overlay.push(&points[i%2][0], n_points);
+        viewer.frame();
+    }
+    return n_frames/timer.delta_s(start, timer.tick());
+}
@@ -0,0 +1,66 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef POINT_OVERLAY_H
+#define POINT_OVERLAY_H
+
+#include <vector>
+
+#include <osg/Geode>
+#include <osg/Vec3>
+#include <osg/Vec4>
+#include <OpenThreads/Mutex>
+
+#include "camera_model.h"
+
+// Markers for many tracked 3D positions, drawn over the scene with the
+// view and projection of the camera rendering it. Positions go into a
+// ring holding the newest capacity() of them. At draw time the ring is
+// copied into one persistently mapped vertex buffer (three regions
+// fenced in turn, so the copy never waits for the GPU) and drawn as
+// round point sprites with a single glDrawArrays(). Without
+// GL_ARB_buffer_storage the buffer is orphaned and refilled instead.
+//
+// Only one graphics context is supported, and the overlay must outlive
+// the scene graph holding its node.
+class PointOverlay {
+public:
+    PointOverlay(unsigned int capacity, float point_size=4.0f,
+                 osg::Vec4 color=osg::Vec4(1.0f, 0.2f, 0.2f, 1.0f));
+
+    // append positions, overwriting the oldest once the ring is full;
+    // safe to call from a tracking thread
+    void push(const osg::Vec3* positions, unsigned int n);
+    void push(const osg::Vec3& position) { push(&position, 1); }
+    // drop all positions
+    void clear();
+
+    unsigned int capacity() const { return _ring.size(); }
+    unsigned int size() const;
+
+    // add under the scene root
+    osg::Geode* node() { return _geode.get(); }
+
+private:
+    friend class PointCloudDrawable;
+
+    // bumped by every push() and clear()
+    unsigned long long version() const;
+    // copy the ring to dst, returns the number of points and their version
+    unsigned int copy_to(osg::Vec3* dst, unsigned long long& version) const;
+
+    std::vector<osg::Vec3> _ring;
+    unsigned int _head;     // next position written
+    unsigned int _count;
+    unsigned long long _version;
+    mutable OpenThreads::Mutex _mutex;
+
+    osg::ref_ptr<osg::Geode> _geode;
+};
+
+// Frames per second drawing an overlay of n_points, all replaced every
+// frame, through cam into an offscreen buffer of the camera's size.
+// The points fill a sphere of radius about center.
+double benchmark_point_overlay(const CameraModel& cam, unsigned int n_points,
+                               const osg::Vec3& center, float radius,
+                               unsigned int n_frames=100);
+
+#endif
@@ -0,0 +1,289 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include "pose_predictor.h"
+
+#include <OpenThreads/ScopedLock>
+#include <osg/Timer>
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cmath>
+
+PosePredictor::PosePredictor(Method method) :
+    _method(method), _q(50.0), _r(1e-6)
+{
+    reset();
+}
+
+double PosePredictor::now() {
+    return osg::Timer::instance()->time_s();
+}
+
+void PosePredictor::set_noise(double process, double measurement) {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    _q = process;
+    _r = measurement;
+}
+
+void PosePredictor::reset() {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    _n_samples = 0;
+    _t_last = 0.0;
+    _pos = osg::Vec3d(0.0, 0.0, 0.0);
+    _vel = osg::Vec3d(0.0, 0.0, 0.0);
+    _P00 = _r;
+    _P01 = 0.0;
+    _P11 = 1.0;
+}
+
+bool PosePredictor::is_valid() const {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    return _n_samples > 0;
+}
+
+void PosePredictor::add_sample(double t, osg::Vec3 eye) {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    osg::Vec3d z(eye);
+
+    if (_n_samples==0) {
+        _pos = z;
+        _vel = osg::Vec3d(0.0, 0.0, 0.0);
+        _P00 = _r;
+        _P01 = 0.0;
+        _P11 = 1.0;
+        _t_last = t;
+        _n_samples++;
+        return;
+    }
+
+    double dt = t - _t_last;
+    if (dt <= 0.0) {
+        // duplicate or out of order sample
+        return;
+    }
+
+    if (_method==CONSTANT_VELOCITY) {
+        _vel = (z - _pos)/dt;
+        _pos = z;
+    } else {
+        // Constant velocity Kalman filter, one per axis. The model and
+        // noise are the same for every axis, so the covariance is
+        // shared.
+
+        // predict
+        osg::Vec3d pos = _pos + _vel*dt;
+        double dt2 = dt*dt;
+        double P00 = _P00 + 2.0*dt*_P01 + dt2*_P11 + _q*dt2*dt/3.0;
+        double P01 = _P01 + dt*_P11 + _q*dt2/2.0;
+        double P11 = _P11 + _q*dt;
+
+        // update
+        double S = P00 + _r;
+        double K0 = P00/S;
+        double K1 = P01/S;
+        osg::Vec3d innovation = z - pos;
+        _pos = pos + innovation*K0;
+        _vel = _vel + innovation*K1;
+
+        _P00 = (1.0-K0)*P00;
+        _P01 = (1.0-K0)*P01;
+        _P11 = P11 - K1*P01;
+    }
+    _t_last = t;
+    _n_samples++;
+}
+
+osg::Vec3 PosePredictor::predict(double t) const {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    if (_n_samples==0) {
+        throw std::runtime_error("cannot predict pose without samples");
+    }
+    return _pos + _vel*(t - _t_last);
+}
+
+void apply_predicted_pose(CameraModel* cam, const PosePredictor& predictor, double t) {
+    osg::Vec3 eye = predictor.predict(t);
+    cam->set_extrinsic( cam->orientation(), eye );
+}
+
+LateLatchViewCallback::LateLatchViewCallback(PosePredictor* predictor, osg::Node* raycast_node,
+                                             double scanout_latency) :
+    _predictor(predictor), _scanout_latency(scanout_latency),
+    _cam(1, 1), _znear(0.0f), _zfar(0.0f), _has_camera(false)
+{
+    osg::StateSet* ss = raycast_node->getStateSet();
+    if (ss) {
+        _view_projection = ss->getUniform("view_projection");
+        _view_projection_inverse = ss->getUniform("view_projection_inverse");
+    }
+    if (!_view_projection.valid() || !_view_projection_inverse.valid()) {
+        throw std::runtime_error("late latch needs a node from make_raycast_geom()");
+    }
+    // keeps the next frame's update from running while draw still reads them
+    _view_projection->setDataVariance(osg::Object::DYNAMIC);
+    _view_projection_inverse->setDataVariance(osg::Object::DYNAMIC);
+}
+
+void LateLatchViewCallback::set_camera(const CameraModel& cam, float znear, float zfar) {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    _cam = cam;
+    _znear = znear;
+    _zfar = zfar;
+    _has_camera = true;
+}
+
+void LateLatchViewCallback::operator()(osg::RenderInfo& renderInfo) const {
+    if (!_predictor->is_valid()) {
+        return;
+    }
+    CameraModel cam(1, 1);
+    float znear, zfar;
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+        if (!_has_camera) {
+            return;
+        }
+        cam = _cam;
+        znear = _znear;
+        zfar = _zfar;
+    }
+    apply_predicted_pose(&cam, *_predictor, PosePredictor::now() + _scanout_latency);
+    osg::Matrixd view_projection = cam.view()*cam.projection(znear, zfar);
+    _view_projection->set(osg::Matrixf(view_projection));
+    _view_projection_inverse->set(osg::Matrixf(osg::Matrixd::inverse(view_projection)));
+}
+
+TrackPlayer::TrackPlayer(const std::vector<PoseSample>& track, PosePredictor* predictor, bool loop) :
+    _track(track), _predictor(predictor), _loop(loop), _done(0)
+{
+}
+
+void TrackPlayer::run() {
+    if (_track.empty()) {
+        return;
+    }
+    double offset = PosePredictor::now() - _track[0].t;
+    double duration = _track.back().t - _track[0].t;
+    unsigned int i=0;
+    while (_done == 0) {
+        double t = _track[i].t + offset;
+        double wait = t - PosePredictor::now();
+        if (wait > 0.0) {
+            OpenThreads::Thread::microSleep( (unsigned int)(wait*1e6) );
+        }
+        _predictor->add_sample( t, _track[i].eye );
+        i++;
+        if (i==_track.size()) {
+            if (!_loop) {
+                break;
+            }
+            i = 0;
+            offset += duration;
+        }
+    }
+}
+
+int TrackPlayer::cancel() {
+    _done.exchange(1);
+    while (isRunning()) {
+        OpenThreads::Thread::YieldCurrentThread();
+    }
+    return 0;
+}
+
+std::vector<PoseSample> load_track(const char* fname) {
+    std::ifstream in(fname);
+    if (!in) {
+        std::ostringstream os;
+        os << "Could not open track file " << fname;
+        throw std::ios_base::failure(os.str());
+    }
+    std::vector<PoseSample> result;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0]=='#') {
+            continue;
+        }
+        std::istringstream ls(line);
+        double t, x, y, z;
+        if (!(ls >> t >> x >> y >> z)) {
+            throw std::runtime_error("Error parsing track: expected \"t x y z\"");
+        }
+        result.push_back( PoseSample(t, osg::Vec3(x,y,z)) );
+    }
+    return result;
+}
+
+// linearly interpolated true position, index i is a hint and is advanced
+static bool track_position(const std::vector<PoseSample>& track, double t,
+                           unsigned int& i, osg::Vec3d& result) {
+    while (i+1 < track.size() && track[i+1].t < t) {
+        i++;
+    }
+    if (i+1 >= track.size()) {
+        return false;
+    }
+    if (track[i+1].t <= track[i].t) {
+        // duplicate timestamps, nothing to interpolate
+        result = osg::Vec3d(track[i+1].eye);
+        return true;
+    }
+    double frac = (t - track[i].t) / (track[i+1].t - track[i].t);
+    result = osg::Vec3d(track[i].eye)*(1.0-frac) + osg::Vec3d(track[i+1].eye)*frac;
+    return true;
+}
+
+PredictionStats replay_track(const std::vector<PoseSample>& track,
+                             PosePredictor& predictor, double latency) {
+    PredictionStats stats;
+    stats.n = 0;
+    stats.latency = latency;
+    stats.mean_error = 0.0;
+    stats.rms_error = 0.0;
+    stats.max_error = 0.0;
+    stats.mean_error_last = 0.0;
+    stats.update_time_us = 0.0;
+
+    predictor.reset();
+
+    osg::Timer timer;
+    double total_us = 0.0;
+    unsigned int truth_idx = 0;
+    for (unsigned int i=0; i<track.size(); i++) {
+        osg::Timer_t start = timer.tick();
+        predictor.add_sample( track[i].t, track[i].eye );
+        osg::Vec3d predicted = predictor.predict( track[i].t + latency );
+        total_us += timer.delta_u(start, timer.tick());
+
+        osg::Vec3d truth;
+        if (!track_position(track, track[i].t + latency, truth_idx, truth)) {
+            break;
+        }
+        double err = (predicted - truth).length();
+        stats.mean_error += err;
+        stats.rms_error += err*err;
+        if (err > stats.max_error) {
+            stats.max_error = err;
+        }
+        stats.mean_error_last += (osg::Vec3d(track[i].eye) - truth).length();
+        stats.n++;
+    }
+
+    if (stats.n > 0) {
+        stats.mean_error /= stats.n;
+        stats.rms_error = sqrt(stats.rms_error/stats.n);
+        stats.mean_error_last /= stats.n;
+        stats.update_time_us = total_us/stats.n;
+    }
+    return stats;
+}
+
+std::ostream& operator<<(std::ostream& os, const PredictionStats& stats) {
+    os << "prediction over " << stats.n << " samples, horizon " << stats.latency*1000.0 << " msec: "
+       << "mean error " << stats.mean_error*1000.0 << " mm, "
+       << "rms " << stats.rms_error*1000.0 << " mm, "
+       << "max " << stats.max_error*1000.0 << " mm "
+       << "(last pose: mean " << stats.mean_error_last*1000.0 << " mm), "
+       << stats.update_time_us << " usec per update";
+    return os;
+}
@@ -0,0 +1,118 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef POSE_PREDICTOR_H
+#define POSE_PREDICTOR_H
+
+#include <vector>
+#include <ostream>
+
+#include <osg/Camera>
+#include <osg/Uniform>
+#include <OpenThreads/Atomic>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/Thread>
+
+#include "camera_model.h"
+
+// A tracked eye position. Timestamps are seconds on the
+// PosePredictor::now() clock.
+struct PoseSample {
+    PoseSample() : t(0.0) {}
+    PoseSample(double t_, osg::Vec3 eye_) : t(t_), eye(eye_) {}
+    double t;
+    osg::Vec3 eye;
+};
+
+// Extrapolates tracked eye positions to the time the frame will be
+// scanned out. Samples arrive from the tracker thread, predictions are
+// requested from the render thread.
+class PosePredictor {
+public:
+    enum Method { CONSTANT_VELOCITY, KALMAN };
+
+    PosePredictor(Method method=KALMAN);
+
+    void add_sample(double t, osg::Vec3 eye);
+    osg::Vec3 predict(double t) const;
+
+    // Kalman tuning: acceleration noise density (m^2/s^3) and tracker
+    // measurement variance (m^2).
+    void set_noise(double process, double measurement);
+
+    bool is_valid() const;
+    void reset();
+
+    static double now();
+
+private:
+    Method _method;
+    double _q;
+    double _r;
+
+    mutable OpenThreads::Mutex _mutex;
+    unsigned int _n_samples;
+    double _t_last;
+    osg::Vec3d _pos;
+    osg::Vec3d _vel;
+    // position/velocity covariance, identical for all three axes
+    double _P00, _P01, _P11;
+};
+
+// move the camera eye to the predicted position, keeping view direction and up
+void apply_predicted_pose(CameraModel* cam, const PosePredictor& predictor, double t);
+
+// Late latch: re-predict the eye position when the camera starts
+// drawing and write the view_projection uniforms of a ray cast surface
+// (see DisplaySurfaceGeometry::make_raycast_geom()). Install it with
+// setPreDrawCallback() on the camera drawing that node. Geometry drawn
+// with gl_ModelViewProjectionMatrix keeps the pose cull saw.
+//
+// The draw thread never touches the main loop's CameraModel: the loop
+// hands over a copy with set_camera() whenever the orientation,
+// intrinsics or clip planes change.
+class LateLatchViewCallback : public osg::Camera::DrawCallback {
+public:
+    LateLatchViewCallback(PosePredictor* predictor, osg::Node* raycast_node, double scanout_latency);
+    void set_camera(const CameraModel& cam, float znear, float zfar);
+    virtual void operator()(osg::RenderInfo& renderInfo) const;
+private:
+    PosePredictor* _predictor;
+    osg::ref_ptr<osg::Uniform> _view_projection;
+    osg::ref_ptr<osg::Uniform> _view_projection_inverse;
+    double _scanout_latency;
+    mutable OpenThreads::Mutex _mutex;
+    CameraModel _cam;
+    float _znear;
+    float _zfar;
+    bool _has_camera;
+};
+
+// Feeds a recorded track into a predictor in real time, like a tracker would.
+class TrackPlayer : public OpenThreads::Thread {
+public:
+    TrackPlayer(const std::vector<PoseSample>& track, PosePredictor* predictor, bool loop=true);
+    virtual void run();
+    virtual int cancel();
+private:
+    std::vector<PoseSample> _track;
+    PosePredictor* _predictor;
+    bool _loop;
+    OpenThreads::Atomic _done;
+};
+
+struct PredictionStats {
+    unsigned int n;
+    double latency;          // prediction horizon (sec)
+    double mean_error;       // predicted vs. true eye position (m)
+    double rms_error;
+    double max_error;
+    double mean_error_last;  // error when rendering the last tracked pose
+    double update_time_us;   // cost of add_sample()+predict()
+};
+
+// track file: one "t x y z" sample per line
+std::vector<PoseSample> load_track(const char* fname);
+PredictionStats replay_track(const std::vector<PoseSample>& track,
+                             PosePredictor& predictor, double latency);
+std::ostream& operator<<(std::ostream& os, const PredictionStats& stats);
+
+#endif
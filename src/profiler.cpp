@@ -0,0 +1,266 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include "profiler.h"
+#include "util.h"
+
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+
+#include <osg/Geode>
+#include <osg/Stats>
+#include <osgText/Text>
+
+#include <time.h>
+#include <stdio.h>
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#define PROFILE_RING_SIZE (1<<16) // events per thread, must be a power of 2
+
+struct ProfileEvent {
+    const char* name;
+    profile_ns_t start;
+    profile_ns_t end;
+};
+
+struct ProfileRing {
+    ProfileRing(const std::string& track_, unsigned int tid_) :
+        track(track_), tid(tid_), events(PROFILE_RING_SIZE), count(0) {}
+    std::string track;
+    unsigned int tid;
+    std::vector<ProfileEvent> events;
+    unsigned long long count;
+    // held by the writer for each event and by the exporters while they
+    // read, so it is only ever contended by an exporter
+    OpenThreads::Mutex mutex;
+};
+
+// Rings are never freed so that zones recorded by threads that have
+// since exited can still be exported.
+static OpenThreads::Mutex rings_mutex;
+static std::vector<ProfileRing*> rings;
+static __thread ProfileRing* thread_ring = NULL;
+
+static ProfileRing* new_ring(const std::string& track) {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(rings_mutex);
+    ProfileRing* ring = new ProfileRing(track, rings.size());
+    rings.push_back(ring);
+    return ring;
+}
+
+static ProfileRing* new_thread_ring() {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(rings_mutex);
+    std::ostringstream os;
+    os << "thread " << rings.size();
+    ProfileRing* ring = new ProfileRing(os.str(), rings.size());
+    rings.push_back(ring);
+    return ring;
+}
+
+static ProfileRing* track_ring(const std::string& track) {
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(rings_mutex);
+        for (unsigned int i=0; i<rings.size(); i++) {
+            if (rings[i]->track==track) {
+                return rings[i];
+            }
+        }
+    }
+    return new_ring(track);
+}
+
+static inline void push_event(ProfileRing* ring, const char* name, profile_ns_t start, profile_ns_t end) {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(ring->mutex);
+    ProfileEvent& ev = ring->events[ring->count & (PROFILE_RING_SIZE-1)];
+    ev.name = name;
+    ev.start = start;
+    ev.end = end;
+    ring->count++;
+}
+
+profile_ns_t profile_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (profile_ns_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+void profile_record(const char* name, profile_ns_t start, profile_ns_t end) {
+    if (!thread_ring) {
+        thread_ring = new_thread_ring();
+    }
+    push_event(thread_ring, name, start, end);
+}
+
+void profile_record_track(const char* track, const char* name, profile_ns_t start, profile_ns_t end) {
+    push_event(track_ring(track), name, start, end);
+}
+
+// ---- OSG statistics ----------------------------------------------
+
+void profile_enable_viewer_stats(osgViewer::Viewer* viewer) {
+    osg::Stats* stats = viewer->getCamera()->getStats();
+    if (!stats) {
+        throw std::runtime_error("viewer camera has no stats, realize the viewer first");
+    }
+    stats->collectStats("rendering", true);
+    stats->collectStats("gpu", true);
+}
+
+static void copy_stats_zone(osg::Stats* stats, unsigned int frame, const std::string& prefix,
+                            const char* track, profile_ns_t offset) {
+    double begin, end;
+    if (stats->getAttribute(frame, prefix+" begin time", begin) &&
+        stats->getAttribute(frame, prefix+" end time", end)) {
+        profile_record_track(track, track,
+                             offset + (profile_ns_t)(begin*1e9),
+                             offset + (profile_ns_t)(end*1e9));
+    }
+}
+
+void profile_collect_viewer_stats(osgViewer::Viewer* viewer) {
+    static unsigned int last_frame = 0;
+
+    osg::Stats* stats = viewer->getCamera()->getStats();
+    if (!stats) {
+        return;
+    }
+
+    // OSG stats are seconds since the viewer started
+    profile_ns_t offset = profile_now_ns() - (profile_ns_t)(viewer->elapsedTime()*1e9);
+
+    // GPU timer queries complete a few frames late
+    const unsigned int lag = 3;
+    unsigned int latest = stats->getLatestFrameNumber();
+    for (unsigned int frame=last_frame+1; frame+lag<=latest; frame++) {
+        copy_stats_zone(stats, frame, "Cull traversal", "cull", offset);
+        copy_stats_zone(stats, frame, "Draw traversal", "draw", offset);
+        copy_stats_zone(stats, frame, "GPU draw", "gpu", offset);
+        last_frame = frame;
+    }
+}
+
+// ---- export ------------------------------------------------------
+
+void profile_write_chrome_trace(const std::string& fname) {
+    std::ofstream out(fname.c_str());
+    if (!out) {
+        std::ostringstream os;
+        os << "Could not open trace file " << fname;
+        throw std::ios_base::failure(os.str());
+    }
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(rings_mutex);
+
+    // Events are recorded when their zone ends, so an outer zone comes
+    // after the zones nested in it and the earliest start can be
+    // anywhere in a ring. A zone that ends during the export may still
+    // start before t0, hence the signed time stamps below.
+    profile_ns_t t0 = (profile_ns_t)-1;
+    for (unsigned int i=0; i<rings.size(); i++) {
+        ProfileRing* ring = rings[i];
+        OpenThreads::ScopedLock<OpenThreads::Mutex> ring_lock(ring->mutex);
+        unsigned long long first = ring->count > PROFILE_RING_SIZE ? ring->count-PROFILE_RING_SIZE : 0;
+        for (unsigned long long j=first; j<ring->count; j++) {
+            t0 = std::min(t0, ring->events[j & (PROFILE_RING_SIZE-1)].start);
+        }
+    }
+
+    char buf[256];
+    bool first_event = true;
+    out << "{\"traceEvents\":[\n";
+    for (unsigned int i=0; i<rings.size(); i++) {
+        ProfileRing* ring = rings[i];
+        out << (first_event ? "" : ",\n");
+        first_event = false;
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << ring->tid
+            << ",\"args\":{\"name\":\"" << ring->track << "\"}}";
+
+        OpenThreads::ScopedLock<OpenThreads::Mutex> ring_lock(ring->mutex);
+        unsigned long long first = ring->count > PROFILE_RING_SIZE ? ring->count-PROFILE_RING_SIZE : 0;
+        for (unsigned long long j=first; j<ring->count; j++) {
+            const ProfileEvent& ev = ring->events[j & (PROFILE_RING_SIZE-1)];
+            // Chrome expects microseconds, keep the nanoseconds as decimals
+            snprintf(buf, sizeof(buf),
+                     ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                     ev.name, ring->tid, (long long)(ev.start-t0)*1e-3, (ev.end-ev.start)*1e-3);
+            out << buf;
+        }
+    }
+    out << "\n]}\n";
+}
+
+std::string profile_summary(double window_sec) {
+    profile_ns_t since = profile_now_ns() - (profile_ns_t)(window_sec*1e9);
+
+    // keyed by zone name, value is (total ns, count)
+    std::map<std::string, std::pair<double, unsigned int> > zones;
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(rings_mutex);
+        for (unsigned int i=0; i<rings.size(); i++) {
+            ProfileRing* ring = rings[i];
+            OpenThreads::ScopedLock<OpenThreads::Mutex> ring_lock(ring->mutex);
+            unsigned long long first = ring->count > PROFILE_RING_SIZE ? ring->count-PROFILE_RING_SIZE : 0;
+            for (unsigned long long j=ring->count; j>first; j--) {
+                const ProfileEvent& ev = ring->events[(j-1) & (PROFILE_RING_SIZE-1)];
+                if (ev.end < since) {
+                    break;
+                }
+                std::pair<double, unsigned int>& zone = zones[ev.name];
+                zone.first += ev.end - ev.start;
+                zone.second++;
+            }
+        }
+    }
+
+    std::ostringstream os;
+    char buf[128];
+    for (std::map<std::string, std::pair<double, unsigned int> >::const_iterator it=zones.begin();
+         it!=zones.end(); ++it) {
+        snprintf(buf, sizeof(buf), "%-16s %8.3f ms  (%u)\n",
+                 it->first.c_str(), it->second.first/it->second.second*1e-6, it->second.second);
+        os << buf;
+    }
+    return os.str();
+}
+
+// ---- HUD ---------------------------------------------------------
+
+class ProfilerHUDCallback : public osg::NodeCallback {
+public:
+    ProfilerHUDCallback(osgText::Text* text) : _text(text), _last_update(0) {}
+    virtual void operator()(osg::Node* node, osg::NodeVisitor* nv) {
+        // re-layout the text a few times per second, not every frame
+        profile_ns_t now = profile_now_ns();
+        if (now - _last_update > 250000000ULL) {
+            _text->setText(profile_summary());
+            _last_update = now;
+        }
+        traverse(node, nv);
+    }
+private:
+    osg::ref_ptr<osgText::Text> _text;
+    profile_ns_t _last_update;
+};
+
+osg::Camera* make_profiler_hud() {
+    osg::Camera* camera = createHUD();
+    camera->addDescription("profiler HUD");
+
+    osg::ref_ptr<osgText::Text> text = new osgText::Text;
+    text->setDataVariance(osg::Object::DYNAMIC);
+    text->setFont("fonts/VeraMono.ttf");
+    text->setCharacterSize(0.025f);
+    text->setPosition(osg::Vec3(0.01f, 0.97f, 0.0f));
+    text->setColor(osg::Vec4(1.0f, 1.0f, 0.0f, 1.0f));
+
+    osg::Geode* geode = new osg::Geode;
+    geode->addDrawable(text.get());
+    geode->getOrCreateStateSet()->setMode(GL_LIGHTING, osg::StateAttribute::OFF);
+    geode->setUpdateCallback(new ProfilerHUDCallback(text.get()));
+    camera->addChild(geode);
+    return camera;
+}
@@ -0,0 +1,66 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef PROFILER_H
+#define PROFILER_H
+
+// Scoped zone profiler. Build with -DENABLE_PROFILER=ON in cmake to
+// turn it on, otherwise PROFILE_ZONE() expands to nothing.
+//
+//   void draw() {
+//       PROFILE_ZONE("draw");
+//       ...
+//   }
+//
+// Each thread writes into its own ring buffer. A ring's lock is shared
+// only with the exporters, so recording does not wait on other threads
+// unless an exporter is reading that ring. The exporters may be called
+// from any thread.
+
+#include <string>
+
+#include <osg/Camera>
+#include <osgViewer/Viewer>
+
+typedef unsigned long long profile_ns_t;
+
+profile_ns_t profile_now_ns();
+
+// record a finished zone on the calling thread. name must be a string literal.
+void profile_record(const char* name, profile_ns_t start, profile_ns_t end);
+
+// record a zone that was timed elsewhere (e.g. on the GPU) on a named track
+void profile_record_track(const char* track, const char* name, profile_ns_t start, profile_ns_t end);
+
+class ProfileZone {
+public:
+    ProfileZone(const char* name) : _name(name), _start(profile_now_ns()) {}
+    ~ProfileZone() { profile_record(_name, _start, profile_now_ns()); }
+private:
+    const char* _name;
+    profile_ns_t _start;
+};
+
+#ifdef ENABLE_PROFILER
+#define PROFILE_CONCAT2(a,b) a##b
+#define PROFILE_CONCAT(a,b) PROFILE_CONCAT2(a,b)
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(_profile_zone_,__LINE__)(name)
+#else
+#define PROFILE_ZONE(name)
+#endif
+
+// Enable OSG's cull, draw and GPU timer query statistics for the
+// viewer and copy them into the "cull", "draw" and "gpu" tracks. Call
+// once per frame after frame().
+void profile_enable_viewer_stats(osgViewer::Viewer* viewer);
+void profile_collect_viewer_stats(osgViewer::Viewer* viewer);
+
+// write all recorded zones as Chrome trace JSON (chrome://tracing)
+void profile_write_chrome_trace(const std::string& fname);
+
+// mean duration per zone over the last window_sec, one zone per line
+std::string profile_summary(double window_sec=1.0);
+
+// HUD camera (see createHUD()) showing profile_summary(), refreshed
+// four times a second from its update callback
+osg::Camera* make_profiler_hud();
+
+#endif
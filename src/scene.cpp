@@ -0,0 +1,243 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include "scene.h"
+#include "profiler.h"
+
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Thread>
+
+#include <osg/Timer>
+#include <osgDB/ReadFile>
+
+#include <algorithm>
+#include <stdexcept>
+#include <sstream>
+
+std::ostream& operator<<(std::ostream& os, const SceneLoadStats& stats) {
+    os << "loaded " << stats.n_images << " images and " << stats.n_surfaces << " surfaces in "
+       << stats.seconds << " sec";
+    return os;
+}
+
+static unsigned int find_by_name(json_t* root, const char* key, const std::vector<std::string>& names) {
+    json_t* value = json_object_get(root, key);
+    if (!value) {
+        return 0;
+    }
+    if (!json_is_string(value)) {
+        std::ostringstream os;
+        os << "scene parsing " << key << ": expected string";
+        throw std::runtime_error(os.str());
+    }
+    std::vector<std::string>::const_iterator it = std::find(names.begin(), names.end(),
+                                                            std::string(json_string_value(value)));
+    if (it == names.end()) {
+        std::ostringstream os;
+        os << "scene " << key << ": no " << json_string_value(value);
+        throw std::runtime_error(os.str());
+    }
+    return it - names.begin();
+}
+
+static float get_render_number(json_t* render, const char* key) {
+    json_t* value = json_object_get(render, key);
+    if (!json_is_number(value)) {
+        std::ostringstream os;
+        os << "scene render parsing " << key << ": expected number";
+        throw std::runtime_error(os.str());
+    }
+    return json_number_value(value);
+}
+
+static void parse_scene(json_t* root, const std::string& dir, BatchManifest& manifest, SceneSettings& settings) {
+    parse_batch_manifest(root, dir, manifest);
+    if (manifest.cameras.empty() || manifest.surfaces.empty()) {
+        throw std::runtime_error("scene needs a camera and a surface");
+    }
+    std::vector<std::string> names;
+    for (unsigned int i=0; i<manifest.cameras.size(); i++) {
+        names.push_back(manifest.cameras[i].name);
+    }
+    settings.view = find_by_name(root, "view", names);
+    names.clear();
+    for (unsigned int i=0; i<manifest.surfaces.size(); i++) {
+        names.push_back(manifest.surfaces[i].name);
+    }
+    settings.surface = find_by_name(root, "surface", names);
+
+    json_t* render = json_object_get(root, "render");
+    if (render) {
+        if (!json_is_object(render)) {
+            throw std::runtime_error("scene parsing render: expected object");
+        }
+        settings.fixed_clip = true;
+        settings.znear = get_render_number(render, "znear");
+        settings.zfar = get_render_number(render, "zfar");
+    }
+}
+
+Scene::Scene(const char* fname) {
+    PROFILE_ZONE("scene manifest");
+    json_error_t error;
+    json_t* root = json_load_file(fname, 0, &error);
+    if (!root) {
+        std::ostringstream os;
+        os << "Could not load scene " << fname << " line " << error.line << ": " << error.text;
+        throw std::runtime_error(os.str());
+    }
+
+    std::string dir(fname);
+    size_t slash = dir.rfind('/');
+    dir = slash==std::string::npos ? std::string(".") : dir.substr(0, slash+1);
+
+    try {
+        parse_scene(root, dir, _manifest, _settings);
+    } catch (...) {
+        json_decref(root);
+        throw;
+    }
+    json_decref(root);
+
+    _surfaces.resize(_manifest.surfaces.size(), NULL);
+    _backgrounds.resize(_manifest.cameras.size());
+    _textures.resize(_manifest.cameras.size());
+}
+
+Scene::~Scene() {
+    for (unsigned int i=0; i<_surfaces.size(); i++) {
+        delete _surfaces[i];
+    }
+}
+
+void Scene::load(unsigned int resource) {
+    if (resource < _manifest.cameras.size()) {
+        PROFILE_ZONE("decode background");
+        const std::string& fname = _manifest.cameras[resource].background;
+        osg::ref_ptr<osg::Image> image = osgDB::readImageFile(fname);
+        if (!image.valid()) {
+            throw std::ios_base::failure("Could not open image file " + fname);
+        }
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+        _backgrounds[resource] = image;
+    } else {
+        unsigned int i = resource - _manifest.cameras.size();
+        DisplaySurfaceGeometry* geom = new DisplaySurfaceGeometry(_manifest.surfaces[i].fname.c_str());
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+        _surfaces[i] = geom;
+    }
+}
+
+DisplaySurfaceGeometry* Scene::surface(unsigned int i) {
+    if (i >= _surfaces.size()) {
+        throw std::out_of_range("scene has no such surface");
+    }
+    if (!_surfaces[i]) {
+        load(_manifest.cameras.size() + i);
+    }
+    return _surfaces[i];
+}
+
+osg::Image* Scene::background(unsigned int i) {
+    if (i >= _backgrounds.size()) {
+        throw std::out_of_range("scene has no such camera");
+    }
+    if (!_backgrounds[i].valid() && !_manifest.cameras[i].background.empty()) {
+        load(i);
+    }
+    return _backgrounds[i].get();
+}
+
+osg::Texture2D* Scene::background_texture(unsigned int i) {
+    osg::Image* image = background(i);
+    if (!image) {
+        return NULL;
+    }
+    if (!_textures[i].valid()) {
+        _textures[i] = new osg::Texture2D(image);
+        _textures[i]->setResizeNonPowerOfTwoHint(false);
+    }
+    return _textures[i].get();
+}
+
+// Pulls resources off the scene's list until it is empty.
+class SceneLoader : public OpenThreads::Thread {
+public:
+    SceneLoader(Scene* scene) : _scene(scene) {}
+
+    virtual void run() {
+        unsigned int resource;
+        while (_scene->next_resource(resource)) {
+            try {
+                _scene->load(resource);
+            } catch (std::exception& e) {
+                OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_scene->_mutex);
+                if (_scene->_error.empty()) {
+                    _scene->_error = e.what();
+                }
+            }
+        }
+    }
+
+private:
+    Scene* _scene;
+};
+
+bool Scene::next_resource(unsigned int& resource) {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    if (_pending.empty()) {
+        return false;
+    }
+    resource = _pending.back();
+    _pending.pop_back();
+    return true;
+}
+
+SceneLoadStats Scene::preload(const std::vector<unsigned int>& cameras, const std::vector<unsigned int>& surfaces,
+                              unsigned int n_threads) {
+    PROFILE_ZONE("scene preload");
+    osg::Timer_t start = osg::Timer::instance()->tick();
+    SceneLoadStats stats;
+    stats.n_images = 0;
+    stats.n_surfaces = 0;
+
+    _pending.clear();
+    _error.clear();
+    for (unsigned int i=0; i<surfaces.size(); i++) {
+        if (!_surfaces.at(surfaces[i]) &&
+            std::find(_pending.begin(), _pending.end(), _manifest.cameras.size() + surfaces[i]) == _pending.end()) {
+            _pending.push_back(_manifest.cameras.size() + surfaces[i]);
+            stats.n_surfaces++;
+        }
+    }
+    // images go last and are taken first, they take longest
+    for (unsigned int i=0; i<cameras.size(); i++) {
+        if (!_backgrounds.at(cameras[i]).valid() && !_manifest.cameras[cameras[i]].background.empty() &&
+            std::find(_pending.begin(), _pending.end(), cameras[i]) == _pending.end()) {
+            _pending.push_back(cameras[i]);
+            stats.n_images++;
+        }
+    }
+
+    if (n_threads==0) {
+        n_threads = std::max(1, OpenThreads::GetNumberOfProcessors());
+    }
+    n_threads = std::min(n_threads, (unsigned int)_pending.size());
+    std::vector<SceneLoader*> loaders;
+    for (unsigned int i=0; i<n_threads; i++) {
+        loaders.push_back(new SceneLoader(this));
+        loaders.back()->start();
+    }
+    for (unsigned int i=0; i<loaders.size(); i++) {
+        loaders[i]->join();
+        delete loaders[i];
+    }
+    if (!_error.empty()) {
+        throw std::runtime_error(_error);
+    }
+    stats.seconds = osg::Timer::instance()->delta_s(start, osg::Timer::instance()->tick());
+    return stats;
+}
+
+SceneLoadStats Scene::preload_view(unsigned int n_threads) {
+    return preload(std::vector<unsigned int>(1, _settings.view), std::vector<unsigned int>(1, _settings.surface),
+                   n_threads);
+}
@@ -0,0 +1,95 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+#include <osg/Image>
+#include <osg/Texture2D>
+#include <OpenThreads/Mutex>
+
+#include "DisplaySurfaceGeometry.h"
+#include "camera_model.h"
+#include "batch_render.h"
+
+// What to render from a scene, besides its cameras and surfaces.
+struct SceneSettings {
+    SceneSettings() : view(0), surface(0), fixed_clip(false), znear(0.1f), zfar(10.0f) {}
+    unsigned int view;          // camera to render through
+    unsigned int surface;       // surface to render
+    bool fixed_clip;            // use znear and zfar, else fit them to the surface
+    float znear;
+    float zfar;
+};
+
+struct SceneLoadStats {
+    unsigned int n_images;
+    unsigned int n_surfaces;
+    double seconds;
+};
+
+std::ostream& operator<<(std::ostream& os, const SceneLoadStats& stats);
+
+// A rig described by a manifest: a batch manifest (see batch_render.h)
+// with the view settings added,
+//
+//   { "view": "cam0", "surface": "arena",
+//     "render": { "znear": 0.1, "zfar": 10.0 },
+//     "cameras": [ ... ], "surfaces": [ ... ] }
+//
+// "view" and "surface" name the camera and surface to render and
+// default to the first ones; without "render" the clip planes follow
+// the surface. Loading reads the manifest only. Surfaces and background
+// images are decoded the first time they are asked for, or by
+// preload(), which decodes them in parallel; a background texture is
+// uploaded by OSG when it is first drawn. So a large rig costs only
+// what the current view uses.
+class Scene {
+public:
+    explicit Scene(const char* fname);
+    ~Scene();
+
+    const BatchManifest& manifest() const { return _manifest; }
+    const SceneSettings& settings() const { return _settings; }
+
+    unsigned int n_cameras() const { return _manifest.cameras.size(); }
+    unsigned int n_surfaces() const { return _manifest.surfaces.size(); }
+    const CameraModel& camera(unsigned int i) const { return _manifest.cameras.at(i).cam; }
+
+    // decoded on first use and kept by the scene
+    DisplaySurfaceGeometry* surface(unsigned int i);
+    // NULL if the camera has no background
+    osg::Image* background(unsigned int i);
+    osg::Texture2D* background_texture(unsigned int i);
+
+    // decode these cameras' backgrounds and these surfaces on a pool of
+    // threads (0: one per processor), skipping what is already loaded
+    SceneLoadStats preload(const std::vector<unsigned int>& cameras, const std::vector<unsigned int>& surfaces,
+                           unsigned int n_threads=0);
+    // the view's background and surface
+    SceneLoadStats preload_view(unsigned int n_threads=0);
+
+private:
+    friend class SceneLoader;
+
+    Scene(const Scene&);
+    Scene& operator=(const Scene&);
+
+    // a background (index < n_cameras) or a surface (index - n_cameras)
+    void load(unsigned int resource);
+    bool next_resource(unsigned int& resource);
+
+    BatchManifest _manifest;
+    SceneSettings _settings;
+    std::vector<DisplaySurfaceGeometry*> _surfaces;
+    std::vector<osg::ref_ptr<osg::Image> > _backgrounds;
+    std::vector<osg::ref_ptr<osg::Texture2D> > _textures;
+
+    OpenThreads::Mutex _mutex;
+    std::vector<unsigned int> _pending;
+    std::string _error;
+};
+
+#endif
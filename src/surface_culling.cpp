@@ -0,0 +1,152 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include "surface_culling.h"
+
+#include <osg/Geode>
+#include <osg/GL>
+#include <osg/Timer>
+#include <osg/Viewport>
+#include <osgViewer/Viewer>
+
+#include <math.h>
+#include <stdexcept>
+
+#include "profiler.h"
+
+std::vector<unsigned int> cull_chunks(const std::vector<SurfaceChunk>& chunks,
+                                      osg::Polytope frustum) {
+    std::vector<unsigned int> visible;
+    cull_chunks(chunks, frustum, visible);
+    return visible;
+}
+
+void cull_chunks(const std::vector<SurfaceChunk>& chunks, osg::Polytope& frustum,
+                 std::vector<unsigned int>& visible) {
+    visible.clear();
+    for (unsigned int i=0; i<chunks.size(); i++) {
+        if (frustum.contains(chunks[i].bound)) {
+            visible.push_back(i);
+        }
+    }
+}
+
+CulledSurface::CulledSurface(DisplaySurfaceGeometry& geom, unsigned int n_u, unsigned int n_v,
+                             unsigned int cells_per_chunk, bool texcoord_colors) {
+    PROFILE_ZONE("make chunks");
+    _chunks = geom.make_chunks(n_u, n_v);
+    _group = new osg::Group;
+    for (unsigned int i=0; i<_chunks.size(); i++) {
+        osg::ref_ptr<osg::Geode> geode = new osg::Geode;
+        geode->addDrawable(geom.make_chunk_geom(_chunks[i], cells_per_chunk, texcoord_colors).get());
+        _group->addChild(geode.get());
+    }
+    _visible.reserve(_chunks.size());
+}
+
+unsigned int CulledSurface::count_visible(const CameraModel& cam, float znear, float zfar) {
+    PROFILE_ZONE("cull chunks");
+    cam.frustum(znear, zfar, _frustum);
+    cull_chunks(_chunks, _frustum, _visible);
+    return _visible.size();
+}
+
+// ---- benchmark ---------------------------------------------------
+
+// waits for the GPU so that timings cover the whole frame
+class CullFinishCallback : public osg::Camera::DrawCallback {
+public:
+    virtual void operator () (osg::RenderInfo& renderInfo) const {
+        glFinish();
+    }
+};
+
+// the rig: cam turned about the z axis in n_cameras steps
+static std::vector<CameraModel> make_rig(const CameraModel& cam, unsigned int n_cameras) {
+    std::vector<CameraModel> rig(n_cameras, cam);
+    for (unsigned int i=0; i<n_cameras; i++) {
+        osg::Quat rot(2.0*osg::PI*i/n_cameras, osg::Vec3d(0,0,1));
+        rig[i].set_extrinsic(cam.orientation()*rot, rot*cam.position());
+    }
+    return rig;
+}
+
+static double time_rig(osg::Node* scene, const std::vector<CameraModel>& rig, float znear, float zfar,
+                       bool culling, unsigned int width, unsigned int height, unsigned int n_frames) {
+    osg::ref_ptr<osg::GraphicsContext::Traits> traits = new osg::GraphicsContext::Traits;
+    traits->x = 0;
+    traits->y = 0;
+    traits->width = width;
+    traits->height = height;
+    traits->windowDecoration = false;
+    traits->doubleBuffer = false;
+    traits->pbuffer = true;
+    osg::ref_ptr<osg::GraphicsContext> gc = osg::GraphicsContext::createGraphicsContext(traits.get());
+    if (!gc.valid()) {
+        throw std::runtime_error("could not create offscreen context for the culling benchmark");
+    }
+
+    // one tile per camera, nested cameras inherit the culling mode
+    unsigned int n_cols = (unsigned int)ceil(sqrt((double)rig.size()));
+    unsigned int n_rows = (rig.size() + n_cols - 1)/n_cols;
+    unsigned int tile_w = width/n_cols, tile_h = height/n_rows;
+    osg::ref_ptr<osg::Group> root = new osg::Group;
+    for (unsigned int i=0; i<rig.size(); i++) {
+        osg::ref_ptr<osg::Camera> camera = new osg::Camera;
+        camera->setReferenceFrame(osg::Transform::ABSOLUTE_RF);
+        camera->setRenderOrder(osg::Camera::NESTED_RENDER);
+        camera->setClearMask(GL_DEPTH_BUFFER_BIT);
+        camera->setViewport(new osg::Viewport((i%n_cols)*tile_w, (i/n_cols)*tile_h, tile_w, tile_h));
+        camera->setViewMatrix(rig[i].view());
+        camera->setProjectionMatrix(rig[i].projection(znear, zfar));
+        camera->addChild(scene);
+        root->addChild(camera.get());
+    }
+
+    osgViewer::Viewer viewer;
+    viewer.setThreadingModel(osgViewer::Viewer::SingleThreaded);
+    viewer.setSceneData(root.get());
+    osg::Camera* camera = viewer.getCamera();
+    camera->setGraphicsContext(gc.get());
+    camera->setViewport(new osg::Viewport(0, 0, width, height));
+    camera->setComputeNearFarMode(osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR);
+    camera->setCullingMode(culling ? osg::CullSettings::DEFAULT_CULLING : osg::CullSettings::NO_CULLING);
+    viewer.realize();
+
+    // the first frames compile the geometry
+    for (int i=0; i<2; i++) {
+        viewer.frame();
+    }
+    camera->setFinalDrawCallback(new CullFinishCallback);
+
+    osg::Timer timer;
+    osg::Timer_t start = timer.tick();
+    for (unsigned int i=0; i<n_frames; i++) {
+        viewer.frame();
+    }
+    return n_frames/timer.delta_s(start, timer.tick());
+}
+
+void benchmark_culled_surface(DisplaySurfaceGeometry& geom, const CameraModel& cam, float znear, float zfar,
+                              unsigned int n_chunks, unsigned int n_cameras, unsigned int n_frames,
+                              std::ostream& os) {
+    std::vector<CameraModel> rig = make_rig(cam, n_cameras);
+    CulledSurface culled(geom, n_chunks, n_chunks);
+    // one chunk as finely tessellated as all of them together
+    osg::ref_ptr<osg::Geode> whole = new osg::Geode;
+    whole->addDrawable(geom.make_chunk_geom(geom.make_chunks(1, 1)[0], n_chunks*16).get());
+    unsigned int n_visible = 0;
+    for (unsigned int i=0; i<rig.size(); i++) {
+        n_visible += culled.count_visible(rig[i], znear, zfar);
+    }
+
+    os << "surface culling, " << n_cameras << " cameras:" << std::endl;
+    os << "  one geometry:         "
+       << time_rig(whole.get(), rig, znear, zfar, true, cam.width(), cam.height(), n_frames)
+       << " frames/sec" << std::endl;
+    os << "  chunks, no culling:   "
+       << time_rig(culled.node(), rig, znear, zfar, false, cam.width(), cam.height(), n_frames)
+       << " frames/sec" << std::endl;
+    os << "  chunks, culled:       "
+       << time_rig(culled.node(), rig, znear, zfar, true, cam.width(), cam.height(), n_frames)
+       << " frames/sec, " << (double)n_visible/rig.size() << " of " << culled.n_chunks()
+       << " chunks per camera" << std::endl;
+}
@@ -0,0 +1,55 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef SURFACE_CULLING_H
+#define SURFACE_CULLING_H
+
+#include <vector>
+#include <ostream>
+
+#include <osg/Polytope>
+#include <osg/Group>
+
+#include "DisplaySurfaceGeometry.h"
+#include "camera_model.h"
+
+// indices of the chunks whose bounds intersect the frustum
+std::vector<unsigned int> cull_chunks(const std::vector<SurfaceChunk>& chunks,
+                                      osg::Polytope frustum);
+// the same into visible, which keeps its capacity between calls
+void cull_chunks(const std::vector<SurfaceChunk>& chunks, osg::Polytope& frustum,
+                 std::vector<unsigned int>& visible);
+
+// A display surface split into chunks, each in its own Geode with its
+// own bound. OSG tests every Geode's bound against the frustum of the
+// camera culling it, the same test cull_chunks() makes, so a projector
+// or camera that covers only part of a large screen draws only that
+// part, and each camera of a rig gets its own set. count_visible()
+// tells the caller in advance how many chunks a camera draws.
+class CulledSurface {
+public:
+    CulledSurface(DisplaySurfaceGeometry& geom, unsigned int n_u, unsigned int n_v,
+                  unsigned int cells_per_chunk=16, bool texcoord_colors=false);
+
+    osg::Group* node() { return _group.get(); }
+
+    // number of chunks OSG will draw for this camera
+    unsigned int count_visible(const CameraModel& cam, float znear, float zfar);
+
+    unsigned int n_chunks() const { return _chunks.size(); }
+    const std::vector<SurfaceChunk>& chunks() const { return _chunks; }
+
+private:
+    std::vector<SurfaceChunk> _chunks;
+    osg::ref_ptr<osg::Group> _group;
+    // kept between calls so counting allocates nothing
+    osg::Polytope _frustum;
+    std::vector<unsigned int> _visible;
+};
+
+// Draws the surface from n_cameras cameras turned about the z axis,
+// tiled in one offscreen context: as one geometry, as n_chunks x
+// n_chunks chunks with frustum culling off and with it on.
+void benchmark_culled_surface(DisplaySurfaceGeometry& geom, const CameraModel& cam, float znear, float zfar,
+                              unsigned int n_chunks, unsigned int n_cameras, unsigned int n_frames,
+                              std::ostream& os);
+
+#endif
@@ -0,0 +1,297 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include "surface_eval.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Scalar texcoords of one point in the surface frame.
+static inline void inverse_local(float x, float y, float z, bool cylinder, float height, float tc[2]) {
+    const float TWO_PI = 2.0f*(float)osg::PI;
+    float u = atan2f(y, x)/TWO_PI;
+    if (cylinder) {
+        u -= 0.5f;
+        // a zero height cylinder is a ring, all of it at v = 0
+        tc[1] = height > 0.0f ? std::max(0.0f, std::min(1.0f, z/height)) : 0.0f;
+    } else {
+        tc[1] = atan2f(z, sqrtf(x*x + y*y))/(float)osg::PI + 0.5f;
+    }
+    tc[0] = u < 0.0f ? u + 1.0f : u;
+}
+
+static void inverse_points(const float m[12], bool cylinder, float height,
+                           const float* xyz, unsigned int n, float* tc) {
+    for (unsigned int i=0; i<n; i++) {
+        const float* X = xyz + 3*i;
+        float x = X[0]*m[0] + X[1]*m[3] + X[2]*m[6] + m[9];
+        float y = X[0]*m[1] + X[1]*m[4] + X[2]*m[7] + m[10];
+        float z = X[0]*m[2] + X[1]*m[5] + X[2]*m[8] + m[11];
+        inverse_local(x, y, z, cylinder, height, tc + 2*i);
+    }
+}
+
+#ifdef __SSE2__
+static inline __m128 select_ps(__m128 mask, __m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+// atan2 of four floats: Cephes' atanf polynomial on |ratio| <= tan(pi/8)
+// after folding the octants, within about 2e-7 rad.
+static inline __m128 atan2_ps(__m128 y, __m128 x) {
+    const __m128 sign_bit = _mm_set1_ps(-0.0f);
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    __m128 ax = _mm_andnot_ps(sign_bit, x);
+    __m128 ay = _mm_andnot_ps(sign_bit, y);
+    __m128 swap = _mm_cmpgt_ps(ay, ax);
+    __m128 num = _mm_min_ps(ax, ay);
+    __m128 den = _mm_max_ps(ax, ay);
+    // 0/0 at the origin gives 0
+    __m128 a = _mm_and_ps(_mm_cmpgt_ps(den, zero), _mm_div_ps(num, den));
+
+    __m128 big = _mm_cmpgt_ps(a, _mm_set1_ps(0.41421356f));
+    a = select_ps(big, _mm_div_ps(_mm_sub_ps(a, one), _mm_add_ps(a, one)), a);
+    __m128 base = _mm_and_ps(big, _mm_set1_ps((float)(osg::PI/4.0)));
+
+    __m128 z = _mm_mul_ps(a, a);
+    __m128 p = _mm_set1_ps(8.05374449538e-2f);
+    p = _mm_sub_ps(_mm_mul_ps(p, z), _mm_set1_ps(1.38776856032e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, z), _mm_set1_ps(1.99777106478e-1f));
+    p = _mm_sub_ps(_mm_mul_ps(p, z), _mm_set1_ps(3.33329491539e-1f));
+    __m128 r = _mm_add_ps(base, _mm_add_ps(_mm_mul_ps(_mm_mul_ps(p, z), a), a));
+
+    r = select_ps(swap, _mm_sub_ps(_mm_set1_ps((float)(osg::PI/2.0)), r), r);
+    r = select_ps(_mm_cmplt_ps(x, zero), _mm_sub_ps(_mm_set1_ps((float)osg::PI), r), r);
+    return _mm_or_ps(r, _mm_and_ps(sign_bit, y));
+}
+
+// inverse_points() on four points at a time, the remainder is scalar
+static void inverse_points_sse(const float m[12], bool cylinder, float height,
+                               const float* xyz, unsigned int n, float* tc) {
+    __m128 M[12];
+    for (int i=0; i<12; i++) {
+        M[i] = _mm_set1_ps(m[i]);
+    }
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), half = _mm_set1_ps(0.5f);
+    const __m128 inv_two_pi = _mm_set1_ps((float)(0.5/osg::PI));
+    const __m128 inv_pi = _mm_set1_ps((float)(1.0/osg::PI));
+    // 0 for a sphere, and for a zero height cylinder whose v is 0
+    const __m128 inv_height = _mm_set1_ps(cylinder && height > 0.0f ? 1.0f/height : 0.0f);
+
+    const unsigned int n4 = n & ~3u;
+    for (unsigned int i=0; i<n4; i+=4) {
+        const float* X = xyz + 3*i;
+        __m128 wx = _mm_set_ps(X[9], X[6], X[3], X[0]);
+        __m128 wy = _mm_set_ps(X[10], X[7], X[4], X[1]);
+        __m128 wz = _mm_set_ps(X[11], X[8], X[5], X[2]);
+        __m128 x = _mm_add_ps(_mm_add_ps(_mm_mul_ps(wx, M[0]), _mm_mul_ps(wy, M[3])),
+                              _mm_add_ps(_mm_mul_ps(wz, M[6]), M[9]));
+        __m128 y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(wx, M[1]), _mm_mul_ps(wy, M[4])),
+                              _mm_add_ps(_mm_mul_ps(wz, M[7]), M[10]));
+        __m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(wx, M[2]), _mm_mul_ps(wy, M[5])),
+                              _mm_add_ps(_mm_mul_ps(wz, M[8]), M[11]));
+
+        __m128 u = _mm_mul_ps(atan2_ps(y, x), inv_two_pi);
+        __m128 v;
+        if (cylinder) {
+            u = _mm_sub_ps(u, half);
+            v = _mm_max_ps(zero, _mm_min_ps(one, _mm_mul_ps(z, inv_height)));
+        } else {
+            __m128 rho = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)));
+            v = _mm_add_ps(_mm_mul_ps(atan2_ps(z, rho), inv_pi), half);
+        }
+        u = _mm_add_ps(u, _mm_and_ps(_mm_cmplt_ps(u, zero), one));
+        _mm_storeu_ps(tc + 2*i, _mm_unpacklo_ps(u, v));
+        _mm_storeu_ps(tc + 2*i + 4, _mm_unpackhi_ps(u, v));
+    }
+    inverse_points(m, cylinder, height, xyz + 3*n4, n - n4, tc + 2*n4);
+}
+#endif
+
+void surface_inverse_points(const SurfaceFrame& to_local, bool cylinder, double height,
+                            const float* xyz, unsigned int n, float* tc) {
+    float m[12];
+    for (int i=0; i<12; i++) {
+        m[i] = to_local.m[i];
+    }
+#ifdef __SSE2__
+    inverse_points_sse(m, cylinder, height, xyz, n, tc);
+#else
+    inverse_points(m, cylinder, height, xyz, n, tc);
+#endif
+}
+
+// Points (radius cos a, radius sin a, v height) in frame, a = 2 pi u + phase.
+static void cylinder_points(const double m[12], bool translate, double radius, double height, double phase,
+                            const double* tc, unsigned int n, double* xyz) {
+    const double t[3] = { translate ? m[9] : 0.0, translate ? m[10] : 0.0, translate ? m[11] : 0.0 };
+    for (unsigned int i=0; i<n; i++) {
+        double angle = tc[2*i]*2.0*osg::PI + phase;
+        double x = cos(angle)*radius, y = sin(angle)*radius, z = tc[2*i+1]*height;
+        double* out = xyz + 3*i;
+        out[0] = x*m[0] + y*m[3] + z*m[6] + t[0];
+        out[1] = x*m[1] + y*m[4] + z*m[7] + t[1];
+        out[2] = x*m[2] + y*m[5] + z*m[8] + t[2];
+    }
+}
+
+// center + radius*(cos az cos el, sin az cos el, sin el)
+static void sphere_points(double radius, const double center[3], const double* tc, unsigned int n,
+                          double* xyz) {
+    for (unsigned int i=0; i<n; i++) {
+        double az = tc[2*i]*2.0*osg::PI;
+        double el = tc[2*i+1]*osg::PI - osg::PI/2.0;
+        double ce = cos(el);
+        double* out = xyz + 3*i;
+        out[0] = radius*cos(az)*ce + center[0];
+        out[1] = radius*sin(az)*ce + center[1];
+        out[2] = radius*sin(el) + center[2];
+    }
+}
+
+#ifdef __SSE2__
+static inline __m128d select_pd(__m128d mask, __m128d a, __m128d b) {
+    return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b));
+}
+
+// the two int32 masks in the low half of m, widened to double lanes
+static inline __m128d widen_mask(__m128i m) {
+    return _mm_castsi128_pd(_mm_unpacklo_epi32(m, m));
+}
+
+// sin and cos of two doubles: Cephes' sin/cos polynomials on
+// |z| <= pi/4 after a three part reduction by pi/4, within a few ulp
+// for |x| < 2^30 (texcoord angles are below 4 pi).
+static inline void sincos_pd(__m128d x, __m128d& s, __m128d& c) {
+    const __m128d sign_bit = _mm_set1_pd(-0.0);
+    const __m128d one = _mm_set1_pd(1.0), half = _mm_set1_pd(0.5);
+    __m128d ax = _mm_andnot_pd(sign_bit, x);
+
+    // octant, rounded up to even; ax >= 0 so truncation is floor
+    __m128i j = _mm_cvttpd_epi32(_mm_mul_pd(ax, _mm_set1_pd(4.0/osg::PI)));
+    j = _mm_and_si128(_mm_add_epi32(j, _mm_set1_epi32(1)), _mm_set1_epi32(~1));
+    __m128d y = _mm_cvtepi32_pd(j);
+    __m128d z = _mm_sub_pd(ax, _mm_mul_pd(y, _mm_set1_pd(7.85398125648498535156e-1)));
+    z = _mm_sub_pd(z, _mm_mul_pd(y, _mm_set1_pd(3.77489470793079817668e-8)));
+    z = _mm_sub_pd(z, _mm_mul_pd(y, _mm_set1_pd(2.69515142907905952645e-15)));
+    __m128d zz = _mm_mul_pd(z, z);
+
+    __m128d ps = _mm_set1_pd(1.58962301576546568060e-10);
+    ps = _mm_add_pd(_mm_mul_pd(ps, zz), _mm_set1_pd(-2.50507477628578072866e-8));
+    ps = _mm_add_pd(_mm_mul_pd(ps, zz), _mm_set1_pd(2.75573136213857245213e-6));
+    ps = _mm_add_pd(_mm_mul_pd(ps, zz), _mm_set1_pd(-1.98412698295895385996e-4));
+    ps = _mm_add_pd(_mm_mul_pd(ps, zz), _mm_set1_pd(8.33333333332211858878e-3));
+    ps = _mm_add_pd(_mm_mul_pd(ps, zz), _mm_set1_pd(-1.66666666666666307295e-1));
+    __m128d sin_z = _mm_add_pd(z, _mm_mul_pd(_mm_mul_pd(z, zz), ps));
+
+    __m128d pc = _mm_set1_pd(-1.13585365213876817300e-11);
+    pc = _mm_add_pd(_mm_mul_pd(pc, zz), _mm_set1_pd(2.08757008419747316778e-9));
+    pc = _mm_add_pd(_mm_mul_pd(pc, zz), _mm_set1_pd(-2.75573141792967388112e-7));
+    pc = _mm_add_pd(_mm_mul_pd(pc, zz), _mm_set1_pd(2.48015872888517045348e-5));
+    pc = _mm_add_pd(_mm_mul_pd(pc, zz), _mm_set1_pd(-1.38888888888730564116e-3));
+    pc = _mm_add_pd(_mm_mul_pd(pc, zz), _mm_set1_pd(4.16666666666665929218e-2));
+    __m128d cos_z = _mm_add_pd(_mm_sub_pd(one, _mm_mul_pd(half, zz)), _mm_mul_pd(_mm_mul_pd(zz, zz), pc));
+
+    // octants 2 and 6 swap the polynomials; sin changes sign in 4 and 6,
+    // cos in 2 and 4, and sin also with x
+    const __m128i zero = _mm_setzero_si128();
+    __m128d swap = widen_mask(_mm_cmpgt_epi32(_mm_and_si128(j, _mm_set1_epi32(2)), zero));
+    __m128d sin_neg = _mm_and_pd(widen_mask(_mm_cmpgt_epi32(_mm_and_si128(j, _mm_set1_epi32(4)), zero)),
+                                 sign_bit);
+    __m128i j2 = _mm_add_epi32(j, _mm_set1_epi32(2));
+    __m128d cos_neg = _mm_and_pd(widen_mask(_mm_cmpgt_epi32(_mm_and_si128(j2, _mm_set1_epi32(4)), zero)),
+                                 sign_bit);
+    s = _mm_xor_pd(_mm_xor_pd(select_pd(swap, cos_z, sin_z), sin_neg), _mm_and_pd(x, sign_bit));
+    c = _mm_xor_pd(select_pd(swap, sin_z, cos_z), cos_neg);
+}
+
+// stores two x,y,z triples from x, y and z lanes
+static inline void store_points(double* xyz, __m128d x, __m128d y, __m128d z) {
+    _mm_storeu_pd(xyz, _mm_unpacklo_pd(x, y));
+    _mm_storeu_pd(xyz + 2, _mm_shuffle_pd(z, x, 2));
+    _mm_storeu_pd(xyz + 4, _mm_unpackhi_pd(y, z));
+}
+
+// cylinder_points() on two points at a time, the remainder is scalar
+static void cylinder_points_sse(const double m[12], bool translate, double radius, double height,
+                                double phase, const double* tc, unsigned int n, double* xyz) {
+    __m128d M[12];
+    for (int i=0; i<12; i++) {
+        M[i] = _mm_set1_pd(i < 9 || translate ? m[i] : 0.0);
+    }
+    const __m128d two_pi = _mm_set1_pd(2.0*osg::PI), phase2 = _mm_set1_pd(phase);
+    const __m128d r = _mm_set1_pd(radius), h = _mm_set1_pd(height);
+
+    const unsigned int n2 = n & ~1u;
+    for (unsigned int i=0; i<n2; i+=2) {
+        __m128d a = _mm_loadu_pd(tc + 2*i), b = _mm_loadu_pd(tc + 2*i + 2);
+        __m128d u = _mm_unpacklo_pd(a, b), v = _mm_unpackhi_pd(a, b);
+        __m128d s, c;
+        sincos_pd(_mm_add_pd(_mm_mul_pd(u, two_pi), phase2), s, c);
+        __m128d x = _mm_mul_pd(c, r), y = _mm_mul_pd(s, r), z = _mm_mul_pd(v, h);
+        store_points(xyz + 3*i,
+                     _mm_add_pd(_mm_add_pd(_mm_mul_pd(x, M[0]), _mm_mul_pd(y, M[3])),
+                                _mm_add_pd(_mm_mul_pd(z, M[6]), M[9])),
+                     _mm_add_pd(_mm_add_pd(_mm_mul_pd(x, M[1]), _mm_mul_pd(y, M[4])),
+                                _mm_add_pd(_mm_mul_pd(z, M[7]), M[10])),
+                     _mm_add_pd(_mm_add_pd(_mm_mul_pd(x, M[2]), _mm_mul_pd(y, M[5])),
+                                _mm_add_pd(_mm_mul_pd(z, M[8]), M[11])));
+    }
+    cylinder_points(m, translate, radius, height, phase, tc + 2*n2, n - n2, xyz + 3*n2);
+}
+
+// sphere_points() on two points at a time, the remainder is scalar
+static void sphere_points_sse(double radius, const double center[3], const double* tc, unsigned int n,
+                              double* xyz) {
+    const __m128d two_pi = _mm_set1_pd(2.0*osg::PI), pi = _mm_set1_pd(osg::PI);
+    const __m128d half_pi = _mm_set1_pd(osg::PI/2.0), r = _mm_set1_pd(radius);
+    const __m128d cx = _mm_set1_pd(center[0]), cy = _mm_set1_pd(center[1]), cz = _mm_set1_pd(center[2]);
+
+    const unsigned int n2 = n & ~1u;
+    for (unsigned int i=0; i<n2; i+=2) {
+        __m128d a = _mm_loadu_pd(tc + 2*i), b = _mm_loadu_pd(tc + 2*i + 2);
+        __m128d u = _mm_unpacklo_pd(a, b), v = _mm_unpackhi_pd(a, b);
+        __m128d sa, ca, se, ce;
+        sincos_pd(_mm_mul_pd(u, two_pi), sa, ca);
+        sincos_pd(_mm_sub_pd(_mm_mul_pd(v, pi), half_pi), se, ce);
+        __m128d rce = _mm_mul_pd(r, ce);
+        store_points(xyz + 3*i, _mm_add_pd(_mm_mul_pd(rce, ca), cx), _mm_add_pd(_mm_mul_pd(rce, sa), cy),
+                     _mm_add_pd(_mm_mul_pd(r, se), cz));
+    }
+    sphere_points(radius, center, tc + 2*n2, n - n2, xyz + 3*n2);
+}
+#endif
+
+void cylinder_eval_points(const SurfaceFrame& frame, double radius, double height,
+                          const double* tc, unsigned int n, double* xyz) {
+#ifdef __SSE2__
+    cylinder_points_sse(frame.m, true, radius, height, osg::PI, tc, n, xyz);
+#else
+    cylinder_points(frame.m, true, radius, height, osg::PI, tc, n, xyz);
+#endif
+}
+
+void cylinder_normal_points(const SurfaceFrame& frame, const double* tc, unsigned int n, double* normals) {
+#ifdef __SSE2__
+    cylinder_points_sse(frame.m, false, 1.0, 0.0, 0.0, tc, n, normals);
+#else
+    cylinder_points(frame.m, false, 1.0, 0.0, 0.0, tc, n, normals);
+#endif
+}
+
+void sphere_eval_points(double radius, const double center[3], const double* tc, unsigned int n,
+                        double* xyz) {
+#ifdef __SSE2__
+    sphere_points_sse(radius, center, tc, n, xyz);
+#else
+    sphere_points(radius, center, tc, n, xyz);
+#endif
+}
+
+void sphere_normal_points(const double* tc, unsigned int n, double* normals) {
+    const double origin[3] = { 0.0, 0.0, 0.0 };
+#ifdef __SSE2__
+    sphere_points_sse(1.0, origin, tc, n, normals);
+#else
+    sphere_points(1.0, origin, tc, n, normals);
+#endif
+}
@@ -0,0 +1,186 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef SURFACE_EVAL_H
+#define SURFACE_EVAL_H
+
+#include <math.h>
+#include <algorithm>
+
+#include <osg/Math>
+#include <osg/Matrixd>
+
+// Closed form display surfaces as plain value types with inline per
+// sample functions. SurfaceEvaluator's batch loops are instantiated per
+// surface type, so the type is resolved once per batch and the per
+// sample functions are inlined. The cylinder and sphere replace the
+// forward loops with SSE2 kernels (cylinder_eval_points() and friends)
+// and the float inverse with surface_inverse_points(); the double
+// inverse stays a loop over libm's atan2(). GeomModel wraps these for
+// the runtime interface.
+//
+// Derived provides
+//   void eval(double u, double v, double xyz[3]) const;
+//   void normal(double u, double v, double n[3]) const;
+//   void inverse(const double xyz[3], double tc[2]) const;
+template<class Derived>
+class SurfaceEvaluator {
+public:
+    // tc holds n u,v pairs, xyz receives n x,y,z triples
+    void texcoord2worldcoord(const double* tc, unsigned int n, double* xyz) const {
+        const Derived& surface = static_cast<const Derived&>(*this);
+        for (unsigned int i=0; i<n; i++) {
+            surface.eval(tc[2*i], tc[2*i+1], xyz + 3*i);
+        }
+    }
+    void texcoord2normal(const double* tc, unsigned int n, double* normals) const {
+        const Derived& surface = static_cast<const Derived&>(*this);
+        for (unsigned int i=0; i<n; i++) {
+            surface.normal(tc[2*i], tc[2*i+1], normals + 3*i);
+        }
+    }
+    // xyz holds n x,y,z triples, tc receives n u,v pairs
+    void worldcoord2texcoord(const double* xyz, unsigned int n, double* tc) const {
+        const Derived& surface = static_cast<const Derived&>(*this);
+        for (unsigned int i=0; i<n; i++) {
+            surface.inverse(xyz + 3*i, tc + 2*i);
+        }
+    }
+};
+
+// An affine transform between a surface frame and the world, out = in*M
+// for OSG's row vectors, unrolled.
+struct SurfaceFrame {
+    SurfaceFrame() {
+        for (int i=0; i<12; i++) {
+            m[i] = (i%4==0) ? 1.0 : 0.0;
+        }
+    }
+    explicit SurfaceFrame(const osg::Matrixd& M) {
+        for (int row=0; row<4; row++) {
+            for (int col=0; col<3; col++) {
+                m[3*row + col] = M(row, col);
+            }
+        }
+    }
+    inline void point(double x, double y, double z, double out[3]) const {
+        out[0] = x*m[0] + y*m[3] + z*m[6] + m[9];
+        out[1] = x*m[1] + y*m[4] + z*m[7] + m[10];
+        out[2] = x*m[2] + y*m[5] + z*m[8] + m[11];
+    }
+    inline void vector(double x, double y, double z, double out[3]) const {
+        out[0] = x*m[0] + y*m[3] + z*m[6];
+        out[1] = x*m[1] + y*m[4] + z*m[7];
+        out[2] = x*m[2] + y*m[5] + z*m[8];
+    }
+    double m[12]; // rows of the upper 4x3 part
+};
+
+// Texcoords of n world points in float, with SSE2 four at a time. The
+// points are taken to the surface frame by to_local; then u is the
+// angle about its z axis, with the cylinder's half turn when cylinder
+// is set, and v is z/height (cylinder) or the elevation (sphere).
+void surface_inverse_points(const SurfaceFrame& to_local, bool cylinder, double height,
+                            const float* xyz, unsigned int n, float* tc);
+
+// Batch eval() and normal() of the surfaces below, with SSE2 two
+// samples at a time. sin and cos are Cephes' polynomials rather than
+// libm's and agree with them to a few ulp.
+void cylinder_eval_points(const SurfaceFrame& frame, double radius, double height,
+                          const double* tc, unsigned int n, double* xyz);
+void cylinder_normal_points(const SurfaceFrame& frame, const double* tc, unsigned int n, double* normals);
+void sphere_eval_points(double radius, const double center[3], const double* tc, unsigned int n,
+                        double* xyz);
+void sphere_normal_points(const double* tc, unsigned int n, double* normals);
+
+// Around the local z axis from z = 0 to height, see data/surface.vert.
+class CylinderSurface : public SurfaceEvaluator<CylinderSurface> {
+public:
+    CylinderSurface() : _radius(1.0), _height(1.0) {}
+    CylinderSurface(double radius, double height, const osg::Matrixd& matrix) :
+        _radius(radius), _height(height), _frame(matrix), _to_local(osg::Matrixd::inverse(matrix)) {}
+
+    inline void eval(double u, double v, double xyz[3]) const {
+        // keep in sync with simple_geom.py
+        double angle = u*2.0*osg::PI + osg::PI;
+        _frame.point(cos(angle)*_radius, sin(angle)*_radius, v*_height, xyz);
+    }
+    // without the half turn of eval(): towards the axis
+    inline void normal(double u, double, double n[3]) const {
+        double angle = u*2.0*osg::PI;
+        _frame.vector(cos(angle), sin(angle), 0.0, n);
+    }
+    // the nearest point of the side: radial, height clamped to the ends;
+    // v is 0 on a zero height cylinder, which is a ring
+    inline void inverse(const double xyz[3], double tc[2]) const {
+        double p[3];
+        _to_local.point(xyz[0], xyz[1], xyz[2], p);
+        double u = atan2(p[1], p[0])/(2.0*osg::PI) - 0.5;
+        tc[0] = u < 0.0 ? u + 1.0 : u;
+        tc[1] = _height > 0.0 ? std::max(0.0, std::min(1.0, p[2]/_height)) : 0.0;
+    }
+    void texcoord2worldcoord(const double* tc, unsigned int n, double* xyz) const {
+        cylinder_eval_points(_frame, _radius, _height, tc, n, xyz);
+    }
+    void texcoord2normal(const double* tc, unsigned int n, double* normals) const {
+        cylinder_normal_points(_frame, tc, n, normals);
+    }
+    void worldcoord2texcoord(const float* xyz, unsigned int n, float* tc) const {
+        surface_inverse_points(_to_local, true, _height, xyz, n, tc);
+    }
+    using SurfaceEvaluator<CylinderSurface>::worldcoord2texcoord;
+
+private:
+    double _radius;
+    double _height;
+    SurfaceFrame _frame;
+    SurfaceFrame _to_local;
+};
+
+class SphereSurface : public SurfaceEvaluator<SphereSurface> {
+public:
+    SphereSurface() : _radius(1.0) { _center[0] = _center[1] = _center[2] = 0.0; }
+    SphereSurface(double radius, const osg::Vec3d& center) :
+        _radius(radius), _to_local(osg::Matrixd::translate(-center)) {
+        _center[0] = center[0]; _center[1] = center[1]; _center[2] = center[2];
+    }
+
+    inline void eval(double u, double v, double xyz[3]) const {
+        // keep in sync with simple_geom.py
+        double n[3];
+        normal(u, v, n);
+        xyz[0] = _radius*n[0] + _center[0];
+        xyz[1] = _radius*n[1] + _center[1];
+        xyz[2] = _radius*n[2] + _center[2];
+    }
+    inline void normal(double u, double v, double n[3]) const {
+        double az = u*2.0*osg::PI;
+        double el = v*osg::PI - osg::PI/2.0;
+        double ce = cos(el);
+        n[0] = cos(az)*ce;
+        n[1] = sin(az)*ce;
+        n[2] = sin(el);
+    }
+    // the nearest point, seen from the center
+    inline void inverse(const double xyz[3], double tc[2]) const {
+        double x = xyz[0] - _center[0], y = xyz[1] - _center[1], z = xyz[2] - _center[2];
+        double u = atan2(y, x)/(2.0*osg::PI);
+        tc[0] = u < 0.0 ? u + 1.0 : u;
+        tc[1] = atan2(z, sqrt(x*x + y*y))/osg::PI + 0.5;
+    }
+    void texcoord2worldcoord(const double* tc, unsigned int n, double* xyz) const {
+        sphere_eval_points(_radius, _center, tc, n, xyz);
+    }
+    void texcoord2normal(const double* tc, unsigned int n, double* normals) const {
+        sphere_normal_points(tc, n, normals);
+    }
+    void worldcoord2texcoord(const float* xyz, unsigned int n, float* tc) const {
+        surface_inverse_points(_to_local, false, 0.0, xyz, n, tc);
+    }
+    using SurfaceEvaluator<SphereSurface>::worldcoord2texcoord;
+
+private:
+    double _radius;
+    double _center[3];
+    SurfaceFrame _to_local;
+};
+
+#endif
@@ -0,0 +1,228 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#include "tiled_renderer.h"
+
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Thread>
+
+#include <osg/FrameStamp>
+#include <osg/GraphicsContext>
+#include <osg/Image>
+#include <osg/Timer>
+#include <osgUtil/UpdateVisitor>
+#include <osgViewer/Viewer>
+
+#include <string.h>
+#include <stdexcept>
+#include <sstream>
+
+// tiles may run this many rows of tiles ahead of the file writer
+#define MAX_BANDS_IN_FLIGHT 2
+
+// Windowing systems do not like contexts being created concurrently,
+// and setting up a viewer writes to the scene's per context GL object
+// buffers. Only culling and drawing run in parallel.
+static OpenThreads::Mutex setup_mutex;
+
+class TileWorker : public OpenThreads::Thread {
+public:
+    TileWorker(TiledRenderer* renderer) : _renderer(renderer) {}
+
+    virtual void run() {
+        try {
+            render_tiles();
+        } catch (std::exception& e) {
+            _renderer->fail(e.what());
+        } catch (const char* e) {
+            _renderer->fail(e);
+        }
+    }
+
+private:
+    void render_tiles() {
+        const unsigned int tw = _renderer->_tile_width;
+        const unsigned int th = _renderer->_tile_height;
+        const CameraModel& cam = _renderer->_cam;
+
+        osg::ref_ptr<osg::GraphicsContext::Traits> traits = new osg::GraphicsContext::Traits;
+        traits->x = 0;
+        traits->y = 0;
+        traits->width = tw;
+        traits->height = th;
+        traits->windowDecoration = false;
+        traits->doubleBuffer = false;
+        traits->pbuffer = true;
+
+        osg::ref_ptr<osg::Image> image = new osg::Image;
+        image->allocateImage(tw, th, 1, GL_RGB, GL_UNSIGNED_BYTE);
+
+        osgViewer::Viewer viewer;
+        viewer.setThreadingModel(osgViewer::Viewer::SingleThreaded);
+        osg::Camera* camera = viewer.getCamera();
+        {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock(setup_mutex);
+            osg::ref_ptr<osg::GraphicsContext> gc = osg::GraphicsContext::createGraphicsContext(traits.get());
+            if (!gc.valid()) {
+                throw std::runtime_error("could not create offscreen context for tile rendering");
+            }
+            viewer.setSceneData(_renderer->_scene.get());
+            camera->setGraphicsContext(gc.get());
+            camera->setViewport(new osg::Viewport(0, 0, tw, th));
+            camera->setDrawBuffer(GL_FRONT);
+            camera->setReadBuffer(GL_FRONT);
+            camera->setComputeNearFarMode(osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR);
+            camera->attach(osg::Camera::COLOR_BUFFER, image.get());
+            camera->setViewMatrix(cam.view());
+            viewer.realize();
+        }
+
+        std::vector<unsigned char> rgb;
+        unsigned int index;
+        while (_renderer->next_tile(index)) {
+            unsigned int col = index % _renderer->n_tile_cols();
+            unsigned int row = index / _renderer->n_tile_cols();
+
+            // tile rows count from the top of the output image
+            double u0 = col*tw;
+            double v0 = cam.y_up() ? (double)cam.height() - (row+1)*th : (double)row*th;
+            camera->setProjectionMatrix(cam.projection_tile(u0, v0, tw, th,
+                                                            _renderer->_znear, _renderer->_zfar));
+            // frame() would also run event and update traversals over the
+            // shared scene; render() updated it once before the workers
+            viewer.advance();
+            viewer.renderingTraversals();
+
+            // the image is bottom up, tiles are stored top down
+            rgb.resize(tw*th*3);
+            for (unsigned int y=0; y<th; y++) {
+                memcpy(&rgb[y*tw*3], image->data(0, th-1-y), tw*3);
+            }
+            _renderer->finish_tile(index, rgb);
+        }
+    }
+
+    TiledRenderer* _renderer;
+};
+
+TiledRenderer::TiledRenderer(const CameraModel& cam, osg::Node* scene,
+                             unsigned int tile_width, unsigned int tile_height,
+                             unsigned int n_contexts) :
+    _cam(cam), _scene(scene), _tile_width(tile_width), _tile_height(tile_height),
+    _n_contexts(n_contexts), _znear(0.1f), _zfar(10.0f),
+    _next_tile(0), _next_band(0), _out(NULL)
+{
+    if (!_cam.is_intrinsic_valid() || !_cam.is_extrinsic_valid()) {
+        throw std::runtime_error("need a fully calibrated camera for tiled rendering");
+    }
+    if (_n_contexts==0) {
+        throw std::runtime_error("need at least one rendering context");
+    }
+}
+
+double TiledRenderer::render(const std::string& fname) {
+    osg::Timer timer;
+    osg::Timer_t start = timer.tick();
+
+    _out = fopen(fname.c_str(), "wb");
+    if (!_out) {
+        std::ostringstream os;
+        os << "Could not open " << fname;
+        throw std::ios_base::failure(os.str());
+    }
+    fprintf(_out, "P6\n%u %u\n255\n", _cam.width(), _cam.height());
+
+    _next_tile = 0;
+    _next_band = 0;
+    _done_tiles.clear();
+    _error.clear();
+
+    // update callbacks run here, once; the workers share the scene for
+    // culling and drawing only
+    _scene->setThreadSafeRefUnref(true);
+    osg::ref_ptr<osg::FrameStamp> stamp = new osg::FrameStamp;
+    stamp->setReferenceTime(0.0);
+    stamp->setSimulationTime(0.0);
+    osgUtil::UpdateVisitor update;
+    update.setFrameStamp(stamp.get());
+    update.setTraversalNumber(stamp->getFrameNumber());
+    _scene->accept(update);
+
+    std::vector<TileWorker*> workers;
+    for (unsigned int i=0; i<_n_contexts; i++) {
+        workers.push_back(new TileWorker(this));
+        workers.back()->start();
+    }
+    for (unsigned int i=0; i<workers.size(); i++) {
+        workers[i]->join();
+        delete workers[i];
+    }
+
+    fclose(_out);
+    _out = NULL;
+    if (!_error.empty()) {
+        throw std::runtime_error(_error);
+    }
+    return timer.delta_s(start, timer.tick());
+}
+
+bool TiledRenderer::next_tile(unsigned int& index) {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    if (_next_tile >= n_tile_cols()*n_tile_rows()) {
+        return false;
+    }
+    // bound memory: do not get too far ahead of the writer
+    unsigned int band = _next_tile / n_tile_cols();
+    while (_error.empty() && band >= _next_band + MAX_BANDS_IN_FLIGHT) {
+        _band_written.wait(&_mutex);
+    }
+    if (!_error.empty()) {
+        return false;
+    }
+    index = _next_tile++;
+    return true;
+}
+
+void TiledRenderer::finish_tile(unsigned int index, std::vector<unsigned char>& rgb) {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    _done_tiles[index].swap(rgb);
+
+    const unsigned int n_cols = n_tile_cols();
+    while (_next_band < n_tile_rows()) {
+        for (unsigned int col=0; col<n_cols; col++) {
+            if (_done_tiles.find(_next_band*n_cols + col)==_done_tiles.end()) {
+                return;
+            }
+        }
+        write_band(_next_band);
+        _next_band++;
+        _band_written.broadcast();
+    }
+}
+
+void TiledRenderer::write_band(unsigned int row) {
+    const unsigned int n_cols = n_tile_cols();
+    unsigned int rows = _cam.height() - row*_tile_height;
+    if (rows > _tile_height) {
+        rows = _tile_height;
+    }
+    for (unsigned int y=0; y<rows; y++) {
+        for (unsigned int col=0; col<n_cols; col++) {
+            unsigned int cols = _cam.width() - col*_tile_width;
+            if (cols > _tile_width) {
+                cols = _tile_width;
+            }
+            const std::vector<unsigned char>& tile = _done_tiles[row*n_cols + col];
+            fwrite(&tile[y*_tile_width*3], 1, cols*3, _out);
+        }
+    }
+    for (unsigned int col=0; col<n_cols; col++) {
+        _done_tiles.erase(row*n_cols + col);
+    }
+}
+
+void TiledRenderer::fail(const std::string& msg) {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    if (_error.empty()) {
+        _error = msg;
+    }
+    _band_written.broadcast();
+}
@@ -0,0 +1,66 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef TILED_RENDERER_H
+#define TILED_RENDERER_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include <osg/Node>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/Condition>
+
+#include "camera_model.h"
+
+// Renders a camera view larger than the maximum framebuffer size by
+// splitting it into tiles. Each of n_contexts threads owns an
+// offscreen pbuffer and renders tiles with CameraModel::projection_tile().
+// Finished rows of tiles are streamed to a binary PPM file, so memory
+// use is bounded by a few rows of tiles whatever the image size.
+//
+// The scene graph is shared by all threads and must not change while
+// rendering. render() runs its update traversal once on the calling
+// thread; the threads only cull and draw it.
+class TiledRenderer {
+public:
+    TiledRenderer(const CameraModel& cam, osg::Node* scene,
+                  unsigned int tile_width=2048, unsigned int tile_height=2048,
+                  unsigned int n_contexts=2);
+
+    void set_clip_planes(float znear, float zfar) { _znear=znear; _zfar=zfar; }
+
+    // render the whole camera image into fname, returns seconds taken
+    double render(const std::string& fname);
+
+private:
+    friend class TileWorker;
+
+    unsigned int n_tile_cols() const { return (_cam.width()+_tile_width-1)/_tile_width; }
+    unsigned int n_tile_rows() const { return (_cam.height()+_tile_height-1)/_tile_height; }
+
+    // worker interface
+    bool next_tile(unsigned int& index);
+    void finish_tile(unsigned int index, std::vector<unsigned char>& rgb);
+    void fail(const std::string& msg);
+    void write_band(unsigned int row);
+
+    CameraModel _cam;
+    osg::ref_ptr<osg::Node> _scene;
+    unsigned int _tile_width;
+    unsigned int _tile_height;
+    unsigned int _n_contexts;
+    float _znear;
+    float _zfar;
+
+    OpenThreads::Mutex _mutex;
+    OpenThreads::Condition _band_written;
+    unsigned int _next_tile;
+    unsigned int _next_band;
+    // finished tiles waiting for their row to complete, top row first
+    std::map<unsigned int, std::vector<unsigned char> > _done_tiles;
+    std::string _error;
+    FILE* _out;
+};
+
+#endif
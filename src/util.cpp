@@ -1,5 +1,6 @@
 /* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 #include "util.h"
+#include "array_pool.h"
 
 #include <osgDB/ReadFile>
 #include <osgDB/WriteFile>
@@ -68,19 +69,20 @@ osg::Group* make_textured_quad(osg::Texture* texture,
     osg::Geode* geode = new osg::Geode();
     {
         // make quad
-        osg::Vec3Array* vertices = new osg::Vec3Array;
-        osg::Vec2Array* tcs = new osg::Vec2Array;
+        GeometryPools& pools = geometry_pools();
+        osg::ref_ptr<osg::Vec3Array> vertices = pools.vec3.get(4);
+        osg::ref_ptr<osg::Vec2Array> tcs = pools.vec2.get(4);
         vertices->push_back(  osg::Vec3(left, bottom, zpos) ); tcs->push_back(osg::Vec2(0.0,0.0));
         vertices->push_back(  osg::Vec3(left+width, bottom, zpos) ); tcs->push_back(osg::Vec2(max_tc_width,0.0));
         vertices->push_back(  osg::Vec3(left+width, bottom+height, zpos) ); tcs->push_back(osg::Vec2(max_tc_width,max_tc_height));
         vertices->push_back(  osg::Vec3(left, bottom+height, zpos) ); tcs->push_back(osg::Vec2(0.0,max_tc_height));
 
-        osg::ref_ptr<osg::Vec4Array> colors = new osg::Vec4Array;
+        osg::ref_ptr<osg::Vec4Array> colors = pools.vec4.get(1);
         colors->push_back(osg::Vec4(1.0f,1.0f,1.0f,1.0f));
 
         osg::ref_ptr<osg::Geometry> this_geom = new osg::Geometry();
-        this_geom->setVertexArray(vertices);
-        this_geom->setTexCoordArray(0,tcs);
+        this_geom->setVertexArray(vertices.get());
+        this_geom->setTexCoordArray(0,tcs.get());
         this_geom->addPrimitiveSet(new osg::DrawArrays(osg::PrimitiveSet::QUADS,0,4));
         this_geom->setColorArray(colors.get());
         this_geom->setColorBinding(osg::Geometry::BIND_OVERALL);